@@ -0,0 +1,46 @@
+/*
+*	IPK Project 1: client-server for simple file transfer
+*	Author: Tomáš Pazdiora (xpazdi02)
+*	File: BenchArgs.cpp
+*/
+
+#include "BenchArgs.h"
+
+#include <sstream>
+#include <stdexcept>
+
+bool load_value(const std::string &arg, uint64_t &value, bool suffixes)
+{
+	try {
+		if (arg.empty() || arg[0] == '-') {
+			return false; // stoull would accept negative value
+		}
+		std::size_t end;
+		value = std::stoull(arg, &end);
+		std::string suffix = arg.substr(end);
+		if (suffixes && (suffix == "K" || suffix == "k")) value <<= 10;
+		else if (suffixes && (suffix == "M" || suffix == "m")) value <<= 20;
+		else if (suffixes && (suffix == "G" || suffix == "g")) value <<= 30;
+		else if (!suffix.empty()) return false;
+		return true;
+	}
+	catch (const std::exception &e) {
+		(void)e; // bypass unreferenced local variable warning
+		return false;
+	}
+}
+
+bool load_list(const std::string &arg, std::vector<uint64_t> &values, bool suffixes)
+{
+	values.clear();
+	std::istringstream list(arg);
+	std::string item;
+	while (std::getline(list, item, ',')) {
+		uint64_t value;
+		if (!load_value(item, value, suffixes)) {
+			return false;
+		}
+		values.push_back(value);
+	}
+	return !values.empty();
+}
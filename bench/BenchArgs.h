@@ -0,0 +1,20 @@
+/*
+*	IPK Project 1: client-server for simple file transfer
+*	Author: Tomáš Pazdiora (xpazdi02)
+*	File: BenchArgs.h
+*/
+
+#ifndef BENCHARGS_H
+#define BENCHARGS_H
+
+#include <string>
+#include <vector>
+#include <stdint.h>
+
+// unsigned value, optionally with K, M or G suffix (binary units) when suffixes are allowed
+bool load_value(const std::string &arg, uint64_t &value, bool suffixes);
+
+// comma separated list of values (see load_value), at least one value is required
+bool load_list(const std::string &arg, std::vector<uint64_t> &values, bool suffixes);
+
+#endif
@@ -0,0 +1,361 @@
+/*
+*	IPK Project 1: client-server for simple file transfer
+*	Author: Tomáš Pazdiora (xpazdi02)
+*	File: bench.cpp
+*/
+
+// Loopback benchmark: in-process server on ephemeral port, uploads and downloads across matrix
+// of file sizes and connection counts, throughput and latency percentiles are printed as JSON
+
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <chrono>
+#include <algorithm>
+#include <cstdio>
+#include <stdint.h>
+#include "IPKFTP.h"
+#include "CRC32.h"
+#include "SHA256.h"
+#include "IOUring.h"
+#include "BenchArgs.h"
+
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+
+const std::string bench_usage = "./ipk-bench [-s sizes] [-c connections] [-b bytes_per_case] [-n max_requests] [-e event_loops] [-U 0|1] [-d directory]\n"
+	"  sizes and connections are comma separated lists (sizes accept K, M and G suffixes),\n"
+	"  -e 0 = worker pool server with one worker per connection, -U 1 = io_uring event loops";
+
+struct args {
+	std::vector<uint64_t> sizes = { 1ULL << 10, 64ULL << 10, 1ULL << 20, 16ULL << 20, 256ULL << 20, 1ULL << 30, 4ULL << 30 };
+	std::vector<unsigned int> connections = { 1, 10, 100, 1000 };
+	uint64_t budget = 1ULL << 30; // bytes transferred by one case (at least one request per connection)
+	unsigned int max_requests = 2000;
+	unsigned int loops = std::max(std::thread::hardware_concurrency(), 1u);
+	bool io_uring = false;
+	std::string directory = "ipk-bench.tmp";
+} arguments;
+
+struct result {
+	std::string operation;
+	uint64_t size;
+	unsigned int connections;
+	std::size_t requests;
+	std::size_t failed;
+	double seconds;
+	std::vector<double> latencies; // microseconds
+};
+
+bool load_args(int argc, const char *argv[], args *arguments);
+
+// deterministic incompressible file
+static void create_file(const std::string &filepath, uint64_t size)
+{
+	std::ofstream file;
+	file.exceptions(std::ofstream::failbit | std::ofstream::badbit);
+	file.open(filepath, std::ios::binary | std::ios::trunc);
+	std::vector<uint64_t> block(128 * 1024);
+	uint64_t state = 0x9E3779B97F4A7C15ULL ^ size;
+	for (uint64_t written = 0; written < size;) {
+		for (auto &value : block) {
+			state ^= state << 13;
+			state ^= state >> 7;
+			state ^= state << 17;
+			value = state;
+		}
+		std::size_t chunk = static_cast<std::size_t>(std::min<uint64_t>(size - written, block.size() * sizeof(uint64_t)));
+		file.write(reinterpret_cast<const char*>(block.data()), chunk);
+		written += chunk;
+	}
+}
+
+static double percentile(const std::vector<double> &sorted, double p)
+{
+	if (sorted.empty()) {
+		return 0;
+	}
+	return sorted[static_cast<std::size_t>(p * (sorted.size() - 1))];
+}
+
+// run requests of one case over given number of connections (connections are set up before clock starts)
+static result run_case(const std::string &port, const std::string &operation, uint64_t size, unsigned int connections, std::size_t requests)
+{
+	result r{ operation, size, connections, requests, 0, 0, {} };
+	r.latencies.resize(requests, 0);
+
+	std::mutex mutex;
+	std::condition_variable cv;
+	unsigned int connected = 0;
+	bool start = false;
+	std::atomic<std::size_t> failed{ 0 };
+	std::vector<std::thread> threads;
+	for (unsigned int c = 0; c < connections; c++) {
+		threads.emplace_back([&, c]() {
+			IPKFTP client;
+			client.SetProgress(false);
+			std::string directory = "../client/c" + std::to_string(c);
+			std::string filename = ((operation == "upload") ? "u" : "d") + std::to_string(c) + "_" + std::to_string(size) + ".bin";
+			bool ready = true;
+			try {
+				mkdir(directory.c_str(), 0755);
+				if (operation == "upload") {
+					// file name of upload is its local name, every connection uploads its own file
+					std::remove((directory + "/" + filename).c_str());
+					if (symlink(("../src_" + std::to_string(size) + ".bin").c_str(), (directory + "/" + filename).c_str()) != 0) {
+						throw std::runtime_error("Error: Unable to create file!");
+					}
+				}
+				client.ClientConnect("localhost", port);
+			}
+			catch (const std::exception &e) {
+				(void)e; // bypass unreferenced local variable warning
+				ready = false;
+			}
+			{
+				std::unique_lock<std::mutex> lock(mutex);
+				connected++;
+				cv.notify_all();
+				cv.wait(lock, [&]() { return start; });
+			}
+
+			for (std::size_t i = c; i < requests; i += connections) {
+				auto begin = std::chrono::steady_clock::now();
+				try {
+					if (!ready) {
+						throw std::runtime_error("Error: Unable to connect!");
+					}
+					if (operation == "upload") {
+						client.Upload(directory + "/" + filename);
+					}
+					else {
+						// every connection downloads the same server file into its own directory
+						std::string download = directory + "/" + "d_" + std::to_string(size) + ".bin";
+						std::remove(download.c_str());
+						client.Download(download);
+					}
+				}
+				catch (const std::exception &e) {
+					(void)e; // bypass unreferenced local variable warning
+					failed++;
+				}
+				r.latencies[i] = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - begin).count();
+			}
+			try {
+				client.ClientDisconnect();
+			}
+			catch (const std::exception &e) {
+				(void)e; // bypass unreferenced local variable warning
+			}
+		});
+	}
+
+	std::chrono::steady_clock::time_point begin;
+	{
+		std::unique_lock<std::mutex> lock(mutex);
+		cv.wait(lock, [&]() { return connected == connections; });
+		start = true;
+		begin = std::chrono::steady_clock::now();
+		cv.notify_all();
+	}
+	for (auto &thread : threads) {
+		thread.join();
+	}
+	r.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+	r.failed = failed;
+	std::sort(r.latencies.begin(), r.latencies.end());
+	return r;
+}
+
+static void print_result(std::ostream &out, const result &r, bool last)
+{
+	double bytes = static_cast<double>(r.size) * static_cast<double>(r.requests - r.failed);
+	out << "    { \"operation\": \"" << r.operation << "\", \"size\": " << r.size << ", \"connections\": " << r.connections
+		<< ", \"requests\": " << r.requests << ", \"failed\": " << r.failed << ", \"seconds\": " << r.seconds
+		<< ", \"mb_per_s\": " << bytes / r.seconds / 1e6 << ", \"requests_per_s\": " << (r.requests - r.failed) / r.seconds
+		<< ", \"latency_us\": { \"p50\": " << percentile(r.latencies, 0.5) << ", \"p99\": " << percentile(r.latencies, 0.99)
+		<< ", \"p999\": " << percentile(r.latencies, 0.999) << ", \"max\": " << percentile(r.latencies, 1.0) << " } }"
+		<< (last ? "" : ",") << std::endl;
+}
+
+int main(int argc, const char *argv[])
+{
+	if (!load_args(argc, argv, &arguments)) {
+		std::cerr << bench_usage << std::endl;
+		return -1;
+	}
+
+	// every connection holds socket on both sides
+	rlimit limit;
+	if (getrlimit(RLIMIT_NOFILE, &limit) == 0) {
+		limit.rlim_cur = limit.rlim_max;
+		setrlimit(RLIMIT_NOFILE, &limit);
+	}
+
+	// server works in its own directory (relative paths), client files are kept next to it
+	mkdir(arguments.directory.c_str(), 0755);
+	if (chdir(arguments.directory.c_str()) != 0) {
+		std::cerr << "Error: Unable to use directory!" << std::endl;
+		return 1;
+	}
+	mkdir("server", 0755);
+	mkdir("client", 0755);
+	if (chdir("server") != 0) {
+		std::cerr << "Error: Unable to use directory!" << std::endl;
+		return 1;
+	}
+
+	unsigned int max_connections = *std::max_element(arguments.connections.begin(), arguments.connections.end());
+	IPKFTP server;
+	IPKServerConfig config;
+	config.host = "localhost";
+	config.loops = arguments.loops;
+	config.tcp.io_uring = arguments.io_uring;
+	config.workers = max_connections;
+	config.queue = max_connections;
+	std::mutex port_mutex;
+	std::condition_variable port_cv;
+	std::string port;
+	config.ready = [&](const std::string &actual_port) {
+		std::lock_guard<std::mutex> lock(port_mutex);
+		port = actual_port;
+		port_cv.notify_all();
+	};
+	std::exception_ptr server_error;
+	std::thread server_thread([&]() {
+		try {
+			server.ServerStart("0", config);
+		}
+		catch (...) {
+			server_error = std::current_exception();
+			std::lock_guard<std::mutex> lock(port_mutex);
+			port = "-";
+			port_cv.notify_all();
+		}
+	});
+	{
+		std::unique_lock<std::mutex> lock(port_mutex);
+		port_cv.wait(lock, [&]() { return !port.empty(); });
+	}
+	if (server_error) {
+		server_thread.join();
+		std::cerr << "Error: Unable to start server!" << std::endl;
+		return 1;
+	}
+
+	std::vector<result> results;
+	for (uint64_t size : arguments.sizes) {
+		std::string source = "../client/src_" + std::to_string(size) + ".bin";
+		std::string download = "d_" + std::to_string(size) + ".bin";
+		try {
+			create_file(source, size);
+			create_file(download, size);
+		}
+		catch (const std::ofstream::failure &e) {
+			(void)e; // bypass unreferenced local variable warning
+			std::cerr << "Error: Unable to create file!" << std::endl;
+			break;
+		}
+		for (unsigned int connections : arguments.connections) {
+			if (static_cast<double>(size) * connections > 4.0 * arguments.budget) {
+				continue; // one request per connection would exceed budget too much
+			}
+			std::size_t requests = static_cast<std::size_t>(std::min<uint64_t>(arguments.max_requests, std::max<uint64_t>(arguments.budget / size, 1)));
+			requests = std::max<std::size_t>(requests, connections);
+			for (const char *operation : { "upload", "download" }) {
+				std::cerr << operation << " size=" << size << " connections=" << connections << " requests=" << requests << std::endl;
+				results.push_back(run_case(port, operation, size, connections, requests));
+			}
+			for (unsigned int c = 0; c < connections; c++) {
+				std::string directory = "../client/c" + std::to_string(c) + "/";
+				std::remove((directory + "u" + std::to_string(c) + "_" + std::to_string(size) + ".bin").c_str());
+				std::remove((directory + "d_" + std::to_string(size) + ".bin").c_str());
+				std::remove(("u" + std::to_string(c) + "_" + std::to_string(size) + ".bin").c_str());
+			}
+		}
+		std::remove(source.c_str());
+		std::remove(download.c_str());
+	}
+
+	server.ServerStop();
+	server_thread.join();
+
+	IPKServerStats stats = IPKFTP::ServerStats();
+	std::ostream &out = std::cout;
+	out << "{" << std::endl;
+	out << "  \"server\": { \"mode\": \"" << (arguments.loops ? (arguments.io_uring && IOUring::Supported() ? "io_uring" : "reactor") : "workers") << "\", \"threads\": "
+		<< (arguments.loops ? arguments.loops : max_connections) << ", \"cache_hits\": " << stats.cache_hits
+		<< ", \"cache_misses\": " << stats.cache_misses << ", \"coalesced\": " << stats.coalesced << " }," << std::endl;
+	out << "  \"build\": { \"crc32_kernel\": " << CRC32Selected() << ", \"sha256_kernel\": " << SHA256Selected()
+		<< ", \"hardware_threads\": " << std::thread::hardware_concurrency() << " }," << std::endl;
+	out << "  \"results\": [" << std::endl;
+	for (std::size_t i = 0; i < results.size(); i++) {
+		print_result(out, results[i], i + 1 == results.size());
+	}
+	out << "  ]" << std::endl;
+	out << "}" << std::endl;
+	return 0;
+}
+
+bool load_args(int argc, const char *argv[], args *arguments) {
+	bool sizes(false), connections(false), budget(false), requests(false), loops(false), uring(false), directory(false);
+	if (argc % 2 == 0) {
+		return false;
+	}
+	for (int i = 1; i < argc; i += 2) {
+		std::vector<uint64_t> values;
+		if (std::string(argv[i]) == "-s" && !sizes) {
+			if (!load_list(argv[i + 1], arguments->sizes, true)) return false;
+			if (std::count(arguments->sizes.begin(), arguments->sizes.end(), 0)) return false;
+			sizes = true;
+		}
+		else if (std::string(argv[i]) == "-c" && !connections) {
+			if (!load_list(argv[i + 1], values, false) || std::count(values.begin(), values.end(), 0)) return false;
+			arguments->connections.assign(values.begin(), values.end());
+			connections = true;
+		}
+		else if (std::string(argv[i]) == "-b" && !budget) {
+			if (!load_list(argv[i + 1], values, true) || values.size() != 1 || values[0] == 0) return false;
+			arguments->budget = values[0];
+			budget = true;
+		}
+		else if (std::string(argv[i]) == "-n" && !requests) {
+			if (!load_list(argv[i + 1], values, false) || values.size() != 1 || values[0] == 0) return false;
+			arguments->max_requests = static_cast<unsigned int>(values[0]);
+			requests = true;
+		}
+		else if (std::string(argv[i]) == "-e" && !loops) {
+			try {
+				int value = std::stoi(argv[i + 1]);
+				if (value < 0) return false;
+				arguments->loops = static_cast<unsigned int>(value); // 0 = worker pool
+			}
+			catch (const std::exception &e) {
+				(void)e; // bypass unreferenced local variable warning
+				return false;
+			}
+			loops = true;
+		}
+		else if (std::string(argv[i]) == "-U" && !uring) {
+			std::string value(argv[i + 1]);
+			if (value != "0" && value != "1") return false;
+			arguments->io_uring = (value == "1");
+			uring = true;
+		}
+		else if (std::string(argv[i]) == "-d" && !directory) {
+			arguments->directory = argv[i + 1];
+			directory = true;
+		}
+		else {
+			return false;
+		}
+	}
+	return true;
+}
@@ -0,0 +1,503 @@
+/*
+*	IPK Project 1: client-server for simple file transfer
+*	Author: Tomáš Pazdiora (xpazdi02)
+*	File: loadgen.cpp
+*/
+
+// Load generator: thousands of concurrent clients (one persistent IPKFTP connection each) send mix of
+// CommandPing, RequestFile (download) and OfferFile (upload) with given file size distribution, either as fast
+// as they can (closed loop) or at given arrival rate (open loop). Throughput, errors by request type and
+// latency histograms are printed as JSON. Without -p in-process server on ephemeral loopback port is used.
+
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <map>
+#include <deque>
+#include <random>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <chrono>
+#include <algorithm>
+#include <cstdio>
+#include <stdint.h>
+#include "IPKFTP.h"
+#include "IPKPacket.h"
+#include "IPKMetrics.h"
+#include "BenchArgs.h"
+
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+
+const std::string loadgen_usage = "./ipk-loadgen [-h host -p port] [-c clients] [-d seconds] [-m mix] [-s sizes] [-r rate] [-t think_ms] [-w directory]\n"
+	"  mix: weighted request types, e.g. ping:10,read:70,write:20 (CommandPing, RequestFile, OfferFile)\n"
+	"  sizes: weighted file sizes, e.g. 1K:60,64K:30,1M:10 (K, M and G suffixes)\n"
+	"  rate: open loop arrivals per second (Poisson), 0 = closed loop (next request follows previous one)";
+
+typedef std::chrono::steady_clock clock_type;
+
+// request types of load (answered by server with status or data)
+const IPKTransmissionType load_types[] = { CommandPing, RequestFile, OfferFile };
+const std::size_t load_type_count = 3;
+
+const char *TypeName(IPKTransmissionType type)
+{
+	switch (type) {
+	case CommandPing: return "CommandPing";
+	case RequestFile: return "RequestFile";
+	case OfferFile: return "OfferFile";
+	default: return "IPKUnknown";
+	}
+}
+
+struct args {
+	std::string host = "localhost";
+	std::string port; // empty = in-process server
+	unsigned int clients = 100;
+	double duration = 10;
+	std::vector<std::pair<uint64_t, double>> mix = { { 0, 10 }, { 1, 70 }, { 2, 20 } }; // index into load_types, weight
+	std::vector<std::pair<uint64_t, double>> sizes = { { 1 << 10, 60 }, { 64 << 10, 30 }, { 1 << 20, 10 } }; // bytes, weight
+	double rate = 0;
+	unsigned int think = 0;
+	std::string directory = "ipk-loadgen.tmp";
+} arguments;
+
+bool load_args(int argc, const char *argv[], args *arguments);
+
+// ---------------- clients ----------------
+
+// counters of one request type (owned by one client thread, merged at the end)
+struct TypeStats {
+	uint64_t requests = 0;
+	uint64_t bytes = 0;
+	std::map<std::string, uint64_t> errors; // by exception message
+	IPKHistogram latency; // microseconds (open loop: since scheduled arrival)
+};
+
+struct ClientStats {
+	TypeStats types[load_type_count];
+};
+
+struct Request {
+	std::size_t type; // index into load_types
+	uint64_t size;
+	clock_type::time_point arrival;
+};
+
+// arrivals of open loop, taken by idle clients
+struct ArrivalQueue {
+	std::mutex mutex;
+	std::condition_variable cv;
+	std::deque<Request> requests;
+	bool closed = false;
+};
+
+class Picker {
+	std::discrete_distribution<std::size_t> distribution;
+	std::vector<uint64_t> values;
+public:
+	Picker(const std::vector<std::pair<uint64_t, double>> &weighted)
+	{
+		std::vector<double> weights;
+		for (const auto &item : weighted) {
+			values.push_back(item.first);
+			weights.push_back(item.second);
+		}
+		distribution = std::discrete_distribution<std::size_t>(weights.begin(), weights.end());
+	}
+	template <typename Generator>
+	uint64_t operator()(Generator &generator) { return values[distribution(generator)]; }
+};
+
+static std::string DownloadName(uint64_t size)
+{
+	return "load_" + std::to_string(size) + ".bin";
+}
+
+static void CreateFile(const std::string &filepath, uint64_t size)
+{
+	std::ofstream file;
+	file.exceptions(std::ofstream::failbit | std::ofstream::badbit);
+	file.open(filepath, std::ios::binary | std::ios::trunc);
+	std::mt19937_64 generator(size);
+	std::vector<uint64_t> block(8192);
+	for (uint64_t written = 0; written < size;) {
+		for (auto &value : block) {
+			value = generator();
+		}
+		std::size_t chunk = static_cast<std::size_t>(std::min<uint64_t>(size - written, block.size() * sizeof(uint64_t)));
+		file.write(reinterpret_cast<const char*>(block.data()), chunk);
+		written += chunk;
+	}
+}
+
+// simulated client: persistent connection, reconnects after any failure
+static void RunClient(unsigned int id, ClientStats &stats, ArrivalQueue *queue, clock_type::time_point deadline)
+{
+	std::mt19937_64 generator(0x1234567ULL + id);
+	Picker pick_type(arguments.mix), pick_size(arguments.sizes);
+	std::string directory = "../client/c" + std::to_string(id) + "/";
+	mkdir(directory.c_str(), 0755);
+
+	IPKFTP client;
+	client.SetProgress(false);
+	bool connected = false;
+	while (true) {
+		Request request;
+		if (queue) {
+			std::unique_lock<std::mutex> lock(queue->mutex);
+			queue->cv.wait(lock, [&]() { return queue->closed || !queue->requests.empty(); });
+			if (queue->requests.empty()) {
+				break;
+			}
+			request = queue->requests.front();
+			queue->requests.pop_front();
+		}
+		else {
+			if (clock_type::now() >= deadline) {
+				break;
+			}
+			request = Request{ static_cast<std::size_t>(pick_type(generator)), pick_size(generator), clock_type::now() };
+		}
+
+		TypeStats &type = stats.types[request.type];
+		type.requests++;
+		try {
+			if (!connected) {
+				client.ClientConnect(arguments.host, arguments.port);
+				connected = true;
+			}
+			switch (load_types[request.type]) {
+			case CommandPing:
+				client.Ping();
+				break;
+			case RequestFile:
+			{
+				std::string filepath = directory + DownloadName(request.size);
+				std::remove(filepath.c_str());
+				client.Download(filepath);
+				type.bytes += request.size;
+				break;
+			}
+			default:
+			{
+				// every client uploads its own file name (link to shared content)
+				std::string filename = "up" + std::to_string(id) + "_" + std::to_string(request.size) + ".bin";
+				std::string filepath = directory + filename;
+				struct stat info;
+				if (lstat(filepath.c_str(), &info) != 0 && symlink(("../" + DownloadName(request.size)).c_str(), filepath.c_str()) != 0) {
+					throw std::runtime_error("Error: Unable to create file!");
+				}
+				client.Upload(filepath);
+				type.bytes += request.size;
+				break;
+			}
+			}
+		}
+		catch (const std::exception &e) {
+			type.errors[e.what()]++;
+			client.ClientDisconnect(); // state of connection is unknown
+			connected = false;
+		}
+		type.latency.Add(static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::microseconds>(clock_type::now() - request.arrival).count()));
+
+		if (!queue && arguments.think) {
+			std::this_thread::sleep_for(std::chrono::milliseconds(arguments.think));
+		}
+	}
+	client.ClientDisconnect();
+}
+
+// open loop: Poisson arrivals until deadline, returns number of requests left in queue (not sent in time)
+static uint64_t RunArrivals(ArrivalQueue &queue, clock_type::time_point begin, clock_type::time_point deadline, uint64_t &generated)
+{
+	std::mt19937_64 generator(0x7654321ULL);
+	std::exponential_distribution<double> interarrival(arguments.rate);
+	Picker pick_type(arguments.mix), pick_size(arguments.sizes);
+	clock_type::time_point next = begin;
+	while (true) {
+		next += std::chrono::duration_cast<clock_type::duration>(std::chrono::duration<double>(interarrival(generator)));
+		if (next >= deadline) {
+			break;
+		}
+		std::this_thread::sleep_until(next);
+		std::lock_guard<std::mutex> lock(queue.mutex);
+		queue.requests.push_back(Request{ static_cast<std::size_t>(pick_type(generator)), pick_size(generator), next });
+		generated++;
+		queue.cv.notify_one();
+	}
+	std::lock_guard<std::mutex> lock(queue.mutex);
+	uint64_t unsent = queue.requests.size();
+	queue.requests.clear();
+	queue.closed = true;
+	queue.cv.notify_all();
+	return unsent;
+}
+
+int main(int argc, const char *argv[])
+{
+	if (!load_args(argc, argv, &arguments)) {
+		std::cerr << loadgen_usage << std::endl;
+		return -1;
+	}
+
+	// every client holds socket (and server socket when it runs in-process)
+	rlimit limit;
+	if (getrlimit(RLIMIT_NOFILE, &limit) == 0) {
+		limit.rlim_cur = limit.rlim_max;
+		setrlimit(RLIMIT_NOFILE, &limit);
+	}
+
+	// files of in-process server are kept in "server", client files next to it
+	mkdir(arguments.directory.c_str(), 0755);
+	if (chdir(arguments.directory.c_str()) != 0) {
+		std::cerr << "Error: Unable to use directory!" << std::endl;
+		return 1;
+	}
+	mkdir("server", 0755);
+	mkdir("client", 0755);
+	if (chdir("server") != 0) {
+		std::cerr << "Error: Unable to use directory!" << std::endl;
+		return 1;
+	}
+
+	IPKFTP server;
+	std::thread server_thread;
+	if (arguments.port.empty()) {
+		IPKServerConfig config;
+		config.host = arguments.host;
+		config.loops = std::max(std::thread::hardware_concurrency(), 1u);
+		std::mutex port_mutex;
+		std::condition_variable port_cv;
+		std::string port;
+		config.ready = [&](const std::string &actual_port) {
+			std::lock_guard<std::mutex> lock(port_mutex);
+			port = actual_port;
+			port_cv.notify_all();
+		};
+		server_thread = std::thread([&server, config, &port_mutex, &port_cv, &port]() {
+			try {
+				server.ServerStart("0", config);
+			}
+			catch (const std::exception &e) {
+				(void)e; // bypass unreferenced local variable warning
+				std::lock_guard<std::mutex> lock(port_mutex);
+				port = "-";
+				port_cv.notify_all();
+			}
+		});
+		std::unique_lock<std::mutex> lock(port_mutex);
+		port_cv.wait(lock, [&]() { return !port.empty(); });
+		if (port == "-") {
+			lock.unlock();
+			server_thread.join();
+			std::cerr << "Error: Unable to start server!" << std::endl;
+			return 1;
+		}
+		arguments.port = port;
+	}
+
+	// files of every size are uploaded first, RequestFile downloads them and OfferFile uploads their content
+	try {
+		IPKFTP setup;
+		setup.SetProgress(false);
+		setup.ClientConnect(arguments.host, arguments.port);
+		for (const auto &size : arguments.sizes) {
+			std::string filepath = "../client/" + DownloadName(size.first);
+			CreateFile(filepath, size.first);
+			setup.Upload(filepath);
+		}
+		setup.ClientDisconnect();
+	}
+	catch (const std::exception &e) {
+		std::cerr << e.what() << std::endl;
+		if (server_thread.joinable()) {
+			server.ServerStop();
+			server_thread.join();
+		}
+		return 1;
+	}
+
+	std::cerr << "clients=" << arguments.clients << " duration=" << arguments.duration << "s "
+		<< (arguments.rate > 0 ? "open loop rate=" + std::to_string(arguments.rate) : std::string("closed loop")) << std::endl;
+	std::vector<ClientStats> stats(arguments.clients);
+	ArrivalQueue queue;
+	auto begin = clock_type::now();
+	auto deadline = begin + std::chrono::duration_cast<clock_type::duration>(std::chrono::duration<double>(arguments.duration));
+	std::vector<std::thread> threads;
+	for (unsigned int c = 0; c < arguments.clients; c++) {
+		threads.emplace_back(RunClient, c, std::ref(stats[c]), (arguments.rate > 0) ? &queue : nullptr, deadline);
+	}
+	uint64_t generated = 0, unsent = 0;
+	if (arguments.rate > 0) {
+		unsent = RunArrivals(queue, begin, deadline, generated);
+	}
+	for (auto &thread : threads) {
+		thread.join();
+	}
+	double seconds = std::chrono::duration<double>(clock_type::now() - begin).count();
+
+	if (server_thread.joinable()) {
+		server.ServerStop();
+		server_thread.join();
+	}
+
+	// merge per-client counters
+	TypeStats total[load_type_count];
+	for (const auto &client : stats) {
+		for (std::size_t t = 0; t < load_type_count; t++) {
+			total[t].requests += client.types[t].requests;
+			total[t].bytes += client.types[t].bytes;
+			for (const auto &error : client.types[t].errors) {
+				total[t].errors[error.first] += error.second;
+			}
+			total[t].latency.Merge(client.types[t].latency);
+		}
+	}
+	uint64_t requests = 0, errors = 0, bytes = 0;
+	for (const auto &type : total) {
+		requests += type.requests;
+		bytes += type.bytes;
+		for (const auto &error : type.errors) {
+			errors += error.second;
+		}
+	}
+
+	std::ostream &out = std::cout;
+	out << "{" << std::endl;
+	out << "  \"config\": { \"host\": \"" << arguments.host << "\", \"port\": " << arguments.port << ", \"clients\": " << arguments.clients
+		<< ", \"duration_s\": " << arguments.duration << ", \"mode\": \"" << (arguments.rate > 0 ? "open" : "closed") << "\", \"rate\": " << arguments.rate
+		<< ", \"think_ms\": " << arguments.think << " }," << std::endl;
+	out << "  \"seconds\": " << seconds << ", \"requests\": " << requests << ", \"errors\": " << errors
+		<< ", \"error_rate\": " << (requests ? static_cast<double>(errors) / requests : 0)
+		<< ", \"requests_per_s\": " << (requests - errors) / seconds << ", \"mb_per_s\": " << bytes / seconds / 1e6;
+	if (arguments.rate > 0) {
+		out << ", \"generated\": " << generated << ", \"unsent\": " << unsent;
+	}
+	out << "," << std::endl;
+	out << "  \"types\": {" << std::endl;
+	for (std::size_t t = 0; t < load_type_count; t++) {
+		const TypeStats &type = total[t];
+		uint64_t type_errors = 0;
+		for (const auto &error : type.errors) {
+			type_errors += error.second;
+		}
+		out << "    \"" << TypeName(load_types[t]) << "\": { \"requests\": " << type.requests << ", \"errors\": " << type_errors
+			<< ", \"error_rate\": " << (type.requests ? static_cast<double>(type_errors) / type.requests : 0) << ", \"bytes\": " << type.bytes
+			<< ", \"errors_by_reason\": {";
+		bool first = true;
+		for (const auto &error : type.errors) {
+			out << (first ? " " : ", ") << "\"" << error.first << "\": " << error.second;
+			first = false;
+		}
+		out << " }," << std::endl << "      \"latency_us\": ";
+		type.latency.Print(out);
+		out << " }" << ((t + 1 < load_type_count) ? "," : "") << std::endl;
+	}
+	out << "  }" << std::endl;
+	out << "}" << std::endl;
+	return 0;
+}
+
+// comma separated list of value[:weight] (weight 1 by default)
+bool load_weighted(const std::string &arg, std::vector<std::pair<uint64_t, double>> &values, bool mix)
+{
+	values.clear();
+	std::istringstream list(arg);
+	std::string item;
+	while (std::getline(list, item, ',')) {
+		try {
+			std::size_t colon = item.find(':');
+			std::string value_text = item.substr(0, colon);
+			double weight = (colon == std::string::npos) ? 1 : std::stod(item.substr(colon + 1));
+			if (weight < 0) return false;
+			uint64_t value;
+			if (mix) {
+				if (value_text == "ping" || value_text == "CommandPing") value = 0;
+				else if (value_text == "read" || value_text == "RequestFile") value = 1;
+				else if (value_text == "write" || value_text == "OfferFile") value = 2;
+				else return false;
+			}
+			else if (!load_value(value_text, value, true)) {
+				return false;
+			}
+			values.push_back({ value, weight });
+		}
+		catch (const std::exception &e) {
+			(void)e; // bypass unreferenced local variable warning
+			return false;
+		}
+	}
+	double sum = 0;
+	for (const auto &value : values) {
+		sum += value.second;
+	}
+	return sum > 0;
+}
+
+bool load_args(int argc, const char *argv[], args *arguments) {
+	bool host(false), port(false), clients(false), duration(false), mix(false), sizes(false), rate(false), think(false), directory(false);
+	if (argc % 2 == 0) {
+		return false;
+	}
+	for (int i = 1; i < argc; i += 2) {
+		std::string option(argv[i]), value(argv[i + 1]);
+		try {
+			if (option == "-h" && !host) {
+				arguments->host = value;
+				host = true;
+			}
+			else if (option == "-p" && !port) {
+				arguments->port = value;
+				port = true;
+			}
+			else if (option == "-c" && !clients) {
+				int number = std::stoi(value);
+				if (number <= 0) return false;
+				arguments->clients = static_cast<unsigned int>(number);
+				clients = true;
+			}
+			else if (option == "-d" && !duration) {
+				arguments->duration = std::stod(value);
+				if (arguments->duration <= 0) return false;
+				duration = true;
+			}
+			else if (option == "-m" && !mix) {
+				if (!load_weighted(value, arguments->mix, true)) return false;
+				mix = true;
+			}
+			else if (option == "-s" && !sizes) {
+				if (!load_weighted(value, arguments->sizes, false)) return false;
+				sizes = true;
+			}
+			else if (option == "-r" && !rate) {
+				arguments->rate = std::stod(value);
+				if (arguments->rate < 0) return false;
+				rate = true;
+			}
+			else if (option == "-t" && !think) {
+				int number = std::stoi(value);
+				if (number < 0) return false;
+				arguments->think = static_cast<unsigned int>(number);
+				think = true;
+			}
+			else if (option == "-w" && !directory) {
+				arguments->directory = value;
+				directory = true;
+			}
+			else {
+				return false;
+			}
+		}
+		catch (const std::exception &e) {
+			(void)e; // bypass unreferenced local variable warning
+			return false;
+		}
+	}
+	return true;
+}
@@ -0,0 +1,286 @@
+/*
+*	IPK Project 1: client-server for simple file transfer
+*	Author: Tomáš Pazdiora (xpazdi02)
+*	File: microbench.cpp
+*/
+
+// Microbenchmark of hot CPU functions: CRC32 (every kernel) and IPKPacket serialization and deserialization
+// across payload sizes and alignments, throughput and heap allocations per operation are printed as JSON
+
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <functional>
+#include <chrono>
+#include <atomic>
+#include <new>
+#include <cstdlib>
+#include <stdint.h>
+#include "CRC32.h"
+#include "IPKPacket.h"
+#include "BenchArgs.h"
+
+// ---------------- allocation counting ----------------
+
+// every heap allocation of this process goes through replaced global operator new
+static std::atomic<uint64_t> allocations{ 0 };
+static std::atomic<uint64_t> allocated_bytes{ 0 };
+
+void *operator new(std::size_t size)
+{
+	allocations.fetch_add(1, std::memory_order_relaxed);
+	allocated_bytes.fetch_add(size, std::memory_order_relaxed);
+	void *ptr = std::malloc(size ? size : 1);
+	if (!ptr) {
+		throw std::bad_alloc();
+	}
+	return ptr;
+}
+void *operator new[](std::size_t size)
+{
+	return operator new(size);
+}
+void *operator new(std::size_t size, const std::nothrow_t &) noexcept
+{
+	try {
+		return operator new(size);
+	}
+	catch (const std::bad_alloc &e) {
+		(void)e; // bypass unreferenced local variable warning
+		return nullptr;
+	}
+}
+void *operator new[](std::size_t size, const std::nothrow_t &tag) noexcept
+{
+	return operator new(size, tag);
+}
+void operator delete(void *ptr) noexcept
+{
+	std::free(ptr);
+}
+void operator delete[](void *ptr) noexcept
+{
+	std::free(ptr);
+}
+void operator delete(void *ptr, std::size_t) noexcept
+{
+	std::free(ptr);
+}
+void operator delete[](void *ptr, std::size_t) noexcept
+{
+	std::free(ptr);
+}
+
+// ---------------- benchmark ----------------
+
+const std::string microbench_usage = "./ipk-microbench [-s sizes] [-a alignments] [-t min_time_ms] [-f filter]\n"
+	"  sizes and alignments are comma separated lists (sizes accept K and M suffixes),\n"
+	"  filter selects functions by whole components of their names (e.g. crc32, clmul, packet, serialize, view) out of\n"
+	"  crc32, crc32_bytewise, crc32_slicing8, crc32_slicing16, crc32_clmul,\n"
+	"  packet_serialize, packet_serialize_into, packet_deserialize, packet_view";
+
+struct args {
+	std::vector<uint64_t> sizes = { 16, 64, 256, 1 << 10, 4 << 10, 64 << 10, 1 << 20 };
+	std::vector<uint64_t> alignments = { 0, 1, 3, 8 };
+	double min_time = 0.1; // seconds of one measurement
+	std::string filter;
+} arguments;
+
+struct result {
+	std::string function;
+	uint64_t size;
+	uint64_t alignment;
+	uint64_t iterations;
+	double seconds;
+	uint64_t allocations;
+	uint64_t allocated_bytes;
+};
+
+bool load_args(int argc, const char *argv[], args *arguments);
+
+// results of measured functions are accumulated here, so they can not be optimized out
+static volatile uint64_t sink;
+
+// run operation until it takes at least min_time, best of three measurements is kept
+static result measure(const std::string &function, uint64_t size, uint64_t alignment, const std::function<uint64_t()> &operation)
+{
+	result r{ function, size, alignment, 0, 0, 0, 0 };
+	uint64_t iterations = 1;
+	for (int round = 0; round < 3;) {
+		uint64_t allocations_before = allocations.load(), bytes_before = allocated_bytes.load();
+		uint64_t value = 0;
+		auto begin = std::chrono::steady_clock::now();
+		for (uint64_t i = 0; i < iterations; i++) {
+			value += operation();
+		}
+		double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+		uint64_t allocations_after = allocations.load(), bytes_after = allocated_bytes.load();
+		sink = sink + value;
+
+		if (seconds < arguments.min_time) {
+			// calibration, iterations are scaled toward min_time
+			double scale = (seconds > 0) ? 1.2 * arguments.min_time / seconds : 100;
+			iterations = static_cast<uint64_t>(iterations * std::min(std::max(scale, 2.0), 100.0));
+			continue;
+		}
+		if (r.iterations == 0 || seconds / iterations < r.seconds / r.iterations) {
+			r.iterations = iterations;
+			r.seconds = seconds;
+			r.allocations = allocations_after - allocations_before;
+			r.allocated_bytes = bytes_after - bytes_before;
+		}
+		round++;
+	}
+	return r;
+}
+
+static void print_result(std::ostream &out, const result &r, bool last)
+{
+	double ns_per_op = r.seconds * 1e9 / r.iterations;
+	out << "    { \"function\": \"" << r.function << "\", \"size\": " << r.size << ", \"alignment\": " << r.alignment
+		<< ", \"iterations\": " << r.iterations << ", \"ns_per_op\": " << ns_per_op
+		<< ", \"mb_per_s\": " << r.size * 1e3 / ns_per_op
+		<< ", \"allocs_per_op\": " << static_cast<double>(r.allocations) / r.iterations
+		<< ", \"alloc_bytes_per_op\": " << static_cast<double>(r.allocated_bytes) / r.iterations << " }"
+		<< (last ? "" : ",") << std::endl;
+}
+
+// filter matches whole components of function name ("serialize" selects packet_serialize(_into), not packet_deserialize)
+static bool selected(const std::string &function)
+{
+	return arguments.filter.empty() || ("_" + function + "_").find("_" + arguments.filter + "_") != std::string::npos;
+}
+
+int main(int argc, const char *argv[])
+{
+	if (!load_args(argc, argv, &arguments)) {
+		std::cerr << microbench_usage << std::endl;
+		return -1;
+	}
+
+	const struct {
+		CRC32Kernel kernel;
+		const char *name;
+	} kernels[] = {
+		{ CRC32Bytewise, "bytewise" }, { CRC32Slicing8, "slicing8" }, { CRC32Slicing16, "slicing16" }, { CRC32CLMUL, "clmul" }
+	};
+
+	// payload is pseudo-random, buffer is 64 byte aligned so alignment is offset from cache line
+	uint64_t max_size = 0, max_alignment = 0;
+	for (uint64_t size : arguments.sizes) max_size = std::max(max_size, size);
+	for (uint64_t alignment : arguments.alignments) max_alignment = std::max(max_alignment, alignment);
+	std::vector<unsigned char> storage(static_cast<std::size_t>(max_size + max_alignment + 2 * IPKPacket::FrameSize + 128));
+	uint32_t state = 0x12345678;
+	for (auto &byte : storage) {
+		state = state * 1664525 + 1013904223;
+		byte = static_cast<unsigned char>(state >> 24);
+	}
+	unsigned char *buffer = storage.data() + (64 - reinterpret_cast<uintptr_t>(storage.data()) % 64) % 64;
+
+	std::vector<result> results;
+	for (uint64_t size : arguments.sizes) {
+		for (uint64_t alignment : arguments.alignments) {
+			const unsigned char *data = buffer + alignment;
+			std::size_t data_size = static_cast<std::size_t>(size);
+
+			// CRC32 with kernel selected at startup and with every supported kernel
+			std::cerr << "size=" << size << " alignment=" << alignment << std::endl;
+			if (selected("crc32")) {
+				results.push_back(measure("crc32", size, alignment, [&]() { return CRC32(data, data_size); }));
+			}
+			for (const auto &kernel : kernels) {
+				if (CRC32Supported(kernel.kernel) && selected(std::string("crc32_") + kernel.name)) {
+					CRC32Kernel k = kernel.kernel;
+					results.push_back(measure(std::string("crc32_") + kernel.name, size, alignment, [&, k]() { return CRC32(data, data_size, k); }));
+				}
+			}
+
+			// DataFrame carries at most FrameSize bytes
+			if (size > IPKPacket::FrameSize) {
+				continue;
+			}
+			IPKPacket packet(DataFrame, {}, std::vector<unsigned char>(data, data + data_size));
+			std::vector<unsigned char> message = packet;
+
+			// serialization operator (new message every time) and into reused buffer
+			if (selected("packet_serialize") && alignment == 0) {
+				results.push_back(measure("packet_serialize", size, alignment, [&]() {
+					std::vector<unsigned char> serialized = packet;
+					return serialized.size();
+				}));
+			}
+			if (selected("packet_serialize_into")) {
+				std::vector<unsigned char> reused;
+				results.push_back(measure("packet_serialize_into", size, alignment, [&]() {
+					IPKPacket::Serialize(reused, DataFrame, {}, 0, 0, 0, data, data_size);
+					return reused.size();
+				}));
+			}
+
+			// deserializing constructor (owning copy of data) and in place view of message
+			if (selected("packet_deserialize") && alignment == 0) {
+				results.push_back(measure("packet_deserialize", size, alignment, [&]() {
+					IPKPacket deserialized(message);
+					return deserialized.GetData().size();
+				}));
+			}
+			if (selected("packet_view")) {
+				unsigned char *copy = buffer + max_size + max_alignment + alignment;
+				copy = std::copy(message.begin(), message.end(), copy) - message.size();
+				results.push_back(measure("packet_view", size, alignment, [&]() {
+					IPKPacketView view(copy, message.size(), CRC32State(copy, message.size()));
+					return view.DataSize();
+				}));
+			}
+		}
+	}
+
+	std::ostream &out = std::cout;
+	out << "{" << std::endl;
+	out << "  \"build\": { \"crc32_kernel\": " << CRC32Selected() << ", \"frame_size\": " << IPKPacket::FrameSize << " }," << std::endl;
+	out << "  \"results\": [" << std::endl;
+	for (std::size_t i = 0; i < results.size(); i++) {
+		print_result(out, results[i], i + 1 == results.size());
+	}
+	out << "  ]" << std::endl;
+	out << "}" << std::endl;
+	return (sink == 0xFFFFFFFFFFFFFFFFULL) ? 1 : 0;
+}
+
+bool load_args(int argc, const char *argv[], args *arguments) {
+	bool sizes(false), alignments(false), time(false), filter(false);
+	if (argc % 2 == 0) {
+		return false;
+	}
+	for (int i = 1; i < argc; i += 2) {
+		std::vector<uint64_t> values;
+		if (std::string(argv[i]) == "-s" && !sizes) {
+			if (!load_list(argv[i + 1], arguments->sizes, true)) return false;
+			for (uint64_t size : arguments->sizes) {
+				if (size == 0) return false; // DataFrame requires data
+			}
+			sizes = true;
+		}
+		else if (std::string(argv[i]) == "-a" && !alignments) {
+			if (!load_list(argv[i + 1], arguments->alignments, false)) return false;
+			for (uint64_t alignment : arguments->alignments) {
+				if (alignment >= 64) return false;
+			}
+			alignments = true;
+		}
+		else if (std::string(argv[i]) == "-t" && !time) {
+			if (!load_list(argv[i + 1], values, false) || values.size() != 1 || values[0] == 0) return false;
+			arguments->min_time = values[0] / 1000.0;
+			time = true;
+		}
+		else if (std::string(argv[i]) == "-f" && !filter) {
+			arguments->filter = argv[i + 1];
+			filter = true;
+		}
+		else {
+			return false;
+		}
+	}
+	return true;
+}
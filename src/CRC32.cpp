@@ -5,8 +5,26 @@
 */
 
 #include "CRC32.h"
+#include "IPKTrace.h"
 #include <array>
 
+// x86 specific (CPUID and PCLMULQDQ)
+#if defined(__x86_64__) || defined(__i386__) || defined(_M_X64) || defined(_M_IX86)
+#define CRC32_X86
+#include <emmintrin.h>
+#include <smmintrin.h>
+#include <wmmintrin.h>
+#if defined(_MSC_VER)
+#include <intrin.h>
+#define CRC32_TARGET_CLMUL
+#define CRC32_ALIGN(x) __declspec(align(x))
+#else
+#include <cpuid.h>
+#define CRC32_TARGET_CLMUL __attribute__((target("sse4.1,pclmul")))
+#define CRC32_ALIGN(x) __attribute__((aligned(x)))
+#endif
+#endif
+
 // Use C++14 extended constexpr if available
 #if __cpp_constexpr >= 201304
 #define CPP14_CONSTEXPR constexpr
@@ -16,16 +34,17 @@
 
 static CPP14_CONSTEXPR uint32_t polynomial = crc32_polynomial;
 
+template <std::size_t N>
 struct CRC32LUT
 {
-	uint32_t values[0x100];
+	uint32_t values[N][0x100];
 
-	CPP14_CONSTEXPR uint32_t& operator[](size_t i)
+	CPP14_CONSTEXPR uint32_t* operator[](size_t i)
 	{
 		return values[i];
 	}
 
-	CPP14_CONSTEXPR const uint32_t& operator[](size_t i) const
+	CPP14_CONSTEXPR const uint32_t* operator[](size_t i) const
 	{
 		return values[i];
 	}
@@ -40,10 +59,12 @@ static CPP14_CONSTEXPR uint32_t bit_reverse(const uint32_t x) {
 	return reversed;
 }
 
-// function for compiling CRC32 lookup table (256 entries)
-static CPP14_CONSTEXPR CRC32LUT crc32lut_compile(const uint32_t polynomial)
+// function for compiling N CRC32 lookup tables (256 entries each),
+// table k advances CRC of byte followed by k zero bytes (slicing-by-N)
+template <std::size_t N>
+static CPP14_CONSTEXPR CRC32LUT<N> crc32lut_compile(const uint32_t polynomial)
 {
-	CRC32LUT lut{};
+	CRC32LUT<N> lut{};
 
 	const uint32_t reversed_polynomial = bit_reverse(polynomial);
 
@@ -53,20 +74,322 @@ static CPP14_CONSTEXPR CRC32LUT crc32lut_compile(const uint32_t polynomial)
 		for (unsigned int j = 0; j < 8; j++) {
 			crc = (crc >> 1) ^ (-int(crc & 1) & reversed_polynomial);
 		}
-		lut[i] = crc;
+		lut[0][i] = crc;
+	}
+	for (std::size_t k = 1; k < N; k++) {
+		for (unsigned int i = 0; i <= 0xFF; i++) {
+			lut[k][i] = (lut[k - 1][i] >> 8) ^ lut[0][lut[k - 1][i] & 0xFF];
+		}
 	}
 	return lut;
 }
 
-// CRC32 lookup table (256 entries)
-static CPP14_CONSTEXPR CRC32LUT crc32lut(crc32lut_compile(polynomial));
+// CRC32 lookup tables (16 x 256 entries, first table is the classic bytewise one)
+static CPP14_CONSTEXPR CRC32LUT<16> crc32lut(crc32lut_compile<16>(polynomial));
+
+// little-endian load independent of host byte order and alignment
+static inline uint32_t load32(const unsigned char *p)
+{
+	return static_cast<uint32_t>(p[0]) | (static_cast<uint32_t>(p[1]) << 8) |
+		(static_cast<uint32_t>(p[2]) << 16) | (static_cast<uint32_t>(p[3]) << 24);
+}
+
+// CRC32 with lookup table (crc is internal, not inverted, state)
+static uint32_t crc32_bytewise(uint32_t crc, const unsigned char *data, std::size_t size)
+{
+	for (const unsigned char *end = data + size; data != end; data++) {
+		crc = (crc >> 8) ^ crc32lut[0][(crc & 0xFF) ^ *data];
+	}
+	return crc;
+}
+
+// CRC32 slicing-by-8
+static uint32_t crc32_slicing8(uint32_t crc, const unsigned char *data, std::size_t size)
+{
+	for (; size >= 8; size -= 8, data += 8) {
+		uint32_t one = load32(data) ^ crc;
+		uint32_t two = load32(data + 4);
+		crc = crc32lut[7][one & 0xFF] ^ crc32lut[6][(one >> 8) & 0xFF] ^
+			crc32lut[5][(one >> 16) & 0xFF] ^ crc32lut[4][one >> 24] ^
+			crc32lut[3][two & 0xFF] ^ crc32lut[2][(two >> 8) & 0xFF] ^
+			crc32lut[1][(two >> 16) & 0xFF] ^ crc32lut[0][two >> 24];
+	}
+	return crc32_bytewise(crc, data, size);
+}
+
+// CRC32 slicing-by-16
+static uint32_t crc32_slicing16(uint32_t crc, const unsigned char *data, std::size_t size)
+{
+	for (; size >= 16; size -= 16, data += 16) {
+		uint32_t one = load32(data) ^ crc;
+		uint32_t two = load32(data + 4);
+		uint32_t three = load32(data + 8);
+		uint32_t four = load32(data + 12);
+		crc = crc32lut[15][one & 0xFF] ^ crc32lut[14][(one >> 8) & 0xFF] ^
+			crc32lut[13][(one >> 16) & 0xFF] ^ crc32lut[12][one >> 24] ^
+			crc32lut[11][two & 0xFF] ^ crc32lut[10][(two >> 8) & 0xFF] ^
+			crc32lut[9][(two >> 16) & 0xFF] ^ crc32lut[8][two >> 24] ^
+			crc32lut[7][three & 0xFF] ^ crc32lut[6][(three >> 8) & 0xFF] ^
+			crc32lut[5][(three >> 16) & 0xFF] ^ crc32lut[4][three >> 24] ^
+			crc32lut[3][four & 0xFF] ^ crc32lut[2][(four >> 8) & 0xFF] ^
+			crc32lut[1][(four >> 16) & 0xFF] ^ crc32lut[0][four >> 24];
+	}
+	return crc32_bytewise(crc, data, size);
+}
+
+#if defined(CRC32_X86)
+// CRC32 folding using carry-less multiplication, 64 bytes per iteration
+// (constants of bit-reflected 0x04C11DB7 polynomial, Intel: "Fast CRC Computation
+// for Generic Polynomials Using PCLMULQDQ Instruction"), size >= 64
+CRC32_TARGET_CLMUL
+static uint32_t crc32_clmul_fold(uint32_t crc, const unsigned char *data, std::size_t size)
+{
+	static const uint64_t CRC32_ALIGN(16) k1k2[] = { 0x0154442bd4, 0x01c6e41596 };
+	static const uint64_t CRC32_ALIGN(16) k3k4[] = { 0x01751997d0, 0x00ccaa009e };
+	static const uint64_t CRC32_ALIGN(16) k5k0[] = { 0x0163cd6124, 0x0000000000 };
+	static const uint64_t CRC32_ALIGN(16) poly[] = { 0x01db710641, 0x01f7011641 };
+
+	__m128i x0, x1, x2, x3, x4, x5, x6, x7, x8, y5, y6, y7, y8;
+
+	x1 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + 0x00));
+	x2 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + 0x10));
+	x3 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + 0x20));
+	x4 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + 0x30));
+	x1 = _mm_xor_si128(x1, _mm_cvtsi32_si128(static_cast<int>(crc)));
+	x0 = _mm_load_si128(reinterpret_cast<const __m128i*>(k1k2));
+	data += 64;
+	size -= 64;
+
+	// fold 4 x 128 bits in parallel
+	while (size >= 64) {
+		x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+		x6 = _mm_clmulepi64_si128(x2, x0, 0x00);
+		x7 = _mm_clmulepi64_si128(x3, x0, 0x00);
+		x8 = _mm_clmulepi64_si128(x4, x0, 0x00);
+
+		x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+		x2 = _mm_clmulepi64_si128(x2, x0, 0x11);
+		x3 = _mm_clmulepi64_si128(x3, x0, 0x11);
+		x4 = _mm_clmulepi64_si128(x4, x0, 0x11);
+
+		y5 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + 0x00));
+		y6 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + 0x10));
+		y7 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + 0x20));
+		y8 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + 0x30));
+
+		x1 = _mm_xor_si128(_mm_xor_si128(x1, x5), y5);
+		x2 = _mm_xor_si128(_mm_xor_si128(x2, x6), y6);
+		x3 = _mm_xor_si128(_mm_xor_si128(x3, x7), y7);
+		x4 = _mm_xor_si128(_mm_xor_si128(x4, x8), y8);
+
+		data += 64;
+		size -= 64;
+	}
+
+	// fold into 128 bits
+	x0 = _mm_load_si128(reinterpret_cast<const __m128i*>(k3k4));
+
+	x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+	x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+	x1 = _mm_xor_si128(_mm_xor_si128(x1, x2), x5);
+
+	x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+	x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+	x1 = _mm_xor_si128(_mm_xor_si128(x1, x3), x5);
+
+	x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+	x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+	x1 = _mm_xor_si128(_mm_xor_si128(x1, x4), x5);
+
+	// fold remaining 128 bit blocks
+	while (size >= 16) {
+		x2 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data));
+
+		x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+		x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+		x1 = _mm_xor_si128(_mm_xor_si128(x1, x2), x5);
+
+		data += 16;
+		size -= 16;
+	}
+
+	// fold 128 bits to 64 bits
+	x2 = _mm_clmulepi64_si128(x1, x0, 0x10);
+	x3 = _mm_setr_epi32(~0, 0, ~0, 0);
+	x1 = _mm_srli_si128(x1, 8);
+	x1 = _mm_xor_si128(x1, x2);
+
+	x0 = _mm_loadl_epi64(reinterpret_cast<const __m128i*>(k5k0));
+
+	x2 = _mm_srli_si128(x1, 4);
+	x1 = _mm_and_si128(x1, x3);
+	x1 = _mm_clmulepi64_si128(x1, x0, 0x00);
+	x1 = _mm_xor_si128(x1, x2);
+
+	// Barrett reduction to 32 bits
+	x0 = _mm_load_si128(reinterpret_cast<const __m128i*>(poly));
+
+	x2 = _mm_and_si128(x1, x3);
+	x2 = _mm_clmulepi64_si128(x2, x0, 0x10);
+	x2 = _mm_and_si128(x2, x3);
+	x2 = _mm_clmulepi64_si128(x2, x0, 0x00);
+	x1 = _mm_xor_si128(x1, x2);
+
+	return static_cast<uint32_t>(_mm_extract_epi32(x1, 1));
+}
+
+static uint32_t crc32_clmul(uint32_t crc, const unsigned char *data, std::size_t size)
+{
+	if (size >= 64) {
+		std::size_t folded = size & ~static_cast<std::size_t>(15);
+		crc = crc32_clmul_fold(crc, data, folded);
+		data += folded;
+		size -= folded;
+	}
+	return crc32_slicing16(crc, data, size);
+}
+
+// CPUID leaf 1: ECX bit 1 = PCLMULQDQ, bit 19 = SSE4.1
+static bool cpu_has_clmul()
+{
+	unsigned int ecx = 0;
+#if defined(_MSC_VER)
+	int info[4];
+	__cpuid(info, 1);
+	ecx = static_cast<unsigned int>(info[2]);
+#else
+	unsigned int eax, ebx, edx;
+	if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx)) {
+		return false;
+	}
+#endif
+	return (ecx & (1u << 1)) && (ecx & (1u << 19));
+}
+#endif
+
+bool CRC32Supported(CRC32Kernel kernel)
+{
+	switch (kernel) {
+	case CRC32Bytewise:
+	case CRC32Slicing8:
+	case CRC32Slicing16:
+		return true;
+	case CRC32CLMUL:
+#if defined(CRC32_X86)
+		return cpu_has_clmul();
+#else
+		return false;
+#endif
+	default:
+		return false;
+	}
+}
+
+// selected once, at startup
+static const CRC32Kernel crc32_selected = CRC32Supported(CRC32CLMUL) ? CRC32CLMUL : CRC32Slicing16;
+
+CRC32Kernel CRC32Selected()
+{
+	return crc32_selected;
+}
+
+static uint32_t crc32_update(CRC32Kernel kernel, uint32_t crc, const unsigned char *data, std::size_t size)
+{
+	switch (kernel) {
+	case CRC32Slicing8:
+		return crc32_slicing8(crc, data, size);
+	case CRC32Slicing16:
+		return crc32_slicing16(crc, data, size);
+#if defined(CRC32_X86)
+	case CRC32CLMUL:
+		return crc32_clmul(crc, data, size);
+#endif
+	default:
+		return crc32_bytewise(crc, data, size);
+	}
+}
 
 // CRC32 with lookup table
 uint32_t CRC32(const std::vector<unsigned char>::const_iterator begin, const std::vector<unsigned char>::const_iterator end)
 {
-	uint32_t crc = 0xFFFFFFFF;
-	for (auto it = begin; it != end; it++) {
-		crc = (crc >> 8) ^ crc32lut[(crc & 0xFF) ^ *it];
+	if (begin == end) {
+		return CRC32(nullptr, 0);
+	}
+	return CRC32(&(*begin), static_cast<std::size_t>(end - begin));
+}
+
+uint32_t CRC32(const unsigned char *data, std::size_t size)
+{
+	return CRC32(data, size, crc32_selected);
+}
+
+uint32_t CRC32(const unsigned char *data, std::size_t size, CRC32Kernel kernel)
+{
+	return ~crc32_update(kernel, 0xFFFFFFFF, data, size);
+}
+
+// product of polynomials a and b modulo CRC32 polynomial (reflected bit order)
+static uint32_t multiply_modp(uint32_t a, uint32_t b)
+{
+	const uint32_t reflected = bit_reverse(polynomial);
+	uint32_t product = 0;
+	for (uint32_t m = 1u << 31; m; m >>= 1) {
+		if (a & m) {
+			product ^= b;
+		}
+		b = (b & 1) ? (b >> 1) ^ reflected : b >> 1;
+	}
+	return product;
+}
+
+uint32_t CRC32CombineOperator(uint64_t size2)
+{
+	// x^(8 * size2) modulo CRC32 polynomial, by squaring x^(2^k)
+	uint32_t result = 1u << 31, square = 1u << 30; // x^0, x^1
+	for (uint64_t bits = size2 * 8; bits; bits >>= 1) {
+		if (bits & 1) {
+			result = multiply_modp(square, result);
+		}
+		square = multiply_modp(square, square);
+	}
+	return result;
+}
+
+uint32_t CRC32Combine(uint32_t crc1, uint32_t crc2, uint32_t combine_operator)
+{
+	return multiply_modp(combine_operator, crc1) ^ crc2;
+}
+
+// ---------------- CRC32State ----------------
+
+CRC32State::CRC32State() : crc(0xFFFFFFFF)
+{
+}
+
+CRC32State::CRC32State(const unsigned char *data, std::size_t size) : CRC32State()
+{
+	IPK_TRACE_SPAN_BYTES("crc32.message", size);
+	Update(data, size);
+}
+
+void CRC32State::Init()
+{
+	crc = 0xFFFFFFFF;
+}
+
+void CRC32State::Update(const unsigned char *begin, const unsigned char *end)
+{
+	Update(begin, static_cast<std::size_t>(end - begin));
+}
+
+void CRC32State::Update(const unsigned char *data, std::size_t size)
+{
+	if (size) {
+		crc = crc32_update(crc32_selected, crc, data, size);
 	}
+}
+
+uint32_t CRC32State::Finalize() const
+{
 	return ~crc;
-}
\ No newline at end of file
+}
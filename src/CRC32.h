@@ -8,10 +8,48 @@
 #define CRC32_H
 
 #include <vector>
+#include <cstddef>
 #include <stdint.h>
 
+// CRC32 kernels (all of them give identical results)
+enum CRC32Kernel {
+	CRC32Bytewise, // 256 entries lookup table, one byte per iteration
+	CRC32Slicing8, // 8 x 256 entries lookup table, 8 bytes per iteration
+	CRC32Slicing16, // 16 x 256 entries lookup table, 16 bytes per iteration
+	CRC32CLMUL // carry-less multiplication folding (x86 with SSE4.1 and PCLMULQDQ)
+};
+
+// Check if kernel can be used on this CPU
+bool CRC32Supported(CRC32Kernel kernel);
+
+// Best supported kernel (selected at startup using CPUID)
+CRC32Kernel CRC32Selected();
+
 // Compute CRC32 of given data
 const uint32_t crc32_polynomial = 0x04C11DB7;
 uint32_t CRC32(const std::vector<unsigned char>::const_iterator begin, const std::vector<unsigned char>::const_iterator end);
+uint32_t CRC32(const unsigned char *data, std::size_t size);
+uint32_t CRC32(const unsigned char *data, std::size_t size, CRC32Kernel kernel);
+
+// CRC32 of concatenated parts from CRC32 of both of them without their data, operator depends only on size
+// of second part, so it is computed once for parts of the same size (see zlib crc32_combine_op)
+uint32_t CRC32CombineOperator(uint64_t size2);
+uint32_t CRC32Combine(uint32_t crc1, uint32_t crc2, uint32_t combine_operator);
+
+// CRC32 of data followed by its own CRC32 (little-endian) is always this value
+const uint32_t crc32_residue = 0x2144DF1C;
+
+// Incremental CRC32 computation (init, update by blocks, finalize)
+class CRC32State {
+	uint32_t crc;
+public:
+	CRC32State();
+	CRC32State(const unsigned char *data, std::size_t size);
+
+	void Init();
+	void Update(const unsigned char *begin, const unsigned char *end);
+	void Update(const unsigned char *data, std::size_t size);
+	uint32_t Finalize() const;
+};
 
-#endif
\ No newline at end of file
+#endif
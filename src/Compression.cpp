@@ -0,0 +1,306 @@
+/*
+*	IPK Project 1: client-server for simple file transfer
+*	Author: Tomáš Pazdiora (xpazdi02)
+*	File: Compression.cpp
+*/
+
+#include "Compression.h"
+
+#include <algorithm>
+#include <cstring>
+
+#if defined(IPK_HAVE_ZLIB)
+#include <zlib.h>
+#endif
+#if defined(IPK_HAVE_ZSTD)
+#include <zstd.h>
+#endif
+
+// ------------ built-in LZ codec -----------
+//
+// stream of sequences: token (literal length << 4 | match length - 4),
+// literal length extension, literals, match offset (2 bytes, little endian),
+// match length extension; lengths 15 are extended by bytes up to 255,
+// last sequence carries literals only
+
+namespace {
+	const std::size_t min_match = 4;
+	const std::size_t max_offset = 0xFFFF;
+	const unsigned int hash_bits = 12;
+
+	inline uint32_t read32(const unsigned char *p)
+	{
+		uint32_t value;
+		std::memcpy(&value, p, sizeof(value));
+		return value;
+	}
+
+	inline std::size_t hash32(uint32_t value)
+	{
+		return static_cast<std::size_t>((value * 2654435761u) >> (32 - hash_bits));
+	}
+
+	void put_length(std::vector<unsigned char> &output, std::size_t length)
+	{
+		for (; length >= 255; length -= 255) {
+			output.push_back(255);
+		}
+		output.push_back(static_cast<unsigned char>(length));
+	}
+
+	bool get_length(const unsigned char *&it, const unsigned char *end, std::size_t &length, std::size_t max)
+	{
+		unsigned char byte;
+		do {
+			if (it == end || length > max) {
+				return false;
+			}
+			byte = *(it++);
+			length += byte;
+		} while (byte == 255);
+		return true;
+	}
+
+	// literals followed by match (match_length 0 = last sequence)
+	void put_sequence(std::vector<unsigned char> &output, const unsigned char *literals, std::size_t literal_length,
+		std::size_t offset, std::size_t match_length)
+	{
+		std::size_t match_code = match_length ? match_length - min_match : 0;
+		output.push_back(static_cast<unsigned char>((std::min<std::size_t>(literal_length, 15) << 4) | std::min<std::size_t>(match_code, 15)));
+		if (literal_length >= 15) {
+			put_length(output, literal_length - 15);
+		}
+		output.insert(output.end(), literals, literals + literal_length);
+		if (match_length) {
+			output.push_back(static_cast<unsigned char>(offset & 0xFF));
+			output.push_back(static_cast<unsigned char>(offset >> 8));
+			if (match_code >= 15) {
+				put_length(output, match_code - 15);
+			}
+		}
+	}
+
+	bool lz_compress(const unsigned char *data, std::size_t size, std::vector<unsigned char> &output, std::size_t limit)
+	{
+		uint32_t table[1 << hash_bits]; // last position of hashed 4 bytes + 1 (0 = none)
+		std::fill(std::begin(table), std::end(table), 0);
+		std::size_t base = output.size();
+
+		std::size_t anchor = 0, i = 0;
+		while (i + min_match <= size) {
+			uint32_t sequence = read32(data + i);
+			uint32_t &entry = table[hash32(sequence)];
+			std::size_t candidate = entry;
+			entry = static_cast<uint32_t>(i + 1);
+			if (candidate && i + 1 - candidate <= max_offset && read32(data + candidate - 1) == sequence) {
+				std::size_t match = candidate - 1;
+				std::size_t length = min_match;
+				while (i + length < size && data[match + length] == data[i + length]) {
+					length++;
+				}
+				put_sequence(output, data + anchor, i - anchor, i - match, length);
+				if (output.size() - base > limit) {
+					return false;
+				}
+				i += length;
+				anchor = i;
+			}
+			else {
+				i += 1 + ((i - anchor) >> 6); // step faster through data that do not match
+			}
+		}
+		put_sequence(output, data + anchor, size - anchor, 0, 0);
+		return output.size() - base <= limit;
+	}
+
+	bool lz_decompress(const unsigned char *data, std::size_t size, unsigned char *output, std::size_t output_size)
+	{
+		const unsigned char *it = data, *end = data + size;
+		std::size_t position = 0;
+		while (it != end) {
+			unsigned char token = *(it++);
+			std::size_t literal_length = token >> 4;
+			if (literal_length == 15 && !get_length(it, end, literal_length, output_size)) {
+				return false;
+			}
+			if (literal_length > static_cast<std::size_t>(end - it) || literal_length > output_size - position) {
+				return false;
+			}
+			std::memcpy(output + position, it, literal_length);
+			it += literal_length;
+			position += literal_length;
+			if (it == end) {
+				break; // last sequence
+			}
+
+			if (end - it < 2) {
+				return false;
+			}
+			std::size_t offset = it[0] | (static_cast<std::size_t>(it[1]) << 8);
+			it += 2;
+			std::size_t match_length = token & 0xF;
+			if (match_length == 15 && !get_length(it, end, match_length, output_size)) {
+				return false;
+			}
+			match_length += min_match;
+			if (offset == 0 || offset > position || match_length > output_size - position) {
+				return false;
+			}
+			unsigned char *to = output + position;
+			const unsigned char *from = to - offset;
+			if (offset >= match_length) {
+				std::memcpy(to, from, match_length);
+			}
+			else {
+				for (std::size_t i = 0; i < match_length; i++) {
+					to[i] = from[i]; // overlapping match repeats last offset bytes
+				}
+			}
+			position += match_length;
+		}
+		return position == output_size;
+	}
+}
+
+// -------------- Compression ---------------
+
+std::vector<CompressionCodec> Compression::Supported()
+{
+	std::vector<CompressionCodec> codecs;
+#if defined(IPK_HAVE_ZSTD)
+	codecs.push_back(ZstdCompression);
+#endif
+	codecs.push_back(LZCompression);
+#if defined(IPK_HAVE_ZLIB)
+	codecs.push_back(ZlibCompression);
+#endif
+	return codecs;
+}
+
+bool Compression::IsSupported(CompressionCodec codec)
+{
+	auto codecs = Supported();
+	return std::find(codecs.begin(), codecs.end(), codec) != codecs.end();
+}
+
+CompressionCodec Compression::FromName(const std::string &name)
+{
+	CompressionCodec codec = NoCompression;
+	if (name == "lz") {
+		codec = LZCompression;
+	}
+	else if (name == "zlib") {
+		codec = ZlibCompression;
+	}
+	else if (name == "zstd") {
+		codec = ZstdCompression;
+	}
+	return IsSupported(codec) ? codec : NoCompression;
+}
+
+bool Compression::Compress(CompressionCodec codec, const unsigned char *data, std::size_t size, std::vector<unsigned char> &output, std::size_t limit)
+{
+	switch (codec) {
+	case LZCompression:
+		return lz_compress(data, size, output, limit);
+#if defined(IPK_HAVE_ZLIB)
+	case ZlibCompression:
+	{
+		std::size_t base = output.size();
+		uLongf compressed_size = compressBound(static_cast<uLong>(size));
+		output.resize(base + compressed_size);
+		if (compress2(output.data() + base, &compressed_size, data, static_cast<uLong>(size), Z_BEST_SPEED) != Z_OK) {
+			return false;
+		}
+		output.resize(base + compressed_size);
+		return compressed_size <= limit;
+	}
+#endif
+#if defined(IPK_HAVE_ZSTD)
+	case ZstdCompression:
+	{
+		std::size_t base = output.size();
+		output.resize(base + ZSTD_compressBound(size));
+		std::size_t compressed_size = ZSTD_compress(output.data() + base, output.size() - base, data, size, 1);
+		if (ZSTD_isError(compressed_size)) {
+			return false;
+		}
+		output.resize(base + compressed_size);
+		return compressed_size <= limit;
+	}
+#endif
+	default:
+		return false;
+	}
+}
+
+bool Compression::Decompress(CompressionCodec codec, const unsigned char *data, std::size_t size, unsigned char *output, std::size_t output_size)
+{
+	switch (codec) {
+	case LZCompression:
+		return lz_decompress(data, size, output, output_size);
+#if defined(IPK_HAVE_ZLIB)
+	case ZlibCompression:
+	{
+		uLongf decompressed_size = static_cast<uLongf>(output_size);
+		return uncompress(output, &decompressed_size, data, static_cast<uLong>(size)) == Z_OK && decompressed_size == output_size;
+	}
+#endif
+#if defined(IPK_HAVE_ZSTD)
+	case ZstdCompression:
+	{
+		std::size_t decompressed_size = ZSTD_decompress(output, output_size, data, size);
+		return !ZSTD_isError(decompressed_size) && decompressed_size == output_size;
+	}
+#endif
+	default:
+		return false;
+	}
+}
+
+// ------------ FrameCompressor -------------
+
+FrameCompressor::FrameCompressor(CompressionCodec codec)
+	: codec(codec), misses(0), skip(0), tried(false)
+{
+}
+
+CompressionCodec FrameCompressor::Codec() const
+{
+	return this->codec;
+}
+
+const std::vector<unsigned char> *FrameCompressor::Compress(const unsigned char *data, std::size_t size, uint32_t frame_crc)
+{
+	static const unsigned int max_skip = 64; // frames (4 MiB)
+	tried = false;
+	if (codec == NoCompression) {
+		return nullptr;
+	}
+	if (skip > 0) {
+		skip--;
+		return nullptr;
+	}
+
+	// CRC32 of original DataFrame and original size precede compressed data
+	uint32_t original_size = static_cast<uint32_t>(size);
+	buffer.resize(sizeof(frame_crc) + sizeof(original_size));
+	std::memcpy(buffer.data(), &frame_crc, sizeof(frame_crc));
+	std::memcpy(buffer.data() + sizeof(frame_crc), &original_size, sizeof(original_size));
+
+	// frame is worth compressing only if it saves at least 1/16 of its size
+	tried = true;
+	std::size_t limit = size - size / 16;
+	if (limit > buffer.size() && Compression::Compress(codec, data, size, buffer, limit - buffer.size())) {
+		misses = 0;
+		return &buffer;
+	}
+	misses++;
+	skip = std::min(1u << std::min(misses, 6u), max_skip) - 1;
+	return nullptr;
+}
+
+bool FrameCompressor::Tried() const
+{
+	return this->tried;
+}
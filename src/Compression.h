@@ -0,0 +1,60 @@
+/*
+*	IPK Project 1: client-server for simple file transfer
+*	Author: Tomáš Pazdiora (xpazdi02)
+*	File: Compression.h
+*/
+
+#ifndef COMPRESSION_H
+#define COMPRESSION_H
+
+#include <string>
+#include <vector>
+#include <stdint.h>
+
+// compression codecs (value is sent on the wire, see CommandPing)
+enum CompressionCodec {
+	NoCompression = 0,
+	LZCompression = 1, // built-in byte oriented LZ77 codec (always available)
+	ZlibCompression = 2, // available when built with IPK_HAVE_ZLIB
+	ZstdCompression = 3 // available when built with IPK_HAVE_ZSTD
+};
+
+class Compression {
+public:
+	// codecs available in this build, in order of preference
+	static std::vector<CompressionCodec> Supported();
+	static bool IsSupported(CompressionCodec codec);
+
+	// codec by its name ("lz", "zlib", "zstd"), NoCompression if unknown or not available
+	static CompressionCodec FromName(const std::string &name);
+
+	// compress data and append them to output, false if compressed data would exceed limit
+	// (output is then not valid)
+	static bool Compress(CompressionCodec codec, const unsigned char *data, std::size_t size, std::vector<unsigned char> &output, std::size_t limit);
+
+	// decompress exactly output_size bytes, false if compressed data are corrupted
+	static bool Decompress(CompressionCodec codec, const unsigned char *data, std::size_t size, unsigned char *output, std::size_t output_size);
+};
+
+// Sender side compression of DataFrames, data that do not compress are skipped
+// for a growing number of frames (so incompressible files cost almost nothing)
+class FrameCompressor {
+	CompressionCodec codec;
+	unsigned int misses; // consecutive frames that did not compress
+	unsigned int skip; // frames sent uncompressed before next try
+	bool tried; // last frame was compressed (or at least tried to)
+	std::vector<unsigned char> buffer;
+public:
+	FrameCompressor(CompressionCodec codec = NoCompression);
+
+	CompressionCodec Codec() const;
+
+	// CompressedFrame data (CRC32 of original DataFrame, original size and compressed data) of frame,
+	// nullptr if frame should be sent uncompressed, data are valid until next call
+	const std::vector<unsigned char> *Compress(const unsigned char *data, std::size_t size, uint32_t frame_crc);
+
+	// last frame did not compress (false if it was skipped)
+	bool Tried() const;
+};
+
+#endif
@@ -0,0 +1,821 @@
+/*
+*	IPK Project 1: client-server for simple file transfer
+*	Author: Tomáš Pazdiora (xpazdi02)
+*	File: IOUring.cpp
+*/
+
+#include "IOUring.h"
+
+#if defined(IPK_HAVE_IO_URING)
+#include "IPKMetrics.h"
+#include "IPKTrace.h"
+#include "CRC32.h"
+#include "MappedFile.h"
+
+#include <vector>
+#include <unordered_map>
+#include <algorithm>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <chrono>
+#include <cstring>
+
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#include <sys/mman.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+
+namespace {
+	int uring_setup(unsigned int entries, io_uring_params *params)
+	{
+		return static_cast<int>(syscall(__NR_io_uring_setup, entries, params));
+	}
+
+	int uring_enter(int fd, unsigned int submit, unsigned int complete, unsigned int flags)
+	{
+		return static_cast<int>(syscall(__NR_io_uring_enter, fd, submit, complete, flags, NULL, 0));
+	}
+
+	int uring_register(int fd, unsigned int opcode, const void *arg, unsigned int count)
+	{
+		return static_cast<int>(syscall(__NR_io_uring_register, fd, opcode, arg, count));
+	}
+
+	// submission and completion queues shared with kernel (used by single thread)
+	class Ring {
+		int fd;
+		void *sq_ring, *cq_ring;
+		std::size_t sq_ring_size, cq_ring_size;
+		io_uring_sqe *sqes;
+		std::size_t sqes_size;
+		unsigned int sq_entries;
+		unsigned int *sq_head, *sq_tail, *sq_mask, *sq_array;
+		unsigned int *cq_head, *cq_tail, *cq_mask;
+		io_uring_cqe *cqes;
+		unsigned int tail; // tail of queued SQEs (published by Submit)
+		unsigned int queued; // SQEs not submitted yet
+		unsigned int features; // IORING_FEAT_* reported by kernel
+
+		void Release();
+	public:
+		Ring(unsigned int entries, unsigned int cq_entries);
+		~Ring();
+		Ring(const Ring &) = delete;
+		Ring &operator=(const Ring &) = delete;
+
+		// zeroed SQE (queued SQEs are submitted when submission queue is full)
+		io_uring_sqe *Get();
+		// submit queued SQEs and wait for at least wait completions
+		void Submit(unsigned int wait);
+		// handle every available completion
+		template <typename Handler>
+		void Reap(Handler handle);
+		bool Register(unsigned int opcode, const void *arg, unsigned int count);
+		unsigned int Features() const { return features; }
+	};
+
+	Ring::Ring(unsigned int entries, unsigned int cq_entries)
+		: fd(-1), sq_ring(MAP_FAILED), cq_ring(MAP_FAILED), sq_ring_size(0), cq_ring_size(0), sqes(static_cast<io_uring_sqe*>(MAP_FAILED)),
+		sqes_size(0), sq_entries(0), tail(0), queued(0), features(0)
+	{
+		io_uring_params params;
+		std::memset(&params, 0, sizeof(params));
+		params.flags = IORING_SETUP_CQSIZE;
+		params.cq_entries = cq_entries;
+#if defined(IORING_SETUP_COOP_TASKRUN)
+		params.flags |= IORING_SETUP_COOP_TASKRUN; // completions are processed when loop enters kernel anyway
+		fd = uring_setup(entries, &params);
+		if (fd < 0 && errno == EINVAL) {
+			std::memset(&params, 0, sizeof(params));
+			params.flags = IORING_SETUP_CQSIZE;
+			params.cq_entries = cq_entries;
+			fd = uring_setup(entries, &params);
+		}
+#else
+		fd = uring_setup(entries, &params);
+#endif
+		if (fd < 0) {
+			throw(TCPException(ListenFailed, "TCPError: io_uring_setup Failed!"));
+		}
+		if (!(params.features & IORING_FEAT_NODROP)) {
+			Release();
+			throw(TCPException(ListenFailed, "TCPError: io_uring drops completions!")); // completion queue could overflow
+		}
+		features = params.features;
+
+		sq_entries = params.sq_entries;
+		sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned int);
+		cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+		bool single_mmap = (params.features & IORING_FEAT_SINGLE_MMAP) != 0;
+		if (single_mmap) {
+			sq_ring_size = cq_ring_size = std::max(sq_ring_size, cq_ring_size);
+		}
+		sq_ring = mmap(NULL, sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+		if (sq_ring != MAP_FAILED) {
+			cq_ring = single_mmap ? sq_ring : mmap(NULL, cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+		}
+		sqes_size = params.sq_entries * sizeof(io_uring_sqe);
+		if (cq_ring != MAP_FAILED) {
+			sqes = static_cast<io_uring_sqe*>(mmap(NULL, sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES));
+		}
+		if (sqes == MAP_FAILED) {
+			Release();
+			throw(TCPException(ListenFailed, "TCPError: Unable to map io_uring!"));
+		}
+
+		unsigned char *sq = static_cast<unsigned char*>(sq_ring);
+		unsigned char *cq = static_cast<unsigned char*>(cq_ring);
+		sq_head = reinterpret_cast<unsigned int*>(sq + params.sq_off.head);
+		sq_tail = reinterpret_cast<unsigned int*>(sq + params.sq_off.tail);
+		sq_mask = reinterpret_cast<unsigned int*>(sq + params.sq_off.ring_mask);
+		sq_array = reinterpret_cast<unsigned int*>(sq + params.sq_off.array);
+		cq_head = reinterpret_cast<unsigned int*>(cq + params.cq_off.head);
+		cq_tail = reinterpret_cast<unsigned int*>(cq + params.cq_off.tail);
+		cq_mask = reinterpret_cast<unsigned int*>(cq + params.cq_off.ring_mask);
+		cqes = reinterpret_cast<io_uring_cqe*>(cq + params.cq_off.cqes);
+		tail = *sq_tail;
+	}
+
+	Ring::~Ring()
+	{
+		Release();
+	}
+
+	void Ring::Release()
+	{
+		if (sqes != MAP_FAILED) munmap(sqes, sqes_size);
+		if (cq_ring != MAP_FAILED && cq_ring != sq_ring) munmap(cq_ring, cq_ring_size);
+		if (sq_ring != MAP_FAILED) munmap(sq_ring, sq_ring_size);
+		if (fd >= 0) close(fd);
+		sqes = static_cast<io_uring_sqe*>(MAP_FAILED);
+		sq_ring = cq_ring = MAP_FAILED;
+		fd = -1;
+	}
+
+	io_uring_sqe *Ring::Get()
+	{
+		if (tail - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE) >= sq_entries) {
+			Submit(0);
+			if (tail - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE) >= sq_entries) {
+				throw(TCPException(SendRecvFailed, "TCPError: io_uring submission queue is full!"));
+			}
+		}
+		unsigned int index = tail & *sq_mask;
+		sq_array[index] = index;
+		tail++;
+		queued++;
+		io_uring_sqe *sqe = &sqes[index];
+		std::memset(sqe, 0, sizeof(*sqe));
+		return sqe;
+	}
+
+	void Ring::Submit(unsigned int wait)
+	{
+		__atomic_store_n(sq_tail, tail, __ATOMIC_RELEASE);
+		while (true) {
+			int ret = uring_enter(fd, queued, wait, wait ? IORING_ENTER_GETEVENTS : 0);
+			if (ret < 0) {
+				if (errno == EINTR) {
+					continue;
+				}
+				if (errno == EAGAIN || errno == EBUSY) {
+					return; // completions have to be reaped first
+				}
+				throw(TCPException(SelectFailed, "TCPError: io_uring_enter Failed!"));
+			}
+			queued -= std::min(static_cast<unsigned int>(ret), queued);
+			if (queued == 0) {
+				return;
+			}
+			wait = 0; // rest of queue (submission stopped at invalid SQE, its error is completed)
+		}
+	}
+
+	template <typename Handler>
+	void Ring::Reap(Handler handle)
+	{
+		while (true) {
+			unsigned int head = *cq_head;
+			if (head == __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE)) {
+				break;
+			}
+			io_uring_cqe cqe = cqes[head & *cq_mask];
+			__atomic_store_n(cq_head, head + 1, __ATOMIC_RELEASE); // slot is free before handler queues more work
+			handle(cqe.user_data, cqe.res);
+		}
+	}
+
+	bool Ring::Register(unsigned int opcode, const void *arg, unsigned int count)
+	{
+		return uring_register(fd, opcode, arg, count) >= 0;
+	}
+
+	// ------------------------------------------
+
+	// user_data of operations of loop itself (operations of connections carry address of connection)
+	const uint64_t wake_data = 1;
+	const uint64_t timer_data = 2;
+	const uint64_t cancel_data = 3;
+	const uint64_t poll_data = 4;
+
+	// connection driven by io_uring event loop
+	struct UringConnection {
+		TCPSocket sock;
+		std::unique_ptr<TCPHandler> handler;
+		TCPRequest request;
+		std::size_t base; // Recv: size of buffer before request
+		std::size_t done; // bytes of current request already processed (SendFile: header and file, RecvFile: written to file)
+		enum Operation { None, Socket, FileWrite } operation; // operation in flight (at most one)
+		bool cancelled; // socket operation was cancelled by timeout
+		bool waiting; // Wait: handler is asked again by next iteration of loop
+		std::chrono::steady_clock::time_point activity;
+		msghdr msg; // Send/SendFile: sendmsg in flight
+		iovec vec[2]; // rest of header and rest of file region
+		std::size_t vec_count;
+		int slot; // registered buffer of RecvFile (-1 = none)
+		std::vector<unsigned char> own; // buffer of RecvFile when no registered one is free
+		std::size_t filled; // bytes received into buffer
+		std::size_t drained; // bytes of buffer already written to file
+	};
+
+	class IOUringLoop : public TCPEventLoop {
+		static const std::size_t slot_size = 128 * 1024;
+		static const unsigned int slot_count = 32; // registered memory counts against RLIMIT_MEMLOCK
+		const int timeout;
+		Ring ring;
+		int event_fd;
+		uint64_t event_value; // target of eventfd read
+		__kernel_timespec tick; // sweep of timeouts
+		__kernel_timespec poll_tick; // handlers with Wait request
+		bool poll_armed;
+		unsigned int inflight; // submitted operations without completion (except cancels)
+		std::atomic<bool> stop;
+		std::mutex incoming_mutex;
+		std::vector<std::unique_ptr<UringConnection>> incoming;
+		std::unordered_map<UringConnection*, std::unique_ptr<UringConnection>> connections;
+		std::vector<UringConnection*> waiting; // connections with Wait request
+		std::vector<unsigned char> slots; // registered buffers (contiguous)
+		std::vector<int> free_slots;
+		bool registered;
+		std::thread thread;
+
+		void Run();
+		void Wake();
+		io_uring_sqe *Queue(uint64_t user_data);
+		void ArmWake();
+		void ArmTimer();
+		void ArmPoll();
+		void Cancel(uint64_t user_data);
+		void Accept();
+		void Sweep();
+		void Poll();
+
+		bool Start(UringConnection &conn);
+		bool Issue(UringConnection &conn);
+		bool Complete(UringConnection &conn, int res);
+		void Account(UringConnection &conn, UringConnection::Operation operation, int res);
+		void NextRequest(UringConnection &conn);
+		unsigned char *Buffer(UringConnection &conn);
+		void ReleaseBuffer(UringConnection &conn);
+		void Remove(UringConnection &conn);
+	public:
+		IOUringLoop(int timeout);
+		~IOUringLoop() override;
+
+		void Add(TCPSocket sock, std::unique_ptr<TCPHandler> handler) override;
+	};
+
+	IOUringLoop::IOUringLoop(int timeout)
+		: timeout(timeout), ring(1024, 16384), event_fd(-1), event_value(0), poll_armed(false), inflight(0), stop(false), registered(false)
+	{
+		event_fd = eventfd(0, EFD_CLOEXEC);
+		if (event_fd < 0) {
+			throw(TCPException(ListenFailed, "TCPError: Unable to create event loop!"));
+		}
+		tick.tv_sec = 1;
+		tick.tv_nsec = 0;
+		poll_tick.tv_sec = 0;
+		poll_tick.tv_nsec = 1000000;
+
+		// registered buffers spare kernel pinning pages of every file write,
+		// plain WRITE is used with the same memory when registration is not permitted
+		slots.resize(slot_size * slot_count);
+		std::vector<iovec> vecs;
+		for (unsigned int i = 0; i < slot_count; i++) {
+			vecs.push_back({ slots.data() + i * slot_size, slot_size });
+			free_slots.push_back(static_cast<int>(slot_count - 1 - i));
+		}
+		registered = ring.Register(IORING_REGISTER_BUFFERS, vecs.data(), slot_count);
+
+		thread = std::thread(&IOUringLoop::Run, this);
+	}
+
+	IOUringLoop::~IOUringLoop()
+	{
+		stop = true;
+		Wake();
+		thread.join();
+		for (auto &conn : incoming) {
+			shutdown(conn->sock, SHUT_RDWR);
+			close(conn->sock);
+		}
+		close(event_fd);
+	}
+
+	void IOUringLoop::Wake()
+	{
+		uint64_t one = 1;
+		if (write(event_fd, &one, sizeof(one)) < 0) {
+			// counter is already signaled
+		}
+	}
+
+	void IOUringLoop::Add(TCPSocket sock, std::unique_ptr<TCPHandler> handler)
+	{
+		std::unique_ptr<UringConnection> conn(new UringConnection{ sock, std::move(handler), {}, 0, 0, UringConnection::None, false, false, {}, {}, {}, 0, -1, {}, 0, 0 });
+		{
+			std::lock_guard<std::mutex> lock(incoming_mutex);
+			incoming.push_back(std::move(conn));
+		}
+		Wake();
+	}
+
+	io_uring_sqe *IOUringLoop::Queue(uint64_t user_data)
+	{
+		io_uring_sqe *sqe = ring.Get();
+		sqe->user_data = user_data;
+		if (user_data != cancel_data) {
+			inflight++;
+		}
+		return sqe;
+	}
+
+	void IOUringLoop::ArmWake()
+	{
+		io_uring_sqe *sqe = Queue(wake_data);
+		sqe->opcode = IORING_OP_READ;
+		sqe->fd = event_fd;
+		sqe->addr = reinterpret_cast<uint64_t>(&event_value);
+		sqe->len = sizeof(event_value);
+	}
+
+	void IOUringLoop::ArmTimer()
+	{
+		io_uring_sqe *sqe = Queue(timer_data);
+		sqe->opcode = IORING_OP_TIMEOUT;
+		sqe->fd = -1;
+		sqe->addr = reinterpret_cast<uint64_t>(&tick);
+		sqe->len = 1;
+	}
+
+	void IOUringLoop::ArmPoll()
+	{
+		io_uring_sqe *sqe = Queue(poll_data);
+		sqe->opcode = IORING_OP_TIMEOUT;
+		sqe->fd = -1;
+		sqe->addr = reinterpret_cast<uint64_t>(&poll_tick);
+		sqe->len = 1;
+		poll_armed = true;
+	}
+
+	void IOUringLoop::Cancel(uint64_t user_data)
+	{
+		io_uring_sqe *sqe = Queue(cancel_data);
+		sqe->opcode = IORING_OP_ASYNC_CANCEL;
+		sqe->fd = -1;
+		sqe->addr = user_data;
+	}
+
+	// register new connections
+	void IOUringLoop::Accept()
+	{
+		std::vector<std::unique_ptr<UringConnection>> accepted;
+		{
+			std::lock_guard<std::mutex> lock(incoming_mutex);
+			accepted.swap(incoming);
+		}
+		for (auto &conn : accepted) {
+			// io_uring waits for blocking sockets by itself (non-blocking one would complete with -EAGAIN)
+			int flags = fcntl(conn->sock, F_GETFL, 0);
+			if (flags >= 0) {
+				fcntl(conn->sock, F_SETFL, flags & ~O_NONBLOCK);
+			}
+			UringConnection &c = *conn;
+			connections[&c] = std::move(conn);
+			c.activity = std::chrono::steady_clock::now();
+			bool keep = false;
+			try {
+				c.request = c.handler->Next();
+				c.base = (c.request.kind == TCPRequest::Recv) ? c.request.data->size() : 0;
+				keep = Start(c);
+			}
+			catch (const std::exception &e) {
+				(void)e; // bypass unreferenced local variable warning
+			}
+			if (!keep) {
+				Remove(c);
+			}
+		}
+	}
+
+	// cancel socket operations of connections waiting for data longer than timeout
+	void IOUringLoop::Sweep()
+	{
+		auto now = std::chrono::steady_clock::now();
+		for (auto &entry : connections) {
+			UringConnection &conn = *entry.second;
+			if (conn.operation == UringConnection::Socket && !conn.cancelled && now - conn.activity >= std::chrono::seconds(timeout)) {
+				conn.cancelled = true; // completed with -ECANCELED, unless it completes meanwhile
+				Cancel(reinterpret_cast<uint64_t>(&conn));
+			}
+		}
+	}
+
+	// ask handlers waiting for their background work again
+	void IOUringLoop::Poll()
+	{
+		std::vector<UringConnection*> polled;
+		polled.swap(waiting);
+		for (UringConnection *c : polled) {
+			if (connections.find(c) == connections.end() || !c->waiting) {
+				continue; // closed meanwhile
+			}
+			UringConnection &conn = *c;
+			conn.waiting = false;
+			conn.activity = std::chrono::steady_clock::now();
+			bool keep = false;
+			try {
+				conn.handler->Completed();
+				NextRequest(conn);
+				keep = Start(conn);
+			}
+			catch (const std::exception &e) {
+				(void)e; // bypass unreferenced local variable warning
+			}
+			if (!keep) {
+				Remove(conn);
+			}
+		}
+	}
+
+	void IOUringLoop::NextRequest(UringConnection &conn)
+	{
+		ReleaseBuffer(conn);
+		conn.request = conn.handler->Next();
+		conn.base = (conn.request.kind == TCPRequest::Recv) ? conn.request.data->size() : 0;
+		conn.done = 0;
+	}
+
+	unsigned char *IOUringLoop::Buffer(UringConnection &conn)
+	{
+		if (conn.slot >= 0) {
+			return slots.data() + conn.slot * slot_size;
+		}
+		if (conn.own.empty()) {
+			if (!free_slots.empty()) {
+				conn.slot = free_slots.back();
+				free_slots.pop_back();
+				return slots.data() + conn.slot * slot_size;
+			}
+			conn.own.resize(slot_size); // all registered buffers are used by other transfers
+		}
+		return conn.own.data();
+	}
+
+	void IOUringLoop::ReleaseBuffer(UringConnection &conn)
+	{
+		if (conn.slot >= 0) {
+			free_slots.push_back(conn.slot);
+			conn.slot = -1;
+		}
+		std::vector<unsigned char>().swap(conn.own);
+		conn.filled = conn.drained = 0;
+	}
+
+	// submit operations of connection until one is in flight (false if connection should be closed)
+	bool IOUringLoop::Start(UringConnection &conn)
+	{
+		while (true) {
+			if (conn.request.kind == TCPRequest::Close) {
+				return false;
+			}
+			if (conn.request.kind == TCPRequest::Wait) {
+				if (!conn.waiting) {
+					conn.waiting = true;
+					waiting.push_back(&conn);
+				}
+				return true; // see Poll
+			}
+			if (Issue(conn)) {
+				return true; // wait for completion
+			}
+			ReleaseBuffer(conn);
+			conn.handler->Completed();
+			NextRequest(conn);
+		}
+	}
+
+	// queue next operation of current request (false if request is complete)
+	bool IOUringLoop::Issue(UringConnection &conn)
+	{
+		TCPRequest &req = conn.request;
+		uint64_t user_data = reinterpret_cast<uint64_t>(&conn);
+		if (req.kind == TCPRequest::Recv) {
+			if (conn.done == req.bytes) {
+				return false;
+			}
+			std::vector<unsigned char> &data = *req.data;
+			data.resize(conn.base + req.bytes);
+			io_uring_sqe *sqe = Queue(user_data);
+			sqe->opcode = IORING_OP_RECV;
+			sqe->fd = conn.sock;
+			sqe->addr = reinterpret_cast<uint64_t>(data.data() + conn.base + conn.done);
+			sqe->len = static_cast<uint32_t>(std::min<std::size_t>(req.bytes - conn.done, UINT32_MAX));
+			conn.operation = UringConnection::Socket;
+			return true;
+		}
+		if (req.kind == TCPRequest::Send || req.kind == TCPRequest::SendFile) {
+			// rest of header and file region in one sendmsg (file is sent from its mapping, page cache is copied once)
+			const std::vector<unsigned char> &data = *req.data;
+			const std::size_t file_bytes = (req.kind == TCPRequest::SendFile) ? req.bytes : 0;
+			if (conn.done == data.size() + file_bytes) {
+				return false;
+			}
+			conn.vec_count = 0;
+			if (conn.done < data.size()) {
+				conn.vec[conn.vec_count++] = { const_cast<unsigned char*>(data.data()) + conn.done, data.size() - conn.done };
+			}
+			if (file_bytes) {
+				std::size_t file_done = conn.done - std::min(conn.done, data.size());
+				conn.vec[conn.vec_count++] = { const_cast<unsigned char*>(req.file->Data()) + req.offset + file_done, file_bytes - file_done };
+			}
+			std::memset(&conn.msg, 0, sizeof(conn.msg));
+			conn.msg.msg_iov = conn.vec;
+			conn.msg.msg_iovlen = conn.vec_count;
+			io_uring_sqe *sqe = Queue(user_data);
+			sqe->opcode = IORING_OP_SENDMSG;
+			sqe->fd = conn.sock;
+			sqe->addr = reinterpret_cast<uint64_t>(&conn.msg);
+			sqe->len = 1;
+			sqe->msg_flags = MSG_NOSIGNAL;
+			conn.operation = UringConnection::Socket;
+			return true;
+		}
+		if (req.kind == TCPRequest::RecvFile) {
+			unsigned char *buffer;
+			if (conn.drained < conn.filled) {
+				// write received block into file
+				buffer = Buffer(conn);
+				io_uring_sqe *sqe = Queue(user_data);
+				sqe->opcode = (conn.slot >= 0 && registered) ? IORING_OP_WRITE_FIXED : IORING_OP_WRITE;
+				sqe->fd = req.descriptor;
+				sqe->off = req.offset + conn.done;
+				sqe->addr = reinterpret_cast<uint64_t>(buffer + conn.drained);
+				sqe->len = static_cast<uint32_t>(conn.filled - conn.drained);
+				sqe->buf_index = static_cast<uint16_t>(std::max(conn.slot, 0));
+				conn.operation = UringConnection::FileWrite;
+				return true;
+			}
+			if (conn.done == req.bytes) {
+				return false;
+			}
+			buffer = Buffer(conn);
+			conn.filled = conn.drained = 0;
+			io_uring_sqe *sqe = Queue(user_data);
+			sqe->opcode = IORING_OP_RECV;
+			sqe->fd = conn.sock;
+			sqe->addr = reinterpret_cast<uint64_t>(buffer);
+			sqe->len = static_cast<uint32_t>(std::min(slot_size, req.bytes - conn.done));
+			conn.operation = UringConnection::Socket;
+			return true;
+		}
+		return false;
+	}
+
+	// apply result of completed operation to current request (throws TCPException)
+	void IOUringLoop::Account(UringConnection &conn, UringConnection::Operation operation, int res)
+	{
+		TCPRequest &req = conn.request;
+		if (res < 0) {
+			if (operation == UringConnection::FileWrite) {
+				throw TCPException(SendRecvFailed, "TCPError: write to file Failed!");
+			}
+			throw TCPException(SendRecvFailed, (req.kind == TCPRequest::Recv || req.kind == TCPRequest::RecvFile) ? "TCPError: recv Failed!" : "TCPError: send Failed!");
+		}
+		if (res == 0) {
+			if (operation == UringConnection::FileWrite) {
+				throw TCPException(SendRecvFailed, "TCPError: write to file Failed!");
+			}
+			throw TCPException(ConnectionClosed, "TCPError: Connection Closed!");
+		}
+		std::size_t bytes = static_cast<std::size_t>(res);
+		conn.activity = std::chrono::steady_clock::now();
+
+		if (operation == UringConnection::FileWrite) {
+			conn.drained += bytes;
+			conn.done += bytes;
+			if (conn.drained == conn.filled) {
+				conn.filled = conn.drained = 0;
+			}
+		}
+		else if (req.kind == TCPRequest::Recv) {
+			if (req.crc) {
+				IPK_TRACE_SPAN_BYTES("crc32.recv", bytes);
+				req.crc->Update(req.data->data() + conn.base + conn.done, bytes); // block is still in cache
+			}
+			IPKMetrics::Add(BytesIn, bytes);
+			conn.done += bytes;
+		}
+		else if (req.kind == TCPRequest::RecvFile) {
+			IPKMetrics::Add(BytesIn, bytes);
+			conn.filled = bytes;
+		}
+		else {
+			if (req.crc && conn.done < req.data->size()) {
+				IPK_TRACE_SPAN_BYTES("crc32.send", std::min(bytes, req.data->size() - conn.done));
+				req.crc->Update(req.data->data() + conn.done, std::min(bytes, req.data->size() - conn.done)); // header only
+			}
+			IPKMetrics::Add(BytesOut, bytes);
+			conn.done += bytes;
+		}
+	}
+
+	// operation of connection completed (false if connection should be closed)
+	bool IOUringLoop::Complete(UringConnection &conn, int res)
+	{
+		UringConnection::Operation operation = conn.operation;
+		bool cancelled = conn.cancelled;
+		conn.operation = UringConnection::None;
+		conn.cancelled = false;
+		try {
+			if (res == -ECANCELED && cancelled) {
+				throw TCPException(Timeout, "TCPError: Timeout!");
+			}
+			if (res != -EINTR && res != -EAGAIN) { // interrupted operation is submitted again
+				Account(conn, operation, res);
+			}
+		}
+		catch (const TCPException &e) {
+			if (conn.request.kind == TCPRequest::Recv) {
+				conn.request.data->resize(conn.base + conn.done);
+			}
+			ReleaseBuffer(conn);
+			conn.handler->Failed(e);
+			NextRequest(conn);
+		}
+		return Start(conn);
+	}
+
+	void IOUringLoop::Remove(UringConnection &conn)
+	{
+		shutdown(conn.sock, SHUT_RDWR);
+		close(conn.sock);
+		ReleaseBuffer(conn);
+		connections.erase(&conn);
+	}
+
+	void IOUringLoop::Run()
+	{
+		ArmWake();
+		ArmTimer();
+		while (!stop) {
+			if (!waiting.empty() && !poll_armed) {
+				ArmPoll();
+			}
+			{
+				IPK_TRACE_SPAN("uring.wait");
+				ring.Submit(1); // all operations queued by previous completions in one syscall
+			}
+			ring.Reap([this](uint64_t user_data, int res) {
+				if (user_data == cancel_data) {
+					return;
+				}
+				inflight--;
+				if (user_data == wake_data) {
+					ArmWake();
+					if (!stop) {
+						Accept();
+					}
+					return;
+				}
+				if (user_data == timer_data) {
+					ArmTimer();
+					Sweep();
+					return;
+				}
+				if (user_data == poll_data) {
+					poll_armed = false;
+					return;
+				}
+				UringConnection &conn = *reinterpret_cast<UringConnection*>(user_data);
+				bool keep = false;
+				try {
+					IPK_TRACE_SPAN("uring.complete");
+					keep = Complete(conn, res);
+				}
+				catch (const std::exception &e) {
+					(void)e; // bypass unreferenced local variable warning
+				}
+				if (!keep) {
+					Remove(conn);
+				}
+			});
+			Poll();
+		}
+
+		// cancel operations in flight, buffers must stay valid until kernel completes them
+		Cancel(wake_data);
+		Cancel(timer_data);
+		if (poll_armed) {
+			Cancel(poll_data);
+		}
+		for (auto &entry : connections) {
+			shutdown(entry.second->sock, SHUT_RDWR);
+			if (entry.second->operation != UringConnection::None) {
+				Cancel(reinterpret_cast<uint64_t>(entry.first));
+			}
+		}
+		while (inflight) {
+			ring.Submit(1);
+			ring.Reap([this](uint64_t user_data, int res) {
+				(void)res; // bypass unreferenced parameter warning
+				if (user_data != cancel_data) {
+					inflight--;
+				}
+			});
+		}
+		for (auto &entry : connections) {
+			close(entry.second->sock);
+		}
+		connections.clear();
+	}
+}
+
+bool IOUring::Supported()
+{
+	static const bool supported = []() {
+		try {
+			Ring ring(8, 16);
+#if defined(IORING_FEAT_FAST_POLL)
+			if (!(ring.Features() & IORING_FEAT_FAST_POLL)) {
+				return false; // kernel older than 5.7, every pending socket receive would block io-wq worker thread
+			}
+#else
+			return false;
+#endif
+			std::vector<unsigned char> storage(sizeof(io_uring_probe) + 256 * sizeof(io_uring_probe_op), 0);
+			io_uring_probe *probe = reinterpret_cast<io_uring_probe*>(storage.data());
+			if (!ring.Register(IORING_REGISTER_PROBE, probe, 256)) {
+				return false; // kernel older than 5.6
+			}
+			const unsigned int required[] = { IORING_OP_RECV, IORING_OP_SENDMSG, IORING_OP_READ, IORING_OP_WRITE, IORING_OP_WRITE_FIXED,
+				IORING_OP_TIMEOUT, IORING_OP_ASYNC_CANCEL };
+			for (unsigned int op : required) {
+				if (op > probe->last_op || !(probe->ops[op].flags & IO_URING_OP_SUPPORTED)) {
+					return false;
+				}
+			}
+			return true;
+		}
+		catch (const TCPException &e) {
+			(void)e; // bypass unreferenced local variable warning
+			return false; // no io_uring (old kernel, disabled by sysctl or seccomp)
+		}
+	}();
+	return supported;
+}
+
+std::unique_ptr<TCPEventLoop> IOUring::Loop(int timeout)
+{
+	if (!Supported()) {
+		return nullptr;
+	}
+	try {
+		return std::unique_ptr<TCPEventLoop>(new IOUringLoop(timeout));
+	}
+	catch (const TCPException &e) {
+		(void)e; // bypass unreferenced local variable warning
+		return nullptr; // limits of io_uring instances were reached
+	}
+}
+
+#else
+
+bool IOUring::Supported()
+{
+	return false;
+}
+
+std::unique_ptr<TCPEventLoop> IOUring::Loop(int timeout)
+{
+	(void)timeout; // bypass unreferenced parameter warning
+	return nullptr;
+}
+
+#endif
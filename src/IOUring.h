@@ -0,0 +1,27 @@
+/*
+*	IPK Project 1: client-server for simple file transfer
+*	Author: Tomáš Pazdiora (xpazdi02)
+*	File: IOUring.h
+*/
+
+#ifndef IOURING_H
+#define IOURING_H
+
+#include <memory>
+#include "TCP.h"
+
+// Linux io_uring backend of reactor mode (raw syscalls, no liburing). Socket receives and sends of all
+// connections of loop are submitted by one io_uring_enter per iteration, SendFile is one sendmsg of header
+// and mapped file region, RecvFile writes received blocks from registered buffers (WRITE_FIXED) in the
+// same batch instead of splice in event loop thread.
+class IOUring {
+public:
+	// kernel provides io_uring with all required operations and internal polling of sockets (IORING_FEAT_FAST_POLL),
+	// not disabled by sysctl or seccomp
+	static bool Supported();
+
+	// io_uring event loop (nullptr when io_uring is not supported, epoll reactor is used then)
+	static std::unique_ptr<TCPEventLoop> Loop(int timeout);
+};
+
+#endif
@@ -0,0 +1,304 @@
+/*
+*	IPK Project 1: client-server for simple file transfer
+*	Author: Tomáš Pazdiora (xpazdi02)
+*	File: IPKClientSession.cpp
+*/
+
+#include "IPKClientSession.h"
+
+#include <fstream>
+#include <stdexcept>
+#include <algorithm>
+
+const std::size_t IPKClientSession::send_batch = 8; // DataFrames gathered into one send
+
+IPKClientSession::IPKClientSession(Direction direction, const std::string &filepath, CompressionCodec compression, int retries, Callback completed)
+	: direction(direction), filepath(filepath), filename(filepath.substr(filepath.find_last_of("/\\") + 1)), retries(retries), errors(0),
+	state(SendRequest), request(CommandPing), partial_offset(0), to_recv(0), codec(NoCompression), frame_size(0), completed(completed)
+{
+	if (direction == Upload) {
+		reader.reset(new IPKFrameReader(filepath));
+	}
+
+	// offer preferred codec first, server chooses one of them (or none)
+	if (compression != NoCompression) {
+		codecs.push_back(static_cast<unsigned char>(compression));
+		for (auto supported : Compression::Supported()) {
+			if (supported != compression) {
+				codecs.push_back(static_cast<unsigned char>(supported));
+			}
+		}
+	}
+	IPKPacket::Serialize(output, CommandPing, {}, 0, 0, 0, codecs.data(), codecs.size());
+}
+
+IPKClientSession::~IPKClientSession()
+{
+	if (completed) {
+		completed(std::make_exception_ptr(std::runtime_error("Error: Transfer was aborted!"))); // event loop was stopped
+	}
+}
+
+TCPRequest IPKClientSession::Next()
+{
+	switch (state) {
+	case SendRequest:
+	case SendFrames:
+		return { TCPRequest::Send, &output, 0, nullptr };
+	case ReadHeader:
+		return { TCPRequest::Recv, &input, IPKPacket::StatusSize, &crc };
+	case ReadFrameHeader:
+		// only header when data can be received directly into file
+		return { TCPRequest::Recv, &input, (writer->Descriptor() >= 0) ? IPKPacket::HeaderSize : IPKPacket::StatusSize, &crc };
+	case ReadBody:
+	case ReadFrameBody:
+		return { TCPRequest::Recv, &input, to_recv, &crc };
+	case ReadFrameData:
+		return { TCPRequest::RecvFile, nullptr, frame_size, nullptr, nullptr, writer->Position(), writer->Descriptor() };
+	case ReadFrameTrailer:
+		return { TCPRequest::Recv, &input, IPKPacket::StatusSize - IPKPacket::HeaderSize, &crc };
+	default:
+		return { TCPRequest::Close, nullptr, 0, nullptr };
+	}
+}
+
+void IPKClientSession::Completed()
+{
+	try {
+		switch (state) {
+		case SendRequest:
+			Expect(ReadHeader);
+			break;
+		case ReadHeader:
+			to_recv = IPKPacket::ExpectedSize(input) - IPKPacket::StatusSize;
+			if (to_recv) {
+				state = ReadBody;
+			}
+			else {
+				Process();
+			}
+			break;
+		case ReadBody:
+			Process();
+			break;
+		case SendFrames:
+			if (reader->Done()) {
+				request = OfferFile;
+				Expect(ReadHeader); // status of saved file
+			}
+			else {
+				SendNextFrames();
+			}
+			break;
+		case ReadFrameHeader:
+			to_recv = writer->Remaining(input);
+			if (input.size() == IPKPacket::HeaderSize && IPKPacket::Type(input) == CompressedFrame) {
+				to_recv += IPKPacket::StatusSize - IPKPacket::HeaderSize; // decompressed by Write
+				state = ReadFrameBody;
+			}
+			else if (input.size() == IPKPacket::HeaderSize) {
+				if (IPKPacket::Type(input) != DataFrame) {
+					throw(IPKPacketException(TransmissionTypeError, "IPKPacketError: DataFrame expected!"));
+				}
+				frame_size = to_recv;
+				state = ReadFrameData;
+			}
+			else {
+				state = ReadFrameBody;
+			}
+			break;
+		case ReadFrameBody:
+			writer->Write(input, crc);
+			FrameWritten();
+			break;
+		case ReadFrameData:
+			writer->Received(frame_size, crc); // CRC32 of data from page cache
+			input.clear();
+			state = ReadFrameTrailer;
+			break;
+		case ReadFrameTrailer:
+			writer->Verify(crc);
+			FrameWritten();
+			break;
+		default:
+			break;
+		}
+	}
+	catch (const IPKPacketException &e) {
+		if (e.error == SignatureError || e.error == VersionError || e.error == TransmissionTypeError ||
+			e.error == SizeError || e.error == CRC32Error) {
+			Retry();
+		}
+		else {
+			Finish(std::current_exception());
+		}
+	}
+	catch (const std::exception &e) {
+		(void)e; // bypass unreferenced local variable warning
+		Finish(std::current_exception()); // file can not be read or saved
+	}
+}
+
+void IPKClientSession::Failed(const TCPException &e)
+{
+	if (e.error == Timeout && state != Closed) {
+		Retry();
+	}
+	else {
+		Finish(std::make_exception_ptr(e));
+	}
+}
+
+// send request of transfer (verified part of previous transfer is continued)
+void IPKClientSession::Request()
+{
+	if (direction == Upload) {
+		int64_t version = reader->Version();
+		IPKPacket::Serialize(output, QueryFile, filename, reader->Size(), 0, 0, reinterpret_cast<const unsigned char*>(&version), sizeof(version));
+		request = QueryFile;
+	}
+	else {
+		uint64_t partial_size = 0;
+		int64_t version = 0;
+		if (IPKFrameWriter::Partial(filepath, partial_size, partial_offset, version) && partial_offset > 0) {
+			IPKPacket::Serialize(output, RequestRange, filename, partial_size, partial_offset, 0, reinterpret_cast<const unsigned char*>(&version), sizeof(version));
+			request = RequestRange;
+		}
+		else {
+			IPKPacket::Serialize(output, RequestFile, filename);
+			request = RequestFile;
+			partial_offset = 0;
+		}
+	}
+	state = SendRequest;
+}
+
+// process complete response stored in input
+void IPKClientSession::Process()
+{
+	IPKPacketView p(input, crc);
+	if (p == StatusInaccessible) {
+		Finish(std::make_exception_ptr(std::runtime_error("Error: File is not accessible on server!")));
+		return;
+	}
+	switch (request) {
+	case CommandPing:
+		if (p != StatusOk) {
+			Finish(std::make_exception_ptr(std::runtime_error((p == StatusBusy) ? "Error: Server is busy!" : "Error: Unable to connect!")));
+			return;
+		}
+		if (p.DataSize() == 1 && std::find(codecs.begin(), codecs.end(), p.Data()[0]) != codecs.end()) {
+			codec = static_cast<CompressionCodec>(p.Data()[0]);
+		}
+		if (reader) {
+			reader->SetCodec(codec);
+		}
+		Request();
+		break;
+	case QueryFile:
+	{
+		if (p != PartialFile) {
+			Retry();
+			return;
+		}
+		int64_t version = reader->Version();
+		uint64_t offset = (p.FileSize() == reader->Size()) ? p.Offset() : 0;
+		if (offset) {
+			IPKPacket::Serialize(output, OfferRange, filename, reader->Size(), offset, reader->Size() - offset, reinterpret_cast<const unsigned char*>(&version), sizeof(version));
+		}
+		else {
+			IPKPacket::Serialize(output, OfferFile, filename, reader->Size(), 0, 0, reinterpret_cast<const unsigned char*>(&version), sizeof(version));
+		}
+		reader->Rewind(offset);
+		SendNextFrames(); // first DataFrames follow offer in the same send
+		break;
+	}
+	case OfferFile:
+		if (p == StatusOk) {
+			Finish(nullptr);
+		}
+		else {
+			Retry();
+		}
+		break;
+	case RequestFile:
+	case RequestRange:
+	{
+		if ((p != OfferFile && p != OfferRange) || filename.compare(0, std::string::npos, p.Filename(), p.FilenameSize()) != 0) {
+			Retry();
+			return;
+		}
+		if (p == OfferRange && (p.Offset() != partial_offset || p.Length() != p.FileSize() - p.Offset())) {
+			Retry();
+			return;
+		}
+		writer.reset(new IPKFrameWriter(filepath, p.FileSize(), (p == OfferRange) ? p.Offset() : 0));
+		writer->SetCodec(codec);
+		writer->SetVersion(p.Version());
+		FrameWritten();
+		break;
+	}
+	default:
+		Retry();
+		break;
+	}
+}
+
+// append next DataFrames of uploaded file to output
+void IPKClientSession::SendNextFrames()
+{
+	//Possible Improvement: send DataFrames from mapped file (SendFile) without copying them into output
+	if (state == SendFrames) {
+		output.clear(); // previous DataFrames were sent
+	}
+	reader->Next(buffers, send_batch);
+	for (const auto &buffer : buffers) {
+		output.insert(output.end(), buffer.data, buffer.data + buffer.size);
+	}
+	state = SendFrames;
+}
+
+// continue with next DataFrame of downloaded file or finish it
+void IPKClientSession::FrameWritten()
+{
+	if (writer->Done()) {
+		auto finished = std::move(writer);
+		finished->Finish();
+		Finish(nullptr);
+	}
+	else {
+		Expect(ReadFrameHeader);
+	}
+}
+
+// start receiving of next packet (or DataFrame)
+void IPKClientSession::Expect(State packet_state)
+{
+	input.clear();
+	crc.Init();
+	state = packet_state;
+}
+
+// repeat request after error, transfer fails after (1 + retries) tries
+void IPKClientSession::Retry()
+{
+	writer.reset(); // verified part of file is kept, so next try continues it
+	if (++errors > retries) {
+		Finish(std::make_exception_ptr(std::runtime_error((direction == Upload) ? "Error: Upload failed!" : "Error: Download failed!")));
+		return;
+	}
+	Request();
+}
+
+// report result of transfer and close connection
+void IPKClientSession::Finish(std::exception_ptr error)
+{
+	reader.reset();
+	writer.reset();
+	state = Closed;
+	Callback callback = std::move(completed);
+	completed = nullptr;
+	if (callback) {
+		callback(error);
+	}
+}
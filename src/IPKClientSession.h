@@ -0,0 +1,79 @@
+/*
+*	IPK Project 1: client-server for simple file transfer
+*	Author: Tomáš Pazdiora (xpazdi02)
+*	File: IPKClientSession.h
+*/
+
+#ifndef IPKCLIENTSESSION_H
+#define IPKCLIENTSESSION_H
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <functional>
+#include <exception>
+#include "TCP.h"
+#include "IPKPacket.h"
+#include "IPKFrame.h"
+#include "CRC32.h"
+#include "Compression.h"
+
+// Transfer state machine of one client connection, uploads or downloads one file (never blocks on socket),
+// see IPKFTP::UploadAsync and IPKFTP::DownloadAsync
+class IPKClientSession : public TCPHandler {
+public:
+	enum Direction { Upload, Download };
+	using Callback = std::function<void(std::exception_ptr)>; // nullptr = transfer succeeded
+private:
+	enum State {
+		SendRequest, // CommandPing, QueryFile, RequestFile or RequestRange
+		ReadHeader, // first IPKPacket::StatusSize bytes of response
+		ReadBody, // rest of response
+		SendFrames, // OfferFile (or OfferRange) followed by DataFrames, next DataFrames
+		ReadFrameHeader, // first IPKPacket::StatusSize bytes of DataFrame
+		ReadFrameBody, // rest of DataFrame (or CompressedFrame)
+		ReadFrameData, // data of DataFrame received directly into file (splice)
+		ReadFrameTrailer, // CRC32 of DataFrame received into file
+		Closed
+	};
+
+	static const std::size_t send_batch; // DataFrames gathered into one send
+
+	const Direction direction;
+	const std::string filepath;
+	const std::string filename;
+	const int retries;
+	int errors;
+	State state;
+	IPKTransmissionType request; // request the response belongs to
+	uint64_t partial_offset; // verified part of previous download requested by RequestRange
+	std::size_t to_recv;
+	CRC32State crc; // CRC32 of received message, computed by blocks
+	std::vector<unsigned char> input;
+	std::vector<unsigned char> output;
+	std::vector<unsigned char> codecs; // offered by CommandPing (preferred one first)
+	CompressionCodec codec; // negotiated codec of connection
+	std::unique_ptr<IPKFrameReader> reader; // uploaded file
+	std::unique_ptr<IPKFrameWriter> writer; // downloaded file
+	std::vector<TCPBuffer> buffers;
+	std::size_t frame_size; // size of DataFrame data received directly into file
+	Callback completed;
+
+	void Request();
+	void Process();
+	void SendNextFrames();
+	void FrameWritten();
+	void Expect(State packet_state);
+	void Retry();
+	void Finish(std::exception_ptr error);
+public:
+	// file is opened for upload right away (throws std::ifstream::failure)
+	IPKClientSession(Direction direction, const std::string &filepath, CompressionCodec compression, int retries, Callback completed);
+	~IPKClientSession() override; // unfinished transfer completes with error
+
+	TCPRequest Next() override;
+	void Completed() override;
+	void Failed(const TCPException &e) override;
+};
+
+#endif
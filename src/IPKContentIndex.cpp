@@ -0,0 +1,339 @@
+/*
+*	IPK Project 1: client-server for simple file transfer
+*	Author: Tomáš Pazdiora (xpazdi02)
+*	File: IPKContentIndex.cpp
+*/
+
+#include "IPKContentIndex.h"
+#include "MappedFile.h"
+#include "SHA256.h"
+
+#include <map>
+#include <vector>
+#include <deque>
+#include <mutex>
+#include <atomic>
+#include <thread>
+#include <condition_variable>
+#include <fstream>
+#include <sstream>
+#include <cstdio>
+#include <iterator>
+#include <functional>
+
+#if defined(_WIN32)
+#include <windows.h>
+#else
+#include <unistd.h>
+#endif
+
+// index file line: SHA-256 (hex), file size, modification time, path (rest of line)
+
+namespace {
+	struct IndexEntry {
+		std::string digest; // raw SHA-256
+		uint64_t size;
+		int64_t mtime;
+	};
+
+	struct ContentIndexState {
+		std::mutex mutex;
+		std::string indexpath;
+		std::ofstream log;
+		std::map<std::string, IndexEntry> files; // by path
+		std::multimap<std::string, std::string> contents; // paths by digest
+		std::atomic<uint64_t> deduplicated{ 0 };
+		std::deque<std::string> pending; // saved files waiting for digest
+		std::condition_variable wake;
+		std::thread hasher; // computes digests of pending files (started by first of them)
+		bool stopping = false;
+
+		~ContentIndexState()
+		{
+			{
+				std::lock_guard<std::mutex> lock(mutex);
+				stopping = true;
+			}
+			wake.notify_all();
+			if (hasher.joinable()) {
+				hasher.join();
+			}
+		}
+	};
+
+	ContentIndexState &content_index()
+	{
+		static ContentIndexState state;
+		return state;
+	}
+
+	std::string to_hex(const std::string &digest)
+	{
+		static const char digits[] = "0123456789abcdef";
+		std::string hex;
+		for (unsigned char c : digest) {
+			hex.push_back(digits[c >> 4]);
+			hex.push_back(digits[c & 0xF]);
+		}
+		return hex;
+	}
+
+	bool from_hex(const std::string &hex, std::string &digest)
+	{
+		if (hex.size() != 2 * sha256_size) {
+			return false;
+		}
+		digest.clear();
+		for (std::size_t i = 0; i < hex.size(); i += 2) {
+			unsigned int value;
+			if (std::sscanf(hex.c_str() + i, "%2x", &value) != 1) {
+				return false;
+			}
+			digest.push_back(static_cast<char>(value));
+		}
+		return true;
+	}
+
+	// following functions expect locked state
+
+	void remove_entry(ContentIndexState &index, const std::string &filepath)
+	{
+		auto file = index.files.find(filepath);
+		if (file == index.files.end()) {
+			return;
+		}
+		auto range = index.contents.equal_range(file->second.digest);
+		for (auto it = range.first; it != range.second; ++it) {
+			if (it->second == filepath) {
+				index.contents.erase(it);
+				break;
+			}
+		}
+		index.files.erase(file);
+	}
+
+	void insert_entry(ContentIndexState &index, const std::string &filepath, const IndexEntry &entry)
+	{
+		remove_entry(index, filepath);
+		index.files[filepath] = entry;
+		index.contents.insert({ entry.digest, filepath });
+	}
+
+	void write_entry(std::ostream &log, const std::string &filepath, const IndexEntry &entry)
+	{
+		log << to_hex(entry.digest) << ' ' << entry.size << ' ' << entry.mtime << ' ' << filepath << '\n';
+	}
+
+	// indexed file was not modified since it was saved
+	bool unchanged(const std::string &filepath, const IndexEntry &entry)
+	{
+		uint64_t size;
+		int64_t mtime;
+		return MappedFile::Stat(filepath, size, mtime) && size == entry.size && mtime == entry.mtime;
+	}
+
+	// identical content is hard linked into ".part.link" file that replaces target, so ".part" file
+	// of resumable upload of target is kept (content is never copied, upload follows when link fails)
+	bool save_link(const std::string &source, const std::string &filepath)
+	{
+		// files saved by server are always replaced by rename, never modified in place, so they can share data
+		std::string linkpath = filepath + ".part.link";
+		std::remove(linkpath.c_str());
+#if defined(_WIN32)
+		if (!CreateHardLinkA(linkpath.c_str(), source.c_str(), NULL)) {
+			return false;
+		}
+		std::remove(filepath.c_str());
+#else
+		if (link(source.c_str(), linkpath.c_str()) != 0) {
+			return false;
+		}
+#endif
+		if (std::rename(linkpath.c_str(), filepath.c_str()) != 0) {
+			std::remove(linkpath.c_str());
+			return false;
+		}
+		return true;
+	}
+
+	void record(ContentIndexState &index, const std::string &filepath, const IndexEntry &entry)
+	{
+		std::lock_guard<std::mutex> lock(index.mutex);
+		if (index.indexpath.empty()) {
+			return; // index was disabled meanwhile
+		}
+		insert_entry(index, filepath, entry);
+		if (index.log.is_open()) {
+			write_entry(index.log, filepath, entry);
+			index.log.flush();
+		}
+	}
+
+	// digests of files saved without one (resumed uploads) are computed outside of event loop
+	void hash_pending(ContentIndexState &index)
+	{
+		std::unique_lock<std::mutex> lock(index.mutex);
+		while (true) {
+			index.wake.wait(lock, [&index]() { return index.stopping || !index.pending.empty(); });
+			if (index.stopping) {
+				return;
+			}
+			std::string filepath = std::move(index.pending.front());
+			index.pending.pop_front();
+			lock.unlock();
+
+			IndexEntry entry;
+			uint64_t size;
+			int64_t mtime;
+			try {
+				if (MappedFile::Stat(filepath, entry.size, entry.mtime)) {
+					unsigned char digest[sha256_size];
+					{
+						MappedFile file(filepath);
+						SHA256(file.Data(), static_cast<std::size_t>(file.Size()), digest);
+					}
+					entry.digest.assign(reinterpret_cast<const char*>(digest), sha256_size);
+					if (MappedFile::Stat(filepath, size, mtime) && size == entry.size && mtime == entry.mtime) {
+						record(index, filepath, entry); // file was not replaced while it was hashed
+					}
+				}
+			}
+			catch (const std::ifstream::failure &e) {
+				(void)e; // bypass unreferenced local variable warning
+			}
+			lock.lock();
+		}
+	}
+}
+
+void IPKContentIndex::Open(const std::string &indexpath)
+{
+	ContentIndexState &index = content_index();
+	std::lock_guard<std::mutex> lock(index.mutex);
+	if (index.log.is_open()) {
+		index.log.close();
+	}
+	index.files.clear();
+	index.contents.clear();
+	index.indexpath = indexpath;
+	if (indexpath.empty()) {
+		return;
+	}
+
+	// later lines override earlier ones, entries of modified or removed files are dropped
+	std::ifstream input(indexpath);
+	std::string line;
+	while (std::getline(input, line)) {
+		std::istringstream fields(line);
+		std::string hex, filepath;
+		IndexEntry entry;
+		if (fields >> hex >> entry.size >> entry.mtime && fields.get() == ' ' && std::getline(fields, filepath) &&
+			!filepath.empty() && from_hex(hex, entry.digest)) {
+			insert_entry(index, filepath, entry);
+		}
+	}
+	input.close();
+	for (auto it = index.files.begin(); it != index.files.end();) {
+		auto next = std::next(it);
+		if (!unchanged(it->first, it->second)) {
+			remove_entry(index, it->first);
+		}
+		it = next;
+	}
+
+	// compact index file (live entries only) and append further changes to it
+	std::string temppath = indexpath + ".tmp";
+	{
+		std::ofstream compacted(temppath, std::ios::trunc);
+		for (const auto &file : index.files) {
+			write_entry(compacted, file.first, file.second);
+		}
+	}
+#if defined(_WIN32)
+	std::remove(indexpath.c_str()); // rename does not replace existing file on Windows
+#endif
+	std::rename(temppath.c_str(), indexpath.c_str());
+	index.log.open(indexpath, std::ios::app);
+}
+
+bool IPKContentIndex::Enabled()
+{
+	ContentIndexState &index = content_index();
+	std::lock_guard<std::mutex> lock(index.mutex);
+	return !index.indexpath.empty();
+}
+
+bool IPKContentIndex::Reserved(const std::string &filename)
+{
+	ContentIndexState &index = content_index();
+	std::lock_guard<std::mutex> lock(index.mutex);
+	if (index.indexpath.empty()) {
+		return false;
+	}
+	std::string indexname = (index.indexpath.compare(0, 2, "./") == 0) ? index.indexpath.substr(2) : index.indexpath;
+	return filename == indexname || filename == indexname + ".tmp";
+}
+
+void IPKContentIndex::Add(const std::string &filepath, const unsigned char *digest)
+{
+	if (!Enabled()) {
+		return;
+	}
+	ContentIndexState &index = content_index();
+	if (!digest) {
+		std::lock_guard<std::mutex> lock(index.mutex);
+		index.pending.push_back(filepath);
+		if (!index.hasher.joinable()) {
+			index.hasher = std::thread(hash_pending, std::ref(index));
+		}
+		index.wake.notify_one();
+		return;
+	}
+	IndexEntry entry;
+	if (!MappedFile::Stat(filepath, entry.size, entry.mtime)) {
+		return;
+	}
+	entry.digest.assign(reinterpret_cast<const char*>(digest), sha256_size);
+	record(index, filepath, entry);
+}
+
+bool IPKContentIndex::Link(const std::string &filepath, uint64_t filesize, const unsigned char *digest)
+{
+	ContentIndexState &index = content_index();
+	std::string key(reinterpret_cast<const char*>(digest), sha256_size);
+	std::vector<std::pair<std::string, IndexEntry>> candidates;
+	{
+		std::lock_guard<std::mutex> lock(index.mutex);
+		auto range = index.contents.equal_range(key);
+		for (auto it = range.first; it != range.second; ++it) {
+			const IndexEntry &entry = index.files[it->second];
+			if (entry.size == filesize) {
+				candidates.push_back({ it->second, entry });
+			}
+		}
+	}
+
+	for (const auto &candidate : candidates) {
+		if (!unchanged(candidate.first, candidate.second)) {
+			std::lock_guard<std::mutex> lock(index.mutex);
+			auto file = index.files.find(candidate.first);
+			if (file != index.files.end() && file->second.mtime == candidate.second.mtime) {
+				remove_entry(index, candidate.first); // file was modified by someone else
+			}
+			continue;
+		}
+		if (candidate.first == filepath || save_link(candidate.first, filepath)) {
+			if (candidate.first != filepath) {
+				Add(filepath, digest);
+			}
+			index.deduplicated++;
+			return true;
+		}
+	}
+	return false;
+}
+
+uint64_t IPKContentIndex::Deduplicated()
+{
+	return content_index().deduplicated;
+}
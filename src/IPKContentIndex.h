@@ -0,0 +1,37 @@
+/*
+*	IPK Project 1: client-server for simple file transfer
+*	Author: Tomáš Pazdiora (xpazdi02)
+*	File: IPKContentIndex.h
+*/
+
+#ifndef IPKCONTENTINDEX_H
+#define IPKCONTENTINDEX_H
+
+#include <string>
+#include <stdint.h>
+
+// Content index of server (SHA-256 digest of every saved file), so upload of content server
+// already holds is only hard linked locally, see OfferDigest. Index is persisted in
+// append-only index file that is compacted when loaded, entries of files modified by
+// anything else than server are recognized by size and modification time and dropped.
+class IPKContentIndex {
+public:
+	// load index file and persist further changes into it (empty path = index is disabled)
+	static void Open(const std::string &indexpath);
+	static bool Enabled();
+
+	// index file (or its compacted copy), never served or saved by request
+	static bool Reserved(const std::string &filename);
+
+	// saved file with its SHA-256 digest (nullptr = digest is computed from file by background thread)
+	static void Add(const std::string &filepath, const unsigned char *digest = nullptr);
+
+	// save indexed file with identical content as filepath by hard link, false if there is none
+	// (or file system does not support hard links)
+	static bool Link(const std::string &filepath, uint64_t filesize, const unsigned char *digest);
+
+	// statistics
+	static uint64_t Deduplicated(); // uploads saved by Link
+};
+
+#endif
@@ -0,0 +1,420 @@
+/*
+*	IPK Project 1: client-server for simple file transfer
+*	Author: Tomáš Pazdiora (xpazdi02)
+*	File: IPKDelta.cpp
+*/
+
+#include "IPKDelta.h"
+#include "IPKPacket.h"
+#include "IPKFrame.h"
+#include "IPKTrace.h"
+
+#include <algorithm>
+#include <fstream>
+#include <cstring>
+
+namespace {
+	enum DeltaInstruction {
+		CopyBlocks = 1,
+		LiteralData = 2
+	};
+	const std::size_t copy_size = 1 + sizeof(uint64_t) + sizeof(uint32_t) + sizeof(uint32_t);
+	const std::size_t literal_header_size = 1 + sizeof(uint32_t);
+	const std::size_t entry_size = 2 * sizeof(uint32_t); // weak checksum and CRC32 of block
+	const unsigned int filter_bits = 20;
+
+	// weak checksum of window: a = sum of bytes, b = sum of running sums of a (both modulo 2^16)
+	void weak_init(const unsigned char *data, std::size_t size, uint32_t &a, uint32_t &b)
+	{
+		a = b = 0;
+		for (std::size_t i = 0; i < size; i++) {
+			a += data[i];
+			b += a;
+		}
+	}
+
+	// move window of given size by one byte
+	inline void weak_roll(uint32_t &a, uint32_t &b, unsigned char out, unsigned char in, uint32_t size)
+	{
+		a += in - static_cast<uint32_t>(out);
+		b += a - size * static_cast<uint32_t>(out);
+	}
+
+	inline uint32_t weak_value(uint32_t a, uint32_t b)
+	{
+		return (a & 0xFFFF) | (b << 16);
+	}
+
+	inline std::size_t filter_hash(uint32_t weak)
+	{
+		return static_cast<std::size_t>((weak * 2654435761u) >> (32 - filter_bits));
+	}
+
+	template<typename T>
+	void put(std::vector<unsigned char> &data, T value)
+	{
+		const unsigned char *value_ptr = reinterpret_cast<const unsigned char*>(&value);
+		data.insert(data.end(), value_ptr, value_ptr + sizeof(value));
+	}
+
+	template<typename T>
+	T get(const unsigned char *&it)
+	{
+		T value;
+		std::memcpy(&value, it, sizeof(value));
+		it += sizeof(value);
+		return value;
+	}
+}
+
+// -------------- IPKSignature --------------
+
+IPKSignature::IPKSignature()
+	: block_size(0)
+{
+}
+
+IPKSignature::IPKSignature(const unsigned char *data, std::size_t size)
+	: block_size(0)
+{
+	if (size < sizeof(block_size) || (size - sizeof(block_size)) % entry_size != 0) {
+		throw(IPKPacketException(SizeError, "IPKPacketError: BlockSignatures Size Error!"));
+	}
+	const unsigned char *it = data;
+	block_size = get<uint32_t>(it);
+	std::size_t blocks = (size - sizeof(block_size)) / entry_size;
+	if (blocks && (block_size == 0 || block_size > IPKPacket::FrameSize)) {
+		throw(IPKPacketException(SizeError, "IPKPacketError: BlockSignatures Size Error!"));
+	}
+	weak.resize(blocks);
+	strong.resize(blocks);
+	for (std::size_t i = 0; i < blocks; i++) {
+		weak[i] = get<uint32_t>(it);
+		strong[i] = get<uint32_t>(it);
+	}
+}
+
+void IPKSignature::Serialize(std::vector<unsigned char> &data) const
+{
+	data.clear();
+	data.reserve(sizeof(block_size) + 2 * sizeof(uint32_t) * weak.size());
+	put(data, block_size);
+	for (std::size_t i = 0; i < weak.size(); i++) {
+		put(data, weak[i]);
+		put(data, strong[i]);
+	}
+}
+
+uint32_t IPKSignature::BlockSizeFor(uint64_t filesize)
+{
+	// fewer larger blocks for large files keep signatures small (10 GiB file has 2.5 MiB of them)
+	uint32_t size = 1024;
+	while (size < IPKPacket::FrameSize && static_cast<uint64_t>(size) * size < filesize) {
+		size <<= 1;
+	}
+	return size;
+}
+
+uint32_t IPKSignature::BlockSize() const
+{
+	return this->block_size;
+}
+
+std::size_t IPKSignature::Blocks() const
+{
+	return this->weak.size();
+}
+
+uint32_t IPKSignature::Weak(std::size_t block) const
+{
+	return this->weak[block];
+}
+
+uint32_t IPKSignature::Strong(std::size_t block) const
+{
+	return this->strong[block];
+}
+
+// ------------- IPKDeltaEncoder ------------
+
+IPKDeltaEncoder::IPKDeltaEncoder(const MappedFile &file, const IPKSignature &signature)
+	: file(file), signature(signature), filter(std::size_t(1) << filter_bits, false), position(0), literal(0),
+	a(0), b(0), rolled(false), run_first(0), run_count(0), matched(0)
+{
+	index.reserve(signature.Blocks());
+	for (std::size_t i = 0; i < signature.Blocks(); i++) {
+		index.push_back({ signature.Weak(i), static_cast<uint32_t>(i) });
+		filter[filter_hash(signature.Weak(i))] = true;
+	}
+	std::sort(index.begin(), index.end());
+}
+
+bool IPKDeltaEncoder::Done() const
+{
+	return literal >= file.Size() && run_count == 0;
+}
+
+uint64_t IPKDeltaEncoder::Position() const
+{
+	return this->literal;
+}
+
+uint64_t IPKDeltaEncoder::Matched() const
+{
+	return this->matched;
+}
+
+// block of previous version equal to current window, -1 if there is none
+int64_t IPKDeltaEncoder::Match()
+{
+	uint32_t weak = weak_value(a, b);
+	if (!filter[filter_hash(weak)]) {
+		return -1;
+	}
+	auto candidates = std::equal_range(index.begin(), index.end(), std::make_pair(weak, uint32_t(0)),
+		[](const std::pair<uint32_t, uint32_t> &x, const std::pair<uint32_t, uint32_t> &y) { return x.first < y.first; });
+	if (candidates.first == candidates.second) {
+		return -1;
+	}
+	uint32_t strong = CRC32(file.Data() + position, signature.BlockSize());
+	int64_t match = -1;
+	for (auto it = candidates.first; it != candidates.second; ++it) {
+		if (signature.Strong(it->second) != strong) {
+			continue;
+		}
+		if (run_count && it->second == run_first + run_count) {
+			return it->second; // block continues pending CopyBlocks
+		}
+		if (match < 0) {
+			match = it->second;
+		}
+	}
+	return match;
+}
+
+// pending CopyBlocks instruction (false if it does not fit into frame)
+bool IPKDeltaEncoder::FlushRun(std::vector<unsigned char> &instructions)
+{
+	if (run_count == 0) {
+		return true;
+	}
+	if (IPKPacket::FrameSize - instructions.size() < copy_size) {
+		return false;
+	}
+	instructions.push_back(CopyBlocks);
+	put(instructions, run_first);
+	put(instructions, run_count);
+	put(instructions, run_crc.Finalize());
+	run_count = 0;
+	return true;
+}
+
+// literal data up to end (false if they do not fit into frame, part of them is written)
+bool IPKDeltaEncoder::FlushLiteral(std::vector<unsigned char> &instructions, uint64_t end)
+{
+	while (literal < end) {
+		std::size_t room = IPKPacket::FrameSize - instructions.size();
+		if (room <= literal_header_size) {
+			return false;
+		}
+		uint32_t size = static_cast<uint32_t>(std::min<uint64_t>(end - literal, room - literal_header_size));
+		instructions.push_back(LiteralData);
+		put(instructions, size);
+		instructions.insert(instructions.end(), file.Data() + literal, file.Data() + literal + size);
+		literal += size;
+	}
+	return true;
+}
+
+void IPKDeltaEncoder::Next(std::vector<unsigned char> &instructions)
+{
+	instructions.clear();
+	const unsigned char *data = file.Data();
+	const uint64_t size = file.Size();
+	const uint32_t block_size = signature.BlockSize();
+
+	while (!Done()) {
+		if (index.empty() || size - position < block_size) {
+			// no complete window left, rest of file is literal
+			position = size;
+			if (FlushRun(instructions) && FlushLiteral(instructions, size)) {
+				continue;
+			}
+			return;
+		}
+		if (!rolled) {
+			weak_init(data + position, block_size, a, b);
+			rolled = true;
+		}
+
+		int64_t block = Match();
+		if (block >= 0) {
+			// literal data preceding block are written first (and pending run before them)
+			if (literal < position && !(FlushRun(instructions) && FlushLiteral(instructions, position))) {
+				return;
+			}
+			if (run_count == 0 || static_cast<uint64_t>(block) != run_first + run_count) {
+				if (!FlushRun(instructions)) {
+					return;
+				}
+				run_first = static_cast<uint64_t>(block);
+				run_crc.Init();
+			}
+			run_count++;
+			run_crc.Update(data + position, block_size);
+			matched += block_size;
+			position += block_size;
+			literal = position;
+			rolled = false;
+			continue;
+		}
+
+		// move window by one byte
+		if (size - position > block_size) {
+			weak_roll(a, b, data[position], data[position + block_size], block_size);
+		}
+		else {
+			rolled = false;
+		}
+		position++;
+
+		// long literal data are written as they come (frame is full)
+		if (position - literal >= IPKPacket::FrameSize && !(FlushRun(instructions) && FlushLiteral(instructions, position))) {
+			return;
+		}
+	}
+}
+
+// ----------- IPKSignatureStream -----------
+
+IPKSignatureStream::IPKSignatureStream(std::shared_ptr<const MappedFile> file)
+	: file(file), block_size(IPKSignature::BlockSizeFor(file->Size())), block_operator(CRC32CombineOperator(block_size)),
+	blocks(static_cast<std::size_t>(file->Size() / block_size)), data(sizeof(block_size) + blocks * entry_size), ready(0), cancel(false)
+{
+	std::memcpy(data.data(), &block_size, sizeof(block_size));
+	thread = std::thread(&IPKSignatureStream::Compute, this);
+}
+
+IPKSignatureStream::~IPKSignatureStream()
+{
+	cancel = true;
+	thread.join();
+}
+
+void IPKSignatureStream::Compute()
+{
+	for (std::size_t i = 0; i < blocks && !cancel; i++) {
+		const unsigned char *block = file->Data() + i * static_cast<uint64_t>(block_size);
+		IPK_TRACE_SPAN_BYTES("signature.block", block_size);
+		uint32_t a, b;
+		weak_init(block, block_size, a, b);
+		uint32_t weak = weak_value(a, b), strong = CRC32(block, block_size);
+		unsigned char *entry = data.data() + sizeof(block_size) + i * entry_size;
+		std::memcpy(entry, &weak, sizeof(weak));
+		std::memcpy(entry + sizeof(weak), &strong, sizeof(strong));
+		std::lock_guard<std::mutex> lock(mutex);
+		ready = i + 1;
+	}
+}
+
+// number of computed blocks
+std::size_t IPKSignatureStream::Ready()
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	return ready;
+}
+
+const std::shared_ptr<const MappedFile> &IPKSignatureStream::File() const
+{
+	return this->file;
+}
+
+uint32_t IPKSignatureStream::BlockSize() const
+{
+	return this->block_size;
+}
+
+std::size_t IPKSignatureStream::Size() const
+{
+	return this->data.size();
+}
+
+const unsigned char *IPKSignatureStream::Get(std::size_t offset, std::size_t &size)
+{
+	std::size_t computed = sizeof(block_size) + Ready() * entry_size;
+	size = std::min(size, computed - std::min(offset, computed));
+	return data.data() + offset;
+}
+
+bool IPKSignatureStream::Strong(uint64_t first, uint32_t count, uint32_t &crc)
+{
+	if (count == 0) {
+		crc = CRC32(nullptr, 0);
+		return true;
+	}
+	if (first + count > Ready()) {
+		return false;
+	}
+	crc = 0;
+	for (std::size_t i = static_cast<std::size_t>(first); i < first + count; i++) {
+		uint32_t strong;
+		std::memcpy(&strong, data.data() + sizeof(block_size) + i * entry_size + sizeof(uint32_t), sizeof(strong));
+		crc = (i == first) ? strong : CRC32Combine(crc, strong, block_operator);
+	}
+	return true;
+}
+
+// ------------- IPKDeltaDecoder ------------
+
+IPKDeltaDecoder::IPKDeltaDecoder(const std::string &filepath, uint64_t base_size, uint64_t block_size, std::shared_ptr<IPKSignatureStream> signatures)
+	: block_size(0)
+{
+	if (block_size == 0 || block_size > IPKPacket::FrameSize || !signatures || signatures->BlockSize() != block_size) {
+		return; // every CopyBlocks rejects file
+	}
+	// blocks are copied from mapping signatures were computed from, file that has changed since then is rejected
+	const MappedFile &base = *signatures->File();
+	uint64_t size = 0;
+	int64_t mtime = 0;
+	if (base.Size() == base_size && MappedFile::Stat(filepath, size, mtime) && size == base.Size() && mtime == base.ModificationTime()) {
+		this->signatures = signatures;
+		this->block_size = static_cast<uint32_t>(block_size);
+	}
+}
+
+void IPKDeltaDecoder::Apply(const unsigned char *data, std::size_t size, IPKFrameWriter &writer)
+{
+	const unsigned char *it = data, *end = data + size;
+	while (it != end) {
+		unsigned char instruction = *(it++);
+		if (instruction == CopyBlocks && static_cast<std::size_t>(end - it) >= copy_size - 1) {
+			uint64_t first = get<uint64_t>(it);
+			uint32_t count = get<uint32_t>(it);
+			uint32_t crc = get<uint32_t>(it);
+			uint64_t bytes = static_cast<uint64_t>(count) * block_size;
+
+			// blocks of previous version are copied only when their CRC32 matches (combined from signatures),
+			// blocks whose signatures are not computed yet could not have been sent to client and are rejected
+			const MappedFile *base = signatures ? signatures->File().get() : nullptr;
+			uint64_t blocks = base ? base->Size() / block_size : 0;
+			const unsigned char *blocks_data = (first < blocks && count <= blocks - first) ? base->Data() + first * block_size : nullptr;
+			uint32_t strong = 0;
+			if (blocks_data && !(signatures->Strong(first, count, strong) && strong == crc)) {
+				blocks_data = nullptr;
+			}
+			//Possible Improvement: copy long runs by parts (large copy holds event loop of reactor)
+			writer.Append(blocks_data, bytes);
+		}
+		else if (instruction == LiteralData && static_cast<std::size_t>(end - it) >= literal_header_size - 1) {
+			uint32_t literal_size = get<uint32_t>(it);
+			if (literal_size > static_cast<std::size_t>(end - it)) {
+				throw(IPKPacketException(SizeError, "IPKPacketError: DeltaFrame Size Error!")); // stream is lost
+			}
+			writer.Append(it, literal_size);
+			it += literal_size;
+		}
+		else {
+			throw(IPKPacketException(SizeError, "IPKPacketError: DeltaFrame Size Error!")); // stream is lost
+		}
+	}
+}
@@ -0,0 +1,142 @@
+/*
+*	IPK Project 1: client-server for simple file transfer
+*	Author: Tomáš Pazdiora (xpazdi02)
+*	File: IPKDelta.h
+*/
+
+#ifndef IPKDELTA_H
+#define IPKDELTA_H
+
+/************** Delta upload ***************
+*
+*  Client asks by RequestSignature for BlockSignatures of previous version
+*  of file held by server (weak rolling checksum and CRC32 of every complete
+*  block), finds these blocks anywhere in its own version of file and sends
+*  OfferDelta followed by a stream of DeltaFrames until the whole file is
+*  described. DeltaFrame data are sequence of instructions:
+*
+*  CopyBlocks (1) | first block (8 bytes) | block count (4 bytes) | CRC32 of copied data (4 bytes)
+*  LiteralData (2) | data size (4 bytes) | data
+*
+*  Server rebuilds file into ".part" file from blocks of previous version
+*  and literal data. CRC32 of copied blocks is checked against signatures
+*  sent on the same connection (combined from CRC32 of blocks), which only
+*  catches references to other signatures, as client matched blocks by the
+*  same CRC32. Rebuilt file is verified by SHA-256 carried by OfferDelta,
+*  so block that only collides with client data by weak checksum and CRC32
+*  is rejected by StatusError and client uploads whole file instead.
+*
+******************************************/
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <utility>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <stdint.h>
+#include "MappedFile.h"
+#include "CRC32.h"
+
+class IPKFrameWriter;
+
+// Block signatures of file (weak rolling checksum and CRC32 of every complete block, see rsync algorithm)
+class IPKSignature {
+	uint32_t block_size;
+	std::vector<uint32_t> weak;
+	std::vector<uint32_t> strong;
+public:
+	// no blocks (server has no previous version of file)
+	IPKSignature();
+
+	// Deserialize BlockSignatures data (throws IPKPacketException)
+	IPKSignature(const unsigned char *data, std::size_t size);
+
+	// Serialize (block size followed by weak checksum and CRC32 of every block)
+	void Serialize(std::vector<unsigned char> &data) const;
+
+	// block size for file of given size (about square root of file size, 1 KiB to IPKPacket::FrameSize)
+	static uint32_t BlockSizeFor(uint64_t filesize);
+
+	uint32_t BlockSize() const;
+	std::size_t Blocks() const;
+	uint32_t Weak(std::size_t block) const;
+	uint32_t Strong(std::size_t block) const;
+};
+
+// Serialized block signatures of mapped file (BlockSignatures data), computed by background thread ahead
+// of sender (see IPKFrameChecksums), so server never hashes whole file on event loop nor waits for it
+class IPKSignatureStream {
+	std::shared_ptr<const MappedFile> file;
+	const uint32_t block_size;
+	const uint32_t block_operator; // CRC32Combine operator of one block
+	const std::size_t blocks;
+	std::vector<unsigned char> data; // block size followed by weak checksum and CRC32 of every block
+	std::size_t ready; // computed blocks
+	std::atomic<bool> cancel;
+	std::mutex mutex;
+	std::thread thread;
+
+	void Compute();
+	std::size_t Ready();
+public:
+	IPKSignatureStream(std::shared_ptr<const MappedFile> file);
+	IPKSignatureStream(const IPKSignatureStream &other) = delete;
+	~IPKSignatureStream();
+
+	const std::shared_ptr<const MappedFile> &File() const; // mapping signatures were computed from
+	uint32_t BlockSize() const;
+	std::size_t Size() const; // size of serialized signatures
+
+	// computed part of serialized signatures from offset (at most size bytes, size is set to number of returned
+	// bytes, 0 while next block is being computed)
+	const unsigned char *Get(std::size_t offset, std::size_t &size);
+
+	// CRC32 of count blocks from first combined from CRC32 of blocks (false if they are not computed yet)
+	bool Strong(uint64_t first, uint32_t count, uint32_t &crc);
+};
+
+// Client side of delta upload, describes mapped file by blocks of previous version and literal data
+class IPKDeltaEncoder {
+	const MappedFile &file;
+	const IPKSignature &signature;
+	std::vector<std::pair<uint32_t, uint32_t>> index; // weak checksum and block (sorted)
+	std::vector<bool> filter; // hashed weak checksums of blocks (most of windows are rejected by one lookup)
+	uint64_t position; // start of current window
+	uint64_t literal; // start of data not described yet
+	uint32_t a, b; // weak checksum of current window
+	bool rolled; // weak checksum of current window is valid
+	uint64_t run_first; // pending CopyBlocks
+	uint32_t run_count;
+	CRC32State run_crc;
+	uint64_t matched;
+
+	int64_t Match();
+	bool FlushRun(std::vector<unsigned char> &instructions);
+	bool FlushLiteral(std::vector<unsigned char> &instructions, uint64_t end);
+public:
+	IPKDeltaEncoder(const MappedFile &file, const IPKSignature &signature);
+
+	bool Done() const;
+	uint64_t Position() const; // described bytes of file
+	uint64_t Matched() const; // bytes described by CopyBlocks
+
+	// instructions of next DeltaFrame (1 to IPKPacket::FrameSize bytes)
+	void Next(std::vector<unsigned char> &instructions);
+};
+
+// Server side of delta upload, rebuilds file from blocks of previous version and literal data
+class IPKDeltaDecoder {
+	std::shared_ptr<IPKSignatureStream> signatures; // of previous version (nullptr = not available, file is rejected)
+	uint32_t block_size;
+public:
+	// previous version of file mapped by signatures sent to client (it has to have base_size bytes
+	// and it must not be modified since then)
+	IPKDeltaDecoder(const std::string &filepath, uint64_t base_size, uint64_t block_size, std::shared_ptr<IPKSignatureStream> signatures);
+
+	// apply instructions of DeltaFrame (throws IPKPacketException when stream is lost)
+	void Apply(const unsigned char *data, std::size_t size, IPKFrameWriter &writer);
+};
+
+#endif
@@ -7,18 +7,42 @@
 #include "IPKFTP.h"
 
 #include "IPKPacket.h"
+#include "CRC32.h"
+#include "IPKFrame.h"
+#include "IPKDelta.h"
+#include "IPKContentIndex.h"
+#include "SHA256.h"
+#include "IPKServerSession.h"
+#include "IPKClientSession.h"
+#include "IPKMetrics.h"
+#include "IPKTrace.h"
+#include "WorkerPool.h"
 
 #include <iostream>
 #include <fstream>
+#include <cstdio>
 #include <iterator>
 #include <stdexcept>
 
 #include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <exception>
+#include <memory>
+#include <deque>
+#include <algorithm>
 
 #include <chrono>
 #include <iomanip>
 
 const int IPKFTP::retries = 2; // total number of tries = 1 + retries
+const std::size_t IPKFTP::send_batch = 8; // DataFrames gathered into one writev call
+const unsigned int IPKFTP::batch_depth = 8; // requests in flight in batch mode
+
+IPKFileChangedException::IPKFileChangedException()
+	: std::runtime_error("Error: File has changed on server!")
+{
+}
 
 
 // ----------------- Utils ------------------
@@ -41,22 +65,61 @@ void IPKFTP::ShowProgress(std::size_t bytes, std::size_t max)
 
 // -------------- File Methods --------------
 
-std::vector<unsigned char> IPKFTP::FileLoad(std::string filename)
+// send file from offset as a stream of data frames (only one frame is held in memory)
+void IPKFTP::FileSend(TCP &tcp, IPKFrameReader &reader, uint64_t offset, std::function<void(std::size_t, std::size_t)> updateCallback)
 {
-	std::vector<unsigned char> data;
-	std::ifstream file;
-	file.exceptions(std::ifstream::failbit | std::ifstream::badbit);
-	file.open(filename, std::ios::binary);
-	std::copy(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>(), std::back_inserter(data));
-	return data;
+	std::vector<TCPBuffer> buffers;
+	reader.Rewind(offset);
+	while (!reader.Done()) {
+		reader.Next(buffers, send_batch);
+		tcp.SendV(buffers); // frames are gathered from mapped file without copying
+		if (updateCallback) {
+			updateCallback(static_cast<std::size_t>(reader.Position()), static_cast<std::size_t>(reader.Size())); //call optional update callback
+		}
+	}
+}
+
+// receive stream of data frames by writer (unfinished transfer can be resumed, see IPKFrameWriter)
+void IPKFTP::FileRecv(TCP &tcp, IPKFrameWriter &writer, std::function<void(std::size_t, std::size_t)> updateCallback)
+{
+	std::vector<unsigned char> packet;
+	while (!writer.Done()) {
+		CRC32State crc; // CRC32 is computed while receiving
+		packet.clear();
+		if (writer.Descriptor() >= 0) {
+			// data of DataFrame are received directly into file (splice), CompressedFrame into packet
+			tcp.Recv(packet, IPKPacket::HeaderSize, crc);
+			std::size_t frame_size = writer.Remaining(packet);
+			if (IPKPacket::Type(packet) == DataFrame) {
+				tcp.RecvFile(writer.Descriptor(), writer.Position(), frame_size);
+				writer.Received(frame_size, crc); // CRC32 of data from page cache
+				packet.clear();
+				tcp.Recv(packet, IPKPacket::StatusSize - IPKPacket::HeaderSize, crc);
+				writer.Verify(crc);
+			}
+			else {
+				tcp.Recv(packet, IPKPacket::StatusSize - IPKPacket::HeaderSize + frame_size, crc);
+				writer.Write(packet, crc);
+			}
+		}
+		else {
+			tcp.Recv(packet, IPKPacket::StatusSize, crc);
+			tcp.Recv(packet, writer.Remaining(packet), crc);
+			writer.Write(packet, crc);
+		}
+		if (updateCallback) {
+			updateCallback(static_cast<std::size_t>(writer.Position()), static_cast<std::size_t>(writer.Size())); //call optional update callback
+		}
+	}
+	writer.Finish();
 }
 
-void IPKFTP::FileSave(std::string filename, std::vector<unsigned char> data)
+// receive complete message (CRC32 is computed while receiving)
+void IPKFTP::MessageRecv(TCP &tcp, std::vector<unsigned char> &message, CRC32State &crc)
 {
-	std::ofstream file;
-	file.exceptions(std::ofstream::failbit | std::ofstream::badbit);
-	file.open(filename, std::ios::binary);
-	std::copy(std::begin(data), std::end(data), std::ostreambuf_iterator<char>(file));
+	message.clear();
+	tcp.Recv(message, IPKPacket::StatusSize, crc);
+	tcp.Recv(message, IPKPacket::ExpectedSize(message) - IPKPacket::StatusSize, crc);
 }
 
 std::string IPKFTP::FileName(std::string filepath)
@@ -67,102 +130,151 @@ std::string IPKFTP::FileName(std::string filepath)
 
 // ------------------------------------------
 
-void IPKFTP::ServerStart(std::string port)
-{
-	//Possible Improvement: std::cout logging
-	//Possible Improvement: split large files
-	//Possible Improvement: enable termination of server using stdin
-
-	tcp.Listen(port, [](TCP client) {
-		std::thread thread(ServerThreadCode, std::move(client));
-		thread.detach(); //detach thread to be ready to accept another client without blocking
-	}); // infinite loop 
-}
+namespace {
+	// runs task on its own thread right away, then every interval and once more when it is destroyed
+	// (empty task = disabled)
+	class PeriodicTask {
+		const std::chrono::seconds interval;
+		const std::function<void()> task;
+		std::mutex mutex;
+		std::condition_variable cv;
+		bool stop = false;
+		std::thread thread;
 
-void IPKFTP::ServerThreadCode(TCP &&client) {
-	for (int i = 0; i <= retries; i++) {
-		IPKTransmissionType send_error = IPKUnknown;
-		try {
-			bool close = false;
-			while (!close) { // loop until client closes connection, or until (1 + retries) * timeout
-				std::vector<unsigned char> packet{};
-				switch (IPKPacket::Type(packet = client.Recv(IPKPacket::StatusSize))) {
-				case CommandPing:
-				{
-					client.Send(IPKPacket(StatusOk));
-					break;
-				}
-				case OfferFile:
-				{
-					client.Recv(packet, IPKPacket::ExpectedSize(packet) - IPKPacket::StatusSize);
-					IPKPacket p(packet);
-					FileSave(p.GetFilename(), p.GetData());
-					client.Send(IPKPacket(StatusOk));
-					break;
-				}
-				case RequestFile:
-				{
-					client.Recv(packet, IPKPacket::ExpectedSize(packet) - IPKPacket::StatusSize);
-					auto filename = IPKPacket(packet).GetFilename();
-					auto data = FileLoad(filename);
-					client.Send(IPKPacket(OfferFile, filename, data));
-					break;
-				}
-				default:
-					send_error = StatusError; // Send ERROR response
-					break;
-				}
-			}
+		void Run()
+		{
+			std::unique_lock<std::mutex> lock(mutex);
+			do {
+				task();
+			} while (!cv.wait_for(lock, interval, [this]() { return stop; }));
 		}
-		catch (const TCPException &e) {
-			if (e.error == Timeout) {
-				send_error = StatusError; // Send ERROR response
-			}
-			else if (e.error == ConnectionClosed || e.error == SendRecvFailed) {
-				break; //close connection
-			}
-			else {
-				throw;
+	public:
+		PeriodicTask(unsigned int interval, std::function<void()> task)
+			: interval(std::max(interval, 1u)), task(task)
+		{
+			if (task) {
+				thread = std::thread(&PeriodicTask::Run, this);
 			}
 		}
-		catch (const IPKPacketException &e) {
-			if (e.error == SignatureError || e.error == VersionError || e.error == TransmissionTypeError ||
-				e.error == SizeError || e.error == CRC32Error) {
-				send_error = StatusError; // Send ERROR response
-			}
-			else {
-				throw;
+		~PeriodicTask()
+		{
+			if (thread.joinable()) {
+				{
+					std::lock_guard<std::mutex> lock(mutex);
+					stop = true;
+				}
+				cv.notify_all();
+				thread.join();
+				task();
 			}
 		}
-		catch (const std::fstream::failure &e) {
-			(void)e; // bypass unreferenced local variable warning
-			send_error = StatusInaccessible; // Send ERROR response
-		}
+	};
 
-		// ----- Try to send ERROR response -----
-		try {
-			if (send_error == StatusError) {
-				client.Send(IPKPacket(StatusError));
-			}
-			else if (send_error == StatusInaccessible) {
-				client.Send(IPKPacket(StatusInaccessible));
-				break; //close connection
+	// replaces file by current report every interval (and once more when server stops)
+	class ReportDump : public PeriodicTask {
+		static void Write(const std::string &filepath, const std::function<void(std::ostream &)> &report)
+		{
+			std::string temppath = filepath + ".tmp";
+			{
+				std::ofstream file(temppath, std::ios::trunc);
+				report(file);
+				if (!file) {
+					return; // next report is tried later
+				}
 			}
+#if defined(_WIN32)
+			std::remove(filepath.c_str()); // rename does not replace existing file on Windows
+#endif
+			std::rename(temppath.c_str(), filepath.c_str()); // readers see either previous or complete report
 		}
-		catch (const TCPException &e) {
-			if (e.error == ConnectionClosed || e.error == SendRecvFailed) {
-				break; //close connection
+	public:
+		ReportDump(const std::string &filepath, unsigned int interval, std::function<void(std::ostream &)> report)
+			: PeriodicTask(interval, filepath.empty() ? std::function<void()>() : [filepath, report]() { Write(filepath, report); })
+		{
+		}
+	};
+}
+
+void IPKFTP::ServerStart(std::string port, IPKServerConfig config)
+{
+	//Possible Improvement: std::cout logging
+	//Possible Improvement: enable termination of server using stdin
+
+	tcp.Configure(config.tcp); // inherited by client connections
+	IPKFileCache::SetCapacity(config.cache);
+	IPKContentIndex::Open(config.index);
+	tcp.Bind(port, config.host);
+	if (config.ready) {
+		config.ready(tcp.LocalPort());
+	}
+	if (!config.trace.empty()) {
+		IPKTrace::Enable("ipk-server");
+	}
+	// until server stops
+	ReportDump metrics(config.metrics, config.metrics_interval, [](std::ostream &out) { out << IPKMetrics::Report(); });
+	ReportDump trace(config.trace, config.trace_interval, [](std::ostream &out) { IPKTrace::Write(out); });
+	unsigned int expiry = config.part_expiry; // abandoned uploads are looked for hourly (or more often for shorter expiry)
+	PeriodicTask parts(std::min(expiry, 3600u), expiry ? [expiry]() { IPKFrameWriter::Expire(expiry); } : std::function<void()>());
+	bool compression = config.compression;
+	if (config.loops) {
+		// reactor mode, connections are driven by fixed number of event loop threads
+		tcp.Listen(port, [compression]() {
+			return std::unique_ptr<TCPHandler>(new IPKServerSession(retries, compression));
+		}, config.loops); // loop until ServerStop
+		return;
+	}
+
+	WorkerPool pool(config.workers, config.queue);
+	tcp.Listen(port, [&pool, compression](TCP client) {
+		auto connection = std::make_shared<TCP>(std::move(client));
+		if (!pool.TrySubmit([connection, compression]() { ServerThreadCode(std::move(*connection), compression); })) {
+			// server is saturated, refuse client right away
+			try {
+				connection->Send(IPKPacket(StatusBusy));
 			}
-			else {
-				throw;
+			catch (const TCPException &e) {
+				(void)e; // bypass unreferenced local variable warning
 			}
 		}
-	}
+	}); // loop until ServerStop, pool waits for its connections then
+}
+
+void IPKFTP::ServerThreadCode(TCP &&client, bool compression) {
+	IPKServerSession session(retries, compression);
+	client.Run(session); // loop until client closes connection, or until (1 + retries) errors
 }
 
 void IPKFTP::ServerStop()
 {
-	//not needed for now, since server starts an infinite loop
+	tcp.Stop(); // ServerStart returns
+}
+
+IPKServerStats IPKFTP::ServerStats()
+{
+	IPKServerStats stats;
+	stats.cache_hits = IPKFileCache::Hits();
+	stats.cache_misses = IPKFileCache::Misses();
+	stats.coalesced = IPKFileCache::Coalesced();
+	stats.cache_bytes = IPKFileCache::Bytes();
+	stats.deduplicated = IPKContentIndex::Deduplicated();
+
+	IPKMetricsSnapshot metrics = IPKMetrics::Snapshot();
+	stats.bytes_in = metrics.counters[BytesIn];
+	stats.bytes_out = metrics.counters[BytesOut];
+	stats.connections = metrics.counters[ConnectionsOpened] - std::min(metrics.counters[ConnectionsClosed], metrics.counters[ConnectionsOpened]);
+	stats.requests = 0;
+	for (auto requests : metrics.requests) {
+		stats.requests += requests;
+	}
+	stats.crc_failures = metrics.counters[CRCFailures];
+	stats.timeouts = metrics.counters[Timeouts];
+	stats.retries = metrics.counters[Retries];
+	return stats;
+}
+
+std::string IPKFTP::ServerReport()
+{
+	return IPKMetrics::Report();
 }
 
 void IPKFTP::ClientConnect(std::string host, std::string port)
@@ -171,20 +283,45 @@ void IPKFTP::ClientConnect(std::string host, std::string port)
 	if (tcp.IsConnected()) {
 		tcp.Close();
 	}
+	this->host = host;
+	this->port = port;
+	bool busy = false;
 	for (int i = 0; i <= retries; i++) {
 		try {
+			if (busy) {
+				std::this_thread::sleep_for(std::chrono::milliseconds(100 * i)); // back off from saturated server
+			}
 			tcp.Connect(host, port);
-			tcp.Send(IPKPacket(CommandPing));
-			if (IPKPacket(tcp.Recv(IPKPacket::StatusSize)) == StatusOk) {
+			// offer preferred codec first, server chooses one of them (or none)
+			std::vector<unsigned char> codecs;
+			if (compression != NoCompression) {
+				codecs.push_back(static_cast<unsigned char>(compression));
+				for (auto supported : Compression::Supported()) {
+					if (supported != compression) {
+						codecs.push_back(static_cast<unsigned char>(supported));
+					}
+				}
+			}
+			IPKPacket::Serialize(message, CommandPing, {}, 0, 0, 0, codecs.data(), codecs.size());
+			tcp.Send(message);
+			CRC32State crc;
+			MessageRecv(tcp, message, crc);
+			IPKPacketView p(message, crc);
+			if (p == StatusOk) {
+				codec = NoCompression;
+				if (p.DataSize() == 1 && std::find(codecs.begin(), codecs.end(), p.Data()[0]) != codecs.end()) {
+					codec = static_cast<CompressionCodec>(p.Data()[0]);
+				}
 				return;
 			}
 			else {
+				busy = (p == StatusBusy);
 				tcp.Close();
 				continue;
 			}
 		}
 		catch (const TCPException &e) {
-			if (e.error == ConnectionClosed || e.error == Timeout || e.error == ConnectFailed) {
+			if (e.error == ConnectionClosed || e.error == Timeout || e.error == ConnectFailed || e.error == SendRecvFailed) {
 				tcp.Close();
 				if (i == retries) throw;
 			}
@@ -202,21 +339,71 @@ void IPKFTP::ClientConnect(std::string host, std::string port)
 			}
 		}
 	}
+	if (busy) {
+		throw std::runtime_error("Error: Server is busy!");
+	}
 	throw std::runtime_error("Error: Unable to connect!");
 }
 
-void IPKFTP::Upload(std::string filepath)
+void IPKFTP::Upload(std::string filepath, bool delta, bool deduplicate)
 {
 	//Possible Improvement: std::cout logging
-	//Possible Improvement: split large files
 
 	auto filename = FileName(filepath);
-	auto filedata = FileLoad(filepath);
+	IPKFrameReader reader(filepath);
+	reader.SetCodec(codec);
+	int64_t version = reader.Version(); // partial upload of other version is not continued by server
+
+	std::vector<unsigned char> digest; // offered instead of QueryFile
+	if (deduplicate) {
+		MappedFile file(filepath);
+		digest.resize(sha256_size);
+		SHA256(file.Data(), static_cast<std::size_t>(file.Size()), digest.data());
+	}
 	
 	for (int i = 0; i <= retries; i++) {
 		try {
-			tcp.Send(IPKPacket(OfferFile, filename, filedata), ShowProgress);
-			IPKPacket p(tcp.Recv(IPKPacket::StatusSize));
+			if (delta) {
+				delta = false; // whole file is sent when delta is not possible
+				if (DeltaSend(filepath, filename)) {
+					return;
+				}
+			}
+
+			// ask server for verified part of previous upload (or for identical content it already holds)
+			if (!digest.empty()) {
+				IPKPacket::Serialize(message, OfferDigest, filename, reader.Size(), 0, 0, digest.data(), digest.size());
+			}
+			else {
+				IPKPacket::Serialize(message, QueryFile, filename, reader.Size(), 0, 0, reinterpret_cast<const unsigned char*>(&version), sizeof(version));
+			}
+			tcp.Send(message);
+			CRC32State crc;
+			MessageRecv(tcp, message, crc);
+			IPKPacketView q(message, crc);
+			if (q == StatusOk && !digest.empty()) {
+				return; // saved by server without sending data
+			}
+			else if (q == StatusInaccessible) {
+				throw std::runtime_error("Error: File is not accessible on server!");
+			}
+			else if (q != PartialFile) {
+				digest.clear(); // server does not support deduplication
+				continue;
+			}
+			uint64_t offset = (q.FileSize() == reader.Size()) ? q.Offset() : 0;
+
+			if (offset) {
+				IPKPacket::Serialize(message, OfferRange, filename, reader.Size(), offset, reader.Size() - offset, reinterpret_cast<const unsigned char*>(&version), sizeof(version));
+			}
+			else {
+				IPKPacket::Serialize(message, OfferFile, filename, reader.Size(), 0, 0, reinterpret_cast<const unsigned char*>(&version), sizeof(version));
+			}
+			tcp.Send(message);
+			FileSend(tcp, reader, offset, progress);
+			message.clear();
+			tcp.Recv(message, IPKPacket::StatusSize);
+			IPKPacketView p(message);
 			if (p == StatusOk) {
 				return;
 			} 
@@ -248,26 +435,85 @@ void IPKFTP::Upload(std::string filepath)
 	throw std::runtime_error("Error: Upload failed!");
 }
 
-void IPKFTP::Download(std::string filepath)
+bool IPKFTP::DeltaSend(const std::string &filepath, const std::string &filename)
+{
+	// signatures of blocks of previous version
+	IPKPacket::Serialize(message, RequestSignature, filename);
+	tcp.Send(message);
+	CRC32State crc;
+	MessageRecv(tcp, message, crc);
+	IPKPacketView s(message, crc);
+	if (s != BlockSignatures) {
+		return false; // server does not support delta upload
+	}
+	IPKSignature signature(s.Data(), s.DataSize());
+	uint64_t base_size = s.FileSize();
+	if (signature.Blocks() == 0) {
+		return false;
+	}
+
+	// literal data and references to blocks of previous version, server verifies rebuilt file by its SHA-256
+	MappedFile file(filepath);
+	IPKDeltaEncoder encoder(file, signature);
+	unsigned char digest[sha256_size];
+	SHA256(file.Data(), static_cast<std::size_t>(file.Size()), digest);
+	IPKPacket::Serialize(message, OfferDelta, filename, file.Size(), base_size, signature.BlockSize(), digest, sizeof(digest));
+	tcp.Send(message);
+	std::vector<unsigned char> instructions;
+	while (!encoder.Done()) {
+		encoder.Next(instructions);
+		IPKPacket::Serialize(message, DeltaFrame, {}, 0, 0, 0, instructions.data(), instructions.size());
+		tcp.Send(message);
+		if (progress) {
+			progress(static_cast<std::size_t>(encoder.Position()), static_cast<std::size_t>(file.Size()));
+		}
+	}
+	message.clear();
+	tcp.Recv(message, IPKPacket::StatusSize);
+	IPKPacketView p(message);
+	return p == StatusOk;
+}
+
+void IPKFTP::Download(std::string filepath, unsigned int connections)
 {
 	//Possible Improvement: std::cout logging
-	//Possible Improvement: split large files
+
+	if (connections > 1) {
+		ParallelDownload(filepath, connections);
+		return;
+	}
 
 	auto filename = FileName(filepath);
 
 	for (int i = 0; i <= retries; i++) {
 		try {
-			tcp.Send(IPKPacket(RequestFile, filename));
-			auto packet = tcp.Recv(IPKPacket::StatusSize);
-			tcp.Recv(packet, IPKPacket::ExpectedSize(packet) - IPKPacket::StatusSize, ShowProgress);
-			IPKPacket p(packet);
+			// continue verified part of previous download (whole file is offered when it has changed)
+			uint64_t partial_size = 0, partial_offset = 0;
+			int64_t version = 0;
+			if (IPKFrameWriter::Partial(filepath, partial_size, partial_offset, version) && partial_offset > 0) {
+				IPKPacket::Serialize(message, RequestRange, filename, partial_size, partial_offset, 0, reinterpret_cast<const unsigned char*>(&version), sizeof(version));
+			}
+			else {
+				IPKPacket::Serialize(message, RequestFile, filename);
+				partial_offset = 0;
+			}
+			tcp.Send(message);
+			CRC32State crc;
+			MessageRecv(tcp, message, crc);
+			IPKPacketView p(message, crc);
 			if (p == StatusInaccessible) {
 				throw std::runtime_error("Error: File is not accessible on server!");
 			}
-			else if (p != OfferFile || p.GetFilename() != filename) { 
+			else if ((p != OfferFile && p != OfferRange) || filename.compare(0, std::string::npos, p.Filename(), p.FilenameSize()) != 0) { 
 				continue; 
 			}
-			FileSave(filepath, p.GetData());
+			else if (p == OfferRange && (p.Offset() != partial_offset || p.Length() != p.FileSize() - p.Offset())) {
+				continue;
+			}
+			IPKFrameWriter writer(filepath, p.FileSize(), (p == OfferRange) ? p.Offset() : 0);
+			writer.SetCodec(codec);
+			writer.SetVersion(p.Version());
+			FileRecv(tcp, writer, progress);
 			return;
 		}
 		catch (const TCPException &e) {
@@ -291,7 +537,507 @@ void IPKFTP::Download(std::string filepath)
 	throw std::runtime_error("Error: Download failed!");
 }
 
+uint64_t IPKFTP::RangeRecv(std::string filepath, uint64_t filesize, int64_t &version, uint64_t offset, uint64_t length, bool allocate,
+	uint64_t &verified, std::function<void(std::size_t, std::size_t)> updateCallback)
+{
+	auto filename = FileName(filepath);
+	uint64_t end = offset + length;
+	verified = offset;
+
+	for (int i = 0; i <= retries; i++) {
+		try {
+			// next try continues verified part of range
+			IPKPacket::Serialize(message, RequestRange, filename, filesize, verified, end - verified, reinterpret_cast<const unsigned char*>(&version), sizeof(version));
+			tcp.Send(message);
+			CRC32State crc;
+			MessageRecv(tcp, message, crc);
+			IPKPacketView p(message, crc);
+			if (p == StatusInaccessible) {
+				throw std::runtime_error("Error: File is not accessible on server!");
+			}
+			else if ((p != OfferFile && p != OfferRange) || filename.compare(0, std::string::npos, p.Filename(), p.FilenameSize()) != 0) {
+				continue;
+			}
+			// whole file is offered when it fits into range or when it has changed
+			uint64_t range_offset = (p == OfferRange) ? p.Offset() : 0;
+			uint64_t range_length = (p == OfferRange) ? p.Length() : p.FileSize();
+			if ((filesize && p.FileSize() != filesize) || (version && p.Version() && p.Version() != version)) {
+				throw IPKFileChangedException();
+			}
+			else if (range_offset != verified || range_length > end - verified) {
+				continue;
+			}
+
+			if (allocate) {
+				IPKFrameWriter::Allocate(filepath, p.FileSize());
+				version = p.Version();
+				allocate = false;
+			}
+			IPKFrameWriter writer(filepath, p.FileSize(), range_offset, range_length);
+			writer.SetCodec(codec);
+			try {
+				FileRecv(tcp, writer, updateCallback);
+			}
+			catch (...) {
+				verified = writer.Verified();
+				throw;
+			}
+			verified = writer.Verified();
+			return p.FileSize();
+		}
+		catch (const TCPException &e) {
+			if (e.error == Timeout) {
+				continue;
+			}
+			else {
+				throw;
+			}
+		}
+		catch (const IPKPacketException &e) {
+			if (e.error == SignatureError || e.error == VersionError || e.error == TransmissionTypeError ||
+				e.error == SizeError || e.error == CRC32Error) {
+				continue;
+			}
+			else {
+				throw;
+			}
+		}
+	}
+	throw std::runtime_error("Error: Download failed!");
+}
+
+void IPKFTP::ParallelDownload(std::string filepath, unsigned int connections)
+{
+	// verified ranges of previous parallel (or sequential) download are kept, only missing ones are downloaded
+	uint64_t filesize = 0;
+	int64_t version = 0;
+	std::vector<std::pair<uint64_t, uint64_t>> verified;
+	bool resumed = IPKFrameWriter::PartialRanges(filepath, filesize, version, verified);
+	if (!resumed) {
+		// first frame tells file size and version (and preallocates ".part" file)
+		uint64_t first = IPKPacket::FrameSize, first_verified = 0;
+		try {
+			filesize = RangeRecv(filepath, 0, version, 0, first, true, first_verified);
+		}
+		catch (...) {
+			IPKFrameWriter::Discard(filepath);
+			throw;
+		}
+		verified.emplace_back(0, std::min(first, filesize));
+	}
+	std::vector<std::pair<uint64_t, uint64_t>> missing;
+	uint64_t received = 0, last = 0;
+	for (const auto &range : verified) {
+		if (range.first > last) {
+			missing.emplace_back(last, range.first);
+		}
+		received += range.second - range.first;
+		last = range.second;
+	}
+	if (last < filesize) {
+		missing.emplace_back(last, filesize);
+	}
+	if (missing.empty()) {
+		if (progress) {
+			progress(static_cast<std::size_t>(filesize), static_cast<std::size_t>(filesize));
+		}
+		IPKFrameWriter::Commit(filepath);
+		return;
+	}
+
+	// missing parts of file are split into disjoint ranges (aligned to frames), connections take them in order
+	uint64_t missing_frames = 0;
+	for (const auto &gap : missing) {
+		missing_frames += (gap.second - gap.first + IPKPacket::FrameSize - 1) / IPKPacket::FrameSize;
+	}
+	uint64_t frames_per_range = (missing_frames + connections - 1) / connections;
+	std::vector<std::pair<uint64_t, uint64_t>> ranges; // offset, length
+	for (const auto &gap : missing) {
+		for (uint64_t offset = gap.first; offset < gap.second; ) {
+			uint64_t next = std::min(((offset / IPKPacket::FrameSize) + frames_per_range) * IPKPacket::FrameSize, gap.second);
+			ranges.emplace_back(offset, next - offset);
+			offset = next;
+		}
+	}
+
+	std::mutex progress_mutex;
+	std::vector<uint64_t> range_progress(ranges.size(), 0);
+	std::vector<uint64_t> range_verified(ranges.size());
+	for (std::size_t r = 0; r < ranges.size(); r++) {
+		range_verified[r] = ranges[r].first;
+	}
+	std::exception_ptr error; // first error (ranges stopped by it report cancellation)
+	std::atomic<std::size_t> next_range{ 0 };
+	std::atomic<bool> failed{ false }; // first error stops other ranges
+	auto fail = [&](std::exception_ptr e) {
+		std::lock_guard<std::mutex> lock(progress_mutex);
+		if (!error) {
+			error = e;
+		}
+		failed = true;
+	};
+	auto update = [&](std::size_t range, uint64_t position) {
+		if (failed) {
+			throw std::runtime_error("Error: Download was cancelled!");
+		}
+		std::lock_guard<std::mutex> lock(progress_mutex);
+		range_progress[range] = position - ranges[range].first;
+		uint64_t bytes = received;
+		for (auto range_bytes : range_progress) {
+			bytes += range_bytes;
+		}
+		if (progress) {
+			progress(static_cast<std::size_t>(bytes), static_cast<std::size_t>(filesize));
+		}
+	};
+	auto download = [&](IPKFTP &connection) {
+		for (std::size_t r = next_range++; r < ranges.size() && !failed; r = next_range++) {
+			try {
+				connection.RangeRecv(filepath, filesize, version, ranges[r].first, ranges[r].second, false, range_verified[r],
+					[r, &update](std::size_t position, std::size_t) { update(r, position); });
+			}
+			catch (...) {
+				fail(std::current_exception());
+			}
+		}
+	};
+
+	// this connection takes ranges too
+	std::vector<std::thread> threads;
+	for (std::size_t c = 1; c < std::min<std::size_t>(connections, ranges.size()); c++) {
+		threads.emplace_back([this, &download, &fail]() {
+			try {
+				IPKFTP connection;
+				connection.SetCompression(compression);
+				connection.ClientConnect(host, port);
+				download(connection);
+				connection.ClientDisconnect();
+			}
+			catch (...) {
+				fail(std::current_exception());
+			}
+		});
+	}
+	download(*this);
+	for (auto &thread : threads) {
+		thread.join();
+	}
+
+	for (std::size_t r = 0; r < ranges.size(); r++) {
+		verified.emplace_back(ranges[r].first, range_verified[r]); // ranges that were not started are empty
+	}
+	if (error) {
+		try {
+			std::rethrow_exception(error);
+		}
+		catch (const IPKFileChangedException &e) {
+			(void)e; // bypass unreferenced local variable warning
+			IPKFrameWriter::Discard(filepath); // verified ranges belong to previous version of file
+			if (resumed) {
+				ClientConnect(host, port); // rest of offered file is not received
+				ParallelDownload(filepath, connections); // download current version from beginning
+				return;
+			}
+			throw;
+		}
+		catch (...) {
+			IPKFrameWriter::SaveRanges(filepath, filesize, version, verified); // next download continues verified ranges
+			throw;
+		}
+	}
+	IPKFrameWriter::Commit(filepath);
+}
+
+namespace {
+	// request of batch waiting for response of server
+	struct BatchRequest {
+		std::size_t index; // index of file in batch
+		IPKTransmissionType expected; // OfferFile (download), PartialFile or StatusOk (upload)
+		uint64_t offset; // continued verified part of file (resumed transfer)
+		std::unique_ptr<IPKFrameReader> reader; // uploaded file
+	};
+}
+
+std::size_t IPKFTP::Batch(const std::vector<std::string> &filepaths, bool upload, unsigned int depth)
+{
+	std::deque<std::size_t> pending; // files to request (again)
+	for (std::size_t i = 0; i < filepaths.size(); i++) {
+		pending.push_back(i);
+	}
+	std::deque<BatchRequest> in_flight; // in order of responses
+	std::vector<int> tries(filepaths.size(), 0);
+	std::size_t failed = 0;
+	depth = std::max(depth, 1u);
+
+	auto fail = [&](std::size_t index, const std::string &error) {
+		std::cerr << filepaths[index] << ": " << error << std::endl;
+		failed++;
+	};
+	// pipeline is lost (stream is out of sync or connection is closed), oldest request gets blamed
+	// (error = it is not retried), other requests in flight are sent again over new connection
+	auto reset = [&](const char *error) {
+		if (++tries[in_flight.front().index] > retries || error) {
+			fail(in_flight.front().index, (error) ? error : (upload) ? "Error: Upload failed!" : "Error: Download failed!");
+			in_flight.pop_front();
+		}
+		for (auto it = in_flight.rbegin(); it != in_flight.rend(); ++it) {
+			pending.push_front(it->index);
+		}
+		in_flight.clear();
+		ClientConnect(host, port);
+	};
+
+	while (!pending.empty() || !in_flight.empty()) {
+		try {
+			// keep up to depth requests in flight
+			while (!pending.empty() && in_flight.size() < depth) {
+				std::size_t index = pending.front();
+				pending.pop_front();
+				auto filename = FileName(filepaths[index]);
+				if (upload) {
+					std::unique_ptr<IPKFrameReader> reader;
+					try {
+						reader.reset(new IPKFrameReader(filepaths[index]));
+						reader->SetCodec(codec);
+					}
+					catch (const std::ifstream::failure &e) {
+						(void)e; // bypass unreferenced local variable warning
+						fail(index, "Error: Unable to open file!");
+						continue;
+					}
+					int64_t version = reader->Version();
+					IPKPacket::Serialize(message, QueryFile, filename, reader->Size(), 0, 0, reinterpret_cast<const unsigned char*>(&version), sizeof(version));
+					in_flight.push_back({ index, PartialFile, 0, std::move(reader) });
+				}
+				else {
+					uint64_t partial_size = 0, partial_offset = 0;
+					int64_t version = 0;
+					if (IPKFrameWriter::Partial(filepaths[index], partial_size, partial_offset, version) && partial_offset > 0) {
+						IPKPacket::Serialize(message, RequestRange, filename, partial_size, partial_offset, 0, reinterpret_cast<const unsigned char*>(&version), sizeof(version));
+					}
+					else {
+						IPKPacket::Serialize(message, RequestFile, filename);
+						partial_offset = 0;
+					}
+					in_flight.push_back({ index, OfferFile, partial_offset, nullptr });
+				}
+				tcp.Send(message);
+			}
+			if (in_flight.empty()) {
+				continue;
+			}
+
+			// response to oldest request in flight
+			BatchRequest &request = in_flight.front();
+			auto filename = FileName(filepaths[request.index]);
+			CRC32State crc;
+			MessageRecv(tcp, message, crc);
+			IPKPacketView p(message, crc);
+			if (p == StatusInaccessible && !upload) {
+				fail(request.index, "Error: File is not accessible on server!");
+				in_flight.pop_front();
+			}
+			else if (request.expected == OfferFile && (p == OfferFile || (p == OfferRange && p.Offset() == request.offset &&
+				p.Length() == p.FileSize() - p.Offset())) && filename.compare(0, std::string::npos, p.Filename(), p.FilenameSize()) == 0) {
+				IPKFrameWriter writer(filepaths[request.index], p.FileSize(), (p == OfferRange) ? p.Offset() : 0);
+				writer.SetCodec(codec);
+				writer.SetVersion(p.Version());
+				FileRecv(tcp, writer);
+				in_flight.pop_front();
+			}
+			else if (request.expected == PartialFile && p == PartialFile && filename.compare(0, std::string::npos, p.Filename(), p.FilenameSize()) == 0) {
+				// offer is answered after responses to requests sent before it
+				IPKFrameReader &reader = *request.reader;
+				int64_t version = reader.Version();
+				uint64_t offset = (p.FileSize() == reader.Size()) ? p.Offset() : 0;
+				if (offset) {
+					IPKPacket::Serialize(message, OfferRange, filename, reader.Size(), offset, reader.Size() - offset, reinterpret_cast<const unsigned char*>(&version), sizeof(version));
+				}
+				else {
+					IPKPacket::Serialize(message, OfferFile, filename, reader.Size(), 0, 0, reinterpret_cast<const unsigned char*>(&version), sizeof(version));
+				}
+				tcp.Send(message);
+				FileSend(tcp, reader, offset);
+				request.expected = StatusOk;
+				in_flight.push_back(std::move(request));
+				in_flight.pop_front();
+			}
+			else if (request.expected == StatusOk && p == StatusOk) {
+				in_flight.pop_front();
+			}
+			else {
+				reset(nullptr);
+			}
+		}
+		catch (const std::ifstream::failure &e) {
+			(void)e; // bypass unreferenced local variable warning
+			reset("Error: Unable to save file!"); // remaining DataFrames of file are lost
+		}
+		catch (const TCPException &e) {
+			if (e.error == Timeout || e.error == ConnectionClosed || e.error == SendRecvFailed) {
+				reset(nullptr);
+			}
+			else {
+				throw;
+			}
+		}
+		catch (const IPKPacketException &e) {
+			if (e.error == SignatureError || e.error == VersionError || e.error == TransmissionTypeError ||
+				e.error == SizeError || e.error == CRC32Error) {
+				reset(nullptr);
+			}
+			else {
+				throw;
+			}
+		}
+	}
+	return failed;
+}
+
+namespace {
+	// event loop of asynchronous transfers of all clients (started by first transfer, stopped by AsyncShutdown)
+	struct TransferLoopState {
+		std::mutex mutex;
+		std::condition_variable cv;
+		std::unique_ptr<TCPEventLoop> loop; // nullptr when platform has no reactor (or loop was not started yet)
+		std::size_t pending = 0; // transfers whose completion was not reported yet
+	};
+
+	TransferLoopState &transfer_loop()
+	{
+		// never destroyed, transfers left running at exit are abandoned without running their callbacks
+		// during static destruction (see AsyncShutdown)
+		static TransferLoopState *state = new TransferLoopState();
+		return *state;
+	}
+}
+
+void IPKFTP::AsyncShutdown()
+{
+	auto &state = transfer_loop();
+	std::unique_ptr<TCPEventLoop> loop;
+	{
+		std::unique_lock<std::mutex> lock(state.mutex);
+		state.cv.wait(lock, [&state]() { return state.pending == 0; });
+		loop = std::move(state.loop);
+	}
+	loop.reset(); // joins event loop thread (transfer started meanwhile by other thread is aborted)
+}
+
+std::future<void> IPKFTP::UploadAsync(std::string filepath, std::function<void(std::exception_ptr)> completed)
+{
+	return TransferAsync(true, filepath, completed);
+}
+
+std::future<void> IPKFTP::DownloadAsync(std::string filepath, std::function<void(std::exception_ptr)> completed)
+{
+	return TransferAsync(false, filepath, completed);
+}
+
+std::future<void> IPKFTP::TransferAsync(bool upload, const std::string &filepath, std::function<void(std::exception_ptr)> completed)
+{
+	auto &state = transfer_loop();
+	{
+		std::lock_guard<std::mutex> lock(state.mutex);
+		state.pending++;
+	}
+	auto promise = std::make_shared<std::promise<void>>();
+	std::future<void> future = promise->get_future();
+	IPKClientSession::Callback done = [promise, completed, &state](std::exception_ptr error) {
+		if (completed) {
+			completed(error);
+		}
+		if (error) {
+			promise->set_exception(error);
+		}
+		else {
+			promise->set_value();
+		}
+		{
+			std::lock_guard<std::mutex> lock(state.mutex);
+			state.pending--;
+		}
+		state.cv.notify_all();
+	};
+
+	// connection of transfer (codec is negotiated by its own CommandPing)
+	TCP connection;
+	std::unique_ptr<IPKClientSession> session;
+	try {
+		if (host.empty()) {
+			throw std::runtime_error("Error: Client is not connected!"); // server is given by ClientConnect
+		}
+		//Possible Improvement: non-blocking connect driven by event loop
+		connection.Connect(host, port);
+		session.reset(new IPKClientSession(upload ? IPKClientSession::Upload : IPKClientSession::Download, filepath, compression, retries, done));
+	}
+	catch (const std::exception &e) {
+		(void)e; // bypass unreferenced local variable warning
+		done(std::current_exception());
+		return future;
+	}
+
+	std::unique_lock<std::mutex> lock(state.mutex);
+	if (!state.loop) {
+		state.loop = TCP::EventLoop(); // first transfer (or first one after AsyncShutdown)
+	}
+	if (state.loop) {
+		state.loop->Add(connection.Release(), std::move(session));
+	}
+	else {
+		lock.unlock();
+		// reactor is not available, fallback to thread per transfer
+		std::shared_ptr<IPKClientSession> handler(std::move(session));
+		TCPSocket client = connection.Release();
+		std::thread([client, handler]() {
+			TCP transfer(client);
+			transfer.Run(*handler);
+		}).detach();
+	}
+	return future;
+}
+
+void IPKFTP::SetProgress(bool show)
+{
+	progress = show ? ShowProgress : std::function<void(std::size_t, std::size_t)>();
+}
+
+void IPKFTP::SetCompression(CompressionCodec codec)
+{
+	this->compression = codec;
+}
+
 void IPKFTP::ClientDisconnect()
 {
 	tcp.Close();
+}
+
+std::string IPKFTP::Stats()
+{
+	IPKPacket::Serialize(message, CommandStats);
+	tcp.Send(message);
+	CRC32State crc;
+	MessageRecv(tcp, message, crc);
+	IPKPacketView p(message, crc);
+	if (p != CommandStats) {
+		throw std::runtime_error("Error: Server does not report metrics!");
+	}
+	return std::string(reinterpret_cast<const char*>(p.Data()), p.DataSize());
+}
+
+void IPKFTP::Ping()
+{
+	// negotiated codec is offered again, so server keeps it
+	unsigned char offered = static_cast<unsigned char>(codec);
+	IPKPacket::Serialize(message, CommandPing, {}, 0, 0, 0, &offered, (codec != NoCompression) ? 1 : 0);
+	tcp.Send(message);
+	CRC32State crc;
+	MessageRecv(tcp, message, crc);
+	IPKPacketView p(message, crc);
+	if (p == StatusBusy) {
+		throw std::runtime_error("Error: Server is busy!");
+	}
+	else if (p != StatusOk) {
+		throw std::runtime_error("Error: Ping failed!");
+	}
 }
\ No newline at end of file
@@ -9,28 +9,129 @@
 
 #include <string>
 #include <vector>
+#include <functional>
+#include <future>
+#include <exception>
+#include <stdexcept>
+#include <stdint.h>
 #include "TCP.h"
+#include "Compression.h"
+
+class IPKFrameReader;
+class IPKFrameWriter;
+class CRC32State;
+
+// server settings
+struct IPKServerConfig {
+	unsigned int loops = 0; // reactor event loops (0 = worker pool)
+	unsigned int workers = 64; // worker pool threads (one connection per worker)
+	unsigned int queue = 128; // connections waiting for worker, others get StatusBusy
+	TCPOptions tcp; // block size and socket buffers of connections (auto-tuning by default)
+	bool compression = true; // clients can negotiate compression of DataFrames
+	uint64_t cache = 256 * 1024 * 1024; // maximal size of hot files kept by server (0 = disabled)
+	std::string index; // content index file of saved files, outside of served directory (empty = deduplication is disabled)
+	std::string host; // interface to listen on (empty = all)
+	std::string metrics; // file periodically replaced by metrics report (empty = disabled, see CommandStats)
+	unsigned int metrics_interval = 10; // seconds between metrics reports
+	std::string trace; // file periodically replaced by Chrome trace of hot paths (empty = tracing is disabled, see IPKTrace)
+	unsigned int trace_interval = 10; // seconds between trace writes
+	unsigned int part_expiry = 24 * 3600; // seconds after which ".part" files of abandoned uploads are removed (0 = kept)
+	std::function<void(const std::string &port)> ready; // server listens (actual port when port is "0")
+};
+
+// server counters
+struct IPKServerStats {
+	uint64_t cache_hits; // requests of cached files
+	uint64_t cache_misses; // requests that opened file
+	uint64_t coalesced; // requests that shared file being sent to other clients
+	uint64_t cache_bytes; // size of cached files and their CompressedFrames
+	uint64_t deduplicated; // uploads saved from identical content held by server
+	uint64_t bytes_in; // received from sockets
+	uint64_t bytes_out; // sent to sockets
+	uint64_t connections; // active connections
+	uint64_t requests; // requests of all types
+	uint64_t crc_failures; // requests and uploads rejected by CRC32
+	uint64_t timeouts; // connections that timed out
+	uint64_t retries; // requests answered by StatusError
+};
+
+// file has changed on server since its download was started (verified part belongs to previous version)
+class IPKFileChangedException : public std::runtime_error {
+public:
+	IPKFileChangedException();
+};
 
 class IPKFTP {
 	static const int retries;
+	static const std::size_t send_batch;
+	static const unsigned int batch_depth;
 	TCP tcp;
+	std::string host, port; // server of client connection (parallel download opens more connections)
+	std::vector<unsigned char> message; // serialized request or response (capacity is reused)
+	CompressionCodec compression = NoCompression; // preferred codec offered by client
+	CompressionCodec codec = NoCompression; // negotiated codec of connection
+	std::function<void(std::size_t, std::size_t)> progress = ShowProgress; // transfer progress (bytes, size)
 
 	static void ShowProgress(std::size_t bytes, std::size_t max);
 
-	static std::vector<unsigned char> FileLoad(std::string filename);
-	static void FileSave(std::string filename, std::vector<unsigned char> data);
+	static void FileSend(TCP &tcp, IPKFrameReader &reader, uint64_t offset, std::function<void(std::size_t, std::size_t)> update = {});
+	static void FileRecv(TCP &tcp, IPKFrameWriter &writer, std::function<void(std::size_t, std::size_t)> update = {});
+	static void MessageRecv(TCP &tcp, std::vector<unsigned char> &message, CRC32State &crc);
 	static std::string FileName(std::string filepath);
 
-	static void ServerThreadCode(TCP &&client);
+	static void ServerThreadCode(TCP &&client, bool compression);
+
+	// download range of file into preallocated ".part" file (allocate = create it, when file size is not known yet,
+	// version of offered file is returned), verified = end of verified part of range (also when download fails),
+	// returns file size (throws IPKFileChangedException when file size or version differs)
+	uint64_t RangeRecv(std::string filepath, uint64_t filesize, int64_t &version, uint64_t offset, uint64_t length, bool allocate,
+		uint64_t &verified, std::function<void(std::size_t, std::size_t)> update = {});
+	void ParallelDownload(std::string filepath, unsigned int connections);
+
+	// send file as delta against previous version held by server (false if server has none, or rejects delta)
+	bool DeltaSend(const std::string &filepath, const std::string &filename);
+
+	std::future<void> TransferAsync(bool upload, const std::string &filepath, std::function<void(std::exception_ptr)> completed);
 public:
-	void ServerStart(std::string port);
+	// start server (worker pool, or reactor with given number of event loops), returns after ServerStop
+	void ServerStart(std::string port, IPKServerConfig config = IPKServerConfig());
+	// stop server started by other thread
 	void ServerStop();
+	static IPKServerStats ServerStats();
+	// metrics of server as JSON text (also available to clients by CommandStats, see Stats)
+	static std::string ServerReport();
+
+	// show progress of transfers on standard output (default)
+	void SetProgress(bool show);
 
+	// offer compression of DataFrames to server (preferred codec, other supported ones follow)
+	void SetCompression(CompressionCodec codec);
 	void ClientConnect(std::string host, std::string port);
 	void ClientDisconnect();
+	// CommandPing round trip on connected client
+	void Ping();
+	// metrics of connected server as JSON text (CommandStats)
+	std::string Stats();
+
+	// upload file (delta = only blocks that differ from previous version held by server are sent,
+	// deduplicate = SHA-256 of file is offered first, nothing is sent when server holds identical content)
+	void Upload(std::string filepath, bool delta = false, bool deduplicate = false);
+	// download file (connections > 1 = disjoint ranges of file are downloaded by parallel connections)
+	void Download(std::string filepath, unsigned int connections = 1);
+	// upload or download list of files over this connection, up to depth requests are pipelined
+	// (server answers them in order), returns number of failed files
+	std::size_t Batch(const std::vector<std::string> &filepaths, bool upload, unsigned int depth = batch_depth);
 
-	void Upload(std::string filepath);
-	void Download(std::string filepath);
+	// asynchronous upload or download over its own connection to server of ClientConnect, transfers of all
+	// clients are driven by one event loop thread shared by process (see IPKClientSession), completed is called
+	// on event loop thread (nullptr = success, must not block or throw) before future becomes ready, failure to connect
+	// is reported the same way, no progress is shown
+	std::future<void> UploadAsync(std::string filepath, std::function<void(std::exception_ptr)> completed = {});
+	std::future<void> DownloadAsync(std::string filepath, std::function<void(std::exception_ptr)> completed = {});
+	// wait for all asynchronous transfers of process and stop their event loop (next transfer starts it again),
+	// completion callbacks of transfers still running are called meanwhile (must not be called from callback),
+	// transfers not finished by AsyncShutdown before exit are abandoned and their callbacks are never called
+	static void AsyncShutdown();
 };
 
 #endif
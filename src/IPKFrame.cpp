@@ -0,0 +1,939 @@
+/*
+*	IPK Project 1: client-server for simple file transfer
+*	Author: Tomáš Pazdiora (xpazdi02)
+*	File: IPKFrame.cpp
+*/
+
+#include "IPKFrame.h"
+#include "IPKPacket.h"
+#include "CRC32.h"
+#include "IPKTrace.h"
+
+#include <algorithm>
+#include <cstdio>
+
+#if defined(__linux__)
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+#if defined(_WIN32)
+#include <windows.h>
+#else
+#include <dirent.h>
+#endif
+#include <map>
+#include <list>
+#include <tuple>
+#include <sstream>
+
+// ------------- IPKFrameReader -------------
+
+IPKFrameReader::IPKFrameReader(std::string filepath)
+	: file(std::make_shared<const MappedFile>(filepath)), position(0)
+{
+	checksums.reset(new IPKFrameChecksums(file));
+}
+
+IPKFrameReader::~IPKFrameReader()
+{
+}
+
+uint64_t IPKFrameReader::Size() const
+{
+	return this->file->Size();
+}
+
+uint64_t IPKFrameReader::Position() const
+{
+	return this->position;
+}
+
+bool IPKFrameReader::Done() const
+{
+	return this->position >= this->file->Size();
+}
+
+void IPKFrameReader::Rewind(uint64_t offset)
+{
+	position = std::min(offset, Size());
+}
+
+int64_t IPKFrameReader::Version() const
+{
+	return this->file->ModificationTime();
+}
+
+void IPKFrameReader::SetCodec(CompressionCodec codec)
+{
+	compressor = FrameCompressor(codec);
+}
+
+void IPKFrameReader::Next(std::vector<TCPBuffer> &buffers, std::size_t frames)
+{
+	const std::size_t header_size = IPKPacket::HeaderSize;
+	const std::size_t trailer_size = IPKPacket::StatusSize - header_size;
+
+	IPK_TRACE_SPAN("frame.next");
+	buffers.clear();
+	storage.resize(frames * IPKPacket::StatusSize); // buffers point into storage, so it must not be reallocated below
+	if (packets.size() < frames) {
+		packets.resize(frames);
+	}
+	std::vector<unsigned char> part;
+	for (std::size_t i = 0; i < frames && !Done(); i++) {
+		std::size_t frame_size = IPKFrameChecksums::FrameSizeAt(position, Size());
+		uint32_t frame_crc = checksums->Get(*file, position, frame_size);
+
+		IPK_TRACE_SPAN_BYTES("frame.compress", frame_size);
+		auto compressed = compressor.Compress(file->Data() + position, frame_size, frame_crc);
+		if (compressed) {
+			IPKPacket::Serialize(packets[i], CompressedFrame, {}, 0, 0, 0, compressed->data(), compressed->size());
+			buffers.push_back({ packets[i].data(), packets[i].size() });
+			position += frame_size;
+			continue;
+		}
+
+		unsigned char *header = storage.data() + i * IPKPacket::StatusSize;
+		unsigned char *trailer = header + header_size;
+
+		IPKPacket::SerializeFrameHeader(part, frame_size);
+		std::copy(part.begin(), part.end(), header);
+		IPKPacket::SerializeTrailer(part, frame_crc);
+		std::copy(part.begin(), part.end(), trailer);
+
+		buffers.push_back({ header, header_size });
+		buffers.push_back({ file->Data() + position, frame_size });
+		buffers.push_back({ trailer, trailer_size });
+		position += frame_size;
+	}
+	if (file->Truncated()) {
+		throw std::ifstream::failure("IPKFTP: File was truncated during transfer!"); // frames may contain zeros instead of data
+	}
+}
+
+// ------------- IPKFrameWriter -------------
+
+// replace marker by complete one (marker written in place would be left truncated by interrupted transfer)
+static void WriteMarker(const std::string &infopath, const std::string &marker)
+{
+	std::string temppath = infopath + ".tmp";
+	{
+		std::ofstream info(temppath, std::ios::trunc);
+		info << marker;
+		if (!info.flush()) {
+			std::remove(temppath.c_str()); // previous marker is kept
+			return;
+		}
+	}
+#if defined(_WIN32)
+	std::remove(infopath.c_str()); // rename does not replace existing file on Windows
+#endif
+	std::rename(temppath.c_str(), infopath.c_str());
+}
+
+// names of files in working directory
+static std::vector<std::string> ListDirectory()
+{
+	std::vector<std::string> names;
+#if defined(_WIN32)
+	WIN32_FIND_DATAA entry;
+	HANDLE find = FindFirstFileA("*", &entry);
+	if (find == INVALID_HANDLE_VALUE) {
+		return names;
+	}
+	do {
+		names.push_back(entry.cFileName);
+	} while (FindNextFileA(find, &entry));
+	FindClose(find);
+#else
+	DIR *directory = opendir(".");
+	if (!directory) {
+		return names;
+	}
+	while (struct dirent *entry = readdir(directory)) {
+		names.push_back(entry->d_name);
+	}
+	closedir(directory);
+#endif
+	return names;
+}
+
+IPKFrameWriter::IPKFrameWriter(std::string filepath, uint64_t filesize, uint64_t offset)
+	: filepath(filepath), partpath(filepath + ".part"), infopath(filepath + ".part.info"), descriptor(-1),
+	codec(NoCompression), hashing(false), expecting(false), filesize(filesize), end(filesize), position(offset), verified(offset), saved(offset), version(0), shared(false), opened(false),
+	accessible(true), corrupted(false), finished(false)
+{
+	IPK_TRACE_SPAN("file.create");
+	file.exceptions(std::fstream::failbit | std::fstream::badbit);
+	if (offset > 0) {
+		uint64_t partial_size = 0, partial_offset = 0;
+		if (!Partial(filepath, partial_size, partial_offset, version) || partial_size != filesize || offset > partial_offset) {
+			corrupted = true; // range does not continue verified part of file, frames are only drained
+			return;
+		}
+	}
+	try {
+		if (offset > 0) {
+			file.open(partpath, std::ios::binary | std::ios::in | std::ios::out); // continue partial file
+			file.seekp(offset);
+		}
+		else {
+			file.open(partpath, std::ios::binary | std::ios::out | std::ios::trunc);
+		}
+		opened = true;
+	}
+	catch (const std::fstream::failure &e) {
+		(void)e; // bypass unreferenced local variable warning
+		accessible = false; // frames still have to be received to keep the stream consistent
+	}
+#if defined(__linux__)
+	if (accessible) {
+		descriptor = open(partpath.c_str(), O_RDWR | O_CLOEXEC); // stream stays empty, frames are written by one of them only
+	}
+#endif
+}
+
+IPKFrameWriter::IPKFrameWriter(std::string filepath, uint64_t filesize, uint64_t offset, uint64_t length)
+	: filepath(filepath), partpath(filepath + ".part"), infopath(filepath + ".part.info"), descriptor(-1),
+	codec(NoCompression), hashing(false), expecting(false), filesize(filesize), end(offset + length), position(offset), verified(offset), saved(offset), version(0), shared(true), opened(false),
+	accessible(true), corrupted(false), finished(false)
+{
+	file.exceptions(std::fstream::failbit | std::fstream::badbit);
+	try {
+		file.open(partpath, std::ios::binary | std::ios::in | std::ios::out); // preallocated by Allocate
+		file.seekp(offset);
+	}
+	catch (const std::fstream::failure &e) {
+		(void)e; // bypass unreferenced local variable warning
+		accessible = false; // frames still have to be received to keep the stream consistent
+	}
+#if defined(__linux__)
+	if (accessible) {
+		descriptor = open(partpath.c_str(), O_RDWR | O_CLOEXEC); // ranges are received into file by splice too
+	}
+#endif
+}
+
+void IPKFrameWriter::CloseDescriptor()
+{
+#if defined(__linux__)
+	if (descriptor >= 0) {
+		close(descriptor);
+		descriptor = -1;
+	}
+#endif
+}
+
+IPKFrameWriter::~IPKFrameWriter()
+{
+	if (!finished && opened && !shared) { // shared ".part" file is discarded or committed by its owner
+		if (file.is_open()) {
+			try {
+				file.close();
+			}
+			catch (const std::fstream::failure &e) {
+				(void)e; // bypass unreferenced local variable warning
+			}
+		}
+		if (verified > 0 && !expecting) {
+			SaveMarker(); // transfer can be resumed from verified offset
+		}
+		else {
+			std::remove(partpath.c_str());
+			std::remove(infopath.c_str());
+		}
+	}
+	CloseDescriptor();
+}
+
+bool IPKFrameWriter::Partial(std::string filepath, uint64_t &filesize, uint64_t &offset, int64_t &version)
+{
+	std::ifstream info(filepath + ".part.info");
+	std::ifstream part(filepath + ".part", std::ios::binary | std::ios::ate);
+	std::string line;
+	std::getline(info, line);
+	std::istringstream marker(line); // filesize, offset and version (missing in older markers)
+	if (!(marker >> filesize >> offset) || !part.is_open()) {
+		return false;
+	}
+	if (!(marker >> version)) {
+		version = 0;
+	}
+	// marker can be ahead of data which were not flushed (only verified data are ever written to file by stream)
+	offset = std::min(offset, static_cast<uint64_t>(part.tellg()));
+	return offset <= filesize;
+}
+
+bool IPKFrameWriter::PartialRanges(std::string filepath, uint64_t &filesize, int64_t &version, std::vector<std::pair<uint64_t, uint64_t>> &ranges)
+{
+	// marker of ranges starts as marker of Partial, verified ranges behind continued part follow
+	ranges.clear();
+	uint64_t offset = 0;
+	if (!Partial(filepath, filesize, offset, version)) {
+		return false;
+	}
+	std::ifstream info(filepath + ".part.info");
+	std::ifstream part(filepath + ".part", std::ios::binary | std::ios::ate);
+	uint64_t partsize = static_cast<uint64_t>(part.tellg());
+	uint64_t start, end, last = offset;
+	std::string line;
+	std::getline(info, line); // line of Partial
+	if (offset > 0) {
+		ranges.emplace_back(0, offset);
+	}
+	while (info >> start >> end) {
+		end = std::min(end, partsize); // marker can be ahead of data which were not flushed
+		if (start < last || start >= end || end > filesize) {
+			break;
+		}
+		ranges.emplace_back(start, end);
+		last = end;
+	}
+	return !ranges.empty();
+}
+
+void IPKFrameWriter::SaveRanges(std::string filepath, uint64_t filesize, int64_t version, std::vector<std::pair<uint64_t, uint64_t>> ranges)
+{
+	std::sort(ranges.begin(), ranges.end());
+	std::vector<std::pair<uint64_t, uint64_t>> merged;
+	for (const auto &range : ranges) {
+		if (range.first >= range.second) {
+			continue;
+		}
+		if (!merged.empty() && range.first <= merged.back().second) {
+			merged.back().second = std::max(merged.back().second, range.second);
+		}
+		else {
+			merged.push_back(range);
+		}
+	}
+	if (merged.empty()) {
+		Discard(filepath);
+		return;
+	}
+	std::ostringstream info;
+	uint64_t offset = (merged.front().first == 0) ? merged.front().second : 0;
+	info << filesize << " " << offset << " " << version << std::endl;
+	for (const auto &range : merged) {
+		if (range.first > 0) {
+			info << range.first << " " << range.second << std::endl;
+		}
+	}
+	WriteMarker(filepath + ".part.info", info.str());
+}
+
+void IPKFrameWriter::Allocate(std::string filepath, uint64_t filesize)
+{
+	std::string partpath = filepath + ".part";
+	std::remove((partpath + ".info").c_str()); // verified ranges are stored by SaveRanges
+#if defined(__linux__)
+	int fd = open(partpath.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (fd < 0) {
+		throw std::ofstream::failure("IPKFTP: Unable to save file!");
+	}
+	// reserve blocks up front (ranges are written out of order), sparse file if not supported
+	bool allocated = (filesize == 0 || posix_fallocate(fd, 0, static_cast<off_t>(filesize)) == 0 || ftruncate(fd, static_cast<off_t>(filesize)) == 0);
+	close(fd);
+	if (!allocated) {
+		throw std::ofstream::failure("IPKFTP: Unable to save file!");
+	}
+#else
+	std::ofstream file;
+	file.exceptions(std::ofstream::failbit | std::ofstream::badbit);
+	file.open(partpath, std::ios::binary | std::ios::trunc);
+	if (filesize) {
+		file.seekp(filesize - 1);
+		file.put(0);
+	}
+#endif
+}
+
+void IPKFrameWriter::Commit(std::string filepath)
+{
+	std::string partpath = filepath + ".part";
+#if defined(_WIN32)
+	std::remove(filepath.c_str()); // rename does not replace existing file on Windows
+#endif
+	if (std::rename(partpath.c_str(), filepath.c_str()) != 0) {
+		throw std::ofstream::failure("IPKFTP: Unable to save file!");
+	}
+	std::remove((partpath + ".info").c_str());
+}
+
+void IPKFrameWriter::Discard(std::string filepath)
+{
+	std::string partpath = filepath + ".part";
+	std::remove(partpath.c_str());
+	std::remove((partpath + ".info").c_str());
+}
+
+void IPKFrameWriter::Expire(uint64_t age)
+{
+	int64_t now = MappedFile::Now();
+	for (const auto &name : ListDirectory()) {
+		uint64_t size = 0;
+		int64_t mtime = 0;
+		if (Transient(name) && MappedFile::Stat(name, size, mtime) && now - mtime > static_cast<int64_t>(age) * 1000000000) {
+			std::remove(name.c_str());
+		}
+	}
+}
+
+bool IPKFrameWriter::Transient(const std::string &filename)
+{
+	// ".part.link" is content linked by IPKContentIndex before it replaces target
+	static const std::string suffixes[] = { ".part", ".part.info", ".part.info.tmp", ".part.link" };
+	for (const auto &suffix : suffixes) {
+		if (filename.size() >= suffix.size() && filename.compare(filename.size() - suffix.size(), suffix.size(), suffix) == 0) {
+			return true;
+		}
+	}
+	return false;
+}
+
+// store verified offset, so unfinished transfer can be resumed
+void IPKFrameWriter::SaveMarker()
+{
+	try {
+		if (file.is_open()) {
+			file.flush();
+		}
+		std::ostringstream info;
+		info << filesize << " " << verified << " " << version << std::endl;
+		WriteMarker(infopath, info.str());
+		saved = verified;
+	}
+	catch (const std::fstream::failure &e) {
+		(void)e; // bypass unreferenced local variable warning
+	}
+}
+
+// frame is completely written and verified
+void IPKFrameWriter::FrameVerified()
+{
+	static const uint64_t marker_interval = 16 * IPKPacket::FrameSize;
+	verified = position;
+	if (!shared && !expecting && verified - saved >= marker_interval) {
+		SaveMarker();
+	}
+}
+
+const std::string &IPKFrameWriter::Path() const
+{
+	return this->filepath;
+}
+
+uint64_t IPKFrameWriter::Size() const
+{
+	return this->filesize;
+}
+
+uint64_t IPKFrameWriter::Position() const
+{
+	return this->position;
+}
+
+uint64_t IPKFrameWriter::Verified() const
+{
+	return this->verified;
+}
+
+bool IPKFrameWriter::Done() const
+{
+	return this->position >= this->end;
+}
+
+void IPKFrameWriter::EnableDigest()
+{
+	hashing = (position == 0 && !shared);
+	sha.Init();
+}
+
+const unsigned char *IPKFrameWriter::Digest()
+{
+	if (!hashing || !finished) {
+		return nullptr;
+	}
+	return digest;
+}
+
+void IPKFrameWriter::ExpectDigest(const unsigned char *digest)
+{
+	EnableDigest();
+	std::copy(digest, digest + sha256_size, expected);
+	expecting = true;
+}
+
+void IPKFrameWriter::SetCodec(CompressionCodec codec)
+{
+	this->codec = codec;
+}
+
+void IPKFrameWriter::SetVersion(int64_t version)
+{
+	if (!shared && opened && saved > 0 && this->version && version && this->version != version) {
+		corrupted = true; // partial file of other version, marker is kept as it is
+		return;
+	}
+	this->version = version;
+}
+
+std::size_t IPKFrameWriter::Remaining(const std::vector<unsigned char> &packet) const
+{
+	std::size_t frame_data_size = IPKPacket::ExpectedSize(packet) - IPKPacket::StatusSize;
+	if (frame_data_size == 0 || frame_data_size > IPKPacket::FrameSize || frame_data_size > end - position) {
+		throw(IPKPacketException(SizeError, "IPKPacketError: DataFrame Size Error!")); // stream is lost
+	}
+	return frame_data_size;
+}
+
+void IPKFrameWriter::Write(const std::vector<unsigned char> &packet, const CRC32State &crc)
+{
+	// CompressedFrame carries data of frame that ends on next IPKPacket::FrameSize boundary
+	bool compressed = (IPKPacket::Type(packet) == CompressedFrame);
+	std::size_t data_size = compressed ? IPKFrameChecksums::FrameSizeAt(position, end) : packet.size() - IPKPacket::StatusSize;
+	uint64_t frame_position = position;
+	position += data_size;
+	IPK_TRACE_SPAN_BYTES("file.write", data_size);
+	try {
+		IPKPacketView frame(packet, crc); // data are written directly from received packet
+		if (frame != DataFrame && frame != CompressedFrame) {
+			throw(IPKPacketException(TransmissionTypeError, "IPKPacketError: DataFrame expected!"));
+		}
+		const unsigned char *data = compressed ? Decompress(frame, data_size) : frame.Data();
+		if (accessible && !corrupted) {
+			if (descriptor >= 0) {
+				file.seekp(frame_position); // other frames may have been received into descriptor
+			}
+			file.write(reinterpret_cast<const char*>(data), data_size);
+			if (hashing) {
+				sha.Update(data, data_size);
+			}
+			FrameVerified();
+		}
+	}
+	catch (const IPKPacketException &e) {
+		if (e.error == CRC32Error) {
+			corrupted = true; // drain remaining frames
+		}
+		else {
+			throw;
+		}
+	}
+	catch (const std::fstream::failure &e) {
+		(void)e; // bypass unreferenced local variable warning
+		accessible = false; // drain remaining frames
+	}
+}
+
+void IPKFrameWriter::Append(const unsigned char *data, uint64_t size)
+{
+	if (size > end - position) {
+		throw(IPKPacketException(SizeError, "IPKPacketError: DeltaFrame Size Error!")); // stream is lost
+	}
+	uint64_t data_position = position;
+	position += size;
+	IPK_TRACE_SPAN_BYTES("file.write", size);
+	if (!data) {
+		corrupted = true; // drain remaining frames
+	}
+	if (accessible && !corrupted) {
+		try {
+			if (descriptor >= 0) {
+				file.seekp(data_position);
+			}
+			file.write(reinterpret_cast<const char*>(data), static_cast<std::streamsize>(size));
+			if (hashing) {
+				sha.Update(data, static_cast<std::size_t>(size));
+			}
+			FrameVerified();
+		}
+		catch (const std::fstream::failure &e) {
+			(void)e; // bypass unreferenced local variable warning
+			accessible = false; // drain remaining frames
+		}
+	}
+}
+
+// original data of CompressedFrame verified by CRC32 of original DataFrame (throws IPKPacketException)
+const unsigned char *IPKFrameWriter::Decompress(const IPKPacketView &frame, std::size_t size)
+{
+	uint32_t frame_crc, original_size;
+	if (frame.DataSize() < sizeof(frame_crc) + sizeof(original_size)) {
+		throw(IPKPacketException(CRC32Error, "IPKPacketError: CRC32 Error!"));
+	}
+	std::copy(frame.Data(), frame.Data() + sizeof(frame_crc), reinterpret_cast<unsigned char*>(&frame_crc));
+	std::copy(frame.Data() + sizeof(frame_crc), frame.Data() + sizeof(frame_crc) + sizeof(original_size), reinterpret_cast<unsigned char*>(&original_size));
+	std::size_t header_size = sizeof(frame_crc) + sizeof(original_size);
+	IPK_TRACE_SPAN_BYTES("frame.decompress", size);
+
+	readback.resize(IPKPacket::FrameSize);
+	if (original_size != size || !Compression::Decompress(codec, frame.Data() + header_size, frame.DataSize() - header_size, readback.data(), size)) {
+		throw(IPKPacketException(CRC32Error, "IPKPacketError: CRC32 Error!"));
+	}
+	IPKPacket::SerializeFrameHeader(frame_header, size);
+	CRC32State crc;
+	crc.Update(frame_header.data(), frame_header.size());
+	crc.Update(readback.data(), size);
+	if (crc.Finalize() != frame_crc) {
+		throw(IPKPacketException(CRC32Error, "IPKPacketError: CRC32 Error!"));
+	}
+	return readback.data();
+}
+
+int IPKFrameWriter::Descriptor() const
+{
+	return (accessible && !corrupted) ? descriptor : -1;
+}
+
+void IPKFrameWriter::Received(std::size_t bytes, CRC32State &crc)
+{
+#if defined(__linux__)
+	IPK_TRACE_SPAN_BYTES("file.readback", bytes);
+	readback.resize(IPKPacket::FrameSize);
+	std::size_t done = 0;
+	while (done < bytes && accessible) {
+		std::size_t chunk = std::min(readback.size(), bytes - done);
+		ssize_t read_ret = pread(descriptor, readback.data(), chunk, static_cast<off_t>(position + done)); // hot in page cache
+		if (read_ret <= 0) {
+			accessible = false; // reported by Finish
+			break;
+		}
+		crc.Update(readback.data(), static_cast<std::size_t>(read_ret));
+		if (hashing) {
+			sha.Update(readback.data(), static_cast<std::size_t>(read_ret));
+		}
+		done += static_cast<std::size_t>(read_ret);
+	}
+#else
+	(void)crc; // bypass unreferenced parameter warning
+	accessible = false; // Descriptor() is never available
+#endif
+	position += bytes;
+}
+
+void IPKFrameWriter::Verify(const CRC32State &crc)
+{
+	if (crc.Finalize() != crc32_residue) {
+		corrupted = true; // drain remaining frames
+	}
+	else if (accessible && !corrupted) {
+		FrameVerified();
+	}
+}
+
+void IPKFrameWriter::Finish()
+{
+	IPK_TRACE_SPAN("file.commit");
+	CloseDescriptor();
+	if (accessible && file.is_open()) {
+		try {
+			file.close();
+		}
+		catch (const std::fstream::failure &e) {
+			(void)e; // bypass unreferenced local variable warning
+			accessible = false;
+		}
+	}
+	if (!accessible) {
+		throw std::ofstream::failure("IPKFTP: Unable to save file!");
+	}
+	if (corrupted) {
+		throw(IPKPacketException(CRC32Error, "IPKPacketError: CRC32 Error!"));
+	}
+	if (hashing) {
+		sha.Finalize(digest);
+	}
+	if (expecting && !(hashing && std::equal(digest, digest + sha256_size, expected))) {
+		throw(IPKPacketException(CRC32Error, "IPKPacketError: SHA-256 Error!")); // ".part" file is removed
+	}
+
+	// replace target file with completely received one
+	if (!shared) {
+		Commit(filepath);
+	}
+	finished = true;
+}
+
+// ----------- IPKFrameChecksums ------------
+
+IPKFrameChecksums::IPKFrameChecksums(std::shared_ptr<const MappedFile> file)
+	: file(file), crcs(Frames(file->Size())), ready(0), cancel(false)
+{
+	thread = std::thread(&IPKFrameChecksums::Compute, this);
+}
+
+IPKFrameChecksums::~IPKFrameChecksums()
+{
+	cancel = true;
+	thread.join();
+}
+
+std::size_t IPKFrameChecksums::Frames(uint64_t filesize)
+{
+	return static_cast<std::size_t>((filesize + IPKPacket::FrameSize - 1) / IPKPacket::FrameSize);
+}
+
+void IPKFrameChecksums::Compute()
+{
+	std::vector<unsigned char> header;
+	for (std::size_t i = 0; i < crcs.size() && !cancel; i++) {
+		uint64_t offset = static_cast<uint64_t>(i) * IPKPacket::FrameSize;
+		std::size_t frame_size = static_cast<std::size_t>(std::min<uint64_t>(IPKPacket::FrameSize, file->Size() - offset));
+		IPK_TRACE_SPAN_BYTES("crc32.frame", frame_size);
+		IPKPacket::SerializeFrameHeader(header, frame_size);
+
+		CRC32State crc;
+		crc.Update(header.data(), header.size());
+		crc.Update(file->Data() + offset, frame_size);
+		std::lock_guard<std::mutex> lock(mutex);
+		crcs[i] = crc.Finalize();
+		ready = i + 1;
+	}
+	file.reset(); // mapping is not needed anymore
+}
+
+uint32_t IPKFrameChecksums::Get(const MappedFile &file, uint64_t offset, std::size_t size)
+{
+	if (offset % IPKPacket::FrameSize == 0 && size == FrameSizeAt(offset, file.Size())) {
+		std::size_t frame = static_cast<std::size_t>(offset / IPKPacket::FrameSize);
+		std::lock_guard<std::mutex> lock(mutex);
+		if (ready > frame) {
+			return crcs[frame]; // precomputed frame
+		}
+	}
+	IPK_TRACE_SPAN_BYTES("crc32.frame", size);
+	std::vector<unsigned char> header;
+	IPKPacket::SerializeFrameHeader(header, size);
+	CRC32State crc;
+	crc.Update(header.data(), header.size());
+	crc.Update(file.Data() + offset, size);
+	return crc.Finalize();
+}
+
+std::size_t IPKFrameChecksums::FrameSizeAt(uint64_t offset, uint64_t end)
+{
+	uint64_t boundary = (offset / IPKPacket::FrameSize + 1) * IPKPacket::FrameSize;
+	return static_cast<std::size_t>(std::min(boundary, end) - offset);
+}
+
+// ------------- IPKCachedFile --------------
+
+IPKCachedFile::IPKCachedFile(const std::string &filepath)
+	: codec(NoCompression), cached(false), bytes(0), filepath(filepath), file(std::make_shared<const MappedFile>(filepath)),
+	checksums(std::make_shared<IPKFrameChecksums>(file)), offer(SerializeOffer(filepath, *file))
+{
+	bytes = file->Size() + offer.size();
+}
+
+// OfferFile of whole file carrying its version (modification time)
+std::vector<unsigned char> IPKCachedFile::SerializeOffer(const std::string &filepath, const MappedFile &file)
+{
+	std::vector<unsigned char> offer;
+	int64_t version = file.ModificationTime();
+	IPKPacket::Serialize(offer, OfferFile, filepath, file.Size(), 0, 0, reinterpret_cast<const unsigned char*>(&version), sizeof(version));
+	return offer;
+}
+
+std::shared_ptr<const std::vector<unsigned char>> IPKCachedFile::Compressed(uint64_t offset, std::size_t size, FrameCompressor &compressor)
+{
+	std::size_t frame = static_cast<std::size_t>(offset / IPKPacket::FrameSize);
+	bool aligned = (offset % IPKPacket::FrameSize == 0 && size == IPKFrameChecksums::FrameSizeAt(offset, file->Size()));
+	bool cacheable = false;
+	if (aligned && cached) { // CompressedFrames of file that is not cached are not kept
+		std::lock_guard<std::mutex> lock(mutex);
+		if (packets.empty()) {
+			codec = compressor.Codec(); // frames are cached for codec of first transfer
+			packets.resize(IPKFrameChecksums::Frames(file->Size()));
+			tried.resize(packets.size(), false);
+		}
+		cacheable = (codec == compressor.Codec());
+		if (cacheable && tried[frame]) {
+			return packets[frame];
+		}
+	}
+
+	std::shared_ptr<const std::vector<unsigned char>> packet;
+	IPK_TRACE_SPAN_BYTES("frame.compress", size);
+	auto compressed = compressor.Compress(file->Data() + offset, size, checksums->Get(*file, offset, size));
+	if (compressed) {
+		auto serialized = std::make_shared<std::vector<unsigned char>>();
+		IPKPacket::Serialize(*serialized, CompressedFrame, {}, 0, 0, 0, compressed->data(), compressed->size());
+		packet = serialized;
+	}
+	else if (!compressor.Tried()) {
+		return packet; // frame was skipped, it may compress next time
+	}
+	if (cacheable) {
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			if (tried[frame]) {
+				return packets[frame]; // compressed by another transfer meanwhile
+			}
+			packets[frame] = packet;
+			tried[frame] = true;
+		}
+		if (packet) {
+			IPKFileCache::Account(*this, packet->size());
+		}
+	}
+	return packet;
+}
+
+// -------------- IPKFileCache --------------
+
+namespace {
+	struct FileCacheState {
+		std::mutex mutex;
+		uint64_t capacity = 256 * 1024 * 1024;
+		uint64_t bytes = 0;
+		std::list<std::shared_ptr<IPKCachedFile>> order; // most recently used first
+		std::map<std::string, std::list<std::shared_ptr<IPKCachedFile>>::iterator> entries;
+		std::atomic<uint64_t> hits{ 0 };
+		std::atomic<uint64_t> misses{ 0 };
+		std::atomic<uint64_t> coalesced{ 0 };
+		struct Flight {
+			std::weak_ptr<IPKCachedFile> entry; // file being sent
+			bool opening = false; // file being opened by other thread
+		};
+		std::map<std::string, Flight> flights; // files being opened or sent
+	};
+
+	FileCacheState &file_cache()
+	{
+		static FileCacheState state;
+		return state;
+	}
+}
+
+// evict least recently used files (cache mutex is locked)
+void IPKFileCache::Evict()
+{
+	auto &cache = file_cache();
+	while (cache.bytes > cache.capacity && !cache.order.empty()) {
+		auto &entry = cache.order.back();
+		cache.bytes -= entry->bytes;
+		entry->cached = false;
+		cache.entries.erase(entry->filepath);
+		cache.order.pop_back();
+	}
+}
+
+void IPKFileCache::Account(IPKCachedFile &entry, uint64_t bytes)
+{
+	auto &cache = file_cache();
+	std::lock_guard<std::mutex> lock(cache.mutex);
+	if (entry.cached) {
+		entry.bytes += bytes;
+		cache.bytes += bytes;
+		Evict();
+	}
+}
+
+void IPKFileCache::SetCapacity(uint64_t bytes)
+{
+	auto &cache = file_cache();
+	std::lock_guard<std::mutex> lock(cache.mutex);
+	cache.capacity = bytes;
+	Evict();
+}
+
+std::shared_ptr<IPKCachedFile> IPKFileCache::Get(const std::string &filepath)
+{
+	auto &cache = file_cache();
+	uint64_t size = 0;
+	int64_t mtime = 0;
+	bool exists = MappedFile::Stat(filepath, size, mtime);
+	auto current = [&](const IPKCachedFile &entry) {
+		return exists && entry.file->Size() == size && entry.file->ModificationTime() == mtime;
+	};
+
+	bool cacheable;
+	{
+		std::lock_guard<std::mutex> lock(cache.mutex);
+		cacheable = exists && size < cache.capacity;
+		auto it = cache.entries.find(filepath);
+		if (it != cache.entries.end()) {
+			auto &entry = *(it->second);
+			if (cacheable && current(*entry)) {
+				cache.order.splice(cache.order.begin(), cache.order, it->second); // most recently used
+				cache.hits++;
+				return entry;
+			}
+			// file has changed
+			cache.bytes -= entry->bytes;
+			entry->cached = false;
+			cache.order.erase(it->second);
+			cache.entries.erase(it);
+		}
+		// file is being opened or sent for other clients already (single flight, also when it is not cached)
+		auto &flight = cache.flights[filepath];
+		auto entry = flight.entry.lock();
+		if (entry && current(*entry)) {
+			cache.coalesced++;
+			return entry;
+		}
+		if (flight.opening) {
+			return nullptr; // caller asks again, event loop never waits for open of other thread
+		}
+		flight.opening = true;
+		cache.misses++;
+	}
+
+	std::shared_ptr<IPKCachedFile> entry;
+	try {
+		entry = std::make_shared<IPKCachedFile>(filepath); // opened outside of lock
+	}
+	catch (...) {
+		std::lock_guard<std::mutex> lock(cache.mutex);
+		auto flight = cache.flights.find(filepath);
+		if (flight->second.entry.expired()) {
+			cache.flights.erase(flight); // file is not accessible (requests asking again fail by their own open)
+		}
+		else {
+			flight->second.opening = false;
+		}
+		throw;
+	}
+
+	std::lock_guard<std::mutex> lock(cache.mutex);
+	auto &flight = cache.flights[filepath];
+	flight.entry = entry;
+	flight.opening = false;
+	if (cache.flights.size() > cache.order.size() + 64) {
+		// forget files that are not opened or sent anymore
+		for (auto it = cache.flights.begin(); it != cache.flights.end();) {
+			it = (it->second.entry.expired() && !it->second.opening) ? cache.flights.erase(it) : std::next(it);
+		}
+	}
+	if (cacheable && cache.entries.find(filepath) == cache.entries.end()) {
+		entry->cached = true;
+		cache.order.push_front(entry);
+		cache.entries[filepath] = cache.order.begin();
+		cache.bytes += entry->bytes;
+		Evict();
+	}
+	return entry;
+}
+
+uint64_t IPKFileCache::Hits()
+{
+	return file_cache().hits;
+}
+
+uint64_t IPKFileCache::Misses()
+{
+	return file_cache().misses;
+}
+
+uint64_t IPKFileCache::Coalesced()
+{
+	return file_cache().coalesced;
+}
+
+uint64_t IPKFileCache::Bytes()
+{
+	auto &cache = file_cache();
+	std::lock_guard<std::mutex> lock(cache.mutex);
+	return cache.bytes;
+}
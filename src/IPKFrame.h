@@ -0,0 +1,250 @@
+/*
+*	IPK Project 1: client-server for simple file transfer
+*	Author: Tomáš Pazdiora (xpazdi02)
+*	File: IPKFrame.h
+*/
+
+#ifndef IPKFRAME_H
+#define IPKFRAME_H
+
+#include <string>
+#include <vector>
+#include <fstream>
+#include <memory>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <stdint.h>
+#include "MappedFile.h"
+#include "TCP.h"
+#include "Compression.h"
+#include "SHA256.h"
+
+class CRC32State;
+class IPKFrameChecksums;
+class IPKPacketView;
+
+// Sender side of DataFrame stream, frames reference memory mapped file (no copy of file data)
+class IPKFrameReader {
+	std::shared_ptr<const MappedFile> file;
+	std::unique_ptr<IPKFrameChecksums> checksums; // computed by background thread ahead of sender
+	uint64_t position;
+	std::vector<unsigned char> storage; // headers and trailers of frames returned by last Next
+	std::vector<std::vector<unsigned char>> packets; // CompressedFrames returned by last Next
+	FrameCompressor compressor;
+public:
+	// open and map file for reading (throws std::ifstream::failure)
+	IPKFrameReader(std::string filepath);
+	~IPKFrameReader();
+
+	uint64_t Size() const;
+	uint64_t Position() const;
+	bool Done() const;
+	int64_t Version() const; // modification time of file (see IPKPacketView::Version)
+
+	// start again from the beginning of file or from offset
+	void Rewind(uint64_t offset = 0);
+
+	// send frames as CompressedFrames by negotiated codec (when they compress)
+	void SetCodec(CompressionCodec codec);
+
+	// next DataFrames (at most frames) as list of buffers: header, data in mapped file and CRC32 trailer
+	// (or complete CompressedFrame), frames end on IPKPacket::FrameSize boundaries of file,
+	// buffers are valid until next call (throws std::ifstream::failure when file was truncated meanwhile)
+	void Next(std::vector<TCPBuffer> &buffers, std::size_t frames = 1);
+};
+
+// Receiver side of DataFrame stream, writes frames into temporary ".part" file,
+// unfinished transfer keeps verified part of file with ".part.info" marker, so it can be resumed
+class IPKFrameWriter {
+	const std::string filepath;
+	const std::string partpath;
+	const std::string infopath;
+	std::fstream file;
+	int descriptor; // same file for zero-copy receive (Linux), -1 if not available
+	std::vector<unsigned char> readback; // frame data read back from page cache, or decompressed
+	std::vector<unsigned char> frame_header;
+	CompressionCodec codec; // of CompressedFrames
+	SHA256State sha; // SHA-256 of written file (see EnableDigest)
+	unsigned char digest[sha256_size];
+	unsigned char expected[sha256_size]; // SHA-256 announced by sender (see ExpectDigest)
+	bool hashing;
+	bool expecting;
+	uint64_t filesize;
+	uint64_t end; // end of received range
+	uint64_t position;
+	uint64_t verified; // end of verified data (written frames with correct CRC32)
+	uint64_t saved; // verified offset stored in marker
+	int64_t version; // of source file, stored in marker (0 = unknown)
+	bool shared; // range of ".part" file written by multiple writers (see Allocate and Commit)
+	bool opened; // ".part" file is owned by this writer
+	bool accessible;
+	bool corrupted;
+	bool finished;
+
+	void CloseDescriptor();
+	void FrameVerified();
+	void SaveMarker();
+	const unsigned char *Decompress(const IPKPacketView &frame, std::size_t size);
+public:
+	// receive file from offset (offset > 0 continues partial file, see Partial and SetVersion)
+	IPKFrameWriter(std::string filepath, uint64_t filesize, uint64_t offset = 0);
+
+	// receive range of file directly at its offset into ".part" file shared with other writers
+	// (created by Allocate, replaced target file by Commit once all ranges are finished)
+	IPKFrameWriter(std::string filepath, uint64_t filesize, uint64_t offset, uint64_t length);
+
+	~IPKFrameWriter(); // unfinished ".part" file is removed, or kept with marker when part of it was verified
+
+	// verified part of unfinished transfer of file and version of its source (false if there is none)
+	static bool Partial(std::string filepath, uint64_t &filesize, uint64_t &offset, int64_t &version);
+
+	// verified ranges [start, end) of unfinished parallel download of file (sorted and disjoint, verified part
+	// continued by Partial comes first), false if there are none
+	static bool PartialRanges(std::string filepath, uint64_t &filesize, int64_t &version, std::vector<std::pair<uint64_t, uint64_t>> &ranges);
+
+	// store verified ranges of ".part" file written by range writers, so parallel download can be resumed
+	// (".part" file is removed when nothing was verified)
+	static void SaveRanges(std::string filepath, uint64_t filesize, int64_t version, std::vector<std::pair<uint64_t, uint64_t>> ranges);
+
+	// create preallocated ".part" file for range writers (throws std::ofstream::failure)
+	static void Allocate(std::string filepath, uint64_t filesize);
+
+	// replace target file with ".part" file (throws std::ofstream::failure)
+	static void Commit(std::string filepath);
+
+	// remove ".part" file and its marker
+	static void Discard(std::string filepath);
+
+	// remove ".part" files and markers in working directory not modified for age seconds (abandoned transfers)
+	static void Expire(uint64_t age);
+
+	// file of unfinished transfer (".part" file or its marker), never served or saved by request
+	static bool Transient(const std::string &filename);
+
+	const std::string &Path() const;
+	uint64_t Size() const;
+	uint64_t Position() const;
+	uint64_t Verified() const; // end of verified data
+	bool Done() const;
+
+	// compute SHA-256 of file while it is written (only when whole file is written by this writer)
+	void EnableDigest();
+
+	// SHA-256 of finished file (sha256_size bytes), nullptr if it was not computed
+	const unsigned char *Digest();
+
+	// file is saved by Finish only when its SHA-256 equals digest, its ".part" file is never kept for resume
+	// (data rebuilt by receiver are not verified by frames, see IPKDeltaDecoder)
+	void ExpectDigest(const unsigned char *digest);
+
+	// accept CompressedFrames of negotiated codec
+	void SetCodec(CompressionCodec codec);
+
+	// version of source file stored in marker, continued partial file of other version is rejected
+	// (frames are only drained, so transfer starts again from beginning)
+	void SetVersion(int64_t version);
+
+	// get remaining size of DataFrame from its first IPKPacket::StatusSize bytes (throws IPKPacketException)
+	std::size_t Remaining(const std::vector<unsigned char> &packet) const;
+
+	// verify and store complete DataFrame or CompressedFrame (after CRC32Error rest of stream is only drained),
+	// crc is computed over complete DataFrame while receiving
+	void Write(const std::vector<unsigned char> &packet, const CRC32State &crc);
+
+	// store verified data rebuilt from DeltaFrame at Position() (nullptr = data are not available,
+	// file is rejected and rest of stream is only drained), throws IPKPacketException beyond end of file
+	void Append(const unsigned char *data, uint64_t size);
+
+	// descriptor DataFrame data can be received into at Position() (see TCP::RecvFile),
+	// -1 if frames have to be received by Write (not available, inaccessible or corrupted file)
+	int Descriptor() const;
+
+	// DataFrame data were received directly into Descriptor(), crc (updated by header)
+	// is updated from page cache
+	void Received(std::size_t bytes, CRC32State &crc);
+
+	// verify complete DataFrame received by Received (crc updated by trailer)
+	void Verify(const CRC32State &crc);
+
+	// replace target file with received one, or only check received range of shared file
+	// (throws std::ofstream::failure or IPKPacketException)
+	void Finish();
+};
+
+// CRC32 of every DataFrame of mapped file, computed by background thread ahead of sender
+// (frame it has not reached yet is computed by sender, so event loop never waits for it)
+class IPKFrameChecksums {
+	std::shared_ptr<const MappedFile> file; // released when all checksums are computed
+	std::vector<uint32_t> crcs;
+	std::size_t ready;
+	std::atomic<bool> cancel;
+	std::mutex mutex;
+	std::thread thread;
+
+	void Compute();
+public:
+	IPKFrameChecksums(std::shared_ptr<const MappedFile> file);
+	IPKFrameChecksums(const IPKFrameChecksums &other) = delete;
+	~IPKFrameChecksums();
+
+	// number of DataFrames of file
+	static std::size_t Frames(uint64_t filesize);
+
+	// CRC32 of DataFrame (header and data) carrying size bytes of file from offset (frame that is not
+	// precomputed yet, or is not one of precomputed ones, is computed from mapped file right away)
+	uint32_t Get(const MappedFile &file, uint64_t offset, std::size_t size);
+
+	// size of DataFrame from offset up to end (frames end on IPKPacket::FrameSize boundaries)
+	static std::size_t FrameSizeAt(uint64_t offset, uint64_t end);
+};
+
+// File served by server, shared by all transfers of the same file version (see IPKFileCache)
+class IPKCachedFile {
+	friend class IPKFileCache;
+	std::mutex mutex;
+	CompressionCodec codec; // of cached CompressedFrames
+	std::vector<std::shared_ptr<const std::vector<unsigned char>>> packets; // serialized CompressedFrames
+	std::vector<bool> tried; // frame was compressed already (packet is nullptr if it did not compress)
+	std::atomic<bool> cached; // entry of IPKFileCache (changed only by cache)
+	uint64_t bytes; // size of file and cached packets (guarded by cache)
+	const std::string filepath;
+
+	static std::vector<unsigned char> SerializeOffer(const std::string &filepath, const MappedFile &file);
+public:
+	const std::shared_ptr<const MappedFile> file;
+	const std::shared_ptr<IPKFrameChecksums> checksums; // computed in parallel with sending
+	const std::vector<unsigned char> offer; // serialized OfferFile of whole file
+
+	// open and map file (throws std::ifstream::failure)
+	IPKCachedFile(const std::string &filepath);
+
+	// serialized CompressedFrame of size bytes of file from offset (nullptr = frame is sent uncompressed),
+	// aligned frames of cached file are compressed only once
+	std::shared_ptr<const std::vector<unsigned char>> Compressed(uint64_t offset, std::size_t size, FrameCompressor &compressor);
+};
+
+// Size bounded LRU cache of files served by server, keyed by path, modification time and size
+// (repeated downloads reuse mapping, checksums, OfferFile and CompressedFrames), concurrent
+// requests of the same file are opened once and share one instance also when it is not cached
+// (single flight, requests arriving during open ask again, CompressedFrames are kept only while file is cached)
+class IPKFileCache {
+	friend class IPKCachedFile;
+	static void Evict();
+	static void Account(IPKCachedFile &entry, uint64_t bytes);
+public:
+	// maximal size of cached files and their CompressedFrames (0 = cache is disabled)
+	static void SetCapacity(uint64_t bytes);
+
+	// cached file, file being sent to other clients, or newly opened one (throws std::ifstream::failure),
+	// nullptr while other thread is opening the same file (caller asks again later instead of waiting for it)
+	static std::shared_ptr<IPKCachedFile> Get(const std::string &filepath);
+
+	// statistics
+	static uint64_t Hits();
+	static uint64_t Misses();
+	static uint64_t Coalesced(); // requests that joined file being sent
+	static uint64_t Bytes();
+};
+
+#endif
@@ -0,0 +1,265 @@
+/*
+*	IPK Project 1: client-server for simple file transfer
+*	Author: Tomáš Pazdiora (xpazdi02)
+*	File: IPKMetrics.cpp
+*/
+
+#include "IPKMetrics.h"
+#include "IPKPacket.h"
+#include "IPKFrame.h"
+#include "IPKContentIndex.h"
+
+#include <atomic>
+#include <mutex>
+#include <memory>
+#include <sstream>
+#include <cmath>
+#include <algorithm>
+#include <iterator>
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+
+static const char *type_names[] = {
+	"RequestFile", "OfferFile", "CommandPing", "StatusOk", "StatusError", "StatusInaccessible", "DataFrame", "StatusBusy",
+	"RequestRange", "OfferRange", "QueryFile", "PartialFile", "CompressedFrame", "RequestSignature", "BlockSignatures",
+	"OfferDelta", "DeltaFrame", "OfferDigest", "CommandStats"
+};
+static_assert(sizeof(type_names) / sizeof(type_names[0]) == IPKUnknown, "name of every IPKTransmissionType");
+static_assert(IPKUnknown <= IPKMetrics::max_types, "request counter of every IPKTransmissionType");
+
+// ------------- IPKHistogram ---------------
+
+IPKHistogram::IPKHistogram()
+	: buckets(bucket_count, 0), count(0), sum(0), max(0)
+{
+}
+
+std::size_t IPKHistogram::Bucket(uint64_t value)
+{
+	if (value < (1ULL << sub_bits)) {
+		return static_cast<std::size_t>(value);
+	}
+#if defined(_MSC_VER)
+	unsigned long msb;
+	_BitScanReverse64(&msb, value);
+#else
+	unsigned int msb = 63 - __builtin_clzll(value);
+#endif
+	uint64_t sub = (value >> (msb - sub_bits)) & ((1ULL << sub_bits) - 1);
+	return static_cast<std::size_t>(((msb - sub_bits + 1) << sub_bits) + sub);
+}
+
+uint64_t IPKHistogram::Upper(std::size_t bucket)
+{
+	if (bucket < (1ULL << sub_bits)) {
+		return bucket;
+	}
+	unsigned int msb = static_cast<unsigned int>(bucket >> sub_bits) + sub_bits - 1;
+	uint64_t sub = bucket & ((1ULL << sub_bits) - 1);
+	uint64_t upper = ((1ULL << sub_bits) + sub + 1) << (msb - sub_bits);
+	return upper ? upper - 1 : UINT64_MAX; // last bucket
+}
+
+void IPKHistogram::Add(uint64_t value)
+{
+	buckets[Bucket(value)]++;
+	count++;
+	sum += value;
+	max = std::max(max, value);
+}
+
+void IPKHistogram::Merge(const IPKHistogram &other)
+{
+	for (std::size_t i = 0; i < bucket_count; i++) {
+		buckets[i] += other.buckets[i];
+	}
+	count += other.count;
+	sum += other.sum;
+	max = std::max(max, other.max);
+}
+
+uint64_t IPKHistogram::Percentile(double p) const
+{
+	uint64_t rank = static_cast<uint64_t>(std::ceil(p * count)), seen = 0;
+	for (std::size_t i = 0; i < bucket_count; i++) {
+		seen += buckets[i];
+		if (seen >= rank && seen > 0) {
+			return std::min(Upper(i), max); // upper bound of bucket
+		}
+	}
+	return max;
+}
+
+void IPKHistogram::Print(std::ostream &out) const
+{
+	out << "{ \"count\": " << count << ", \"mean\": " << (count ? sum / count : 0) << ", \"p50\": " << Percentile(0.5)
+		<< ", \"p90\": " << Percentile(0.9) << ", \"p99\": " << Percentile(0.99) << ", \"p999\": " << Percentile(0.999)
+		<< ", \"max\": " << max << ", \"buckets\": [";
+	bool first = true;
+	for (std::size_t i = 0; i < bucket_count; i++) {
+		if (buckets[i]) {
+			out << (first ? " " : ", ") << "[" << Upper(i) << ", " << buckets[i] << "]";
+			first = false;
+		}
+	}
+	out << " ] }";
+}
+
+// -------------- IPKMetrics ----------------
+
+namespace {
+	const std::chrono::steady_clock::time_point process_start = std::chrono::steady_clock::now();
+
+	// counters of one thread, relaxed atomics only make concurrent reading by Snapshot well defined
+	struct ThreadMetrics {
+		std::atomic<uint64_t> counters[IPKCounterCount];
+		std::atomic<uint64_t> requests[IPKMetrics::max_types];
+		std::atomic<uint64_t> buckets[IPKLatencyCount][IPKHistogram::bucket_count];
+		std::atomic<uint64_t> sum[IPKLatencyCount];
+		std::atomic<uint64_t> max[IPKLatencyCount];
+
+		ThreadMetrics()
+		{
+			for (auto &counter : counters) counter.store(0, std::memory_order_relaxed);
+			for (auto &counter : requests) counter.store(0, std::memory_order_relaxed);
+			for (auto &latency : buckets) {
+				for (auto &counter : latency) counter.store(0, std::memory_order_relaxed);
+			}
+			for (auto &counter : sum) counter.store(0, std::memory_order_relaxed);
+			for (auto &counter : max) counter.store(0, std::memory_order_relaxed);
+		}
+	};
+
+	// single writer, so increment does not need atomic read-modify-write
+	inline void increment(std::atomic<uint64_t> &counter, uint64_t value)
+	{
+		counter.store(counter.load(std::memory_order_relaxed) + value, std::memory_order_relaxed);
+	}
+
+	struct MetricsRegistry {
+		std::mutex mutex;
+		std::vector<std::unique_ptr<ThreadMetrics>> blocks; // never released
+		std::vector<ThreadMetrics*> unused; // blocks of finished threads
+	};
+
+	MetricsRegistry &registry()
+	{
+		static MetricsRegistry *state = new MetricsRegistry(); // outlives threads finishing during exit
+		return *state;
+	}
+
+	// block of current thread, returned to registry when thread finishes
+	struct ThreadBlock {
+		ThreadMetrics *block;
+		ThreadBlock()
+		{
+			MetricsRegistry &metrics = registry();
+			std::lock_guard<std::mutex> lock(metrics.mutex);
+			if (!metrics.unused.empty()) {
+				block = metrics.unused.back();
+				metrics.unused.pop_back();
+			}
+			else {
+				metrics.blocks.emplace_back(new ThreadMetrics());
+				block = metrics.blocks.back().get();
+			}
+		}
+		~ThreadBlock()
+		{
+			MetricsRegistry &metrics = registry();
+			std::lock_guard<std::mutex> lock(metrics.mutex);
+			metrics.unused.push_back(block);
+		}
+	};
+
+	ThreadMetrics &thread_metrics()
+	{
+		static thread_local ThreadBlock current;
+		return *current.block;
+	}
+}
+
+void IPKMetrics::Add(IPKCounter counter, uint64_t value)
+{
+	increment(thread_metrics().counters[counter], value);
+}
+
+void IPKMetrics::Request(unsigned int type)
+{
+	if (type < max_types) {
+		increment(thread_metrics().requests[type], 1);
+	}
+}
+
+void IPKMetrics::Record(IPKLatency latency, std::chrono::steady_clock::duration duration)
+{
+	ThreadMetrics &metrics = thread_metrics();
+	uint64_t us = static_cast<uint64_t>(std::max<long long>(std::chrono::duration_cast<std::chrono::microseconds>(duration).count(), 0));
+	increment(metrics.buckets[latency][IPKHistogram::Bucket(us)], 1);
+	increment(metrics.sum[latency], us);
+	if (us > metrics.max[latency].load(std::memory_order_relaxed)) {
+		metrics.max[latency].store(us, std::memory_order_relaxed);
+	}
+}
+
+IPKMetricsSnapshot IPKMetrics::Snapshot()
+{
+	IPKMetricsSnapshot snapshot;
+	std::fill(std::begin(snapshot.counters), std::end(snapshot.counters), 0);
+	std::fill(std::begin(snapshot.requests), std::end(snapshot.requests), 0);
+
+	MetricsRegistry &metrics = registry();
+	std::lock_guard<std::mutex> lock(metrics.mutex);
+	for (const auto &block : metrics.blocks) {
+		for (std::size_t i = 0; i < IPKCounterCount; i++) {
+			snapshot.counters[i] += block->counters[i].load(std::memory_order_relaxed);
+		}
+		for (std::size_t i = 0; i < max_types; i++) {
+			snapshot.requests[i] += block->requests[i].load(std::memory_order_relaxed);
+		}
+		for (std::size_t l = 0; l < IPKLatencyCount; l++) {
+			IPKHistogram &histogram = snapshot.latency[l];
+			for (std::size_t i = 0; i < IPKHistogram::bucket_count; i++) {
+				uint64_t count = block->buckets[l][i].load(std::memory_order_relaxed);
+				histogram.buckets[i] += count;
+				histogram.count += count;
+			}
+			histogram.sum += block->sum[l].load(std::memory_order_relaxed);
+			histogram.max = std::max(histogram.max, block->max[l].load(std::memory_order_relaxed));
+		}
+	}
+	return snapshot;
+}
+
+std::string IPKMetrics::Report()
+{
+	IPKMetricsSnapshot snapshot = Snapshot();
+	const uint64_t *counters = snapshot.counters;
+	double uptime = std::chrono::duration<double>(std::chrono::steady_clock::now() - process_start).count();
+
+	std::ostringstream out;
+	out << "{ \"uptime_s\": " << uptime << ", \"bytes_in\": " << counters[BytesIn] << ", \"bytes_out\": " << counters[BytesOut]
+		<< ", \"connections_active\": " << counters[ConnectionsOpened] - std::min(counters[ConnectionsClosed], counters[ConnectionsOpened])
+		<< ", \"connections_total\": " << counters[ConnectionsOpened] << ", \"crc_failures\": " << counters[CRCFailures]
+		<< ", \"timeouts\": " << counters[Timeouts] << ", \"retries\": " << counters[Retries] << "," << std::endl;
+	out << "  \"requests\": {";
+	bool first = true;
+	for (std::size_t i = 0; i < IPKUnknown; i++) {
+		if (snapshot.requests[i]) {
+			out << (first ? " " : ", ") << "\"" << type_names[i] << "\": " << snapshot.requests[i];
+			first = false;
+		}
+	}
+	out << " }," << std::endl;
+	out << "  \"cache\": { \"hits\": " << IPKFileCache::Hits() << ", \"misses\": " << IPKFileCache::Misses()
+		<< ", \"coalesced\": " << IPKFileCache::Coalesced() << ", \"bytes\": " << IPKFileCache::Bytes()
+		<< " }, \"deduplicated\": " << IPKContentIndex::Deduplicated() << "," << std::endl;
+	out << "  \"latency_us\": {" << std::endl << "    \"request\": ";
+	snapshot.latency[RequestLatency].Print(out);
+	out << "," << std::endl << "    \"disk\": ";
+	snapshot.latency[DiskLatency].Print(out);
+	out << std::endl << "  }" << std::endl << "}" << std::endl;
+	return out.str();
+}
@@ -0,0 +1,95 @@
+/*
+*	IPK Project 1: client-server for simple file transfer
+*	Author: Tomáš Pazdiora (xpazdi02)
+*	File: IPKMetrics.h
+*/
+
+#ifndef IPKMETRICS_H
+#define IPKMETRICS_H
+
+#include <string>
+#include <vector>
+#include <chrono>
+#include <ostream>
+#include <cstddef>
+#include <stdint.h>
+
+// counters of process (bytes are counted by TCP for every connection, rest by server sessions)
+enum IPKCounter {
+	BytesIn, // received from sockets (including data spliced into files)
+	BytesOut, // sent to sockets (including sendfile)
+	ConnectionsOpened, // server connections
+	ConnectionsClosed,
+	CRCFailures, // requests and uploads rejected by CRC32
+	Timeouts, // connections waiting for data longer than timeout
+	Retries, // requests answered by StatusError (client retries them)
+	IPKCounterCount
+};
+
+// latency histograms (microseconds)
+enum IPKLatency {
+	RequestLatency, // request received until its response (including file data) was sent
+	DiskLatency, // open, write and commit of files by server
+	IPKLatencyCount
+};
+
+// Log-linear histogram, 8 sub-buckets per power of two (relative error below 12.5 %)
+class IPKHistogram {
+public:
+	static const unsigned int sub_bits = 3;
+	static const std::size_t bucket_count = (64 - sub_bits + 1) << sub_bits;
+
+	std::vector<uint64_t> buckets;
+	uint64_t count;
+	uint64_t sum;
+	uint64_t max;
+
+	IPKHistogram();
+
+	static std::size_t Bucket(uint64_t value);
+	static uint64_t Upper(std::size_t bucket); // largest value of bucket
+
+	void Add(uint64_t value);
+	void Merge(const IPKHistogram &other);
+	uint64_t Percentile(double p) const;
+
+	// JSON object with percentiles and non-empty buckets ([upper, count])
+	void Print(std::ostream &out) const;
+};
+
+struct IPKMetricsSnapshot;
+
+// Process-wide metrics. Every thread updates its own block of counters (single writer, no locks
+// and no atomic read-modify-write), blocks are summed on demand. Block of finished thread is
+// reused by next thread, so counters are never lost.
+class IPKMetrics {
+public:
+	static const std::size_t max_types = 32;
+
+	static void Add(IPKCounter counter, uint64_t value = 1);
+	static void Request(unsigned int type);
+	static void Record(IPKLatency latency, std::chrono::steady_clock::duration duration);
+
+	static IPKMetricsSnapshot Snapshot();
+
+	// JSON report of metrics, hot-file cache and deduplication counters (see CommandStats)
+	static std::string Report();
+};
+
+// metrics summed over all threads
+struct IPKMetricsSnapshot {
+	uint64_t counters[IPKCounterCount];
+	uint64_t requests[IPKMetrics::max_types]; // by IPKTransmissionType
+	IPKHistogram latency[IPKLatencyCount];
+};
+
+// records lifetime of scope into latency histogram
+class IPKLatencyTimer {
+	const IPKLatency latency;
+	const std::chrono::steady_clock::time_point start;
+public:
+	IPKLatencyTimer(IPKLatency latency) : latency(latency), start(std::chrono::steady_clock::now()) {}
+	~IPKLatencyTimer() { IPKMetrics::Record(latency, std::chrono::steady_clock::now() - start); }
+};
+
+#endif
@@ -6,120 +6,239 @@
 
 #include "IPKPacket.h"
 #include "CRC32.h"
+#include "IPKTrace.h"
 #include <algorithm>
 #include <stdexcept>
 
 const std::string IPKPacket::signature{ "IPKFTP" };
-const uint8_t IPKPacket::version{ 1 };
+const uint8_t IPKPacket::version{ 2 };
 
 const std::size_t IPKPacket::StatusSize = 20; // size of serialized status packet
+const std::size_t IPKPacket::HeaderSize = 0x10; // size of serialized header
+const std::size_t IPKPacket::FrameSize = 64 * 1024; // maximal data size of DataFrame
 
-// Create Packet
-IPKPacket::IPKPacket(IPKTransmissionType type, std::string filename, std::vector<unsigned char> data)
-	: type(type), filename(filename), data(data)
+// fields carried by transmission type
+static bool has_filename(IPKTransmissionType type)
+{
+	return type == RequestFile || type == OfferFile || type == RequestRange || type == OfferRange || type == QueryFile || type == PartialFile ||
+		type == RequestSignature || type == BlockSignatures || type == OfferDelta || type == OfferDigest;
+}
+static bool has_filesize(IPKTransmissionType type)
+{
+	return type == OfferFile || type == RequestRange || type == OfferRange || type == QueryFile || type == PartialFile ||
+		type == BlockSignatures || type == OfferDelta || type == OfferDigest;
+}
+static bool has_offset(IPKTransmissionType type)
+{
+	return type == RequestRange || type == OfferRange || type == PartialFile || type == OfferDelta;
+}
+static bool has_length(IPKTransmissionType type)
+{
+	return type == RequestRange || type == OfferRange || type == OfferDelta;
+}
+static bool has_data(IPKTransmissionType type)
 {
-	if (type == RequestFile && (filename.size() == 0)) {
-		throw IPKPacketException(PacketCreationError, "IPKTransmissionType::RequestFile requires filename");
+	return type == DataFrame || type == CompressedFrame || type == CommandPing || type == StatusOk || type == BlockSignatures || type == DeltaFrame ||
+		type == OfferDigest || type == OfferDelta || type == CommandStats || type == OfferFile || type == OfferRange || type == RequestRange || type == QueryFile;
+}
+
+// check requirements of transmission type
+static void check_creation(IPKTransmissionType type, std::size_t filename_size, std::size_t data_size)
+{
+	if (has_filename(type) && (filename_size == 0)) {
+		throw IPKPacketException(PacketCreationError, "IPKTransmissionType requires filename");
 	}
-	else if (type == OfferFile && (filename.size() == 0)) {
-		throw IPKPacketException(PacketCreationError, "IPKTransmissionType::OfferFile requires filename");
+	else if ((type == DataFrame || type == CompressedFrame || type == DeltaFrame) && (data_size == 0 || data_size > IPKPacket::FrameSize)) {
+		throw IPKPacketException(PacketCreationError, "IPKTransmissionType::DataFrame requires 1 to FrameSize bytes of data");
+	}
+	else if (!has_data(type) && data_size != 0) {
+		throw IPKPacketException(PacketCreationError, "IPKTransmissionType does not carry data");
 	}
 }
 
-// Deserialize
-IPKPacket::IPKPacket(const std::vector<unsigned char> message)
-	: type(IPKUnknown), filename(), data()
+// Create Packet
+IPKPacket::IPKPacket(IPKTransmissionType type, std::string filename, std::vector<unsigned char> data)
+	: type(type), filename(filename), filesize(0), offset(0), length(0), data(data)
+{
+	check_creation(type, this->filename.size(), this->data.size());
+}
+
+// Create Packet with file size (and range)
+IPKPacket::IPKPacket(IPKTransmissionType type, std::string filename, uint64_t filesize, uint64_t offset, uint64_t length)
+	: IPKPacket(type, filename)
 {
 	// bypass const for initialization within this constructor
-	auto &type_notconst = *(const_cast<IPKTransmissionType*>(&this->type));
-	auto &filename_notconst = *(const_cast<std::string*>(&this->filename));
-	auto &data_notconst = *(const_cast<std::vector<unsigned char>*>(&this->data));
+	const_cast<uint64_t &>(this->filesize) = filesize;
+	const_cast<uint64_t &>(this->offset) = offset;
+	const_cast<uint64_t &>(this->length) = length;
+}
 
-	// check signature
-	if (this->signature != std::string(message.begin(), message.begin() + 0x6)) {
-		throw(IPKPacketException(SignatureError, "IPKPacketError: Wrong Signature!"));
-	}
-	// check version
-	if (this->version != static_cast<uint8_t>(*(message.begin() + 0x6))) {
-		throw(IPKPacketException(VersionError, "IPKPacketError: Wrong Version!"));
-	}
-	// check crc
-	auto crc = *(reinterpret_cast<const uint32_t*>(&(*(message.end() - 0x4))));
-	if (crc != CRC32(message.begin(), message.end() - 0x4)) {
-		throw(IPKPacketException(CRC32Error, "IPKPacketError: CRC32 Error!"));
-	}
-	// check transmission type
-	auto t = static_cast<IPKTransmissionType>(*(message.begin() + 0x7));
-	if (t >= IPKUnknown || t < 0) {
-		throw(IPKPacketException(TransmissionTypeError, "IPKPacketError: Unknown transmission type!"));
-	}
-	type_notconst = t;
-	// check overall message size
-	auto overall_size = *(reinterpret_cast<const uint64_t*>(&(*(message.begin() + 0x8))));
-	if (overall_size != message.size() ) {
-		throw(IPKPacketException(SizeError, "IPKPacketError: Size Error!"));
-	}
-	// load filename
-	auto message_data_it = message.end();
-	if (type == RequestFile || type == OfferFile) {
-		for (auto it = message.begin() + 0x10; it != message.end(); it++) {
-			if (*it == 0) {
-				message_data_it = it + 1;
-				break;
-			}
-			filename_notconst += *it;
-		}
-	}
-	// load data
-	if (type == OfferFile) {
-		std::copy(message_data_it, message.end() - 0x4, std::back_inserter(data_notconst));
+// copy block by block and update CRC32 while the block is still in cache
+static unsigned char *copy_crc(const unsigned char *begin, const unsigned char *end, unsigned char *it, CRC32State &crc)
+{
+	const std::size_t block_size = 4096;
+	while (begin != end) {
+		const unsigned char *block_end = begin + std::min<std::size_t>(block_size, end - begin);
+		unsigned char *block_it = it;
+		it = std::copy(begin, block_end, it);
+		crc.Update(block_it, block_end - begin);
+		begin = block_end;
 	}
+	return it;
+}
+
+// Deserialize
+IPKPacket::IPKPacket(const std::vector<unsigned char> &message)
+	: IPKPacket(message, CRC32State(message.data(), message.size()))
+{
+}
+
+// Deserialize with CRC32State computed over complete message
+IPKPacket::IPKPacket(const std::vector<unsigned char> &message, const CRC32State &crc)
+	: type(IPKUnknown), filename(), filesize(0), offset(0), length(0), data()
+{
+	IPKPacketView view(message, crc);
+
+	// bypass const for initialization within this constructor
+	const_cast<IPKTransmissionType &>(this->type) = view.Type();
+	const_cast<std::string &>(this->filename).assign(view.Filename(), view.FilenameSize());
+	const_cast<uint64_t &>(this->filesize) = view.FileSize();
+	const_cast<uint64_t &>(this->offset) = view.Offset();
+	const_cast<uint64_t &>(this->length) = view.Length();
+	const_cast<std::vector<unsigned char> &>(this->data).assign(view.Data(), view.Data() + view.DataSize());
 }
 
 // Serialize
 IPKPacket::operator const std::vector<unsigned char>() const
 {
 	std::vector<unsigned char> message;
+	Serialize(message, this->type, this->filename, this->filesize, this->offset, this->length, this->data.data(), this->data.size());
+	return message;
+}
+
+// Serialize into caller provided buffer
+void IPKPacket::Serialize(std::vector<unsigned char> &message, IPKTransmissionType type, const std::string &filename, uint64_t filesize,
+	uint64_t offset, uint64_t length, const unsigned char *data, std::size_t data_size)
+{
+	IPK_TRACE_SPAN_BYTES("packet.serialize", data_size);
+	check_creation(type, filename.size(), data_size);
 
 	uint64_t overall_size = 20;
-	if (this->type == RequestFile || this->type == OfferFile) {
-		overall_size += this->filename.size() + 1;
+	if (has_filename(type)) {
+		overall_size += filename.size() + 1;
+	}
+	if (has_filesize(type)) {
+		overall_size += sizeof(filesize);
+	}
+	if (has_offset(type)) {
+		overall_size += sizeof(offset);
 	}
-	if (this->type == OfferFile) {
-		overall_size += this->data.size();
+	if (has_length(type)) {
+		overall_size += sizeof(length);
 	}
-	message.resize(overall_size);
+	if (has_data(type)) {
+		overall_size += data_size;
+	}
+	message.resize(static_cast<std::size_t>(overall_size));
 
-	auto it = std::begin(message);
+	unsigned char *it = message.data();
+	CRC32State crc;
 
-	it = std::copy(std::begin(this->signature), std::end(this->signature), it); // signature
-	*(it++) = static_cast<unsigned char>(this->version); // version
-	*(it++) = static_cast<unsigned char>(this->type); // transmission type
+	unsigned char header[0x10];
+	std::copy(std::begin(signature), std::end(signature), header); // signature
+	header[0x6] = static_cast<unsigned char>(version); // version
+	header[0x7] = static_cast<unsigned char>(type); // transmission type
 	unsigned char *overall_size_ptr = reinterpret_cast<unsigned char*>(&overall_size);
-	it = std::copy(overall_size_ptr, overall_size_ptr + sizeof(overall_size), it); // overall size
-	if (this->type == RequestFile || this->type == OfferFile) {
-		it = std::copy(std::begin(this->filename), std::end(this->filename), it); // filename
-		*(it++) = static_cast<unsigned char>(0); // null terminator
+	std::copy(overall_size_ptr, overall_size_ptr + sizeof(overall_size), header + 0x8); // overall size
+	it = copy_crc(header, header + sizeof(header), it, crc);
+	if (has_filename(type)) {
+		const unsigned char *filename_ptr = reinterpret_cast<const unsigned char*>(filename.c_str());
+		it = copy_crc(filename_ptr, filename_ptr + filename.size() + 1, it, crc); // filename with null terminator
+	}
+	if (has_filesize(type)) {
+		const unsigned char *filesize_ptr = reinterpret_cast<const unsigned char*>(&filesize);
+		it = copy_crc(filesize_ptr, filesize_ptr + sizeof(filesize), it, crc); // file size
+	}
+	if (has_offset(type)) {
+		const unsigned char *offset_ptr = reinterpret_cast<const unsigned char*>(&offset);
+		it = copy_crc(offset_ptr, offset_ptr + sizeof(offset), it, crc); // range offset
+	}
+	if (has_length(type)) {
+		const unsigned char *length_ptr = reinterpret_cast<const unsigned char*>(&length);
+		it = copy_crc(length_ptr, length_ptr + sizeof(length), it, crc); // range length
 	}
-	if (this->type == OfferFile) {
-		it = std::copy(std::begin(this->data), std::end(this->data), it); // file data
+	if (has_data(type)) {
+		it = copy_crc(data, data + data_size, it, crc); // frame data
 	}
 
-	uint32_t crc = CRC32(std::begin(message), std::end(message) - 4);
-	unsigned char *crc_ptr = reinterpret_cast<unsigned char*>(&crc);
-	it = std::copy(crc_ptr, crc_ptr + sizeof(crc), it); // crc
+	uint32_t crc_value = crc.Finalize();
+	unsigned char *crc_ptr = reinterpret_cast<unsigned char*>(&crc_value);
+	std::copy(crc_ptr, crc_ptr + sizeof(crc_value), it); // crc
+}
 
-	return message;
+// Serialize DataFrame header only
+void IPKPacket::SerializeFrameHeader(std::vector<unsigned char> &message, std::size_t data_size)
+{
+	uint64_t overall_size = StatusSize + data_size;
+	message.resize(0x10);
+
+	auto it = std::copy(std::begin(signature), std::end(signature), std::begin(message)); // signature
+	*(it++) = static_cast<unsigned char>(version); // version
+	*(it++) = static_cast<unsigned char>(DataFrame); // transmission type
+	unsigned char *overall_size_ptr = reinterpret_cast<unsigned char*>(&overall_size);
+	std::copy(overall_size_ptr, overall_size_ptr + sizeof(overall_size), it); // overall size
+}
+
+// Serialize packet fields only
+void IPKPacket::SerializeHeader(std::vector<unsigned char> &message, IPKTransmissionType type, const std::string &filename, uint64_t filesize,
+	uint64_t offset, uint64_t length, std::size_t data_size)
+{
+	Serialize(message, type, filename, filesize, offset, length);
+	message.resize(message.size() - sizeof(uint32_t)); // CRC32 trailer follows data
+	uint64_t overall_size = message.size() + data_size + sizeof(uint32_t);
+	unsigned char *overall_size_ptr = reinterpret_cast<unsigned char*>(&overall_size);
+	std::copy(overall_size_ptr, overall_size_ptr + sizeof(overall_size), message.begin() + 0x8); // overall size
+}
+
+// Serialize CRC32 trailer
+void IPKPacket::SerializeTrailer(std::vector<unsigned char> &message, const CRC32State &crc)
+{
+	SerializeTrailer(message, crc.Finalize());
+}
+
+// Serialize CRC32 trailer from CRC32 value
+void IPKPacket::SerializeTrailer(std::vector<unsigned char> &message, uint32_t crc_value)
+{
+	unsigned char *crc_ptr = reinterpret_cast<unsigned char*>(&crc_value);
+	message.assign(crc_ptr, crc_ptr + sizeof(crc_value));
 }
 
 // get filename from packet
-const std::string IPKPacket::GetFilename() const
+const std::string &IPKPacket::GetFilename() const
 {
 	return this->filename;
 }
 
-// get file data from packet
-const std::vector<unsigned char> IPKPacket::GetData() const
+// get file size from packet
+const uint64_t IPKPacket::GetFileSize() const
+{
+	return this->filesize;
+}
+
+// get range offset from packet
+const uint64_t IPKPacket::GetOffset() const
+{
+	return this->offset;
+}
+
+// get range length from packet
+const uint64_t IPKPacket::GetLength() const
+{
+	return this->length;
+}
+
+// get frame data from packet
+const std::vector<unsigned char> &IPKPacket::GetData() const
 {
 	return this->data;
 }
@@ -131,7 +250,7 @@ const IPKTransmissionType IPKPacket::Type() const
 }
 
 // Get type from incomplete serialized packet (min size == 8)
-IPKTransmissionType IPKPacket::Type(const std::vector<unsigned char> message)
+IPKTransmissionType IPKPacket::Type(const std::vector<unsigned char> &message)
 {
 	// check if it's possible to get size
 	if (message.size() < 8) {
@@ -149,7 +268,7 @@ IPKTransmissionType IPKPacket::Type(const std::vector<unsigned char> message)
 }
 
 // Get expected size from incomplete serialized packet (min size == 16)
-std::size_t IPKPacket::ExpectedSize(const std::vector<unsigned char> message)
+std::size_t IPKPacket::ExpectedSize(const std::vector<unsigned char> &message)
 {
 	// check if it's possible to get size
 	if (message.size() < 16) {
@@ -164,6 +283,9 @@ std::size_t IPKPacket::ExpectedSize(const std::vector<unsigned char> message)
 		throw(IPKPacketException(VersionError, "IPKPacketError: Wrong Version!"));
 	}
 	const uint64_t overall_size = *(reinterpret_cast<const uint64_t*>(&(*(message.begin() + 0x8))));
+	if (overall_size < StatusSize) {
+		throw(IPKPacketException(SizeError, "IPKPacketError: ExpectedSize: Size Error!"));
+	}
 	return overall_size;
 }
 
@@ -179,6 +301,138 @@ bool IPKPacket::operator!=(const IPKTransmissionType t) const
 	return this->type != t;
 }
 
+// ------------- IPKPacketView --------------
+
+// Deserialize in place
+IPKPacketView::IPKPacketView(const unsigned char *message, std::size_t size, const CRC32State &crc)
+	: type(IPKUnknown), filename(""), filename_size(0), filesize(0), offset(0), length(0), data(nullptr), data_size(0)
+{
+	// check minimal size
+	if (size < IPKPacket::StatusSize) {
+		throw(IPKPacketException(SizeError, "IPKPacketError: Size Error!"));
+	}
+	// check signature
+	if (!std::equal(IPKPacket::signature.begin(), IPKPacket::signature.end(), message)) {
+		throw(IPKPacketException(SignatureError, "IPKPacketError: Wrong Signature!"));
+	}
+	// check version
+	if (IPKPacket::version != static_cast<uint8_t>(message[0x6])) {
+		throw(IPKPacketException(VersionError, "IPKPacketError: Wrong Version!"));
+	}
+	// check crc (CRC32 of message followed by its CRC32 is constant)
+	if (crc.Finalize() != crc32_residue) {
+		throw(IPKPacketException(CRC32Error, "IPKPacketError: CRC32 Error!"));
+	}
+	// check transmission type
+	auto t = static_cast<IPKTransmissionType>(message[0x7]);
+	if (t >= IPKUnknown || t < 0) {
+		throw(IPKPacketException(TransmissionTypeError, "IPKPacketError: Unknown transmission type!"));
+	}
+	type = t;
+	// check overall message size
+	uint64_t overall_size;
+	std::copy(message + 0x8, message + 0x10, reinterpret_cast<unsigned char*>(&overall_size));
+	if (overall_size != size) {
+		throw(IPKPacketException(SizeError, "IPKPacketError: Size Error!"));
+	}
+	const unsigned char *body = message + 0x10;
+	const unsigned char *body_end = message + size - 0x4;
+	// locate filename
+	const unsigned char *message_data_it = body;
+	if (has_filename(type)) {
+		const unsigned char *terminator = std::find(body, body_end, 0);
+		filename = reinterpret_cast<const char*>(body);
+		filename_size = terminator - body;
+		message_data_it = (terminator != body_end) ? terminator + 1 : body_end;
+	}
+	// load file size, range offset and length
+	uint64_t *fields[] = { has_filesize(type) ? &filesize : nullptr, has_offset(type) ? &offset : nullptr, has_length(type) ? &length : nullptr };
+	for (uint64_t *field : fields) {
+		if (!field) {
+			continue;
+		}
+		if (body_end - message_data_it < static_cast<std::ptrdiff_t>(sizeof(uint64_t))) {
+			throw(IPKPacketException(SizeError, "IPKPacketError: Size Error!"));
+		}
+		std::copy(message_data_it, message_data_it + sizeof(uint64_t), reinterpret_cast<unsigned char*>(field));
+		message_data_it += sizeof(uint64_t);
+	}
+	// locate data (follows fields)
+	if (has_data(type)) {
+		data = message_data_it;
+		data_size = body_end - message_data_it;
+	}
+}
+
+IPKPacketView::IPKPacketView(const std::vector<unsigned char> &message, const CRC32State &crc)
+	: IPKPacketView(message.data(), message.size(), crc)
+{
+}
+
+IPKPacketView::IPKPacketView(const std::vector<unsigned char> &message)
+	: IPKPacketView(message, CRC32State(message.data(), message.size()))
+{
+}
+
+const char *IPKPacketView::Filename() const
+{
+	return this->filename;
+}
+
+std::size_t IPKPacketView::FilenameSize() const
+{
+	return this->filename_size;
+}
+
+uint64_t IPKPacketView::FileSize() const
+{
+	return this->filesize;
+}
+
+uint64_t IPKPacketView::Offset() const
+{
+	return this->offset;
+}
+
+uint64_t IPKPacketView::Length() const
+{
+	return this->length;
+}
+
+const unsigned char *IPKPacketView::Data() const
+{
+	return this->data;
+}
+
+std::size_t IPKPacketView::DataSize() const
+{
+	return this->data_size;
+}
+
+int64_t IPKPacketView::Version() const
+{
+	int64_t version = 0;
+	if (this->data_size == sizeof(version)) {
+		std::copy(this->data, this->data + sizeof(version), reinterpret_cast<unsigned char*>(&version));
+	}
+	return version;
+}
+
+IPKTransmissionType IPKPacketView::Type() const
+{
+	return this->type;
+}
+
+bool IPKPacketView::operator==(const IPKTransmissionType t) const
+{
+	return this->type == t;
+}
+
+bool IPKPacketView::operator!=(const IPKTransmissionType t) const
+{
+	return this->type != t;
+}
+
 IPKPacketException::IPKPacketException(const IPKPacketError error, const std::string message)
 	: std::runtime_error(message), error(error)
 {
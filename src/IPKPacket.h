@@ -17,29 +17,89 @@
 *  8h     | 8 bytes  | overall message size
 *
 *  10h    | optional | filename (null terminated)
-*  ???    | optional | file data
+*  ???    | optional | file size (8 bytes)
+*  ???    | optional | range offset (8 bytes)
+*  ???    | optional | range length (8 bytes)
+*  ???    | optional | frame data
 *
 *  end-4h | 4 bytes  | message CRC32 (0x04C11DB7 polynomial)
 *  ---------------------------------------
 *
 *  *the "overall message size" is complete size of message including CRC32
 *  *CRC32 is computed for "overall message size" minus 4 bytes
-*  *file size can be determined using "overall message size"
+*  *CRC32 of complete message (including CRC32) equals crc32_residue, so it can
+*   be computed by blocks while message is being received (see TCP::Recv)
+*  *frame data size can be determined using "overall message size"
 *
 ************ IPKTransmissionType *********
 *
 * (0) RequestFile - requires filename
-* (1) OfferFile - requires filename and data
-* (2) CommandPing
-* (3) StatusOk
+* (1) OfferFile - requires filename and file size, optional data: version
+*     of file (modification time, 8 bytes, 0 = unknown)
+* (2) CommandPing - optional data: compression codecs supported by client
+*     (1 byte each, in order of preference, see CompressionCodec)
+* (3) StatusOk - optional data: compression codec chosen by server for this
+*     connection (answer to CommandPing with codecs, 1 byte)
 * (4) StatusError
 * (5) StatusInaccessible
+* (6) DataFrame - requires frame data (1 to FrameSize bytes)
+* (7) StatusBusy - server is saturated, connection is closed
+* (8) RequestRange - requires filename, file size (expected, 0 = any),
+*     offset and length (0 = up to end of file), optional data: version of
+*     file the partial download was started from (as OfferFile)
+* (9) OfferRange - requires filename, file size, offset and length, optional
+*     data: version of file (as OfferFile)
+* (10) QueryFile - requires filename and file size (of upload), optional
+*      data: version of uploaded file (as OfferFile)
+* (11) PartialFile - requires filename, file size and offset (verified
+*      bytes of partial upload held by server, 0 = none)
+* (12) CompressedFrame - DataFrame compressed by negotiated codec, frame
+*      data are CRC32 of original DataFrame (4 bytes), original data size
+*      (4 bytes) and compressed data
+* (13) RequestSignature - requires filename
+* (14) BlockSignatures - requires filename and file size (0 = no file),
+*      data are signatures of file blocks (see IPKSignature)
+* (15) OfferDelta - requires filename, file size, offset (size of previous
+*      version the delta was computed against), length (block size) and
+*      data (SHA-256 of file, 32 bytes)
+* (16) DeltaFrame - requires data (1 to FrameSize bytes of instructions,
+*      see IPKDelta.h)
+* (17) OfferDigest - requires filename, file size and data (SHA-256 of file,
+*      32 bytes), server answers StatusOk when it already holds identical
+*      content (file is saved without receiving it), otherwise PartialFile
+*      (as QueryFile)
+* (18) CommandStats - request has no fields, server answers by CommandStats
+*      with data: its metrics as JSON text (see IPKMetrics::Report)
+*
+************** File transfer *************
+*
+*  OfferFile packet is followed by a stream of DataFrame packets carrying
+*  the file data in order (every frame except the last one is FrameSize
+*  bytes long), so file size is not bounded by memory of either side.
+*
+*  OfferRange is followed by DataFrames of given range only. Frames of range
+*  end on FrameSize boundaries of the file (first frame can be shorter).
+*  Server answers RequestRange by OfferRange, or by OfferFile of whole file
+*  when file size or version differs. Client asks server by QueryFile how
+*  much of upload it already holds and continues by OfferRange (server
+*  answers offset 0 when its partial upload is of other version). Version
+*  is stored in ".part.info" marker together with verified offset.
+*
+*  Any DataFrame can be replaced by CompressedFrame when both sides agreed
+*  on codec during CommandPing. Message CRC32 covers compressed frame, CRC32
+*  of original DataFrame is verified after decompression.
+*
+*  OfferDelta is followed by DeltaFrames that rebuild file from blocks of
+*  its previous version held by server (see IPKDelta.h).
 *
 ******************************************/
 
 #include <string>
 #include <vector>
 #include <stdexcept>
+#include <stdint.h>
+
+class CRC32State;
 
 enum IPKTransmissionType {
 	RequestFile = 0,
@@ -48,7 +108,20 @@ enum IPKTransmissionType {
 	StatusOk = 3,
 	StatusError = 4,
 	StatusInaccessible = 5,
-	IPKUnknown = 6
+	DataFrame = 6,
+	StatusBusy = 7,
+	RequestRange = 8,
+	OfferRange = 9,
+	QueryFile = 10,
+	PartialFile = 11,
+	CompressedFrame = 12,
+	RequestSignature = 13,
+	BlockSignatures = 14,
+	OfferDelta = 15,
+	DeltaFrame = 16,
+	OfferDigest = 17,
+	CommandStats = 18,
+	IPKUnknown = 19
 };
 
 enum IPKPacketError {
@@ -61,33 +134,99 @@ enum IPKPacketError {
 };
 
 class IPKPacket {
+	friend class IPKPacketView;
 	static const std::string signature;
 	static const uint8_t version;
 	const IPKTransmissionType type;
 	const std::string filename;
+	const uint64_t filesize;
+	const uint64_t offset;
+	const uint64_t length;
 	const std::vector<unsigned char> data;
 public:
 	// Create Packet
 	IPKPacket(IPKTransmissionType type, std::string filename = {}, std::vector<unsigned char> data = {});
+	IPKPacket(IPKTransmissionType type, std::string filename, uint64_t filesize, uint64_t offset = 0, uint64_t length = 0);
 
 	// Deserialize
-	IPKPacket(const std::vector<unsigned char> message);
+	IPKPacket(const std::vector<unsigned char> &message);
+
+	// Deserialize with CRC32State computed over complete message (including CRC32) while receiving
+	IPKPacket(const std::vector<unsigned char> &message, const CRC32State &crc);
 
 	// Serialize
 	operator const std::vector<unsigned char>() const;
 
-	// Get Filename, Data, type
-	const std::string GetFilename() const;
-	const std::vector<unsigned char> GetData() const;
+	// Serialize into caller provided buffer without temporary IPKPacket (capacity of message is reused)
+	static void Serialize(std::vector<unsigned char> &message, IPKTransmissionType type, const std::string &filename = {}, uint64_t filesize = 0,
+		uint64_t offset = 0, uint64_t length = 0, const unsigned char *data = nullptr, std::size_t data_size = 0);
+
+	// Serialize DataFrame header only (data follow, CRC32 is computed while sending, see TCP::Send)
+	static void SerializeFrameHeader(std::vector<unsigned char> &message, std::size_t data_size);
+
+	// Serialize packet without data and CRC32 trailer (data_size bytes of data follow, CRC32 is computed while sending)
+	static void SerializeHeader(std::vector<unsigned char> &message, IPKTransmissionType type, const std::string &filename, uint64_t filesize,
+		uint64_t offset, uint64_t length, std::size_t data_size);
+
+	// Serialize CRC32 trailer from CRC32State computed over rest of message
+	static void SerializeTrailer(std::vector<unsigned char> &message, const CRC32State &crc);
+	static void SerializeTrailer(std::vector<unsigned char> &message, uint32_t crc);
+
+	// Get Filename, FileSize, range Offset and Length, Data, type
+	const std::string &GetFilename() const;
+	const uint64_t GetFileSize() const;
+	const uint64_t GetOffset() const;
+	const uint64_t GetLength() const;
+	const std::vector<unsigned char> &GetData() const;
 	const IPKTransmissionType Type() const;
 
 	// Get type from incomplete serialized packet (min size == 8)
-	static IPKTransmissionType Type(const std::vector<unsigned char> message);
+	static IPKTransmissionType Type(const std::vector<unsigned char> &message);
 
 	// Get expected size from incomplete serialized packet (min size == 16)
-	static std::size_t ExpectedSize(const std::vector<unsigned char> message);
+	static std::size_t ExpectedSize(const std::vector<unsigned char> &message);
 	static const std::size_t StatusSize;
 
+	// Size of serialized header (signature, version, type and overall size)
+	static const std::size_t HeaderSize;
+
+	// Maximal size of data carried by one DataFrame
+	static const std::size_t FrameSize;
+
+	// Comparison
+	bool operator==(const IPKTransmissionType t) const;
+	bool operator!=(const IPKTransmissionType t) const;
+};
+
+// Non-owning view of serialized packet, parsed in place (message must outlive the view)
+class IPKPacketView {
+	IPKTransmissionType type;
+	const char *filename;
+	std::size_t filename_size;
+	uint64_t filesize;
+	uint64_t offset;
+	uint64_t length;
+	const unsigned char *data;
+	std::size_t data_size;
+public:
+	// Deserialize (same checks as IPKPacket, throws IPKPacketException)
+	IPKPacketView(const unsigned char *message, std::size_t size, const CRC32State &crc);
+	IPKPacketView(const std::vector<unsigned char> &message, const CRC32State &crc);
+	IPKPacketView(const std::vector<unsigned char> &message);
+
+	// Get Filename (not null terminated), FileSize, range Offset and Length, Data, type
+	const char *Filename() const;
+	std::size_t FilenameSize() const;
+	uint64_t FileSize() const;
+	uint64_t Offset() const;
+	uint64_t Length() const;
+	const unsigned char *Data() const;
+	std::size_t DataSize() const;
+	IPKTransmissionType Type() const;
+
+	// version of file carried as data of OfferFile, OfferRange, RequestRange and QueryFile (0 = unknown)
+	int64_t Version() const;
+
 	// Comparison
 	bool operator==(const IPKTransmissionType t) const;
 	bool operator!=(const IPKTransmissionType t) const;
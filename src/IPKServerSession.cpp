@@ -0,0 +1,498 @@
+/*
+*	IPK Project 1: client-server for simple file transfer
+*	Author: Tomáš Pazdiora (xpazdi02)
+*	File: IPKServerSession.cpp
+*/
+
+#include "IPKServerSession.h"
+#include "IPKContentIndex.h"
+#include "IPKMetrics.h"
+
+#include <fstream>
+#include <algorithm>
+
+IPKServerSession::IPKServerSession(int retries, bool compression)
+	: retries(retries), compression(compression), errors(0), state(ReadHeader), close_after_response(false), to_recv(0),
+	signatures_sent(0), pending_offer(), range_end(0), frame_offset(0), frame_size(0), frame_compressed(false)
+{
+	IPKMetrics::Add(ConnectionsOpened);
+}
+
+IPKServerSession::~IPKServerSession()
+{
+	IPKMetrics::Add(ConnectionsClosed);
+}
+
+TCPRequest IPKServerSession::Next()
+{
+	switch (state) {
+	case ReadHeader:
+		return { TCPRequest::Recv, &input, IPKPacket::StatusSize, &crc };
+	case ReadFrameHeader:
+		// only header when data can be received directly into file
+		return { TCPRequest::Recv, &input, (writer->Descriptor() >= 0 && !delta) ? IPKPacket::HeaderSize : IPKPacket::StatusSize, &crc };
+	case ReadBody:
+	case ReadFrameBody:
+		return { TCPRequest::Recv, &input, to_recv, &crc };
+	case ReadFrameData:
+		return { TCPRequest::RecvFile, nullptr, frame_size, nullptr, nullptr, writer->Position(), writer->Descriptor() };
+	case ReadFrameTrailer:
+		return { TCPRequest::Recv, &input, IPKPacket::StatusSize - IPKPacket::HeaderSize, &crc };
+	case SendResponse:
+	case SendOffer:
+	case SendFrameTrailer:
+		return { TCPRequest::Send, &output, 0, nullptr };
+	case SendFrame:
+		if (frame_compressed) {
+			return { TCPRequest::Send, &output, 0, nullptr };
+		}
+		return { TCPRequest::SendFile, &output, frame_size, nullptr, cached->file.get(), frame_offset };
+	case SendSignatures:
+		return { TCPRequest::Send, &output, 0, &crc };
+	case WaitOffer:
+	case WaitSignatures:
+		return { TCPRequest::Wait, nullptr, 0, nullptr };
+	default:
+		return { TCPRequest::Close, nullptr, 0, nullptr };
+	}
+}
+
+void IPKServerSession::Completed()
+{
+	try {
+		switch (state) {
+		case ReadHeader:
+			to_recv = IPKPacket::ExpectedSize(input) - IPKPacket::StatusSize;
+			if (to_recv) {
+				state = ReadBody;
+			}
+			else {
+				Process();
+			}
+			break;
+		case ReadBody:
+			Process();
+			break;
+		case ReadFrameHeader:
+			if (delta) {
+				to_recv = IPKPacket::ExpectedSize(input) - IPKPacket::StatusSize;
+				if (to_recv == 0 || to_recv > IPKPacket::FrameSize) {
+					throw(IPKPacketException(SizeError, "IPKPacketError: DeltaFrame Size Error!")); // stream is lost
+				}
+				state = ReadFrameBody;
+				break;
+			}
+			to_recv = writer->Remaining(input);
+			if (input.size() == IPKPacket::HeaderSize && IPKPacket::Type(input) == CompressedFrame) {
+				to_recv += IPKPacket::StatusSize - IPKPacket::HeaderSize; // decompressed by Write
+				state = ReadFrameBody;
+			}
+			else if (input.size() == IPKPacket::HeaderSize) {
+				if (IPKPacket::Type(input) != DataFrame) {
+					throw(IPKPacketException(TransmissionTypeError, "IPKPacketError: DataFrame expected!"));
+				}
+				frame_size = to_recv;
+				state = ReadFrameData;
+			}
+			else {
+				state = ReadFrameBody;
+			}
+			break;
+		case ReadFrameBody:
+			if (delta) {
+				IPKPacketView frame(input, crc);
+				if (frame != DeltaFrame) {
+					throw(IPKPacketException(TransmissionTypeError, "IPKPacketError: DeltaFrame expected!"));
+				}
+				IPKLatencyTimer timer(DiskLatency);
+				delta->Apply(frame.Data(), frame.DataSize(), *writer);
+			}
+			else {
+				IPKLatencyTimer timer(DiskLatency);
+				writer->Write(input, crc);
+			}
+			FrameWritten();
+			break;
+		case ReadFrameData:
+			writer->Received(frame_size, crc); // CRC32 of data from page cache
+			input.clear();
+			state = ReadFrameTrailer;
+			break;
+		case ReadFrameTrailer:
+			writer->Verify(crc);
+			FrameWritten();
+			break;
+		case SendResponse:
+			if (close_after_response) {
+				RequestDone();
+				state = Closed;
+			}
+			else {
+				Expect(ReadHeader);
+			}
+			break;
+		case WaitOffer:
+			Offer(pending_offer.filename, pending_offer.offset, pending_offer.length, pending_offer.expected_size, pending_offer.expected_version);
+			break;
+		case SendOffer:
+		case SendFrame:
+			SendNextFrame();
+			break;
+		case SendFrameTrailer:
+			cached.reset();
+			Expect(ReadHeader);
+			break;
+		case SendSignatures:
+		case WaitSignatures:
+			SendNextSignatures();
+			break;
+		default:
+			break;
+		}
+	}
+	catch (const IPKPacketException &e) {
+		if (e.error == CRC32Error) {
+			IPKMetrics::Add(CRCFailures);
+		}
+		Error(StatusError); // Send ERROR response
+	}
+	catch (const std::fstream::failure &e) {
+		(void)e; // bypass unreferenced local variable warning
+		Error(StatusInaccessible); // Send ERROR response
+	}
+}
+
+void IPKServerSession::Failed(const TCPException &e)
+{
+	if (e.error == Timeout) {
+		IPKMetrics::Add(Timeouts);
+	}
+	if (e.error == Timeout && state != Closed) {
+		Error(StatusError); // Send ERROR response
+	}
+	else {
+		state = Closed; // close connection
+	}
+}
+
+// start receiving of next packet (or DataFrame)
+void IPKServerSession::Expect(State packet_state)
+{
+	if (packet_state == ReadHeader) {
+		RequestDone(); // response was sent
+	}
+	input.clear();
+	crc.Init();
+	state = packet_state;
+}
+
+// process complete request stored in input
+void IPKServerSession::Process()
+{
+	IPKPacketView p(input, crc);
+	IPKMetrics::Request(p.Type());
+	request_start = std::chrono::steady_clock::now();
+	std::shared_ptr<IPKSignatureStream> sent_signatures = std::move(signatures); // kept only for OfferDelta that follows them
+	std::string requested(p.Filename(), p.FilenameSize());
+	if (IPKFrameWriter::Transient(requested) || IPKContentIndex::Reserved(requested)) {
+		Error(StatusInaccessible); // files of server itself are never served or replaced
+		return;
+	}
+	switch (p.Type()) {
+	case CommandPing:
+	{
+		// first of offered codecs supported by server
+		unsigned char codec = NoCompression;
+		for (std::size_t i = 0; compression && i < p.DataSize() && codec == NoCompression; i++) {
+			if (Compression::IsSupported(static_cast<CompressionCodec>(p.Data()[i]))) {
+				codec = p.Data()[i];
+			}
+		}
+		compressor = FrameCompressor(static_cast<CompressionCodec>(codec));
+		IPKPacket::Serialize(output, StatusOk, {}, 0, 0, 0, &codec, (p.DataSize() > 0) ? 1 : 0);
+		close_after_response = false;
+		state = SendResponse;
+		break;
+	}
+	case OfferFile:
+	case OfferRange:
+	{
+		uint64_t offset = (p == OfferRange) ? p.Offset() : 0;
+		if (offset > p.FileSize() || (p == OfferRange && p.Length() != p.FileSize() - offset)) {
+			Error(StatusError); // upload always continues up to end of file
+			break;
+		}
+		{
+			IPKLatencyTimer timer(DiskLatency);
+			writer.reset(new IPKFrameWriter(std::string(p.Filename(), p.FilenameSize()), p.FileSize(), offset));
+		}
+		writer->SetCodec(compressor.Codec());
+		writer->SetVersion(p.Version()); // partial upload of other version is rejected
+		if (IPKContentIndex::Enabled()) {
+			writer->EnableDigest(); // content index is updated by saved file
+		}
+		FrameWritten();
+		break;
+	}
+	case OfferDelta:
+	{
+		// file is rebuilt from its previous version, Finish rejects it when its SHA-256 differs from offered one
+		std::string filename(p.Filename(), p.FilenameSize());
+		if (p.DataSize() != sha256_size) {
+			Error(StatusError);
+			break;
+		}
+		{
+			IPKLatencyTimer timer(DiskLatency);
+			delta.reset(new IPKDeltaDecoder(filename, p.Offset(), p.Length(), sent_signatures));
+			writer.reset(new IPKFrameWriter(filename, p.FileSize()));
+		}
+		writer->ExpectDigest(p.Data());
+		FrameWritten();
+		break;
+	}
+	case RequestSignature:
+	{
+		// block signatures of current version of file (none if there is no such file)
+		std::string filename(p.Filename(), p.FilenameSize());
+		try {
+			IPKLatencyTimer timer(DiskLatency);
+			signatures = std::make_shared<IPKSignatureStream>(std::make_shared<const MappedFile>(filename));
+		}
+		catch (const std::ifstream::failure &e) {
+			(void)e; // bypass unreferenced local variable warning
+			std::vector<unsigned char> signature;
+			IPKSignature().Serialize(signature);
+			IPKPacket::Serialize(output, BlockSignatures, filename, 0, 0, 0, signature.data(), signature.size());
+			close_after_response = false;
+			state = SendResponse;
+			break;
+		}
+		// signatures are computed by background thread and sent by parts as they are ready
+		IPKPacket::SerializeHeader(output, BlockSignatures, filename, signatures->File()->Size(), 0, 0, signatures->Size());
+		crc.Init();
+		signatures_sent = 0;
+		state = SendSignatures;
+		break;
+	}
+	case OfferDigest:
+	{
+		// identical content held by server is saved without receiving it
+		std::string filename(p.Filename(), p.FilenameSize());
+		bool linked = false;
+		if (p.DataSize() == sha256_size) {
+			IPKLatencyTimer timer(DiskLatency);
+			linked = IPKContentIndex::Link(filename, p.FileSize(), p.Data());
+		}
+		if (linked) {
+			Respond(StatusOk);
+			break;
+		}
+	}
+	// no identical content, answer as QueryFile
+	case QueryFile:
+	{
+		// verified part of previous upload of the same file version
+		std::string filename(p.Filename(), p.FilenameSize());
+		uint64_t partial_size = 0, partial_offset = 0;
+		int64_t partial_version = 0;
+		if (!IPKFrameWriter::Partial(filename, partial_size, partial_offset, partial_version) || partial_size != p.FileSize() ||
+			(partial_version && p.Version() && partial_version != p.Version())) {
+			partial_offset = 0;
+		}
+		IPKPacket::Serialize(output, PartialFile, filename, p.FileSize(), partial_offset);
+		close_after_response = false;
+		state = SendResponse;
+		break;
+	}
+	case CommandStats:
+	{
+		std::string report = IPKMetrics::Report();
+		IPKPacket::Serialize(output, CommandStats, {}, 0, 0, 0, reinterpret_cast<const unsigned char*>(report.data()), report.size());
+		close_after_response = false;
+		state = SendResponse;
+		break;
+	}
+	case RequestFile:
+	{
+		Offer(std::string(p.Filename(), p.FilenameSize()), 0, 0, 0, 0);
+		break;
+	}
+	case RequestRange:
+	{
+		Offer(std::string(p.Filename(), p.FilenameSize()), p.Offset(), p.Length(), p.FileSize(), p.Version());
+		break;
+	}
+	default:
+		Error(StatusError); // Send ERROR response
+		break;
+	}
+}
+
+// continue with next computed part of BlockSignatures or finish it by CRC32 trailer
+void IPKServerSession::SendNextSignatures()
+{
+	if (signatures_sent == signatures->Size()) {
+		IPKPacket::SerializeTrailer(output, crc);
+		close_after_response = false;
+		state = SendResponse; // signatures are kept for OfferDelta
+		return;
+	}
+	std::size_t size = IPKPacket::FrameSize;
+	const unsigned char *data = signatures->Get(signatures_sent, size);
+	if (size == 0) {
+		state = WaitSignatures; // event loop asks again instead of waiting for background thread
+		return;
+	}
+	output.assign(data, data + size);
+	signatures_sent += size;
+	state = SendSignatures;
+}
+
+// continue with next DataFrame of offered file or finish it
+void IPKServerSession::FrameWritten()
+{
+	if (writer->Done()) {
+		delta.reset(); // previous version of file is released before it is replaced
+		auto finished = std::move(writer);
+		{
+			IPKLatencyTimer timer(DiskLatency);
+			finished->Finish();
+			IPKContentIndex::Add(finished->Path(), finished->Digest()); // digest of resumed upload is computed from file
+		}
+		Respond(StatusOk);
+	}
+	else {
+		Expect(ReadFrameHeader);
+	}
+}
+
+// offer range of file (length 0 = up to end of file), whole file is offered by OfferFile,
+// also when file size or version differs from expected one (file has changed since range was computed)
+void IPKServerSession::Offer(const std::string &filename, uint64_t offset, uint64_t length, uint64_t expected_size, int64_t expected_version)
+{
+	try {
+		IPKLatencyTimer timer(DiskLatency);
+		cached = IPKFileCache::Get(filename);
+	}
+	catch (const std::ifstream::failure &e) {
+		(void)e; // bypass unreferenced local variable warning
+		Respond(StatusInaccessible); // stream of requests stays in sync, pipelined requests can continue
+		return;
+	}
+	if (!cached) {
+		// file is being opened by other session, event loop asks again
+		pending_offer = { filename, offset, length, expected_size, expected_version };
+		state = WaitOffer;
+		return;
+	}
+	uint64_t filesize = cached->file->Size();
+	int64_t version = cached->file->ModificationTime();
+	if ((expected_size && expected_size != filesize) || (expected_version && expected_version != version)) {
+		offset = length = 0;
+	}
+	if (offset > filesize) {
+		Error(StatusError);
+		return;
+	}
+	if (length == 0 || length > filesize - offset) {
+		length = filesize - offset;
+	}
+	if (offset == 0 && length == filesize) {
+		output = cached->offer;
+	}
+	else {
+		IPKPacket::Serialize(output, OfferRange, filename, filesize, offset, length, reinterpret_cast<const unsigned char*>(&version), sizeof(version));
+	}
+	frame_offset = offset;
+	frame_size = 0;
+	range_end = offset + length;
+	state = SendOffer;
+}
+
+// continue with next DataFrame of requested range or finish it,
+// CRC32 trailer of previous DataFrame is sent together with header of next one
+void IPKServerSession::SendNextFrame()
+{
+	output.clear();
+	bool trailer = (frame_size > 0 && !frame_compressed); // CompressedFrame was sent complete
+	if (trailer) {
+		IPKPacket::SerializeTrailer(output, cached->checksums->Get(*cached->file, frame_offset, frame_size));
+		Unchanged();
+	}
+
+	uint64_t next_offset = frame_offset + frame_size;
+	if (next_offset >= range_end) {
+		if (trailer) {
+			state = SendFrameTrailer;
+		}
+		else {
+			cached.reset();
+			Expect(ReadHeader);
+		}
+		return;
+	}
+
+	frame_offset = next_offset;
+	frame_size = IPKFrameChecksums::FrameSizeAt(frame_offset, range_end);
+
+	// frame that compresses is sent from memory instead of page cache (compressed once for cached file)
+	frame_compressed = false;
+	if (compressor.Codec() != NoCompression) {
+		auto packet = cached->Compressed(frame_offset, frame_size, compressor);
+		Unchanged();
+		if (packet) {
+			//Possible Improvement: send cached packet without copying it into output
+			output.insert(output.end(), packet->begin(), packet->end());
+			frame_compressed = true;
+			state = SendFrame;
+			return;
+		}
+	}
+
+	std::vector<unsigned char> header;
+	IPKPacket::SerializeFrameHeader(header, frame_size);
+	output.insert(output.end(), header.begin(), header.end());
+	state = SendFrame;
+}
+
+// frame read from mapping of file truncated meanwhile may be zeros, so it must not be verified by client
+// (throws std::ifstream::failure)
+void IPKServerSession::Unchanged()
+{
+	if (cached->file->Truncated()) {
+		throw std::ifstream::failure("IPKFTP: File was truncated during transfer!");
+	}
+}
+
+void IPKServerSession::Respond(IPKTransmissionType status, bool close)
+{
+	IPKPacket::Serialize(output, status);
+	close_after_response = close;
+	state = SendResponse;
+}
+
+// ERROR response, connection is closed after (1 + retries) errors or when file is inaccessible
+void IPKServerSession::Error(IPKTransmissionType status)
+{
+	cached.reset();
+	writer.reset();
+	delta.reset();
+	signatures.reset();
+	if (status == StatusInaccessible) {
+		Respond(StatusInaccessible, true);
+	}
+	else {
+		IPKMetrics::Add(Retries);
+		Respond(StatusError, ++errors > retries);
+	}
+}
+
+// latency of request that was just answered
+void IPKServerSession::RequestDone()
+{
+	if (request_start != std::chrono::steady_clock::time_point()) {
+		IPKMetrics::Record(RequestLatency, std::chrono::steady_clock::now() - request_start);
+		request_start = std::chrono::steady_clock::time_point();
+	}
+}
@@ -0,0 +1,85 @@
+/*
+*	IPK Project 1: client-server for simple file transfer
+*	Author: Tomáš Pazdiora (xpazdi02)
+*	File: IPKServerSession.h
+*/
+
+#ifndef IPKSERVERSESSION_H
+#define IPKSERVERSESSION_H
+
+#include <vector>
+#include <memory>
+#include <chrono>
+#include "TCP.h"
+#include "IPKPacket.h"
+#include "IPKFrame.h"
+#include "IPKDelta.h"
+#include "CRC32.h"
+
+// Request state machine of one server connection (never blocks on socket)
+class IPKServerSession : public TCPHandler {
+	enum State {
+		ReadHeader, // first IPKPacket::StatusSize bytes of request
+		ReadBody, // rest of request
+		ReadFrameHeader, // first IPKPacket::StatusSize bytes of DataFrame (or DeltaFrame) of offered file
+		ReadFrameBody, // rest of DataFrame (or DeltaFrame)
+		ReadFrameData, // data of DataFrame received directly into file (splice)
+		ReadFrameTrailer, // CRC32 of DataFrame received into file
+		SendResponse, // status response
+		WaitOffer, // requested file is being opened by other session (Offer is retried)
+		SendOffer, // OfferFile header of requested file
+		SendFrame, // CRC32 of previous DataFrame, header and data of next DataFrame (sendfile), or CompressedFrame
+		SendFrameTrailer, // CRC32 of last DataFrame
+		SendSignatures, // header of BlockSignatures or next computed part of signatures (CRC32 trailer is sent as response)
+		WaitSignatures, // next block of signatures is being computed by background thread
+		Closed
+	};
+
+	const int retries;
+	const bool compression; // codec can be negotiated by CommandPing
+	int errors;
+	State state;
+	bool close_after_response;
+	std::size_t to_recv;
+	CRC32State crc; // CRC32 of received or sent message, computed by blocks
+	std::vector<unsigned char> input;
+	std::vector<unsigned char> output;
+	std::unique_ptr<IPKFrameWriter> writer;
+	std::unique_ptr<IPKDeltaDecoder> delta; // offered file is rebuilt from DeltaFrames
+	std::shared_ptr<IPKSignatureStream> signatures; // sent by last response (kept for OfferDelta that follows it)
+	std::size_t signatures_sent; // bytes of signatures sent so far
+
+	// requested file (DataFrame data are sent directly from page cache, see IPKFileCache)
+	std::shared_ptr<IPKCachedFile> cached;
+	struct {
+		std::string filename;
+		uint64_t offset, length, expected_size;
+		int64_t expected_version;
+	} pending_offer; // arguments of Offer retried by WaitOffer
+	uint64_t range_end; // end of requested range of file
+	uint64_t frame_offset; // offset of current DataFrame data in file
+	std::size_t frame_size; // size of current DataFrame data (sent or received into file)
+	bool frame_compressed; // current DataFrame is sent as complete CompressedFrame
+	FrameCompressor compressor; // negotiated codec
+	std::chrono::steady_clock::time_point request_start; // request being handled (see IPKMetrics, epoch = none)
+
+	void Expect(State packet_state);
+	void Process();
+	void Offer(const std::string &filename, uint64_t offset, uint64_t length, uint64_t expected_size, int64_t expected_version);
+	void FrameWritten();
+	void SendNextFrame();
+	void Unchanged();
+	void SendNextSignatures();
+	void Respond(IPKTransmissionType status, bool close = false);
+	void Error(IPKTransmissionType status);
+	void RequestDone();
+public:
+	IPKServerSession(int retries, bool compression = true);
+	~IPKServerSession() override;
+
+	TCPRequest Next() override;
+	void Completed() override;
+	void Failed(const TCPException &e) override;
+};
+
+#endif
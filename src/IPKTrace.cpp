@@ -0,0 +1,200 @@
+/*
+*	IPK Project 1: client-server for simple file transfer
+*	Author: Tomáš Pazdiora (xpazdi02)
+*	File: IPKTrace.cpp
+*/
+
+#include "IPKTrace.h"
+
+#include <chrono>
+#include <mutex>
+#include <memory>
+#include <vector>
+#include <cstring>
+#include <iomanip>
+#include <algorithm>
+
+#if defined(_WIN32)
+#include <process.h>
+#define getpid _getpid
+#else
+#include <unistd.h>
+#endif
+
+std::atomic<bool> IPKTrace::enabled{ false };
+
+namespace {
+	// fields are relaxed atomics, so events can be read while their slots are being overwritten
+	struct TraceEvent {
+		std::atomic<const char*> name;
+		std::atomic<uint64_t> start;
+		std::atomic<uint64_t> duration;
+		std::atomic<uint64_t> bytes;
+	};
+
+	struct TraceCopy {
+		const char *name;
+		uint64_t start, duration, bytes;
+	};
+
+	// ring of one thread (single writer), event i is in slot i % capacity
+	struct TraceBuffer {
+		const unsigned int tid;
+		std::atomic<uint64_t> head{ 0 }; // number of recorded events
+		std::unique_ptr<TraceEvent[]> events;
+
+		TraceBuffer(unsigned int tid) : tid(tid), events(new TraceEvent[IPKTrace::capacity]) {}
+	};
+
+	struct TraceRegistry {
+		std::mutex mutex;
+		std::vector<std::unique_ptr<TraceBuffer>> buffers; // never released, events of finished threads are kept
+		std::vector<TraceBuffer*> unused; // buffers of finished threads
+		std::string process_name = "ipkftp";
+	};
+
+	TraceRegistry &registry()
+	{
+		static TraceRegistry *state = new TraceRegistry(); // outlives threads finishing during exit
+		return *state;
+	}
+
+	// buffer of current thread (allocated by first span), reused by next thread when this one finishes
+	struct ThreadBuffer {
+		TraceBuffer *buffer;
+		ThreadBuffer()
+		{
+			TraceRegistry &traces = registry();
+			std::lock_guard<std::mutex> lock(traces.mutex);
+			if (!traces.unused.empty()) {
+				buffer = traces.unused.back();
+				traces.unused.pop_back();
+			}
+			else {
+				traces.buffers.emplace_back(new TraceBuffer(static_cast<unsigned int>(traces.buffers.size() + 1)));
+				buffer = traces.buffers.back().get();
+			}
+		}
+		~ThreadBuffer()
+		{
+			TraceRegistry &traces = registry();
+			std::lock_guard<std::mutex> lock(traces.mutex);
+			traces.unused.push_back(buffer);
+		}
+	};
+
+	TraceBuffer &thread_buffer()
+	{
+		static thread_local ThreadBuffer current;
+		return *current.buffer;
+	}
+
+	// events of ring that were not overwritten while they were copied
+	void copy_events(const TraceBuffer &buffer, std::vector<TraceCopy> &events)
+	{
+		events.clear();
+		uint64_t head = buffer.head.load(std::memory_order_acquire);
+		uint64_t first = (head > IPKTrace::capacity) ? head - IPKTrace::capacity : 0;
+		for (uint64_t i = first; i < head; i++) {
+			const TraceEvent &event = buffer.events[i % IPKTrace::capacity];
+			events.push_back({ event.name.load(std::memory_order_relaxed), event.start.load(std::memory_order_relaxed),
+				event.duration.load(std::memory_order_relaxed), event.bytes.load(std::memory_order_relaxed) });
+		}
+		// writer of event i + capacity (which reuses slot of event i) stores head = i + capacity before it starts
+		std::atomic_thread_fence(std::memory_order_acquire);
+		uint64_t current = buffer.head.load(std::memory_order_relaxed);
+		uint64_t valid = (current >= IPKTrace::capacity) ? current - IPKTrace::capacity + 1 : 0;
+		if (valid > first) {
+			events.erase(events.begin(), events.begin() + static_cast<std::ptrdiff_t>(std::min(valid - first, head - first)));
+		}
+	}
+
+	// JSON string (names are static identifiers, process name is given by user)
+	void write_string(std::ostream &out, const std::string &text)
+	{
+		out << '"';
+		for (char c : text) {
+			if (c == '"' || c == '\\') {
+				out << '\\' << c;
+			}
+			else if (static_cast<unsigned char>(c) >= 0x20) {
+				out << c;
+			}
+		}
+		out << '"';
+	}
+}
+
+void IPKTrace::Enable(const std::string &process_name)
+{
+	{
+		TraceRegistry &traces = registry();
+		std::lock_guard<std::mutex> lock(traces.mutex);
+		traces.process_name = process_name;
+	}
+	enabled.store(true, std::memory_order_relaxed);
+}
+
+void IPKTrace::Disable()
+{
+	enabled.store(false, std::memory_order_relaxed);
+}
+
+uint64_t IPKTrace::Now()
+{
+	return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count());
+}
+
+void IPKTrace::Record(const char *name, uint64_t start, uint64_t bytes)
+{
+	uint64_t end = Now();
+	TraceBuffer &buffer = thread_buffer();
+	uint64_t index = buffer.head.load(std::memory_order_relaxed);
+	TraceEvent &event = buffer.events[index % capacity];
+	std::atomic_thread_fence(std::memory_order_release); // head of previous event is visible before slot is reused
+	event.name.store(name, std::memory_order_relaxed);
+	event.start.store(start, std::memory_order_relaxed);
+	event.duration.store(end - start, std::memory_order_relaxed);
+	event.bytes.store(bytes, std::memory_order_relaxed);
+	buffer.head.store(index + 1, std::memory_order_release);
+}
+
+void IPKTrace::Write(std::ostream &out)
+{
+	std::vector<std::pair<unsigned int, const TraceBuffer*>> buffers;
+	std::string process_name;
+	{
+		TraceRegistry &traces = registry();
+		std::lock_guard<std::mutex> lock(traces.mutex);
+		for (const auto &buffer : traces.buffers) {
+			buffers.push_back({ buffer->tid, buffer.get() }); // buffers are never released
+		}
+		process_name = traces.process_name;
+	}
+	const long long pid = static_cast<long long>(getpid());
+
+	out << "{ \"displayTimeUnit\": \"ns\", \"traceEvents\": [" << std::endl;
+	out << "  { \"name\": \"process_name\", \"ph\": \"M\", \"pid\": " << pid << ", \"args\": { \"name\": ";
+	write_string(out, process_name);
+	out << " } }";
+
+	// Chrome trace timestamps are microseconds
+	out << std::fixed << std::setprecision(3);
+	std::vector<TraceCopy> events;
+	for (const auto &buffer : buffers) {
+		copy_events(*buffer.second, events);
+		for (const auto &event : events) {
+			const char *category_end = std::strchr(event.name, '.');
+			std::size_t category_size = category_end ? static_cast<std::size_t>(category_end - event.name) : std::strlen(event.name);
+			out << "," << std::endl << "  { \"name\": \"" << event.name << "\", \"cat\": \"";
+			out.write(event.name, static_cast<std::streamsize>(category_size));
+			out << "\", \"ph\": \"X\", \"pid\": " << pid << ", \"tid\": " << buffer.first
+				<< ", \"ts\": " << event.start / 1000.0 << ", \"dur\": " << event.duration / 1000.0;
+			if (event.bytes) {
+				out << ", \"args\": { \"bytes\": " << event.bytes << " }";
+			}
+			out << " }";
+		}
+	}
+	out << std::endl << "] }" << std::endl;
+}
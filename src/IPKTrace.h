@@ -0,0 +1,61 @@
+/*
+*	IPK Project 1: client-server for simple file transfer
+*	Author: Tomáš Pazdiora (xpazdi02)
+*	File: IPKTrace.h
+*/
+
+#ifndef IPKTRACE_H
+#define IPKTRACE_H
+
+#include <string>
+#include <ostream>
+#include <atomic>
+#include <cstddef>
+#include <stdint.h>
+
+// Tracing of hot paths (socket waits and transfers, CRC32, packet serialization, file reads and writes).
+// Spans are recorded into per-thread ring buffers (oldest events are overwritten) only while tracing is
+// enabled, otherwise span costs one relaxed load. Events are written as Chrome trace JSON
+// (chrome://tracing, ui.perfetto.dev). Build with IPK_NO_TRACE removes spans completely.
+class IPKTrace {
+	static std::atomic<bool> enabled;
+public:
+	static const std::size_t capacity = 1 << 14; // events per thread
+
+	static void Enable(const std::string &process_name);
+	static void Disable();
+	static bool Enabled() { return enabled.load(std::memory_order_relaxed); }
+
+	// monotonic nanoseconds (same clock in every process, so traces of client and server can be merged)
+	static uint64_t Now();
+	static void Record(const char *name, uint64_t start, uint64_t bytes);
+
+	// events of all threads as Chrome trace JSON (threads can keep tracing meanwhile)
+	static void Write(std::ostream &out);
+};
+
+// records lifetime of scope (name is static string, its prefix before '.' is category of span)
+class IPKTraceSpan {
+	const char *const name;
+	const uint64_t bytes;
+	const uint64_t start;
+public:
+	IPKTraceSpan(const char *name, uint64_t bytes = 0)
+		: name(IPKTrace::Enabled() ? name : nullptr), bytes(bytes), start(this->name ? IPKTrace::Now() : 0) {}
+	~IPKTraceSpan() { if (name) IPKTrace::Record(name, start, bytes); }
+	IPKTraceSpan(const IPKTraceSpan &) = delete;
+	IPKTraceSpan &operator=(const IPKTraceSpan &) = delete;
+};
+
+#define IPK_TRACE_CONCAT_(a, b) a##b
+#define IPK_TRACE_CONCAT(a, b) IPK_TRACE_CONCAT_(a, b)
+
+#if defined(IPK_NO_TRACE)
+#define IPK_TRACE_SPAN(name) ((void)0)
+#define IPK_TRACE_SPAN_BYTES(name, bytes) ((void)0)
+#else
+#define IPK_TRACE_SPAN(name) IPKTraceSpan IPK_TRACE_CONCAT(ipk_trace_span_, __LINE__)(name)
+#define IPK_TRACE_SPAN_BYTES(name, bytes) IPKTraceSpan IPK_TRACE_CONCAT(ipk_trace_span_, __LINE__)(name, bytes)
+#endif
+
+#endif
@@ -0,0 +1,244 @@
+/*
+*	IPK Project 1: client-server for simple file transfer
+*	Author: Tomáš Pazdiora (xpazdi02)
+*	File: MappedFile.cpp
+*/
+
+#include "MappedFile.h"
+#include "IPKTrace.h"
+
+#include <fstream>
+
+// Linux specific
+#if defined(__linux__) || defined(__FreeBSD__)
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <signal.h>
+#include <atomic>
+#include <mutex>
+#endif
+
+// Windows specific
+#if defined(_WIN32)
+#include <windows.h>
+#endif
+
+#if defined(_WIN32)
+
+MappedFile::MappedFile(std::string filepath)
+	: file_handle(INVALID_HANDLE_VALUE), mapping_handle(NULL), data(nullptr), size(0), mtime(0)
+{
+	IPK_TRACE_SPAN("file.map");
+	file_handle = CreateFileA(filepath.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+	LARGE_INTEGER file_size;
+	FILETIME write_time;
+	if (file_handle == INVALID_HANDLE_VALUE || !GetFileSizeEx(file_handle, &file_size) || !GetFileTime(file_handle, NULL, NULL, &write_time)) {
+		if (file_handle != INVALID_HANDLE_VALUE) CloseHandle(file_handle);
+		throw std::ifstream::failure("MappedFile: Unable to open file!");
+	}
+	size = static_cast<uint64_t>(file_size.QuadPart);
+	mtime = ((static_cast<int64_t>(write_time.dwHighDateTime) << 32) | write_time.dwLowDateTime) * 100;
+
+	if (size) { // empty file can not be mapped
+		mapping_handle = CreateFileMappingA(file_handle, NULL, PAGE_READONLY, 0, 0, NULL);
+		if (mapping_handle != NULL) {
+			data = static_cast<const unsigned char*>(MapViewOfFile(mapping_handle, FILE_MAP_READ, 0, 0, 0));
+		}
+		if (data == nullptr) {
+			if (mapping_handle != NULL) CloseHandle(mapping_handle);
+			CloseHandle(file_handle);
+			throw std::ifstream::failure("MappedFile: Unable to map file!");
+		}
+	}
+}
+
+MappedFile::~MappedFile()
+{
+	if (data) UnmapViewOfFile(data);
+	if (mapping_handle != NULL) CloseHandle(mapping_handle);
+	CloseHandle(file_handle);
+}
+
+int MappedFile::Descriptor() const
+{
+	return -1;
+}
+
+bool MappedFile::Stat(const std::string &filepath, uint64_t &size, int64_t &mtime)
+{
+	WIN32_FILE_ATTRIBUTE_DATA attributes;
+	if (!GetFileAttributesExA(filepath.c_str(), GetFileExInfoStandard, &attributes) || (attributes.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY)) {
+		return false;
+	}
+	size = (static_cast<uint64_t>(attributes.nFileSizeHigh) << 32) | attributes.nFileSizeLow;
+	mtime = ((static_cast<int64_t>(attributes.ftLastWriteTime.dwHighDateTime) << 32) | attributes.ftLastWriteTime.dwLowDateTime) * 100;
+	return true;
+}
+
+int64_t MappedFile::Now()
+{
+	FILETIME now;
+	GetSystemTimeAsFileTime(&now);
+	return ((static_cast<int64_t>(now.dwHighDateTime) << 32) | now.dwLowDateTime) * 100;
+}
+
+bool MappedFile::Truncated() const
+{
+	return false; // mapped file can not be truncated on Windows
+}
+
+#else
+
+// access to mapping beyond end of truncated file raises SIGBUS, handler maps zero page over such page
+// of guarded mapping and marks it, so transfer of that file fails instead of whole process
+namespace {
+	struct MappingGuard {
+		std::atomic<uintptr_t> begin{ 0 }; // 0 = free slot, 1 = slot is being set
+		std::atomic<uintptr_t> end{ 0 };
+		std::atomic<bool> truncated{ false };
+	};
+
+	const int guard_count = 4096; // mappings beyond are not guarded
+	MappingGuard guards[guard_count];
+	uintptr_t page_size = 4096;
+	struct sigaction default_bus;
+
+	void bus_handler(int sig, siginfo_t *info, void *context)
+	{
+		(void)context; // bypass unreferenced parameter warning
+		uintptr_t address = reinterpret_cast<uintptr_t>(info->si_addr);
+		for (auto &guard : guards) {
+			if (address >= guard.begin && address < guard.end) {
+				void *page = reinterpret_cast<void*>(address & ~(page_size - 1));
+				if (mmap(page, static_cast<std::size_t>(page_size), PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0) != MAP_FAILED) {
+					guard.truncated = true;
+					return; // access is repeated on zero page
+				}
+			}
+		}
+		sigaction(sig, &default_bus, nullptr); // not a mapped file, repeated access takes previous action
+	}
+
+	int guard_mapping(const unsigned char *data, uint64_t size)
+	{
+		static std::once_flag installed;
+		std::call_once(installed, []() {
+			page_size = static_cast<uintptr_t>(sysconf(_SC_PAGESIZE));
+			struct sigaction action = {};
+			action.sa_sigaction = bus_handler;
+			action.sa_flags = SA_SIGINFO;
+			sigemptyset(&action.sa_mask);
+			sigaction(SIGBUS, &action, &default_bus);
+		});
+		for (int i = 0; i < guard_count; i++) {
+			uintptr_t free_slot = 0;
+			if (guards[i].begin.compare_exchange_strong(free_slot, 1)) {
+				guards[i].truncated = false;
+				guards[i].end = reinterpret_cast<uintptr_t>(data) + static_cast<uintptr_t>(size);
+				guards[i].begin = reinterpret_cast<uintptr_t>(data);
+				return i;
+			}
+		}
+		return -1;
+	}
+
+	void unguard_mapping(int guard)
+	{
+		if (guard >= 0) {
+			guards[guard].end = 0;
+			guards[guard].begin = 0;
+		}
+	}
+}
+
+MappedFile::MappedFile(std::string filepath)
+	: fd(-1), guard(-1), data(nullptr), size(0), mtime(0)
+{
+	IPK_TRACE_SPAN("file.map");
+	struct stat st;
+	fd = open(filepath.c_str(), O_RDONLY | O_CLOEXEC);
+	if (fd < 0 || fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)) {
+		if (fd >= 0) close(fd);
+		throw std::ifstream::failure("MappedFile: Unable to open file!");
+	}
+	size = static_cast<uint64_t>(st.st_size);
+#if defined(__linux__)
+	mtime = static_cast<int64_t>(st.st_mtim.tv_sec) * 1000000000 + st.st_mtim.tv_nsec;
+#else
+	mtime = static_cast<int64_t>(st.st_mtime) * 1000000000;
+#endif
+
+	if (size) { // empty file can not be mapped
+		void *mapping = mmap(NULL, static_cast<std::size_t>(size), PROT_READ, MAP_SHARED, fd, 0);
+		if (mapping == MAP_FAILED) {
+			close(fd);
+			throw std::ifstream::failure("MappedFile: Unable to map file!");
+		}
+		madvise(mapping, static_cast<std::size_t>(size), MADV_SEQUENTIAL);
+		data = static_cast<const unsigned char*>(mapping);
+		guard = guard_mapping(data, size);
+	}
+}
+
+MappedFile::~MappedFile()
+{
+	unguard_mapping(guard);
+	if (data) munmap(const_cast<unsigned char*>(data), static_cast<std::size_t>(size));
+	close(fd);
+}
+
+int MappedFile::Descriptor() const
+{
+	return fd;
+}
+
+bool MappedFile::Stat(const std::string &filepath, uint64_t &size, int64_t &mtime)
+{
+	struct stat st;
+	if (stat(filepath.c_str(), &st) != 0 || !S_ISREG(st.st_mode)) {
+		return false;
+	}
+	size = static_cast<uint64_t>(st.st_size);
+#if defined(__linux__)
+	mtime = static_cast<int64_t>(st.st_mtim.tv_sec) * 1000000000 + st.st_mtim.tv_nsec;
+#else
+	mtime = static_cast<int64_t>(st.st_mtime) * 1000000000;
+#endif
+	return true;
+}
+
+int64_t MappedFile::Now()
+{
+	struct timespec now;
+	clock_gettime(CLOCK_REALTIME, &now);
+	return static_cast<int64_t>(now.tv_sec) * 1000000000 + now.tv_nsec;
+}
+
+bool MappedFile::Truncated() const
+{
+	if (guard >= 0) {
+		return guards[guard].truncated;
+	}
+	struct stat st;
+	return data && fstat(fd, &st) == 0 && static_cast<uint64_t>(st.st_size) < size; // unguarded mapping
+}
+
+#endif
+
+const unsigned char *MappedFile::Data() const
+{
+	return this->data;
+}
+
+uint64_t MappedFile::Size() const
+{
+	return this->size;
+}
+
+int64_t MappedFile::ModificationTime() const
+{
+	return this->mtime;
+}
@@ -0,0 +1,50 @@
+/*
+*	IPK Project 1: client-server for simple file transfer
+*	Author: Tomáš Pazdiora (xpazdi02)
+*	File: MappedFile.h
+*/
+
+#ifndef MAPPEDFILE_H
+#define MAPPEDFILE_H
+
+#include <string>
+#include <stdint.h>
+
+// Read-only memory mapped file (file data are read directly from page cache), file truncated by another
+// process while it is mapped reads as zeros beyond its new end instead of raising SIGBUS, see Truncated
+class MappedFile {
+#if defined(_WIN32)
+	void *file_handle;
+	void *mapping_handle;
+#else
+	int fd;
+	int guard; // slot of SIGBUS guard of mapping (-1 = none)
+#endif
+	const unsigned char *data;
+	uint64_t size;
+	int64_t mtime;
+public:
+	// open and map file (throws std::ifstream::failure)
+	MappedFile(std::string filepath);
+	MappedFile(const MappedFile &other) = delete;
+	~MappedFile();
+
+	const unsigned char *Data() const;
+	uint64_t Size() const;
+	int64_t ModificationTime() const; // nanoseconds (platform specific epoch)
+
+	// part of mapping was read after file was truncated (data read from mapping so far may be zeros),
+	// transfer of such data must fail instead of being verified
+	bool Truncated() const;
+
+	// file descriptor for zero-copy transfers (-1 if not available)
+	int Descriptor() const;
+
+	// size and modification time of regular file without opening it (false if it is not accessible)
+	static bool Stat(const std::string &filepath, uint64_t &size, int64_t &mtime);
+
+	// current time in units and epoch of ModificationTime
+	static int64_t Now();
+};
+
+#endif
@@ -0,0 +1,242 @@
+/*
+*	IPK Project 1: client-server for simple file transfer
+*	Author: Tomáš Pazdiora (xpazdi02)
+*	File: SHA256.cpp
+*/
+
+#include "SHA256.h"
+#include <cstring>
+
+// x86 specific (CPUID and SHA extensions)
+#if defined(__x86_64__) || defined(__i386__) || defined(_M_X64) || defined(_M_IX86)
+#define SHA256_X86
+#include <emmintrin.h>
+#include <tmmintrin.h>
+#include <smmintrin.h>
+#include <immintrin.h>
+#if defined(_MSC_VER)
+#include <intrin.h>
+#define SHA256_TARGET_SHANI
+#else
+#include <cpuid.h>
+#define SHA256_TARGET_SHANI __attribute__((target("sse4.1,sha")))
+#endif
+#endif
+
+static const uint32_t round_constants[64] = {
+	0x428A2F98, 0x71374491, 0xB5C0FBCF, 0xE9B5DBA5, 0x3956C25B, 0x59F111F1, 0x923F82A4, 0xAB1C5ED5,
+	0xD807AA98, 0x12835B01, 0x243185BE, 0x550C7DC3, 0x72BE5D74, 0x80DEB1FE, 0x9BDC06A7, 0xC19BF174,
+	0xE49B69C1, 0xEFBE4786, 0x0FC19DC6, 0x240CA1CC, 0x2DE92C6F, 0x4A7484AA, 0x5CB0A9DC, 0x76F988DA,
+	0x983E5152, 0xA831C66D, 0xB00327C8, 0xBF597FC7, 0xC6E00BF3, 0xD5A79147, 0x06CA6351, 0x14292967,
+	0x27B70A85, 0x2E1B2138, 0x4D2C6DFC, 0x53380D13, 0x650A7354, 0x766A0ABB, 0x81C2C92E, 0x92722C85,
+	0xA2BFE8A1, 0xA81A664B, 0xC24B8B70, 0xC76C51A3, 0xD192E819, 0xD6990624, 0xF40E3585, 0x106AA070,
+	0x19A4C116, 0x1E376C08, 0x2748774C, 0x34B0BCB5, 0x391C0CB3, 0x4ED8AA4A, 0x5B9CCA4F, 0x682E6FF3,
+	0x748F82EE, 0x78A5636F, 0x84C87814, 0x8CC70208, 0x90BEFFFA, 0xA4506CEB, 0xBEF9A3F7, 0xC67178F2
+};
+
+static const uint32_t initial_state[8] = {
+	0x6A09E667, 0xBB67AE85, 0x3C6EF372, 0xA54FF53A, 0x510E527F, 0x9B05688C, 0x1F83D9AB, 0x5BE0CD19
+};
+
+static inline uint32_t rotr(uint32_t x, unsigned int n)
+{
+	return (x >> n) | (x << (32 - n));
+}
+
+// compress 64 byte blocks into state
+static void sha256_scalar(uint32_t state[8], const unsigned char *data, std::size_t blocks)
+{
+	for (; blocks > 0; blocks--, data += 64) {
+		uint32_t w[64];
+		for (int i = 0; i < 16; i++) {
+			w[i] = (static_cast<uint32_t>(data[4 * i]) << 24) | (static_cast<uint32_t>(data[4 * i + 1]) << 16) |
+				(static_cast<uint32_t>(data[4 * i + 2]) << 8) | static_cast<uint32_t>(data[4 * i + 3]);
+		}
+		for (int i = 16; i < 64; i++) {
+			uint32_t s0 = rotr(w[i - 15], 7) ^ rotr(w[i - 15], 18) ^ (w[i - 15] >> 3);
+			uint32_t s1 = rotr(w[i - 2], 17) ^ rotr(w[i - 2], 19) ^ (w[i - 2] >> 10);
+			w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+		}
+
+		uint32_t a = state[0], b = state[1], c = state[2], d = state[3];
+		uint32_t e = state[4], f = state[5], g = state[6], h = state[7];
+		for (int i = 0; i < 64; i++) {
+			uint32_t t1 = h + (rotr(e, 6) ^ rotr(e, 11) ^ rotr(e, 25)) + ((e & f) ^ (~e & g)) + round_constants[i] + w[i];
+			uint32_t t2 = (rotr(a, 2) ^ rotr(a, 13) ^ rotr(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+			h = g; g = f; f = e; e = d + t1;
+			d = c; c = b; b = a; a = t1 + t2;
+		}
+		state[0] += a; state[1] += b; state[2] += c; state[3] += d;
+		state[4] += e; state[5] += f; state[6] += g; state[7] += h;
+	}
+}
+
+#if defined(SHA256_X86)
+// four rounds at a time, state is kept as ABEF and CDGH (layout of SHA256RNDS2)
+SHA256_TARGET_SHANI
+static void sha256_shani(uint32_t state[8], const unsigned char *data, std::size_t blocks)
+{
+	const __m128i byteswap = _mm_set_epi64x(0x0C0D0E0F08090A0BULL, 0x0405060700010203ULL);
+	__m128i tmp = _mm_shuffle_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i*>(state)), 0xB1); // CDAB
+	__m128i state1 = _mm_shuffle_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i*>(state + 4)), 0x1B); // EFGH
+	__m128i state0 = _mm_alignr_epi8(tmp, state1, 8); // ABEF
+	state1 = _mm_blend_epi16(state1, tmp, 0xF0); // CDGH
+
+	for (; blocks > 0; blocks--, data += 64) {
+		__m128i abef = state0, cdgh = state1;
+		__m128i w[4]; // message schedule of last 16 rounds
+		for (int i = 0; i < 4; i++) {
+			w[i] = _mm_shuffle_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i*>(data + 16 * i)), byteswap);
+		}
+		for (int i = 0; i < 16; i++) {
+			__m128i message = _mm_add_epi32(w[i & 3], _mm_loadu_si128(reinterpret_cast<const __m128i*>(round_constants + 4 * i)));
+			state1 = _mm_sha256rnds2_epu32(state1, state0, message);
+			state0 = _mm_sha256rnds2_epu32(state0, state1, _mm_shuffle_epi32(message, 0x0E));
+			if (i < 12) {
+				// W[t] = sigma1(W[t-2]) + W[t-7] + sigma0(W[t-15]) + W[t-16]
+				__m128i next = _mm_add_epi32(_mm_sha256msg1_epu32(w[i & 3], w[(i + 1) & 3]), _mm_alignr_epi8(w[(i + 3) & 3], w[(i + 2) & 3], 4));
+				w[i & 3] = _mm_sha256msg2_epu32(next, w[(i + 3) & 3]);
+			}
+		}
+		state0 = _mm_add_epi32(state0, abef);
+		state1 = _mm_add_epi32(state1, cdgh);
+	}
+
+	tmp = _mm_shuffle_epi32(state0, 0x1B); // FEBA
+	state1 = _mm_shuffle_epi32(state1, 0xB1); // DCHG
+	_mm_storeu_si128(reinterpret_cast<__m128i*>(state), _mm_blend_epi16(tmp, state1, 0xF0)); // DCBA
+	_mm_storeu_si128(reinterpret_cast<__m128i*>(state + 4), _mm_alignr_epi8(state1, tmp, 8)); // HGFE
+}
+
+// CPUID leaf 1: ECX bit 9 = SSSE3, bit 19 = SSE4.1, leaf 7: EBX bit 29 = SHA
+static bool cpu_has_shani()
+{
+	unsigned int ecx = 0, ebx7 = 0;
+#if defined(_MSC_VER)
+	int info[4];
+	__cpuid(info, 0);
+	if (info[0] < 7) {
+		return false;
+	}
+	__cpuid(info, 1);
+	ecx = static_cast<unsigned int>(info[2]);
+	__cpuidex(info, 7, 0);
+	ebx7 = static_cast<unsigned int>(info[1]);
+#else
+	unsigned int eax, ebx, edx;
+	if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx) || __get_cpuid_max(0, nullptr) < 7) {
+		return false;
+	}
+	__cpuid_count(7, 0, eax, ebx7, edx, edx);
+#endif
+	return (ecx & (1u << 9)) && (ecx & (1u << 19)) && (ebx7 & (1u << 29));
+}
+#endif
+
+bool SHA256Supported(SHA256Kernel kernel)
+{
+	switch (kernel) {
+	case SHA256Scalar:
+		return true;
+	case SHA256SHANI:
+#if defined(SHA256_X86)
+		return cpu_has_shani();
+#else
+		return false;
+#endif
+	default:
+		return false;
+	}
+}
+
+// selected once, at startup
+static const SHA256Kernel sha256_selected = SHA256Supported(SHA256SHANI) ? SHA256SHANI : SHA256Scalar;
+
+SHA256Kernel SHA256Selected()
+{
+	return sha256_selected;
+}
+
+static void sha256_update(SHA256Kernel kernel, uint32_t state[8], const unsigned char *data, std::size_t blocks)
+{
+	switch (kernel) {
+#if defined(SHA256_X86)
+	case SHA256SHANI:
+		sha256_shani(state, data, blocks);
+		break;
+#endif
+	default:
+		sha256_scalar(state, data, blocks);
+		break;
+	}
+}
+
+void SHA256(const unsigned char *data, std::size_t size, unsigned char *digest)
+{
+	SHA256(data, size, digest, sha256_selected);
+}
+
+void SHA256(const unsigned char *data, std::size_t size, unsigned char *digest, SHA256Kernel kernel)
+{
+	SHA256State sha(kernel);
+	sha.Update(data, size);
+	sha.Finalize(digest);
+}
+
+// ---------------- SHA256State ----------------
+
+SHA256State::SHA256State(SHA256Kernel kernel)
+	: kernel(kernel)
+{
+	Init();
+}
+
+void SHA256State::Init()
+{
+	std::memcpy(state, initial_state, sizeof(state));
+	length = 0;
+	buffered = 0;
+}
+
+void SHA256State::Update(const unsigned char *data, std::size_t size)
+{
+	length += size;
+	if (buffered) {
+		std::size_t chunk = (size < sizeof(block) - buffered) ? size : sizeof(block) - buffered;
+		std::memcpy(block + buffered, data, chunk);
+		buffered += chunk;
+		data += chunk;
+		size -= chunk;
+		if (buffered < sizeof(block)) {
+			return;
+		}
+		sha256_update(kernel, state, block, 1);
+		buffered = 0;
+	}
+	std::size_t blocks = size / sizeof(block);
+	if (blocks) {
+		sha256_update(kernel, state, data, blocks);
+	}
+	buffered = size - blocks * sizeof(block);
+	std::memcpy(block, data + blocks * sizeof(block), buffered);
+}
+
+void SHA256State::Finalize(unsigned char *digest) const
+{
+	// padding: 0x80, zeros and message length in bits (big-endian)
+	SHA256State last(*this);
+	unsigned char padding[2 * sizeof(block)] = { 0x80 };
+	std::size_t padding_size = ((buffered < 56) ? 56 : 120) - buffered;
+	uint64_t bits = length * 8;
+	for (int i = 0; i < 8; i++) {
+		padding[padding_size + i] = static_cast<unsigned char>(bits >> (56 - 8 * i));
+	}
+	last.Update(padding, padding_size + 8);
+
+	for (int i = 0; i < 8; i++) {
+		digest[4 * i] = static_cast<unsigned char>(last.state[i] >> 24);
+		digest[4 * i + 1] = static_cast<unsigned char>(last.state[i] >> 16);
+		digest[4 * i + 2] = static_cast<unsigned char>(last.state[i] >> 8);
+		digest[4 * i + 3] = static_cast<unsigned char>(last.state[i]);
+	}
+}
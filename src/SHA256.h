@@ -0,0 +1,45 @@
+/*
+*	IPK Project 1: client-server for simple file transfer
+*	Author: Tomáš Pazdiora (xpazdi02)
+*	File: SHA256.h
+*/
+
+#ifndef SHA256_H
+#define SHA256_H
+
+#include <cstddef>
+#include <stdint.h>
+
+// SHA-256 kernels (all of them give identical results)
+enum SHA256Kernel {
+	SHA256Scalar, // portable implementation (FIPS 180-4)
+	SHA256SHANI // SHA extensions (x86 with SSE4.1 and SHA)
+};
+
+// Check if kernel can be used on this CPU
+bool SHA256Supported(SHA256Kernel kernel);
+
+// Best supported kernel (selected at startup using CPUID)
+SHA256Kernel SHA256Selected();
+
+// Compute SHA-256 digest (sha256_size bytes) of given data
+const std::size_t sha256_size = 32;
+void SHA256(const unsigned char *data, std::size_t size, unsigned char *digest);
+void SHA256(const unsigned char *data, std::size_t size, unsigned char *digest, SHA256Kernel kernel);
+
+// Incremental SHA-256 computation (init, update by blocks, finalize)
+class SHA256State {
+	uint32_t state[8];
+	uint64_t length;
+	unsigned char block[64];
+	std::size_t buffered;
+	SHA256Kernel kernel;
+public:
+	SHA256State(SHA256Kernel kernel = SHA256Selected());
+
+	void Init();
+	void Update(const unsigned char *data, std::size_t size);
+	void Finalize(unsigned char *digest) const;
+};
+
+#endif
@@ -5,9 +5,16 @@
 */
 
 #include "TCP.h"
+#include "IPKMetrics.h"
+#include "IPKTrace.h"
+#include "CRC32.h"
+#include "MappedFile.h"
+#include "IOUring.h"
 
 #include <string>
 #include <algorithm>
+#include <thread>
+#include <chrono>
 
 // Linux specific
 #if defined(__linux__) || defined(__FreeBSD__)
@@ -18,6 +25,12 @@
 #include <fcntl.h>
 #include <arpa/inet.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/uio.h>
+#include <sys/ioctl.h>
+#include <poll.h>
+#include <limits.h>
+#include <errno.h>
 
 #define INVALID_SOCKET -1
 #define SOCKET_ERROR -1
@@ -25,6 +38,101 @@
 #define SEND_FLAGS MSG_NOSIGNAL
 #endif
 
+// Linux zero-copy (sendfile) and send coalescing
+#if defined(__linux__)
+#include <sys/sendfile.h>
+#include <linux/sockios.h>
+#include <signal.h>
+#define SEND_MORE MSG_MORE
+
+namespace {
+	// sendfile has no MSG_NOSIGNAL, SIGPIPE of connection closed by peer is blocked for calling thread
+	// and consumed, so it is reported by EPIPE only (disposition of SIGPIPE is left to application)
+	ssize_t SendFileNoSignal(int sock, int descriptor, off_t *offset, std::size_t bytes)
+	{
+		sigset_t pipe_set, old_set;
+		sigemptyset(&pipe_set);
+		sigaddset(&pipe_set, SIGPIPE);
+		pthread_sigmask(SIG_BLOCK, &pipe_set, &old_set);
+		ssize_t ret = sendfile(sock, descriptor, offset, bytes);
+		int error = errno;
+		if (!sigismember(&old_set, SIGPIPE)) { // signal blocked by caller is left pending
+			if (ret < 0 && error == EPIPE) {
+				timespec zero = { 0, 0 };
+				while (sigtimedwait(&pipe_set, NULL, &zero) < 0 && errno == EINTR) {
+					// interrupted by other signal
+				}
+			}
+			pthread_sigmask(SIG_SETMASK, &old_set, NULL);
+		}
+		errno = error;
+		return ret;
+	}
+}
+#else
+#define SEND_MORE 0
+#endif
+
+// Linux zero-copy receive (splice)
+#if defined(__linux__)
+namespace {
+	void ClosePipe(int (&pipe_fds)[2])
+	{
+		if (pipe_fds[0] >= 0) {
+			close(pipe_fds[0]);
+			close(pipe_fds[1]);
+			pipe_fds[0] = pipe_fds[1] = -1;
+		}
+	}
+
+	// move at most bytes from socket into file at offset through pipe (data never enter user space),
+	// returns number of moved bytes or 0 if socket would block (pipe is always left empty)
+	std::size_t SpliceToFile(int sock, int (&pipe_fds)[2], int descriptor, uint64_t offset, std::size_t bytes)
+	{
+		if (pipe_fds[0] < 0 && pipe2(pipe_fds, O_NONBLOCK | O_CLOEXEC) < 0) {
+			throw TCPException(SendRecvFailed, "TCPError: pipe Failed!");
+		}
+
+		ssize_t in_ret;
+		do {
+			in_ret = splice(sock, NULL, pipe_fds[1], NULL, bytes, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+		} while (in_ret < 0 && errno == EINTR);
+		if (in_ret == 0) {
+			throw TCPException(ConnectionClosed, "TCPError: Connection Closed!");
+		}
+		else if (in_ret < 0) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK) {
+				return 0;
+			}
+			throw TCPException(SendRecvFailed, "TCPError: splice Failed!");
+		}
+
+		loff_t file_offset = static_cast<loff_t>(offset);
+		std::size_t in_pipe = static_cast<std::size_t>(in_ret);
+		while (in_pipe) {
+			ssize_t out_ret = splice(pipe_fds[0], NULL, descriptor, &file_offset, in_pipe, SPLICE_F_MOVE);
+			if (out_ret > 0) {
+				in_pipe -= static_cast<std::size_t>(out_ret);
+			}
+			else if (out_ret == 0 || errno != EINTR) {
+				ClosePipe(pipe_fds); // stream is lost, pipe content is dropped
+				throw TCPException(SendRecvFailed, "TCPError: splice to file Failed!");
+			}
+		}
+		return static_cast<std::size_t>(in_ret);
+	}
+}
+#endif
+
+// Linux reactor (epoll)
+#if defined(__linux__)
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <atomic>
+#include <mutex>
+#include <unordered_map>
+#endif
+
 // Windows specific
 #if defined(_WIN32)
 #include <ws2tcpip.h>
@@ -48,8 +156,19 @@
 // Settings
 const int TCP::maxconnections = SOMAXCONN;
 const bool TCP::nonblocking = true;
-static const std::size_t default_block_size = 1024;
 static const int default_timeout = 7;
+static const std::size_t min_auto_block = 16 * 1024; // auto-tuned block size range
+static const std::size_t max_auto_block = 4 * 1024 * 1024;
+
+// last socket operation failed only because it would block (caller should wait for socket)
+static bool would_block()
+{
+#if defined(_WIN32)
+	return WSAGetLastError() == WSAEWOULDBLOCK;
+#else
+	return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+#endif
+}
 
 
 void TCP::Connect(std::string host, std::string port)
@@ -73,6 +192,7 @@ void TCP::Connect(std::string host, std::string port)
 	for (auto res = result; res != NULL; res = res->ai_next) {
 		this->sock = socket(res->ai_family, res->ai_socktype, res->ai_protocol); // try to create socket
 		if (this->sock != INVALID_SOCKET) {
+			setBuffers(this->sock); // before connect, so window scaling is negotiated accordingly
 			if (connect(this->sock, res->ai_addr, res->ai_addrlen) != SOCKET_ERROR) { // try to connect
 				freeaddrinfo(result);
 				if (nonblocking) { // set non-blocking if enabled
@@ -101,6 +221,473 @@ void TCP::Listen(std::string port, std::function<void(TCP)> clientConnectionHand
 	}, host);
 }
 void TCP::Listen(std::string port, std::function<void(TCP, const std::string, const std::string)> clientConnectionHandler, std::string host)
+{
+	if (!this->connected) {
+		Bind(port, host);
+	}
+
+	// accept loop (until Stop) //Possible Improvement: enable termination of server using stdin
+	while (!stopped) {
+		std::string client_ip, client_port;
+		TCPSocket client;
+		try {
+			client = Accept(&client_ip, &client_port);
+		}
+		catch (const TCPException &e) {
+			(void)e; // bypass unreferenced local variable warning
+			if (stopped) {
+				break;
+			}
+			throw;
+		}
+
+		// call connection handler
+		if (clientConnectionHandler) {
+			TCP connection(client);
+			connection.Configure(this->options);
+			clientConnectionHandler(std::move(connection), client_ip, client_port);
+		}
+		else {
+			shutdown(client, SHUT_RDWR);
+			close(client);
+		}
+	}
+}
+
+#if defined(__linux__)
+namespace {
+	// connection driven by reactor event loop
+	struct ReactorConnection {
+		TCPSocket sock;
+		std::unique_ptr<TCPHandler> handler;
+		TCPRequest request;
+		std::size_t base; // Recv: size of buffer before request
+		std::size_t done; // bytes of current request already processed
+		std::chrono::steady_clock::time_point activity;
+		int pipe[2]; // RecvFile: splice pipe, created on first use
+		bool waiting; // Wait: handler is asked again by next iteration of loop
+	};
+
+	// single event loop thread of reactor (owns its connections)
+	class ReactorLoop : public TCPEventLoop {
+		const int timeout;
+		int epoll_fd;
+		int event_fd;
+		std::atomic<bool> stop;
+		std::mutex incoming_mutex;
+		std::vector<std::unique_ptr<ReactorConnection>> incoming;
+		std::unordered_map<TCPSocket, std::unique_ptr<ReactorConnection>> connections;
+		std::vector<TCPSocket> waiting; // connections with Wait request
+		std::thread thread;
+
+		void Run();
+		void Wake();
+		void Poll();
+		bool Progress(ReactorConnection &conn);
+		void Remove(TCPSocket sock);
+	public:
+		ReactorLoop(int timeout);
+		~ReactorLoop() override;
+
+		void Add(TCPSocket sock, std::unique_ptr<TCPHandler> handler) override;
+	};
+
+	ReactorLoop::ReactorLoop(int timeout) : timeout(timeout), epoll_fd(-1), event_fd(-1), stop(false)
+	{
+		epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+		event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+		if (epoll_fd < 0 || event_fd < 0) {
+			if (epoll_fd >= 0) close(epoll_fd);
+			if (event_fd >= 0) close(event_fd);
+			throw(TCPException(ListenFailed, "TCPError: Unable to create event loop!"));
+		}
+		epoll_event ev{};
+		ev.events = EPOLLIN;
+		ev.data.fd = event_fd;
+		epoll_ctl(epoll_fd, EPOLL_CTL_ADD, event_fd, &ev);
+		thread = std::thread(&ReactorLoop::Run, this);
+	}
+
+	ReactorLoop::~ReactorLoop()
+	{
+		stop = true;
+		Wake();
+		thread.join();
+		for (auto &conn : connections) {
+			shutdown(conn.first, SHUT_RDWR);
+			close(conn.first);
+			ClosePipe(conn.second->pipe);
+		}
+		for (auto &conn : incoming) {
+			shutdown(conn->sock, SHUT_RDWR);
+			close(conn->sock);
+		}
+		close(event_fd);
+		close(epoll_fd);
+	}
+
+	void ReactorLoop::Wake()
+	{
+		uint64_t one = 1;
+		if (write(event_fd, &one, sizeof(one)) < 0) {
+			// counter is already signaled
+		}
+	}
+
+	void ReactorLoop::Add(TCPSocket sock, std::unique_ptr<TCPHandler> handler)
+	{
+		std::unique_ptr<ReactorConnection> conn(new ReactorConnection{ sock, std::move(handler), {}, 0, 0, {}, { -1, -1 }, false });
+		{
+			std::lock_guard<std::mutex> lock(incoming_mutex);
+			incoming.push_back(std::move(conn));
+		}
+		Wake();
+	}
+
+	void ReactorLoop::Remove(TCPSocket sock)
+	{
+		epoll_ctl(epoll_fd, EPOLL_CTL_DEL, sock, NULL);
+		shutdown(sock, SHUT_RDWR);
+		close(sock);
+		auto it = connections.find(sock);
+		if (it != connections.end()) {
+			ClosePipe(it->second->pipe);
+			connections.erase(it);
+		}
+	}
+
+	// advance connection state machine as far as possible without blocking (false if connection should be closed)
+	bool ReactorLoop::Progress(ReactorConnection &conn)
+	{
+		while (true) {
+			TCPRequest &req = conn.request;
+			if (req.kind == TCPRequest::Close) {
+				return false;
+			}
+			if (req.kind == TCPRequest::Wait) {
+				if (!conn.waiting) {
+					conn.waiting = true;
+					waiting.push_back(conn.sock);
+				}
+				return true; // see Poll
+			}
+
+			bool would_block = false;
+			try {
+				IPK_TRACE_SPAN("reactor.progress");
+				if (req.kind == TCPRequest::Recv) {
+					while (conn.done < req.bytes) {
+						std::vector<unsigned char> &data = *req.data;
+						data.resize(conn.base + req.bytes);
+						unsigned char *ptr = data.data() + conn.base + conn.done;
+						long long recv_ret = recv(conn.sock, reinterpret_cast<char*>(ptr), req.bytes - conn.done, 0);
+						if (recv_ret > 0) {
+							if (req.crc) {
+								IPK_TRACE_SPAN_BYTES("crc32.recv", static_cast<uint64_t>(recv_ret));
+								req.crc->Update(ptr, static_cast<std::size_t>(recv_ret));
+							}
+							IPKMetrics::Add(BytesIn, static_cast<uint64_t>(recv_ret));
+							conn.done += static_cast<std::size_t>(recv_ret);
+							conn.activity = std::chrono::steady_clock::now();
+							continue;
+						}
+						data.resize(conn.base + conn.done);
+						if (recv_ret == 0) {
+							throw TCPException(ConnectionClosed, "TCPError: Connection Closed!");
+						}
+						else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+							would_block = true;
+							break;
+						}
+						else if (errno != EINTR) {
+							throw TCPException(SendRecvFailed, "TCPError: recv Failed!");
+						}
+					}
+				}
+				else if (req.kind == TCPRequest::RecvFile) {
+					while (conn.done < req.bytes) {
+						std::size_t moved = SpliceToFile(conn.sock, conn.pipe, req.descriptor, req.offset + conn.done, req.bytes - conn.done);
+						if (moved == 0) {
+							would_block = true;
+							break;
+						}
+						IPKMetrics::Add(BytesIn, moved);
+						conn.done += moved;
+						conn.activity = std::chrono::steady_clock::now();
+					}
+				}
+				else {
+					const std::vector<unsigned char> &data = *req.data;
+					const std::size_t file_bytes = (req.kind == TCPRequest::SendFile) ? req.bytes : 0;
+					while (conn.done < data.size()) {
+						const unsigned char *ptr = data.data() + conn.done;
+						long long send_ret = send(conn.sock, reinterpret_cast<const char*>(ptr), data.size() - conn.done, SEND_FLAGS | (file_bytes ? SEND_MORE : 0));
+						if (send_ret > 0) {
+							if (req.crc) {
+								IPK_TRACE_SPAN_BYTES("crc32.send", static_cast<uint64_t>(send_ret));
+								req.crc->Update(ptr, static_cast<std::size_t>(send_ret));
+							}
+							IPKMetrics::Add(BytesOut, static_cast<uint64_t>(send_ret));
+							conn.done += static_cast<std::size_t>(send_ret);
+							conn.activity = std::chrono::steady_clock::now();
+							continue;
+						}
+						if (send_ret == 0) {
+							throw TCPException(ConnectionClosed, "TCPError: Connection Closed!");
+						}
+						else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+							would_block = true;
+							break;
+						}
+						else if (errno != EINTR) {
+							throw TCPException(SendRecvFailed, "TCPError: send Failed!");
+						}
+					}
+					// file data directly from page cache
+					while (!would_block && conn.done < data.size() + file_bytes) {
+						std::size_t file_done = conn.done - data.size();
+						off_t file_offset = static_cast<off_t>(req.offset + file_done);
+						ssize_t sendfile_ret = SendFileNoSignal(conn.sock, req.file->Descriptor(), &file_offset, file_bytes - file_done);
+						if (sendfile_ret > 0) {
+							IPKMetrics::Add(BytesOut, static_cast<uint64_t>(sendfile_ret));
+							conn.done += static_cast<std::size_t>(sendfile_ret);
+							conn.activity = std::chrono::steady_clock::now();
+						}
+						else if (sendfile_ret < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+							would_block = true;
+						}
+						else if (sendfile_ret == 0 || errno != EINTR) {
+							throw TCPException(SendRecvFailed, "TCPError: sendfile Failed!");
+						}
+					}
+				}
+				if (would_block) {
+					return true; // wait for next event
+				}
+				conn.handler->Completed();
+			}
+			catch (const TCPException &e) {
+				conn.handler->Failed(e);
+			}
+
+			// start next request
+			conn.request = conn.handler->Next();
+			conn.base = (conn.request.kind == TCPRequest::Recv) ? conn.request.data->size() : 0;
+			conn.done = 0;
+		}
+	}
+
+	// ask handlers waiting for their background work again
+	void ReactorLoop::Poll()
+	{
+		std::vector<TCPSocket> polled;
+		polled.swap(waiting);
+		for (TCPSocket sock : polled) {
+			auto it = connections.find(sock);
+			if (it == connections.end() || !it->second->waiting) {
+				continue; // closed meanwhile
+			}
+			ReactorConnection &conn = *it->second;
+			conn.waiting = false;
+			conn.activity = std::chrono::steady_clock::now();
+			bool keep = false;
+			try {
+				conn.handler->Completed();
+				conn.request = conn.handler->Next();
+				conn.base = (conn.request.kind == TCPRequest::Recv) ? conn.request.data->size() : 0;
+				conn.done = 0;
+				keep = Progress(conn);
+			}
+			catch (const std::exception &e) {
+				(void)e; // bypass unreferenced local variable warning
+			}
+			if (!keep) {
+				Remove(sock);
+			}
+		}
+	}
+
+	void ReactorLoop::Run()
+	{
+		const int max_events = 64;
+		epoll_event events[max_events];
+		auto last_sweep = std::chrono::steady_clock::now();
+
+		while (!stop) {
+			int n;
+			{
+				IPK_TRACE_SPAN("reactor.wait");
+				n = epoll_wait(epoll_fd, events, max_events, waiting.empty() ? 1000 : 1);
+			}
+			if (n < 0 && errno != EINTR) {
+				break;
+			}
+
+			for (int i = 0; i < n; i++) {
+				if (events[i].data.fd == event_fd) {
+					uint64_t value;
+					if (read(event_fd, &value, sizeof(value)) < 0) {
+						// nothing to read
+					}
+
+					// register new connections (edge triggered, both directions)
+					std::vector<std::unique_ptr<ReactorConnection>> accepted;
+					{
+						std::lock_guard<std::mutex> lock(incoming_mutex);
+						accepted.swap(incoming);
+					}
+					for (auto &conn : accepted) {
+						TCPSocket sock = conn->sock;
+						epoll_event ev{};
+						ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+						ev.data.fd = sock;
+						ReactorConnection &c = *(connections[sock] = std::move(conn));
+						c.activity = std::chrono::steady_clock::now();
+						bool keep = false;
+						try {
+							c.request = c.handler->Next();
+							c.base = (c.request.kind == TCPRequest::Recv) ? c.request.data->size() : 0;
+							keep = (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, sock, &ev) == 0) && Progress(c);
+						}
+						catch (const std::exception &e) {
+							(void)e; // bypass unreferenced local variable warning
+						}
+						if (!keep) {
+							Remove(sock);
+						}
+					}
+					continue;
+				}
+
+				auto it = connections.find(events[i].data.fd);
+				if (it == connections.end()) {
+					continue;
+				}
+				bool keep = false;
+				try {
+					keep = Progress(*it->second);
+				}
+				catch (const std::exception &e) {
+					(void)e; // bypass unreferenced local variable warning
+				}
+				if (!keep) {
+					Remove(it->first);
+				}
+			}
+
+			Poll();
+
+			// check timeouts of connections waiting for data
+			auto now = std::chrono::steady_clock::now();
+			if (now - last_sweep >= std::chrono::seconds(1)) {
+				last_sweep = now;
+				std::vector<TCPSocket> closed;
+				for (auto &entry : connections) {
+					ReactorConnection &conn = *entry.second;
+					if (now - conn.activity < std::chrono::seconds(timeout)) {
+						continue;
+					}
+					bool keep = false;
+					try {
+						conn.activity = now;
+						conn.handler->Failed(TCPException(Timeout, "TCPError: Timeout!"));
+						if (conn.request.kind == TCPRequest::Recv) {
+							conn.request.data->resize(conn.base + conn.done);
+						}
+						conn.request = conn.handler->Next();
+						conn.base = (conn.request.kind == TCPRequest::Recv) ? conn.request.data->size() : 0;
+						conn.done = 0;
+						keep = Progress(conn);
+					}
+					catch (const std::exception &e) {
+						(void)e; // bypass unreferenced local variable warning
+					}
+					if (!keep) {
+						closed.push_back(entry.first);
+					}
+				}
+				for (auto sock : closed) {
+					Remove(sock);
+				}
+			}
+		}
+	}
+}
+#endif
+
+void TCP::Listen(std::string port, std::function<std::unique_ptr<TCPHandler>()> handlerFactory, unsigned int loops, std::string host)
+{
+	if (!this->connected) {
+		Bind(port, host);
+	}
+
+#if defined(__linux__)
+	// fixed number of event loops, accepted connections are distributed round-robin
+	// (io_uring loops when requested and supported by kernel, epoll loops otherwise)
+	std::vector<std::unique_ptr<TCPEventLoop>> reactor;
+	for (unsigned int i = 0; i < std::max(loops, 1U); i++) {
+		reactor.push_back(EventLoop(this->options.io_uring));
+	}
+
+	// accept loop (until Stop, event loops close their connections)
+	for (std::size_t next = 0; !stopped; next = (next + 1) % reactor.size()) {
+		TCPSocket client;
+		try {
+			client = Accept();
+		}
+		catch (const TCPException &e) {
+			(void)e; // bypass unreferenced local variable warning
+			if (stopped) {
+				break;
+			}
+			throw;
+		}
+		reactor[next]->Add(client, handlerFactory());
+	}
+#else
+	// reactor is not available, fallback to thread per connection
+	(void)loops; // bypass unreferenced parameter warning
+	while (!stopped) {
+		TCPSocket client;
+		try {
+			client = Accept();
+		}
+		catch (const TCPException &e) {
+			(void)e; // bypass unreferenced local variable warning
+			if (stopped) {
+				break;
+			}
+			throw;
+		}
+		std::shared_ptr<TCPHandler> handler(handlerFactory());
+		TCPOptions client_options = this->options;
+		std::thread([client, handler, client_options]() {
+			TCP connection(client);
+			connection.Configure(client_options);
+			connection.Run(*handler);
+		}).detach();
+	}
+#endif
+}
+
+std::unique_ptr<TCPEventLoop> TCP::EventLoop(bool io_uring)
+{
+#if defined(__linux__)
+	std::unique_ptr<TCPEventLoop> loop;
+	if (io_uring) {
+		loop = IOUring::Loop(default_timeout);
+	}
+	if (!loop) {
+		loop.reset(new ReactorLoop(default_timeout));
+	}
+	return loop;
+#else
+	(void)io_uring; // bypass unreferenced parameter warning
+	return nullptr;
+#endif
+}
+
+void TCP::Bind(std::string port, std::string host)
 {
 	if (this->connected == true) {
 		throw(TCPException(ListenFailed, "TCPError: Listen: Already connected!"));
@@ -127,6 +714,7 @@ void TCP::Listen(std::string port, std::function<void(TCP, const std::string, co
 	for (auto res = result; res != NULL; res = res->ai_next) {
 		this->sock = socket(res->ai_family, res->ai_socktype, res->ai_protocol); // try to create socket
 		if (this->sock != INVALID_SOCKET) {
+			setBuffers(this->sock); // inherited by accepted sockets
 			if (bind(this->sock, res->ai_addr, res->ai_addrlen) != SOCKET_ERROR) { // try to bind
 				freeaddrinfo(result);
 				if (listen(this->sock, maxconnections) == SOCKET_ERROR) { // listen
@@ -155,41 +743,69 @@ void TCP::Listen(std::string port, std::function<void(TCP, const std::string, co
 	if (this->connected == false) {
 		throw(TCPException(ListenFailed, "TCPError: ListenFailed!"));
 	}
+}
 
-	// accept loop (infinite for now) //Possible Improvement: enable termination of server using stdin
-	bool done = false;
-	while (!done) {
-		TCPSocket client = accept(this->sock, NULL, NULL); // accept IPv4 and IPv6
-		if (client == INVALID_SOCKET) {
-			throw(TCPException(ListenFailed, "TCPError: accept Failed!"));
+std::string TCP::LocalPort()
+{
+	sockaddr_storage addr_stor; socklen_t addr_len = sizeof(addr_stor);
+	if (getsockname(this->sock, reinterpret_cast<sockaddr*>(&addr_stor), &addr_len) == SOCKET_ERROR) {
+		return {};
+	}
+	if (addr_stor.ss_family == AF_INET6) {
+		return std::to_string(ntohs(reinterpret_cast<sockaddr_in6*>(&addr_stor)->sin6_port));
+	}
+	return std::to_string(ntohs(reinterpret_cast<sockaddr_in*>(&addr_stor)->sin_port));
+}
+
+void TCP::Stop()
+{
+	stopped = true;
+	shutdown(this->sock, SHUT_RDWR); // wakes up blocking accept
+}
+
+TCPSocket TCP::Accept(std::string *client_ip, std::string *client_port)
+{
+	TCPSocket client = accept(this->sock, NULL, NULL); // accept IPv4 and IPv6
+	if (client == INVALID_SOCKET) {
+		throw(TCPException(ListenFailed, "TCPError: accept Failed!"));
+	}
+
+	if (nonblocking) { // set non-blocking if enabled
+		if (!setNonBlocking(client)) {
+			shutdown(client, SHUT_RDWR);
+			close(client);
+			throw(TCPException(setNonBlockingFailed, "TCPError: Unable to make socket non-blocking!"));
 		}
+	}
 
+	if (client_ip || client_port) {
 		sockaddr_storage addr_stor; socklen_t addr_len = sizeof(addr_stor);
 		sockaddr_in *addr4 = reinterpret_cast<sockaddr_in*>(&addr_stor);
 		sockaddr_in6 *addr6 = reinterpret_cast<sockaddr_in6*>(&addr_stor);
 		getpeername(client, reinterpret_cast<sockaddr*>(&addr_stor), &addr_len);
 
-		if (nonblocking) { // set non-blocking if enabled
-			if (!setNonBlocking(client)) {
-				shutdown(client, SHUT_RDWR);
-				close(client);
-				throw(TCPException(setNonBlockingFailed, "TCPError: Unable to make socket non-blocking!"));
-			}
-		}
-		// call connection handler
-		if (clientConnectionHandler) {
-			char client_ip_buffer[INET6_ADDRSTRLEN];
-			std::string client_port;
-			if (addr_stor.ss_family == AF_INET) {
-				inet_ntop(addr4->sin_family, &(addr4->sin_addr), client_ip_buffer, sizeof(client_ip_buffer));
-				client_port = std::to_string(ntohs(addr4->sin_port));
-			} else if (addr_stor.ss_family == AF_INET6) {
-				inet_ntop(addr6->sin6_family, &(addr6->sin6_addr), client_ip_buffer, sizeof(client_ip_buffer));
-				client_port = std::to_string(ntohs(addr4->sin_port));
-			}
-			clientConnectionHandler(TCP(client), std::string(client_ip_buffer), client_port);
+		char client_ip_buffer[INET6_ADDRSTRLEN] = { 0 };
+		std::string port;
+		if (addr_stor.ss_family == AF_INET) {
+			inet_ntop(addr4->sin_family, &(addr4->sin_addr), client_ip_buffer, sizeof(client_ip_buffer));
+			port = std::to_string(ntohs(addr4->sin_port));
+		} else if (addr_stor.ss_family == AF_INET6) {
+			inet_ntop(addr6->sin6_family, &(addr6->sin6_addr), client_ip_buffer, sizeof(client_ip_buffer));
+			port = std::to_string(ntohs(addr6->sin6_port));
 		}
+		if (client_ip) *client_ip = client_ip_buffer;
+		if (client_port) *client_port = port;
+	}
+	return client;
+}
+
+TCPSocket TCP::Release()
+{
+	if (this->connected == false) {
+		throw(TCPException(ConnectionClosed, "TCPError: Not connected!"));
 	}
+	this->connected = false;
+	return this->sock;
 }
 
 void TCP::Close()
@@ -212,107 +828,380 @@ std::vector<unsigned char> TCP::Recv(std::size_t bytes, std::function<void(std::
 }
 void TCP::Recv(std::vector<unsigned char>& data, std::size_t bytes, std::function<void(std::size_t, std::size_t)> updateCallback)
 {
-	//Possible Improvement: use epoll
-	fd_set rfds;
-	timeval time_out;
-
+	RecvBlocks(data, bytes, nullptr, updateCallback);
+}
+void TCP::Recv(std::vector<unsigned char>& data, std::size_t bytes, CRC32State &crc, std::function<void(std::size_t, std::size_t)> updateCallback)
+{
+	RecvBlocks(data, bytes, &crc, updateCallback);
+}
+void TCP::RecvBlocks(std::vector<unsigned char>& data, std::size_t bytes, CRC32State *crc, std::function<void(std::size_t, std::size_t)> updateCallback)
+{
+	IPK_TRACE_SPAN_BYTES("tcp.recv", bytes);
 	std::size_t to_read = bytes;
 
 	while (to_read) {
-		time_out.tv_sec = this->timeout;
-		time_out.tv_usec = 0;
-		FD_ZERO(&rfds);
-		FD_SET(this->sock, &rfds);
-
-		// wait for socket to be ready
-		int select_ret = 1;
-		if (nonblocking) {
-			select_ret = select(this->sock + 1, &rfds, NULL, NULL, &time_out);
-		}
-
-		if (select_ret == SOCKET_ERROR) {
-			throw TCPException(SelectFailed, "TCPError: SelectFailed!");
-		}
-		else if (select_ret) {
-			if (!(nonblocking) || FD_ISSET(this->sock, &rfds)) {
-				std::size_t to_read_current = std::min(this->block_size, to_read); // read up to maximal block size
-				data.resize(data.size() + to_read_current);
-
-				char *ptr = reinterpret_cast<char *>(&(*(data.end() - to_read_current)));
-				long long recv_ret = recv(this->sock, ptr, to_read_current, 0);
-				if (recv_ret == SOCKET_ERROR) {
-					throw TCPException(SendRecvFailed, "TCPError: recv Failed!");
-				} else if (recv_ret == 0) {
-					data.resize(data.size() - to_read_current);
-					throw TCPException(ConnectionClosed, "TCPError: Connection Closed!");
-				}
-
-				std::size_t read = static_cast<std::size_t>(recv_ret);
-				data.resize(data.size() - to_read_current + read);
-				to_read -= read;
+		std::size_t to_read_current = std::min(this->recv_block, to_read); // read up to current block size
+		data.resize(data.size() + to_read_current);
 
-				if (updateCallback) {
-					updateCallback(bytes - to_read, bytes); //call optional update callback
-				}
+		char *ptr = reinterpret_cast<char *>(&(*(data.end() - to_read_current)));
+		long long recv_ret = recv(this->sock, ptr, to_read_current, 0);
+		if (recv_ret == SOCKET_ERROR) {
+			data.resize(data.size() - to_read_current);
+			if (would_block()) {
+				Wait(false); // poll only when there is nothing to read
+				continue;
 			}
+			throw TCPException(SendRecvFailed, "TCPError: recv Failed!");
+		} else if (recv_ret == 0) {
+			data.resize(data.size() - to_read_current);
+			throw TCPException(ConnectionClosed, "TCPError: Connection Closed!");
 		}
-		else {
-			throw TCPException(Timeout, "TCPError: Timeout!");
+
+		std::size_t read = static_cast<std::size_t>(recv_ret);
+		IPKMetrics::Add(BytesIn, read);
+		data.resize(data.size() - to_read_current + read);
+		to_read -= read;
+		TuneRecvBlock(read);
+
+		if (crc) {
+			IPK_TRACE_SPAN_BYTES("crc32.recv", read);
+			crc->Update(reinterpret_cast<const unsigned char*>(ptr), read); // block is still in cache
+		}
+
+		if (updateCallback) {
+			updateCallback(bytes - to_read, bytes); //call optional update callback
 		}
 	}
 }
 
 void TCP::Send(const std::vector<unsigned char>& data, std::function<void(std::size_t, std::size_t)> updateCallback)
 {
-	//Possible Improvement: use epoll
-	fd_set sfds;
+	SendBlocks(data.data(), data.size(), nullptr, updateCallback);
+}
+void TCP::Send(const std::vector<unsigned char>& data, CRC32State &crc, std::function<void(std::size_t, std::size_t)> updateCallback)
+{
+	SendBlocks(data.data(), data.size(), &crc, updateCallback);
+}
+void TCP::SendBlocks(const unsigned char *data, std::size_t size, CRC32State *crc, std::function<void(std::size_t, std::size_t)> updateCallback, int flags)
+{
+	IPK_TRACE_SPAN_BYTES("tcp.send", size);
+	auto it = data;
+	std::size_t to_write = size;
+
+	while (to_write) {
+		std::size_t to_write_current = std::min(this->send_block, to_write); // write up to current block size
+
+		const char *ptr = reinterpret_cast<const char*>(it);
+		long long send_ret = send(this->sock, ptr, to_write_current, SEND_FLAGS | flags);
+		if (send_ret == SOCKET_ERROR) {
+			if (would_block()) {
+				Wait(true); // poll only when send buffer is full
+				continue;
+			}
+			throw TCPException(SendRecvFailed, "TCPError: send Failed!");
+		} else if (send_ret == 0) {
+			throw TCPException(ConnectionClosed, "TCPError: Connection Closed!");
+		}
+
+		std::size_t write = static_cast<std::size_t>(send_ret);
+		IPKMetrics::Add(BytesOut, write);
+		it += write;
+		to_write -= write;
+		TuneSendBlock(write);
+
+		if (crc) {
+			IPK_TRACE_SPAN_BYTES("crc32.send", write);
+			crc->Update(reinterpret_cast<const unsigned char*>(ptr), write); // block is still in cache
+		}
+
+		if (updateCallback) {
+			updateCallback(size - to_write, size); //call optional update callback
+		}
+	}
+}
+
+// grow recv block toward bytes waiting in socket (auto-tuning only)
+void TCP::TuneRecvBlock(std::size_t received)
+{
+	if (this->options.block_size) {
+		return;
+	}
+	if (received == this->recv_block) {
+		// block was filled, more data are probably waiting
+#if defined(_WIN32)
+		u_long available = 0;
+		ioctlsocket(this->sock, FIONREAD, &available);
+#else
+		int available = 0;
+		ioctl(this->sock, FIONREAD, &available);
+#endif
+		std::size_t target = std::max(this->recv_block * 2, static_cast<std::size_t>(available));
+		this->recv_block = std::min(target, max_auto_block);
+	}
+	else if (received < this->recv_block / 8) {
+		this->recv_block = std::max(this->recv_block / 2, min_auto_block); // slow peer, avoid resizing buffers in vain
+	}
+}
+
+// grow send block toward free space of socket send buffer (auto-tuning only)
+void TCP::TuneSendBlock(std::size_t sent)
+{
+	if (this->options.block_size || sent < this->send_block) {
+		return; // fixed size or send buffer is full
+	}
+#if defined(__linux__)
+	if (this->send_buffer_size == 0) {
+		socklen_t len = sizeof(this->send_buffer_size);
+		getsockopt(this->sock, SOL_SOCKET, SO_SNDBUF, &this->send_buffer_size, &len);
+	}
+	int queued = 0;
+	if (this->send_buffer_size > 0 && ioctl(this->sock, SIOCOUTQ, &queued) == 0 && queued < this->send_buffer_size) {
+		std::size_t free_space = static_cast<std::size_t>(this->send_buffer_size - queued);
+		this->send_block = std::min(std::max(free_space, min_auto_block), max_auto_block);
+		return;
+	}
+#endif
+	this->send_block = std::min(this->send_block * 2, max_auto_block);
+}
+
+void TCP::SendV(const std::vector<TCPBuffer> &buffers, std::function<void(std::size_t, std::size_t)> updateCallback)
+{
+	std::size_t total = 0;
+	for (const auto &buffer : buffers) {
+		total += buffer.size;
+	}
+	IPK_TRACE_SPAN_BYTES("tcp.sendv", total);
+
+#if defined(_WIN32)
+	std::vector<WSABUF> vec;
+	for (const auto &buffer : buffers) {
+		if (buffer.size) {
+			vec.push_back({ static_cast<ULONG>(buffer.size), reinterpret_cast<CHAR*>(const_cast<unsigned char*>(buffer.data)) });
+		}
+	}
+#else
+	std::vector<iovec> vec;
+	for (const auto &buffer : buffers) {
+		if (buffer.size) {
+			vec.push_back({ const_cast<unsigned char*>(buffer.data), buffer.size });
+		}
+	}
+#endif
+
+	std::size_t first = 0; // first not completely sent buffer
+	std::size_t sent = 0;
+	while (first < vec.size()) {
+#if defined(_WIN32)
+		DWORD written = 0;
+		long long send_ret = (WSASend(this->sock, &vec[first], static_cast<DWORD>(vec.size() - first), &written, 0, NULL, NULL) == 0) ? written : SOCKET_ERROR;
+		bool would_block = (send_ret == SOCKET_ERROR && WSAGetLastError() == WSAEWOULDBLOCK);
+#else
+		msghdr msg{};
+		msg.msg_iov = &vec[first];
+		msg.msg_iovlen = std::min<std::size_t>(vec.size() - first, IOV_MAX);
+		long long send_ret = sendmsg(this->sock, &msg, SEND_FLAGS); // writev without SIGPIPE
+		bool would_block = (send_ret == SOCKET_ERROR && (errno == EAGAIN || errno == EWOULDBLOCK));
+		if (send_ret == SOCKET_ERROR && errno == EINTR) {
+			continue;
+		}
+#endif
+		if (would_block) {
+			Wait(true);
+			continue;
+		}
+		else if (send_ret == SOCKET_ERROR) {
+			throw TCPException(SendRecvFailed, "TCPError: send Failed!");
+		}
+		else if (send_ret == 0) {
+			throw TCPException(ConnectionClosed, "TCPError: Connection Closed!");
+		}
+
+		// skip sent buffers
+		std::size_t written_bytes = static_cast<std::size_t>(send_ret);
+		IPKMetrics::Add(BytesOut, written_bytes);
+		sent += written_bytes;
+		while (written_bytes) {
+#if defined(_WIN32)
+			std::size_t current = vec[first].len;
+#else
+			std::size_t current = vec[first].iov_len;
+#endif
+			if (written_bytes >= current) {
+				written_bytes -= current;
+				first++;
+			}
+			else {
+#if defined(_WIN32)
+				vec[first].buf += written_bytes;
+				vec[first].len -= static_cast<ULONG>(written_bytes);
+#else
+				vec[first].iov_base = static_cast<unsigned char*>(vec[first].iov_base) + written_bytes;
+				vec[first].iov_len -= written_bytes;
+#endif
+				written_bytes = 0;
+			}
+		}
+
+		if (updateCallback) {
+			updateCallback(sent, total); //call optional update callback
+		}
+	}
+}
+
+void TCP::SendFile(const std::vector<unsigned char> &header, const MappedFile &file, uint64_t offset, std::size_t bytes)
+{
+	SendBlocks(header.data(), header.size(), nullptr, {}, bytes ? SEND_MORE : 0); // header is coalesced with file data
+#if defined(__linux__)
+	if (file.Descriptor() >= 0) {
+		IPK_TRACE_SPAN_BYTES("tcp.sendfile", bytes);
+		off_t file_offset = static_cast<off_t>(offset);
+		std::size_t to_write = bytes;
+		while (to_write) {
+			ssize_t sendfile_ret = SendFileNoSignal(this->sock, file.Descriptor(), &file_offset, to_write); // directly from page cache
+			if (sendfile_ret > 0) {
+				IPKMetrics::Add(BytesOut, static_cast<uint64_t>(sendfile_ret));
+				to_write -= static_cast<std::size_t>(sendfile_ret);
+			}
+			else if (sendfile_ret < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+				Wait(true);
+			}
+			else if (sendfile_ret == 0 || errno != EINTR) {
+				throw TCPException(SendRecvFailed, "TCPError: sendfile Failed!");
+			}
+		}
+		return;
+	}
+#endif
+	SendBlocks(file.Data() + offset, bytes, nullptr, {}); // send directly from mapping
+}
+
+void TCP::RecvFile(int descriptor, uint64_t offset, std::size_t bytes)
+{
+#if defined(__linux__)
+	IPK_TRACE_SPAN_BYTES("tcp.splice", bytes);
+	std::size_t to_read = bytes;
+	while (to_read) {
+		std::size_t moved = SpliceToFile(this->sock, this->splice_pipe, descriptor, offset, to_read); // socket -> pipe -> file
+		if (moved == 0) {
+			Wait(false);
+		}
+		IPKMetrics::Add(BytesIn, moved);
+		offset += moved;
+		to_read -= moved;
+	}
+#elif !defined(_WIN32)
+	std::vector<unsigned char> data;
+	std::size_t to_read = bytes;
+	while (to_read) {
+		data.clear();
+		RecvBlocks(data, to_read, nullptr, {});
+		if (pwrite(descriptor, data.data(), data.size(), static_cast<off_t>(offset)) != static_cast<ssize_t>(data.size())) {
+			throw TCPException(SendRecvFailed, "TCPError: write to file Failed!");
+		}
+		offset += data.size();
+		to_read -= data.size();
+	}
+#else
+	(void)descriptor; (void)offset; (void)bytes; // bypass unreferenced parameter warning
+	throw TCPException(PlatformSpecificError, "TCPError: RecvFile is not supported!");
+#endif
+}
+
+// wait until socket is ready for reading or writing (throws on timeout)
+void TCP::Wait(bool write)
+{
+	IPK_TRACE_SPAN(write ? "tcp.wait_send" : "tcp.wait_recv");
+#if defined(__linux__) || defined(__FreeBSD__)
+	// poll has no FD_SETSIZE limit (descriptors above 1023 would overflow fd_set)
+	pollfd fd;
+	fd.fd = this->sock;
+	fd.events = write ? POLLOUT : POLLIN;
+	fd.revents = 0;
+	int poll_ret;
+	do {
+		poll_ret = poll(&fd, 1, this->timeout * 1000);
+	} while (poll_ret < 0 && errno == EINTR);
+	if (poll_ret == SOCKET_ERROR) {
+		throw TCPException(SelectFailed, "TCPError: SelectFailed!");
+	}
+	else if (poll_ret == 0) {
+		throw TCPException(Timeout, "TCPError: Timeout!");
+	}
+#else
+	fd_set fds;
 	timeval time_out;
+	time_out.tv_sec = this->timeout;
+	time_out.tv_usec = 0;
+	FD_ZERO(&fds);
+	FD_SET(this->sock, &fds);
 
-	auto it = data.begin();
-	std::size_t to_write = data.size();
+	int select_ret = select(this->sock + 1, write ? NULL : &fds, write ? &fds : NULL, NULL, &time_out);
+	if (select_ret == SOCKET_ERROR) {
+		throw TCPException(SelectFailed, "TCPError: SelectFailed!");
+	}
+	else if (select_ret == 0) {
+		throw TCPException(Timeout, "TCPError: Timeout!");
+	}
+#endif
+}
 
-	while (to_write) {
-		time_out.tv_sec = this->timeout;
-		time_out.tv_usec = 0;
-		FD_ZERO(&sfds);
-		FD_SET(this->sock, &sfds);
-
-		// wait for socket to be ready
-		int select_ret = 1;
-		if (nonblocking) {
-			select_ret = select(this->sock + 1, NULL, &sfds, NULL, &time_out);
-		}
-
-		if (select_ret == SOCKET_ERROR) {
-			throw TCPException(SelectFailed, "TCPError: SelectFailed!");
-		}
-		else if (select_ret) {
-			if (!(nonblocking) || FD_ISSET(this->sock, &sfds)) {
-				std::size_t to_write_current = std::min(this->block_size, to_write); // write up to maximal block size
-				
-				const char *ptr = reinterpret_cast<const char*>(&(*it));
-				long long send_ret = send(this->sock, ptr, to_write_current, SEND_FLAGS);
-				if (send_ret == SOCKET_ERROR) {
-					throw TCPException(SendRecvFailed, "TCPError: send Failed!");
-				} else if (send_ret == 0) {
-					throw TCPException(ConnectionClosed, "TCPError: Connection Closed!");
-				}
-				
-				std::size_t write = static_cast<std::size_t>(send_ret);
-				it += write;
-				to_write -= write;
-				
-				if (updateCallback) {
-					updateCallback(data.size() - to_write, data.size()); //call optional update callback
-				}
+void TCP::Run(TCPHandler &handler)
+{
+	while (true) {
+		TCPRequest req = handler.Next();
+		if (req.kind == TCPRequest::Close) {
+			break;
+		}
+		try {
+			if (req.kind == TCPRequest::Recv) {
+				RecvBlocks(*req.data, req.bytes, req.crc, {});
+			}
+			else if (req.kind == TCPRequest::SendFile) {
+				SendFile(*req.data, *req.file, req.offset, req.bytes);
+			}
+			else if (req.kind == TCPRequest::RecvFile) {
+				RecvFile(req.descriptor, req.offset, req.bytes);
+			}
+			else if (req.kind == TCPRequest::Wait) {
+				std::this_thread::sleep_for(std::chrono::milliseconds(1));
+			}
+			else {
+				SendBlocks(req.data->data(), req.data->size(), req.crc, {});
 			}
 		}
-		else {
-			throw TCPException(Timeout, "TCPError: Timeout!");
+		catch (const TCPException &e) {
+			handler.Failed(e);
+			continue;
 		}
+		handler.Completed();
+	}
+}
+
+void TCP::Configure(const TCPOptions &options)
+{
+	this->options = options;
+	this->recv_block = options.block_size ? options.block_size : min_auto_block;
+	this->send_block = options.block_size ? options.block_size : min_auto_block;
+	this->send_buffer_size = 0;
+	if (this->connected) {
+		setBuffers(this->sock);
 	}
 }
 
+void TCP::setBuffers(TCPSocket socket)
+{
+	// kernel auto-tuning is kept unless buffer sizes are set explicitly
+	if (this->options.send_buffer > 0) {
+		setsockopt(socket, SOL_SOCKET, SO_SNDBUF, reinterpret_cast<const char*>(&this->options.send_buffer), sizeof(this->options.send_buffer));
+	}
+	if (this->options.recv_buffer > 0) {
+		setsockopt(socket, SOL_SOCKET, SO_RCVBUF, reinterpret_cast<const char*>(&this->options.recv_buffer), sizeof(this->options.recv_buffer));
+	}
+	// requests and status packets are small and always answered, Nagle's algorithm would hold them until delayed ACK
+	int nodelay = 1;
+	setsockopt(socket, IPPROTO_TCP, TCP_NODELAY, reinterpret_cast<const char*>(&nodelay), sizeof(nodelay));
+}
+
 bool TCP::setNonBlocking(TCPSocket socket)
 {
 #if defined(__linux__) || defined(__FreeBSD__)
@@ -331,7 +1220,8 @@ bool TCP::setNonBlocking(TCPSocket socket)
 }
 
 
-TCP::TCP() : block_size(default_block_size), timeout(default_timeout), connected(false), sock(INVALID_SOCKET), moved(false) {
+TCP::TCP() : timeout(default_timeout), options(), recv_block(min_auto_block), send_block(min_auto_block), send_buffer_size(0),
+	connected(false), sock(INVALID_SOCKET), splice_pipe{ -1, -1 }, moved(false), stopped(false) {
 #if defined(_WIN32)
 	// initialize winsock2
 	WSADATA wsaData;
@@ -340,9 +1230,12 @@ TCP::TCP() : block_size(default_block_size), timeout(default_timeout), connected
 	}
 #endif
 }
-TCP::TCP(TCP && other) : block_size(other.block_size), timeout(other.timeout), connected(other.connected), sock(other.sock), moved(other.moved) {
+TCP::TCP(TCP && other) : timeout(other.timeout), options(other.options), recv_block(other.recv_block), send_block(other.send_block),
+	send_buffer_size(other.send_buffer_size), connected(other.connected), sock(other.sock),
+	splice_pipe{ other.splice_pipe[0], other.splice_pipe[1] }, moved(other.moved), stopped(other.stopped.load()) {
 	other.connected = false;
 	other.sock = INVALID_SOCKET;
+	other.splice_pipe[0] = other.splice_pipe[1] = -1;
 	other.moved = true;
 }
 
@@ -357,6 +1250,9 @@ TCP::~TCP()
 	if (this->connected) {
 		Close();
 	}
+#if defined(__linux__)
+	ClosePipe(this->splice_pipe);
+#endif
 #if defined(_WIN32)
 	if (!this->moved) {
 		WSACleanup(); // winsock2 cleanup
@@ -11,6 +11,8 @@
 #include <stdexcept>
 #include <functional>
 #include <vector>
+#include <memory>
+#include <atomic>
 
 // Linux specific
 #if defined(__linux__) || defined(__FreeBSD__)
@@ -36,18 +38,85 @@ enum TCPError {
 	PlatformSpecificError
 };
 
+class TCPException;
+class CRC32State;
+class MappedFile;
+
+// per connection tuning of TCP (see TCP::Configure)
+struct TCPOptions {
+	std::size_t block_size = 0; // maximal recv/send block size (0 = auto-tuning toward available bytes)
+	int send_buffer = 0; // SO_SNDBUF in bytes (0 = system default)
+	int recv_buffer = 0; // SO_RCVBUF in bytes (0 = system default)
+	bool io_uring = false; // reactor mode uses io_uring event loops when kernel supports them (see IOUring)
+};
+
+// contiguous block of memory for scatter-gather send (see TCP::SendV)
+struct TCPBuffer {
+	const unsigned char *data;
+	std::size_t size;
+};
+
+// I/O request of connection state machine (see TCPHandler)
+struct TCPRequest {
+	enum Kind { Recv, Send, SendFile, RecvFile, Wait, Close } kind; // Wait: nothing to transfer until background work of handler progresses, Completed is called again by next iteration of loop (about 1 ms)
+	std::vector<unsigned char> *data; // Recv: received bytes are appended, Send/SendFile: whole buffer is sent (SendFile: before file)
+	std::size_t bytes; // Recv: number of bytes to receive, SendFile/RecvFile: number of bytes of file
+	CRC32State *crc; // optional, updated with every received/sent block (not with file data)
+	const MappedFile *file; // SendFile: file to send
+	uint64_t offset; // SendFile/RecvFile: offset in file
+	int descriptor; // RecvFile: file descriptor received bytes are written to
+};
+
+// Connection state machine driven either by blocking TCP::Run or by reactor mode of TCP::Listen
+class TCPHandler {
+public:
+	virtual ~TCPHandler() {}
+
+	// next I/O request of state machine
+	virtual TCPRequest Next() = 0;
+
+	// last request was completed
+	virtual void Completed() = 0;
+
+	// last request failed (Timeout, ConnectionClosed, SendRecvFailed, ...)
+	virtual void Failed(const TCPException &e) = 0;
+};
+
+// event loop thread driving connections passed to it by their handlers (owns them, see TCP::Listen and TCP::EventLoop)
+class TCPEventLoop {
+public:
+	virtual ~TCPEventLoop() {}
+
+	// pass connected (non-blocking) socket to event loop
+	virtual void Add(TCPSocket sock, std::unique_ptr<TCPHandler> handler) = 0;
+};
+
 class TCP {
 	static const int maxconnections; // maximal simultaneous connections
 	static const bool nonblocking; // use nonblocking sockets
-	const std::size_t block_size; // maximal recv/send block size
 	const int timeout; // connection timeout
+	TCPOptions options;
+	std::size_t recv_block; // current recv block size
+	std::size_t send_block; // current send block size
+	int send_buffer_size; // actual SO_SNDBUF (auto-tuning), 0 if unknown
 
 	bool connected;
 	TCPSocket sock;
+	int splice_pipe[2]; // pipe of RecvFile (Linux splice), created on first use
 
 	bool moved;
+	std::atomic<bool> stopped; // accept loop of Listen was stopped (see Stop)
 	
 	bool setNonBlocking(TCPSocket socket);
+	void setBuffers(TCPSocket socket);
+	void TuneRecvBlock(std::size_t received);
+	void TuneSendBlock(std::size_t sent);
+
+	void RecvBlocks(std::vector<unsigned char> &data, std::size_t bytes, CRC32State *crc, std::function<void(std::size_t, std::size_t)> update);
+	void SendBlocks(const unsigned char *data, std::size_t size, CRC32State *crc, std::function<void(std::size_t, std::size_t)> update, int flags = 0);
+	void Wait(bool write);
+
+	TCPSocket Accept(std::string *client_ip = nullptr, std::string *client_port = nullptr);
 
 public:
 	TCP();
@@ -56,13 +125,36 @@ public:
 	TCP(TCP && other);
 	~TCP();
 
+	// set block size and socket buffers (applied to current socket, next connection and accepted connections)
+	void Configure(const TCPOptions &options);
+
 	// connect to specific host and port
 	void Connect(std::string host, std::string port);
 
+	// bind and listen on specific port ("0" = ephemeral port) and optionally on specific interface (host),
+	// connections are accepted by Listen then (which binds by itself when it was not called)
+	void Bind(std::string port, std::string host = {});
+
+	// local port of bound or connected socket (actual port of ephemeral one)
+	std::string LocalPort();
+
+	// stop accept loop of Listen running in other thread (Listen returns)
+	void Stop();
+
 	// listen on specific port and optionally on specefic interface (host)
 	void Listen(std::string port, std::function<void(TCP)> clientConnectionHandler, std::string host = {});
 	void Listen(std::string port, std::function<void(TCP, const std::string, const std::string)> clientConnectionHandler, std::string host = {});
 
+	// listen in reactor mode, connections are driven by handlers on fixed number of event loop threads (epoll)
+	void Listen(std::string port, std::function<std::unique_ptr<TCPHandler>()> handlerFactory, unsigned int loops, std::string host = {});
+
+	// event loop thread for connections driven by handlers (epoll, or io_uring when requested and supported),
+	// nullptr when platform has no reactor (connections have to be driven by Run then)
+	static std::unique_ptr<TCPEventLoop> EventLoop(bool io_uring = false);
+
+	// give up ownership of connected socket (to pass it to event loop), TCP is not connected then
+	TCPSocket Release();
+
 	// close connection
 	void Close();
 
@@ -71,11 +163,26 @@ public:
 
 
 	// blocking recv with timeout and periodical update callback
+	// (crc is updated with every block right after it is received / sent)
 	std::vector<unsigned char> Recv(std::size_t bytes, std::function<void(std::size_t, std::size_t)> update = {});
 	void Recv(std::vector<unsigned char> &data, std::size_t bytes, std::function<void(std::size_t, std::size_t)> update = {});
+	void Recv(std::vector<unsigned char> &data, std::size_t bytes, CRC32State &crc, std::function<void(std::size_t, std::size_t)> update = {});
 
 	// blocking send with timeout and periodical update callback
 	void Send(const std::vector<unsigned char> &data, std::function<void(std::size_t, std::size_t)> update = {});
+	void Send(const std::vector<unsigned char> &data, CRC32State &crc, std::function<void(std::size_t, std::size_t)> update = {});
+
+	// blocking scatter-gather send (writev) with timeout and periodical update callback
+	void SendV(const std::vector<TCPBuffer> &buffers, std::function<void(std::size_t, std::size_t)> update = {});
+
+	// blocking send of header followed by region of file (zero-copy sendfile on Linux)
+	void SendFile(const std::vector<unsigned char> &header, const MappedFile &file, uint64_t offset, std::size_t bytes);
+
+	// blocking receive of bytes directly into file descriptor at offset (zero-copy splice on Linux)
+	void RecvFile(int descriptor, uint64_t offset, std::size_t bytes);
+
+	// drive connection state machine using blocking Recv and Send
+	void Run(TCPHandler &handler);
 };
 
 class TCPException : public std::runtime_error {
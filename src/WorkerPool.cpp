@@ -0,0 +1,101 @@
+/*
+*	IPK Project 1: client-server for simple file transfer
+*	Author: Tomáš Pazdiora (xpazdi02)
+*	File: WorkerPool.cpp
+*/
+
+#include "WorkerPool.h"
+
+#include <algorithm>
+
+WorkerPool::WorkerPool(std::size_t threads, std::size_t queue_depth)
+	: capacity(std::max<std::size_t>(threads, 1) + queue_depth), admitted(0), waiting(0), next(0), stop(false)
+{
+	for (std::size_t i = 0; i < std::max<std::size_t>(threads, 1); i++) {
+		workers.emplace_back(new Worker());
+	}
+	for (std::size_t i = 0; i < workers.size(); i++) {
+		this->threads.emplace_back(&WorkerPool::Run, this, i);
+	}
+}
+
+WorkerPool::~WorkerPool()
+{
+	{
+		std::lock_guard<std::mutex> lock(sleep_mutex);
+		stop = true;
+	}
+	sleep_cv.notify_all();
+	for (auto &thread : threads) {
+		thread.join();
+	}
+}
+
+bool WorkerPool::TrySubmit(std::function<void()> task)
+{
+	// admission control
+	std::size_t current = admitted.load();
+	do {
+		if (current >= capacity) {
+			return false;
+		}
+	} while (!admitted.compare_exchange_weak(current, current + 1));
+
+	{
+		std::lock_guard<std::mutex> lock(sleep_mutex);
+		waiting++; // counted before push, so it never drops below zero
+	}
+	Worker &worker = *workers[next++ % workers.size()];
+	{
+		std::lock_guard<std::mutex> lock(worker.mutex);
+		worker.tasks.push_back(std::move(task));
+	}
+	sleep_cv.notify_one();
+	return true;
+}
+
+// take task from own queue (front) or steal from other queues (back)
+bool WorkerPool::Pop(std::size_t index, std::function<void()> &task)
+{
+	for (std::size_t i = 0; i < workers.size(); i++) {
+		Worker &worker = *workers[(index + i) % workers.size()];
+		std::lock_guard<std::mutex> lock(worker.mutex);
+		if (!worker.tasks.empty()) {
+			if (i == 0) {
+				task = std::move(worker.tasks.front());
+				worker.tasks.pop_front();
+			}
+			else {
+				task = std::move(worker.tasks.back());
+				worker.tasks.pop_back();
+			}
+			waiting--;
+			return true;
+		}
+	}
+	return false;
+}
+
+void WorkerPool::Run(std::size_t index)
+{
+	while (true) {
+		std::function<void()> task;
+		if (!Pop(index, task)) {
+			std::unique_lock<std::mutex> lock(sleep_mutex);
+			sleep_cv.wait(lock, [this]() { return stop || waiting > 0; });
+			if (stop) {
+				return;
+			}
+			continue;
+		}
+
+		try {
+			task();
+		}
+		catch (const std::exception &e) {
+			(void)e; // bypass unreferenced local variable warning
+		}
+		task = nullptr; // release resources held by task before leaving its slot
+		admitted--;
+	}
+}
@@ -0,0 +1,50 @@
+/*
+*	IPK Project 1: client-server for simple file transfer
+*	Author: Tomáš Pazdiora (xpazdi02)
+*	File: WorkerPool.h
+*/
+
+#ifndef WORKERPOOL_H
+#define WORKERPOOL_H
+
+#include <deque>
+#include <vector>
+#include <memory>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <functional>
+
+// Fixed number of worker threads with bounded number of waiting tasks,
+// every worker has its own queue and idle workers steal tasks of others
+class WorkerPool {
+	struct Worker {
+		std::mutex mutex;
+		std::deque<std::function<void()>> tasks;
+	};
+
+	const std::size_t capacity; // maximal number of running and waiting tasks
+	std::vector<std::unique_ptr<Worker>> workers;
+	std::vector<std::thread> threads;
+
+	std::atomic<std::size_t> admitted; // running and waiting tasks
+	std::atomic<std::size_t> waiting; // tasks in queues
+	std::atomic<std::size_t> next; // round-robin queue selection
+	std::atomic<bool> stop;
+
+	std::mutex sleep_mutex;
+	std::condition_variable sleep_cv;
+
+	bool Pop(std::size_t index, std::function<void()> &task);
+	void Run(std::size_t index);
+public:
+	WorkerPool(std::size_t threads, std::size_t queue_depth);
+	WorkerPool(const WorkerPool &other) = delete;
+	~WorkerPool();
+
+	// enqueue task, returns false when pool is saturated (all workers busy and queue is full)
+	bool TrySubmit(std::function<void()> task);
+};
+
+#endif
@@ -7,16 +7,48 @@
 #include <iostream>
 #include <string>
 #include <fstream>
+#include <vector>
+#include <deque>
+#include <future>
 #include "IPKFTP.h"
+#include "IPKTrace.h"
 
-const std::string client_usage = "./ipk-client -h host -p port [-r|-w] file";
+const std::string client_usage = "./ipk-client -h host -p port [-z lz|zlib|zstd] [-T trace_file] [-j connections] -r file (-j = parallel ranges)\n"
+	"./ipk-client -h host -p port [-z lz|zlib|zstd] [-T trace_file] [-w|-d|-u] file\n"
+	"./ipk-client -h host -p port [-z lz|zlib|zstd] [-T trace_file] [-j connections] [-R|-W] [file ...] (batch, file list is read from stdin when no file is given,\n"
+	"  -j = files are transferred concurrently over separate connections driven by one thread)\n"
+	"./ipk-client -h host -p port -S (metrics of server as JSON)";
 
 struct args {
 	std::string host, port, filename;
+	std::string trace; // Chrome trace of hot paths written on exit
 	char mode;
+	unsigned int connections = 1;
+	CompressionCodec compression = NoCompression;
+	bool batch = false;
+	std::vector<std::string> filenames; // batch
 } arguments;
 
 bool load_args(int argc, const char *argv[], args *arguments);
+std::size_t async_batch(IPKFTP &ipkftp, const std::vector<std::string> &filenames, bool upload, unsigned int connections);
+
+// writes trace when client finishes (also after failure)
+struct TraceFile {
+	const std::string filepath;
+	TraceFile(const std::string &filepath) : filepath(filepath)
+	{
+		if (!filepath.empty()) {
+			IPKTrace::Enable("ipk-client");
+		}
+	}
+	~TraceFile()
+	{
+		if (!filepath.empty()) {
+			std::ofstream file(filepath, std::ios::trunc);
+			IPKTrace::Write(file);
+		}
+	}
+};
 
 int main(int argc, const char *argv[]) {
 	if (!load_args(argc, argv, &arguments)) {
@@ -24,20 +56,34 @@ int main(int argc, const char *argv[]) {
 		return -1;
 	}
 
+	TraceFile trace(arguments.trace);
 	try {
 		IPKFTP ipkftp;
+		ipkftp.SetCompression(arguments.compression);
 		ipkftp.ClientConnect(arguments.host, arguments.port);
-		if (arguments.mode == 'w') {
-			ipkftp.Upload(arguments.filename);
+		if (arguments.mode == 's') {
+			std::cout << ipkftp.Stats();
+			ipkftp.ClientDisconnect();
+			return 0;
+		}
+		else if (arguments.batch) {
+			std::size_t failed = (arguments.connections > 1) ? async_batch(ipkftp, arguments.filenames, arguments.mode == 'w', arguments.connections)
+				: ipkftp.Batch(arguments.filenames, arguments.mode == 'w');
+			IPKFTP::AsyncShutdown();
+			ipkftp.ClientDisconnect();
+			return (failed) ? 1 : 0;
+		}
+		else if (arguments.mode == 'w' || arguments.mode == 'd' || arguments.mode == 'u') {
+			ipkftp.Upload(arguments.filename, arguments.mode == 'd', arguments.mode == 'u');
 		}
 		else {
-			ipkftp.Download(arguments.filename);
+			ipkftp.Download(arguments.filename, arguments.connections);
 		}
 		ipkftp.ClientDisconnect();
 	}
 	catch (const std::ifstream::failure &e) {
 		(void)e; // bypass unreferenced local variable warning
-		if (arguments.mode == 'w') {
+		if (arguments.mode == 'w' || arguments.mode == 'd' || arguments.mode == 'u') {
 			std::cerr << "Error: Unable to open file!" << std::endl;
 		}
 		else {
@@ -53,16 +99,87 @@ int main(int argc, const char *argv[]) {
 	return 0;
 };
 
+// asynchronous transfers of files, at most connections of them at once, returns number of failed files
+std::size_t async_batch(IPKFTP &ipkftp, const std::vector<std::string> &filenames, bool upload, unsigned int connections) {
+	std::deque<std::pair<std::string, std::future<void>>> running;
+	std::size_t failed = 0;
+	auto wait_oldest = [&]() {
+		try {
+			running.front().second.get();
+		}
+		catch (const std::ifstream::failure &e) {
+			(void)e; // bypass unreferenced local variable warning
+			std::cerr << running.front().first << ": " << (upload ? "Error: Unable to open file!" : "Error: Unable to save file!") << std::endl;
+			failed++;
+		}
+		catch (const std::exception &e) {
+			std::cerr << running.front().first << ": " << e.what() << std::endl;
+			failed++;
+		}
+		running.pop_front();
+	};
+	for (const auto &filename : filenames) {
+		if (running.size() >= connections) {
+			wait_oldest();
+		}
+		running.emplace_back(filename, upload ? ipkftp.UploadAsync(filename) : ipkftp.DownloadAsync(filename));
+	}
+	while (!running.empty()) {
+		wait_oldest();
+	}
+	return failed;
+}
+
 bool load_args(int argc, const char *argv[], args *arguments) {
-	bool host(false), port(false), mode(false);
-	if (argc == 7) {
-		for (int i = 1; i < 6; i += 2) {
-			if (std::string(argv[i]) == "-h" && !host) {
+	bool host(false), port(false), mode(false), connections(false), compression(false), trace(false);
+	if (argc >= 6) {
+		for (int i = 1; i < argc; i += 2) {
+			if ((std::string(argv[i]) == "-R" || std::string(argv[i]) == "-W") && !mode) {
+				// batch, remaining arguments are files
+				arguments->mode = (std::string(argv[i]) == "-W") ? 'w' : 'r'; mode = true;
+				arguments->batch = true;
+				arguments->filenames.assign(argv + i + 1, argv + argc);
+				if (arguments->filenames.empty()) {
+					std::string line;
+					while (std::getline(std::cin, line)) {
+						if (!line.empty()) {
+							arguments->filenames.push_back(line);
+						}
+					}
+				}
+				break;
+			}
+			else if (std::string(argv[i]) == "-S" && !mode && i + 1 == argc) {
+				arguments->mode = 's'; mode = true; // metrics of server
+			}
+			else if (i + 1 >= argc) {
+				return false;
+			}
+			else if (std::string(argv[i]) == "-h" && !host) {
 				arguments->host = std::string(argv[i + 1]); host = true;
 			}
 			else if (std::string(argv[i]) == "-p" && !port) {
 				arguments->port = std::string(argv[i + 1]); port = true;
 			}
+			else if (std::string(argv[i]) == "-z" && !compression) {
+				arguments->compression = Compression::FromName(argv[i + 1]);
+				if (arguments->compression == NoCompression) return false; // unknown or not available codec
+				compression = true;
+			}
+			else if (std::string(argv[i]) == "-T" && !trace) {
+				arguments->trace = std::string(argv[i + 1]); trace = true;
+			}
+			else if (std::string(argv[i]) == "-j" && !connections) {
+				try {
+					int value = std::stoi(argv[i + 1]);
+					if (value < 1) return false;
+					arguments->connections = static_cast<unsigned int>(value); connections = true;
+				}
+				catch (const std::exception &e) {
+					(void)e; // bypass unreferenced local variable warning
+					return false;
+				}
+			}
 			else if (std::string(argv[i]) == "-r" && !mode) {
 				arguments->filename = std::string(argv[i + 1]);
 				arguments->mode = 'r'; mode = true;
@@ -71,11 +188,22 @@ bool load_args(int argc, const char *argv[], args *arguments) {
 				arguments->filename = std::string(argv[i + 1]);
 				arguments->mode = 'w'; mode = true;
 			}
+			else if (std::string(argv[i]) == "-d" && !mode) {
+				// upload of delta against previous version of file held by server
+				arguments->filename = std::string(argv[i + 1]);
+				arguments->mode = 'd'; mode = true;
+			}
+			else if (std::string(argv[i]) == "-u" && !mode) {
+				// upload skipped when server already holds identical content (SHA-256)
+				arguments->filename = std::string(argv[i + 1]);
+				arguments->mode = 'u'; mode = true;
+			}
 			else {
 				return false;
 			}
 		}
-		return true;
+		// parallel connections are used only by download and batches
+		return host && port && mode && (!connections || arguments->batch || arguments->mode == 'r');
 	}
 	else {
 		return false;
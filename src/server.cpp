@@ -8,10 +8,11 @@
 #include <string>
 #include "IPKFTP.h"
 
-const std::string server_usage = "./ipk-server -p port ";
+const std::string server_usage = "./ipk-server -p port [-e event_loops [-U 0|1] | -t workers -q queue_depth] [-b block_size] [-s socket_buffer] [-z 0|1] [-c cache_bytes] [-i index_file] [-x part_expiry_s] [-m metrics_file] [-T trace_file]";
 
 struct args {
 	std::string port;
+	IPKServerConfig config;
 } arguments;
 
 bool load_args(int argc, const char *argv[], args *arguments);
@@ -25,7 +26,7 @@ int main(int argc, const char *argv[])
 
 	try {
 		IPKFTP ipkftp;
-		ipkftp.ServerStart(arguments.port); // infinite loop for now
+		ipkftp.ServerStart(arguments.port, arguments.config); // infinite loop for now
 		ipkftp.ServerStop(); // reserved for future
 	}
 	catch (const std::exception &e){
@@ -36,12 +37,107 @@ int main(int argc, const char *argv[])
 	return 0;
 };
 
+bool load_number(const char *arg, unsigned int *number, bool allow_zero = false);
+bool load_size(const char *arg, uint64_t *size);
+
 bool load_args(int argc, const char *argv[], args *arguments) {
-	if (argc == 3 && std::string(argv[1]) == "-p") {
-		arguments->port = argv[2];
+	bool port(false), loops(false), workers(false), queue(false), block(false), buffer(false), compression(false), cache(false), index(false), expiry(false), metrics(false), trace(false), uring(false);
+	if (argc % 2 == 0) {
+		return false;
+	}
+	for (int i = 1; i < argc; i += 2) {
+		if (std::string(argv[i]) == "-p" && !port) {
+			arguments->port = argv[i + 1]; port = true;
+		}
+		else if (std::string(argv[i]) == "-e" && !loops) {
+			if (!load_number(argv[i + 1], &arguments->config.loops)) return false;
+			loops = true;
+		}
+		else if (std::string(argv[i]) == "-t" && !workers) {
+			if (!load_number(argv[i + 1], &arguments->config.workers)) return false;
+			workers = true;
+		}
+		else if (std::string(argv[i]) == "-q" && !queue) {
+			if (!load_number(argv[i + 1], &arguments->config.queue, true)) return false;
+			queue = true;
+		}
+		else if (std::string(argv[i]) == "-b" && !block) {
+			unsigned int block_size;
+			if (!load_number(argv[i + 1], &block_size, true)) return false; // 0 = auto-tuning
+			arguments->config.tcp.block_size = block_size;
+			block = true;
+		}
+		else if (std::string(argv[i]) == "-s" && !buffer) {
+			unsigned int buffer_size;
+			if (!load_number(argv[i + 1], &buffer_size)) return false;
+			arguments->config.tcp.send_buffer = arguments->config.tcp.recv_buffer = static_cast<int>(buffer_size);
+			buffer = true;
+		}
+		else if (std::string(argv[i]) == "-c" && !cache) {
+			if (!load_size(argv[i + 1], &arguments->config.cache)) return false; // 0 = disabled
+			cache = true;
+		}
+		else if (std::string(argv[i]) == "-i" && !index) {
+			arguments->config.index = argv[i + 1]; // "" = deduplication is disabled
+			index = true;
+		}
+		else if (std::string(argv[i]) == "-x" && !expiry) {
+			if (!load_number(argv[i + 1], &arguments->config.part_expiry, true)) return false; // 0 = ".part" files are kept
+			expiry = true;
+		}
+		else if (std::string(argv[i]) == "-m" && !metrics) {
+			arguments->config.metrics = argv[i + 1]; // replaced by metrics report every 10 seconds
+			metrics = true;
+		}
+		else if (std::string(argv[i]) == "-T" && !trace) {
+			arguments->config.trace = argv[i + 1]; // replaced by Chrome trace every 10 seconds
+			trace = true;
+		}
+		else if (std::string(argv[i]) == "-U" && !uring) {
+			unsigned int enabled;
+			if (!load_number(argv[i + 1], &enabled, true) || enabled > 1) return false;
+			arguments->config.tcp.io_uring = (enabled == 1); // epoll is used when io_uring is not available
+			uring = true;
+		}
+		else if (std::string(argv[i]) == "-z" && !compression) {
+			unsigned int enabled;
+			if (!load_number(argv[i + 1], &enabled, true) || enabled > 1) return false;
+			arguments->config.compression = (enabled == 1);
+			compression = true;
+		}
+		else {
+			return false;
+		}
+	}
+	return port && !(loops && (workers || queue)) && !(uring && !loops);
+}
+
+bool load_number(const char *arg, unsigned int *number, bool allow_zero) {
+	try {
+		int value = std::stoi(arg);
+		if (value < 0 || (value == 0 && !allow_zero)) {
+			return false;
+		}
+		*number = static_cast<unsigned int>(value);
 		return true;
 	}
-	else {
+	catch (const std::exception &e) {
+		(void)e; // bypass unreferenced local variable warning
+		return false;
+	}
+}
+bool load_size(const char *arg, uint64_t *size) {
+	try {
+		std::size_t end;
+		std::string value(arg);
+		if (value.empty() || value[0] == '-') {
+			return false;
+		}
+		*size = std::stoull(value, &end);
+		return end == value.size();
+	}
+	catch (const std::exception &e) {
+		(void)e; // bypass unreferenced local variable warning
 		return false;
 	}
-}
\ No newline at end of file
+}